@@ -3,10 +3,26 @@
 #include <tf2_ros/transform_broadcaster.h>
 #include <tf2_ros/static_transform_broadcaster.h>
 
+// Bag access
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+
 // STL
-#include <fstream>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <limits>
 #include <sstream>
 
+// POSIX file access
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 // This include
 #include "deepdive.hh"
 
@@ -118,58 +134,280 @@ Eigen::Affine3d CeresToEigen(double ceres[6], bool invert) {
 
 // CONFIG MANAGEMENT
 
-// Parse a human-readable configuration
-bool ReadConfig(std::string const& calfile,   // Calibration file
-  std::string const& frame_world,             // World name
-  std::string const& frame_vive,              // Vive frame name
-  std::string const& frame_body,              // Body frame name
-  double registration[6],
-  LighthouseMap & lighthouses, TrackerMap & trackers) {
-  // Entries take the form x y z qx qy qz qw parent child
-  std::ifstream infile(calfile);
-  if (!infile.is_open()) {
-    ROS_WARN("Could not open config file for reading");
-    return false;
+// Binary configuration layout. Fields are naturally aligned and in host
+// byte order, so entries are read straight out of a mapping of the file.
+static constexpr uint32_t CONFIG_MAGIC = 0x46434444;
+static constexpr uint32_t CONFIG_VERSION = 1;
+static constexpr size_t CONFIG_MAX_NAME = 64;
+struct ConfigHeader {
+  uint32_t magic;                            // Always CONFIG_MAGIC
+  uint32_t version;                          // Always CONFIG_VERSION
+  uint32_t count;                            // Number of entries
+  uint32_t crc;                              // CRC32 of the entries
+};
+struct ConfigRecord {
+  double tf[7];                              // x y z qx qy qz qw
+  char parent[CONFIG_MAX_NAME];              // Null-terminated parent frame
+  char child[CONFIG_MAX_NAME];               // Null-terminated child frame
+};
+
+// Lookup table for the standard (zlib) CRC32 polynomial
+struct Crc32Table {
+  uint32_t entry[256];
+  Crc32Table() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+      entry[i] = c;
+    }
   }
+};
+
+// Standard (zlib) CRC32
+static uint32_t Crc32(uint8_t const* data, size_t len) {
+  // Function-local statics are initialized exactly once, even when called
+  // from several threads at the same time
+  static Crc32Table const table;
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < len; i++)
+    crc = table.entry[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFFu;
+}
+
+// Is this file name one for the binary format?
+static bool IsBinaryConfig(std::string const& calfile) {
+  std::string ext(CONFIG_BINARY_EXTENSION);
+  return calfile.size() >= ext.size() &&
+    calfile.compare(calfile.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+// Entries take the form x y z qx qy qz qw parent child
+static bool ParseText(char const* data, size_t size,
+  std::vector<ConfigEntry> & entries) {
+  std::istringstream infile(std::string(data, size));
   std::string line;
-  int count = 0;
   while (std::getline(infile, line)) {
     std::istringstream iss(line);
-    double x, y, z, qx, qy, qz, qw;
-    std::string p, c;
-    if (!(iss >> x >> y >> z >> qx >> qy >> qz >> qw >> p >> c)) {
+    ConfigEntry entry;
+    if (!(iss >> entry.tf[0] >> entry.tf[1] >> entry.tf[2] >> entry.tf[3]
+              >> entry.tf[4] >> entry.tf[5] >> entry.tf[6]
+              >> entry.parent >> entry.child)) {
       ROS_ERROR("Badly formatted config file");
       return false;
     }
-    // ROS_INFO_STREAM(p << " -> " << c);
-    Eigen::AngleAxisd aa(Eigen::Quaterniond(qw, qx, qy, qz));
+    entries.push_back(entry);
+  }
+  return true;
+}
+
+// Header followed by count records, with a checksum over the records
+static bool ParseBinary(char const* data, size_t size,
+  std::vector<ConfigEntry> & entries) {
+  ConfigHeader const* header = reinterpret_cast<ConfigHeader const*>(data);
+  if (header->version != CONFIG_VERSION) {
+    ROS_ERROR_STREAM("Unsupported config file version " << header->version);
+    return false;
+  }
+  if (size != sizeof(ConfigHeader) + header->count * sizeof(ConfigRecord)) {
+    ROS_ERROR("Truncated config file");
+    return false;
+  }
+  uint8_t const* payload =
+    reinterpret_cast<uint8_t const*>(data + sizeof(ConfigHeader));
+  if (Crc32(payload, size - sizeof(ConfigHeader)) != header->crc) {
+    ROS_ERROR("Config file failed its checksum");
+    return false;
+  }
+  ConfigRecord const* records = reinterpret_cast<ConfigRecord const*>(payload);
+  entries.resize(header->count);
+  for (uint32_t i = 0; i < header->count; i++) {
+    std::copy(records[i].tf, records[i].tf + 7, entries[i].tf);
+    entries[i].parent.assign(records[i].parent,
+      strnlen(records[i].parent, CONFIG_MAX_NAME));
+    entries[i].child.assign(records[i].child,
+      strnlen(records[i].child, CONFIG_MAX_NAME));
+  }
+  return true;
+}
+
+// Read the transforms in a text or binary configuration
+bool ReadConfigEntries(std::string const& calfile,
+  std::vector<ConfigEntry> & entries) {
+  entries.clear();
+  int fd = open(calfile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    ROS_WARN("Could not open config file for reading");
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    ROS_WARN("Could not stat config file");
+    return false;
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return true;
+  }
+  void * ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    ROS_WARN("Could not map config file");
+    return false;
+  }
+  char const* data = static_cast<char const*>(ptr);
+  bool success = (size >= sizeof(ConfigHeader) &&
+    reinterpret_cast<ConfigHeader const*>(data)->magic == CONFIG_MAGIC)
+      ? ParseBinary(data, size, entries) : ParseText(data, size, entries);
+  munmap(ptr, size);
+  return success;
+}
+
+// Write to a temporary file and rename it over the original
+static bool WriteAtomically(std::string const& calfile,
+  std::string const& contents) {
+  std::string tmpfile = calfile + ".tmp";
+  int fd = open(tmpfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    ROS_WARN("Could not open config file for writing");
+    return false;
+  }
+  size_t done = 0;
+  while (done < contents.size()) {
+    ssize_t n = write(fd, contents.data() + done, contents.size() - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  bool success = (done == contents.size()) && (fsync(fd) == 0);
+  success = (close(fd) == 0) && success;
+  if (!success || rename(tmpfile.c_str(), calfile.c_str()) != 0) {
+    ROS_WARN("Could not write config file");
+    unlink(tmpfile.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Shortest decimal form of a double that reads back exactly
+static std::string FormatExact(double value) {
+  std::string str;
+  for (int p = 6; p <= std::numeric_limits<double>::max_digits10; p++) {
+    std::ostringstream oss;
+    oss << std::setprecision(p) << value;
+    str = oss.str();
+    if (std::strtod(str.c_str(), nullptr) == value)
+      break;
+  }
+  return str;
+}
+
+// Write transforms to a configuration, in the format implied by its name.
+// The file is replaced atomically, so readers never see a partial write.
+bool WriteConfigEntries(std::string const& calfile,
+  std::vector<ConfigEntry> const& entries) {
+  std::string contents;
+  if (IsBinaryConfig(calfile)) {
+    std::vector<ConfigRecord> records(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (entries[i].parent.size() >= CONFIG_MAX_NAME ||
+          entries[i].child.size() >= CONFIG_MAX_NAME) {
+        ROS_WARN_STREAM("Frame name too long for " << entries[i].child);
+        return false;
+      }
+      memset(&records[i], 0, sizeof(ConfigRecord));
+      std::copy(entries[i].tf, entries[i].tf + 7, records[i].tf);
+      strncpy(records[i].parent, entries[i].parent.c_str(), CONFIG_MAX_NAME);
+      strncpy(records[i].child, entries[i].child.c_str(), CONFIG_MAX_NAME);
+    }
+    ConfigHeader header;
+    header.magic = CONFIG_MAGIC;
+    header.version = CONFIG_VERSION;
+    header.count = records.size();
+    header.crc = Crc32(reinterpret_cast<uint8_t const*>(records.data()),
+      records.size() * sizeof(ConfigRecord));
+    contents.append(reinterpret_cast<char const*>(&header), sizeof(header));
+    contents.append(reinterpret_cast<char const*>(records.data()),
+      records.size() * sizeof(ConfigRecord));
+  } else {
+    std::ostringstream outfile;
+    std::vector<ConfigEntry>::const_iterator it;
+    for (it = entries.begin(); it != entries.end(); it++) {
+      for (size_t i = 0; i < 7; i++)
+        outfile << FormatExact(it->tf[i]) << " ";
+      outfile << it->parent << " " << it->child << std::endl;
+    }
+    contents = outfile.str();
+  }
+  return WriteAtomically(calfile, contents);
+}
+
+// Convert an entry to an angle-axis transform
+static void EntryToTransform(ConfigEntry const& entry, double tf[6]) {
+  Eigen::AngleAxisd aa(Eigen::Quaterniond(
+    entry.tf[6], entry.tf[3], entry.tf[4], entry.tf[5]));
+  tf[0] = entry.tf[0];
+  tf[1] = entry.tf[1];
+  tf[2] = entry.tf[2];
+  tf[3] = aa.angle() * aa.axis()[0];
+  tf[4] = aa.angle() * aa.axis()[1];
+  tf[5] = aa.angle() * aa.axis()[2];
+}
+
+// Convert an angle-axis transform to an entry
+static ConfigEntry TransformToEntry(double const tf[6],
+  std::string const& parent, std::string const& child) {
+  Eigen::Vector3d v(tf[3], tf[4], tf[5]);
+  Eigen::AngleAxisd aa = Eigen::AngleAxisd::Identity();
+  if (v.norm() > 0) {
+    aa.angle() = v.norm();
+    aa.axis() = v.normalized();
+  }
+  Eigen::Quaterniond q(aa);
+  ConfigEntry entry;
+  entry.tf[0] = tf[0];
+  entry.tf[1] = tf[1];
+  entry.tf[2] = tf[2];
+  entry.tf[3] = q.x();
+  entry.tf[4] = q.y();
+  entry.tf[5] = q.z();
+  entry.tf[6] = q.w();
+  entry.parent = parent;
+  entry.child = child;
+  return entry;
+}
+
+// Parse a text or binary configuration
+bool ReadConfig(std::string const& calfile,   // Calibration file
+  std::string const& frame_world,             // World name
+  std::string const& frame_vive,              // Vive frame name
+  std::string const& frame_body,              // Body frame name
+  double registration[6],
+  LighthouseMap & lighthouses, TrackerMap & trackers) {
+  std::vector<ConfigEntry> entries;
+  if (!ReadConfigEntries(calfile, entries))
+    return false;
+  size_t count = 0;
+  std::vector<ConfigEntry>::const_iterator it;
+  for (it = entries.begin(); it != entries.end(); it++) {
+    std::string const& p = it->parent;
+    std::string const& c = it->child;
     if (p == frame_world && c == frame_vive) {
-      registration[0] = x;
-      registration[1] = y;
-      registration[2] = z;
-      registration[3] = aa.angle() * aa.axis()[0];
-      registration[4] = aa.angle() * aa.axis()[1];
-      registration[5] = aa.angle() * aa.axis()[2];
+      EntryToTransform(*it, registration);
       count++;
       continue;
     }
     if (p == frame_vive && lighthouses.find(c) != lighthouses.end()) {
-      lighthouses[c].vTl[0] = x;
-      lighthouses[c].vTl[1] = y;
-      lighthouses[c].vTl[2] = z;
-      lighthouses[c].vTl[3] = aa.angle() * aa.axis()[0];
-      lighthouses[c].vTl[4] = aa.angle() * aa.axis()[1];
-      lighthouses[c].vTl[5] = aa.angle() * aa.axis()[2];
+      EntryToTransform(*it, lighthouses[c].vTl);
       count++;
       continue;
     }
     if (p == frame_body && trackers.find(c) != trackers.end()) {
-      trackers[c].bTh[0] = x;
-      trackers[c].bTh[1] = y;
-      trackers[c].bTh[2] = z;
-      trackers[c].bTh[3] = aa.angle() * aa.axis()[0];
-      trackers[c].bTh[4] = aa.angle() * aa.axis()[1];
-      trackers[c].bTh[5] = aa.angle() * aa.axis()[2];
+      EntryToTransform(*it, trackers[c].bTh);
       count++;
       continue;
     }
@@ -178,76 +416,22 @@ bool ReadConfig(std::string const& calfile,   // Calibration file
   return (count == 1 + lighthouses.size() + trackers.size());
 }
 
-// Write a human-readable configuration
+// Write a text or binary configuration
 bool WriteConfig(std::string const& calfile,    // Calibration file
   std::string const& frame_world,               // World name
   std::string const& frame_vive,                // Vive frame name
   std::string const& frame_body,                // Body frame name
   double registration[6],
   LighthouseMap const& lighthouses, TrackerMap const& trackers) {
-  std::ofstream outfile(calfile);
-  if (!outfile.is_open()) {
-    ROS_WARN("Could not open config file for writing");
-    return false;
-  }
-  // World registration
-  {
-    Eigen::Vector3d v(registration[3], registration[4], registration[5]);
-    Eigen::AngleAxisd aa = Eigen::AngleAxisd::Identity();
-    if (v.norm() > 0) {
-      aa.angle() = v.norm();
-      aa.axis() = v.normalized();
-    }
-    Eigen::Quaterniond q(aa);
-    outfile << registration[0] << " "
-            << registration[1] << " "
-            << registration[2] << " "
-            << q.x() << " "
-            << q.y() << " "
-            << q.z() << " "
-            << q.w() << " "
-            << frame_world << " " << frame_vive
-            << std::endl;
-  }
+  std::vector<ConfigEntry> entries;
+  entries.push_back(TransformToEntry(registration, frame_world, frame_vive));
   LighthouseMap::const_iterator it;
-  for (it = lighthouses.begin(); it != lighthouses.end(); it++)  {
-    Eigen::Vector3d v(it->second.vTl[3], it->second.vTl[4], it->second.vTl[5]);
-    Eigen::AngleAxisd aa;
-    if (v.norm() > 0) {
-      aa.angle() = v.norm();
-      aa.axis() = v.normalized();
-    }
-    Eigen::Quaterniond q(aa);
-    outfile << it->second.vTl[0] << " "
-            << it->second.vTl[1] << " "
-            << it->second.vTl[2] << " "
-            << q.x() << " "
-            << q.y() << " "
-            << q.z() << " "
-            << q.w() << " "
-            << frame_vive << " " << it->first
-            << std::endl;
-  }
+  for (it = lighthouses.begin(); it != lighthouses.end(); it++)
+    entries.push_back(TransformToEntry(it->second.vTl, frame_vive, it->first));
   TrackerMap::const_iterator jt;
-  for (jt = trackers.begin(); jt != trackers.end(); jt++)  {
-    Eigen::Vector3d v(jt->second.bTh[3], jt->second.bTh[4], jt->second.bTh[5]);
-    Eigen::AngleAxisd aa;
-    if (v.norm() > 0) {
-      aa.angle() = v.norm();
-      aa.axis() = v.normalized();
-    }
-    Eigen::Quaterniond q(aa);
-    outfile << jt->second.bTh[0] << " "
-            << jt->second.bTh[1] << " "
-            << jt->second.bTh[2] << " "
-            << q.x() << " "
-            << q.y() << " "
-            << q.z() << " "
-            << q.w() << " "
-            << frame_body << " " << jt->first
-            << std::endl;
-  }
-  return true;
+  for (jt = trackers.begin(); jt != trackers.end(); jt++)
+    entries.push_back(TransformToEntry(jt->second.bTh, frame_body, jt->first));
+  return WriteConfigEntries(calfile, entries);
 }
 
 // REUSABLE CALLS
@@ -379,6 +563,235 @@ void TrackerCallback(deepdive_ros::Trackers::ConstPtr const& msg,
   }
 }
 
+// COMPACT LIGHT
+
+void TrackerHandleCallback(deepdive_ros::Trackers::ConstPtr const& msg,
+  HandleMap & handles) {
+  // Every message holds all trackers, and handles of removed ones are reused
+  handles.clear();
+  std::vector<deepdive_ros::Tracker>::const_iterator it;
+  for (it = msg->trackers.begin(); it != msg->trackers.end(); it++)
+    handles[it->handle] = it->serial;
+}
+
+void LighthouseHandleCallback(deepdive_ros::Lighthouses::ConstPtr const& msg,
+  HandleMap & handles) {
+  handles.clear();
+  std::vector<deepdive_ros::Lighthouse>::const_iterator it;
+  for (it = msg->lighthouses.begin(); it != msg->lighthouses.end(); it++)
+    handles[it->handle] = it->serial;
+}
+
+bool Expand(deepdive_ros::LightCompact const& from,
+  HandleMap const& trackers, HandleMap const& lighthouses,
+    deepdive_ros::Light & to) {
+  HandleMap::const_iterator tt = trackers.find(from.tracker);
+  HandleMap::const_iterator lt = lighthouses.find(from.lighthouse);
+  if (tt == trackers.end() || lt == lighthouses.end())
+    return false;
+  to.header.stamp = from.header.stamp;
+  to.header.frame_id = tt->second;
+  to.lighthouse = lt->second;
+  to.axis = from.axis;
+  to.pulses.clear();
+  to.pulses.reserve(from.angles.size());
+  size_t i = 0;
+  for (uint32_t m = from.mask; m && i < from.angles.size()
+    && i < from.durations.size(); m &= m - 1, i++) {
+    deepdive_ros::Pulse pulse;
+    pulse.sensor = __builtin_ctz(m);
+    pulse.angle = from.angles[i];
+    pulse.duration = static_cast<double>(from.durations[i])
+      / deepdive_ros::LightCompact::TICKS_PER_SEC;
+    to.pulses.push_back(pulse);
+  }
+  return true;
+}
+
+void LightCompactCallback(deepdive_ros::LightCompact::ConstPtr const& msg,
+  HandleMap const& trackers, HandleMap const& lighthouses,
+    std::function<void(deepdive_ros::Light::ConstPtr const&)> cb) {
+  // Expanded messages are recycled once the callback lets go of them. This
+  // runs on the callback thread of the node, or the bag reader.
+  static MessagePool<deepdive_ros::Light> pool;
+  MessagePool<deepdive_ros::Light>::Ptr light = pool.Acquire();
+  if (Expand(*msg, trackers, lighthouses, *light))
+    cb(light);
+}
+
+// BAG PROCESSING
+
+bool ReadBag(std::string const& bagfile, BagCallbacks const& cb,
+  double duration) {
+  rosbag::Bag bag;
+  try {
+    bag.open(bagfile, rosbag::bagmode::Read);
+  } catch (rosbag::BagException const& e) {
+    ROS_ERROR_STREAM("Could not open bag " << bagfile << ": " << e.what());
+    return false;
+  }
+  std::vector<std::string> topics = {
+    "/trackers", "/lighthouses", "/light", "/light_compact", "/tf", "/imu" };
+  HandleMap trackers, lighthouses;
+  size_t count = 0;
+  ros::Time begin = ros::TIME_MIN, end = ros::TIME_MAX;
+  if (duration > 0.0) {
+    rosbag::View all(bag, rosbag::TopicQuery(topics));
+    if (all.size() > 0) {
+      begin = all.getBeginTime();
+      end = begin + ros::Duration(duration);
+    }
+  }
+  rosbag::View view(bag, rosbag::TopicQuery(topics), begin, end);
+  for (rosbag::View::iterator it = view.begin(); it != view.end(); it++) {
+    std::string const& topic = it->getTopic();
+    if (topic == "/trackers") {
+      deepdive_ros::Trackers::ConstPtr msg =
+        it->instantiate<deepdive_ros::Trackers>();
+      if (!msg) continue;
+      TrackerHandleCallback(msg, trackers);
+      if (cb.trackers) cb.trackers(msg);
+    } else if (topic == "/lighthouses") {
+      deepdive_ros::Lighthouses::ConstPtr msg =
+        it->instantiate<deepdive_ros::Lighthouses>();
+      if (!msg) continue;
+      LighthouseHandleCallback(msg, lighthouses);
+      if (cb.lighthouses) cb.lighthouses(msg);
+    } else if (topic == "/light") {
+      deepdive_ros::Light::ConstPtr msg =
+        it->instantiate<deepdive_ros::Light>();
+      if (!msg || !cb.light) continue;
+      cb.light(msg);
+    } else if (topic == "/light_compact") {
+      deepdive_ros::LightCompact::ConstPtr msg =
+        it->instantiate<deepdive_ros::LightCompact>();
+      if (!msg || !cb.light) continue;
+      LightCompactCallback(msg, trackers, lighthouses, cb.light);
+    } else if (topic == "/tf") {
+      tf2_msgs::TFMessage::ConstPtr msg =
+        it->instantiate<tf2_msgs::TFMessage>();
+      if (!msg || !cb.tf) continue;
+      cb.tf(msg);
+    } else if (topic == "/imu") {
+      sensor_msgs::Imu::ConstPtr msg = it->instantiate<sensor_msgs::Imu>();
+      if (!msg || !cb.imu) continue;
+      cb.imu(msg);
+    }
+    count++;
+  }
+  bag.close();
+  ROS_INFO_STREAM("Read " << count << " messages from " << bagfile);
+  return true;
+}
+
+// LIGHT STORE
+
+namespace {
+
+// One pulse before reduction, in sort order
+struct LightSample {
+  uint16_t lighthouse;
+  uint16_t tracker;
+  int64_t bin;
+  uint8_t sensor;
+  uint8_t axis;
+  double angle;
+};
+
+bool SameRow(LightSample const& a, LightSample const& b) {
+  return a.lighthouse == b.lighthouse && a.tracker == b.tracker
+    && a.bin == b.bin && a.sensor == b.sensor && a.axis == b.axis;
+}
+
+bool SameEpoch(LightSample const& a, LightSample const& b) {
+  return a.lighthouse == b.lighthouse && a.tracker == b.tracker
+    && a.bin == b.bin;
+}
+
+}  // namespace
+
+void LightStore::Build(MeasurementMap const& measurements,
+  LighthouseMap const& lighthouses, TrackerMap const& trackers,
+    double resolution) {
+  resolution_ = resolution;
+  // Index devices in map order
+  std::map<std::string, uint16_t> lidx, tidx;
+  for (LighthouseMap::const_iterator it = lighthouses.begin();
+    it != lighthouses.end(); it++)
+      lidx.emplace(it->first, static_cast<uint16_t>(lidx.size()));
+  for (TrackerMap::const_iterator it = trackers.begin();
+    it != trackers.end(); it++)
+      tidx.emplace(it->first, static_cast<uint16_t>(tidx.size()));
+  // Flatten the pulses, binning them in time
+  std::vector<LightSample> samples;
+  MeasurementMap::const_iterator mt;
+  for (mt = measurements.begin(); mt != measurements.end(); mt++) {
+    std::map<std::string, uint16_t>::const_iterator lt, tt;
+    lt = lidx.find(mt->second.light.lighthouse);
+    tt = tidx.find(mt->second.light.header.frame_id);
+    if (lt == lidx.end() || tt == tidx.end())
+      continue;
+    LightSample sample;
+    sample.lighthouse = lt->second;
+    sample.tracker = tt->second;
+    sample.bin = static_cast<int64_t>(round(mt->first.toSec() / resolution));
+    sample.axis = mt->second.light.axis;
+    std::vector<deepdive_ros::Pulse>::const_iterator pt;
+    for (pt = mt->second.light.pulses.begin();
+      pt != mt->second.light.pulses.end(); pt++) {
+      if (pt->sensor >= NUM_SENSORS)
+        continue;
+      sample.sensor = static_cast<uint8_t>(pt->sensor);
+      sample.angle = pt->angle;
+      samples.push_back(sample);
+    }
+  }
+  // Sort once. The sort is stable so that samples in a row are summed in
+  // time order, as they were before reduction.
+  std::stable_sort(samples.begin(), samples.end(),
+    [](LightSample const& a, LightSample const& b) {
+      if (a.lighthouse != b.lighthouse) return a.lighthouse < b.lighthouse;
+      if (a.tracker != b.tracker) return a.tracker < b.tracker;
+      if (a.bin != b.bin) return a.bin < b.bin;
+      if (a.sensor != b.sensor) return a.sensor < b.sensor;
+      return a.axis < b.axis;
+    });
+  // Reduce each row to its mean, and mark where epochs start
+  bin.clear();
+  tracker.clear();
+  lighthouse.clear();
+  sensor.clear();
+  axis.clear();
+  angle.clear();
+  epochs_.clear();
+  keys_.clear();
+  for (size_t i = 0, j = 0; i < samples.size(); i = j) {
+    double sum = 0.0;
+    for (j = i; j < samples.size() && SameRow(samples[i], samples[j]); j++)
+      sum += samples[j].angle;
+    if (i == 0 || !SameEpoch(samples[i - 1], samples[i])) {
+      epochs_.push_back(bin.size());
+      keys_.push_back(Key(samples[i].lighthouse, samples[i].tracker));
+    }
+    bin.push_back(samples[i].bin);
+    tracker.push_back(samples[i].tracker);
+    lighthouse.push_back(samples[i].lighthouse);
+    sensor.push_back(samples[i].sensor);
+    axis.push_back(samples[i].axis);
+    angle.push_back(sum / (j - i));
+  }
+  epochs_.push_back(bin.size());
+}
+
+std::pair<size_t, size_t> LightStore::Epochs(
+  uint16_t lighthouse, uint16_t tracker) const {
+  std::pair<std::vector<uint32_t>::const_iterator,
+    std::vector<uint32_t>::const_iterator> range = std::equal_range(
+      keys_.begin(), keys_.end(), Key(lighthouse, tracker));
+  return std::make_pair(range.first - keys_.begin(),
+    range.second - keys_.begin());
+}
+
 // STATISTICS
 
 bool Mean(std::vector<double> const& v, double & d) {
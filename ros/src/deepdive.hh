@@ -6,16 +6,25 @@
 #include <deepdive_ros/Lighthouses.h>
 #include <deepdive_ros/Trackers.h>
 #include <deepdive_ros/Light.h>
+#include <deepdive_ros/LightCompact.h>
+#include <tf2_msgs/TFMessage.h>
+#include <sensor_msgs/Imu.h>
 
 // Eigen
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 
 // STL
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <string>
 #include <vector>
 #include <map>
 
+// Pooled allocation
+#include "deepdive_arena.hh"
+
 // Universal constants
 static constexpr size_t NUM_SENSORS = 32;
 
@@ -70,7 +79,8 @@ struct Measurement {
   double wTb[6];
   deepdive_ros::Light light;
 };
-typedef std::map<ros::Time, Measurement> MeasurementMap;
+typedef std::map<ros::Time, Measurement, std::less<ros::Time>,
+  NodeAllocator<std::pair<const ros::Time, Measurement>>> MeasurementMap;
 
 // Correction data structure
 typedef std::map<ros::Time, geometry_msgs::TransformStamped> CorrectionMap;
@@ -93,7 +103,27 @@ Eigen::Affine3d CeresToEigen(double ceres[6], bool invert = false);
 
 // CONFIG MANAGEMENT
 
-// Parse a human-readable configuration
+// A single transform in a configuration file
+struct ConfigEntry {
+  double tf[7];                              // x y z qx qy qz qw
+  std::string parent;                        // Parent frame
+  std::string child;                         // Child frame
+};
+
+// Files with this extension are written in the binary format. Either format
+// is recognized on reading, from the first few bytes of the file.
+static constexpr char const* CONFIG_BINARY_EXTENSION = ".tfb";
+
+// Read the transforms in a text or binary configuration
+bool ReadConfigEntries(std::string const& calfile,
+  std::vector<ConfigEntry> & entries);
+
+// Write transforms to a configuration, in the format implied by its name.
+// The file is replaced atomically, so readers never see a partial write.
+bool WriteConfigEntries(std::string const& calfile,
+  std::vector<ConfigEntry> const& entries);
+
+// Parse a text or binary configuration
 bool ReadConfig(std::string const& calfile,   // Calibration file
   std::string const& frame_world,             // World name
   std::string const& frame_vive,              // Vive frame name
@@ -101,7 +131,7 @@ bool ReadConfig(std::string const& calfile,   // Calibration file
   double registration[6],
   LighthouseMap & lighthouses, TrackerMap & trackers);
 
-// Write a human-readable configuration
+// Write a text or binary configuration
 bool WriteConfig(std::string const& calfile,    // Calibration file
   std::string const& frame_world,               // World name
   std::string const& frame_vive,                // Vive frame name
@@ -117,6 +147,89 @@ void LighthouseCallback(deepdive_ros::Lighthouses::ConstPtr const& msg,
 void TrackerCallback(deepdive_ros::Trackers::ConstPtr const& msg,
   TrackerMap & trackers, std::function<void(TrackerMap::iterator)> cb);
 
+// COMPACT LIGHT
+
+// Bridge handle -> serial number, learned from the latched topics
+typedef std::map<uint16_t, std::string> HandleMap;
+
+void TrackerHandleCallback(deepdive_ros::Trackers::ConstPtr const& msg,
+  HandleMap & handles);
+
+void LighthouseHandleCallback(deepdive_ros::Lighthouses::ConstPtr const& msg,
+  HandleMap & handles);
+
+// Expand a compact light message, returning false if a handle is unknown
+bool Expand(deepdive_ros::LightCompact const& from,
+  HandleMap const& trackers, HandleMap const& lighthouses,
+    deepdive_ros::Light & to);
+
+// Expand a compact light message and pass it to a regular light callback.
+// The expanded message is reused once the callback no longer holds it.
+void LightCompactCallback(deepdive_ros::LightCompact::ConstPtr const& msg,
+  HandleMap const& trackers, HandleMap const& lighthouses,
+    std::function<void(deepdive_ros::Light::ConstPtr const&)> cb);
+
+// BAG PROCESSING
+
+// Handlers for the messages read from a bag
+struct BagCallbacks {
+  std::function<void(deepdive_ros::Trackers::ConstPtr const&)> trackers;
+  std::function<void(deepdive_ros::Lighthouses::ConstPtr const&)> lighthouses;
+  std::function<void(deepdive_ros::Light::ConstPtr const&)> light;
+  std::function<void(tf2_msgs::TFMessage::ConstPtr const&)> tf;
+  std::function<void(sensor_msgs::Imu::ConstPtr const&)> imu;
+};
+
+// Stream the device, light, inertial and correction messages in a bag
+// straight into the handlers, in recorded order and as fast as the file can
+// be read. Compact light is expanded with the handles learned from the bag.
+// A positive duration reads only that many seconds from the start.
+bool ReadBag(std::string const& bagfile, BagCallbacks const& cb,
+  double duration = 0.0);
+
+// LIGHT STORE
+
+// Light measurements binned into discrete time units and averaged, held in
+// flat columns sorted once by (lighthouse, tracker, bin, sensor, axis). Each
+// row is the mean angle of one sensor axis over one bin. Rows that share the
+// same (lighthouse, tracker, bin) form an epoch, and a solver consumes the
+// store with range scans over epochs and their rows.
+class LightStore {
+ public:
+  // Bin and average the measurements. Lighthouses and trackers are indexed in
+  // the iteration order of their maps, and unknown devices are dropped.
+  void Build(MeasurementMap const& measurements,
+    LighthouseMap const& lighthouses, TrackerMap const& trackers,
+      double resolution);
+
+  // Range [first, second) of epochs seen by a lighthouse and tracker
+  std::pair<size_t, size_t> Epochs(uint16_t lighthouse, uint16_t tracker) const;
+
+  // Bin time and range [Begin, End) of rows for an epoch
+  ros::Time Time(size_t epoch) const {
+    return ros::Time(static_cast<double>(bin[epochs_[epoch]]) * resolution_);
+  }
+  size_t Begin(size_t epoch) const { return epochs_[epoch]; }
+  size_t End(size_t epoch) const { return epochs_[epoch + 1]; }
+  size_t NumEpochs() const { return epochs_.empty() ? 0 : epochs_.size() - 1; }
+
+  // Columns, one entry per row
+  std::vector<int64_t> bin;
+  std::vector<uint16_t> tracker;
+  std::vector<uint16_t> lighthouse;
+  std::vector<uint8_t> sensor;
+  std::vector<uint8_t> axis;
+  std::vector<double> angle;
+
+ private:
+  static uint32_t Key(uint16_t lighthouse, uint16_t tracker) {
+    return (static_cast<uint32_t>(lighthouse) << 16) | tracker;
+  }
+  double resolution_ = 1.0;
+  std::vector<size_t> epochs_;    // First row of each epoch, then the end
+  std::vector<uint32_t> keys_;    // (lighthouse, tracker) of each epoch
+};
+
 // RUNTIME STATISTICS
 
 class Statistic {
@@ -159,6 +272,12 @@ class Statistic {
 // Get the average of a vector of doubles
 bool Mean(std::vector<double> const& v, double & d);
 
+// Wall time elapsed since some point, in milliseconds
+inline double ElapsedMs(std::chrono::steady_clock::time_point const& since) {
+  return std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - since).count();
+}
+
 // TRACKING ROUTINES
 
 // This algorithm solves the Procrustes problem in that it finds an affine transform
@@ -234,9 +353,9 @@ static bool Kabsch(
 // see: https://github.com/cnlohr/libsurvive/wiki/BSD-Calibration-Values
 
 // Given a point in space, predict the lighthouse angle
-template <typename T>
-static void Predict(T const* params, T const* xyz, T* ang, bool correct) {
-  if (correct) {
+template <bool CORRECT, typename T>
+static void Predict(T const* params, T const* xyz, T* ang) {
+  if (CORRECT) {
     ang[0] = atan2(xyz[0] - (params[0*NUM_PARAMS + PARAM_TILT] + params[0*NUM_PARAMS + PARAM_CURVE] * xyz[1]) * xyz[1], xyz[2]);
     ang[1] = atan2(xyz[1] - (params[1*NUM_PARAMS + PARAM_TILT] + params[1*NUM_PARAMS + PARAM_CURVE] * xyz[0]) * xyz[0], xyz[2]);
     ang[0] -= params[0*NUM_PARAMS + PARAM_PHASE] + params[0*NUM_PARAMS + PARAM_GIB_MAG] * sin(ang[0] + params[0*NUM_PARAMS + PARAM_GIB_PHASE]);
@@ -247,10 +366,18 @@ static void Predict(T const* params, T const* xyz, T* ang, bool correct) {
   }
 }
 
-// Given the lighthouse angle, predict the point in space
 template <typename T>
-static void Correct(T const* params, T * angle, bool correct) {
-  if (correct) {
+static void Predict(T const* params, T const* xyz, T* ang, bool correct) {
+  if (correct)
+    Predict<true>(params, xyz, ang);
+  else
+    Predict<false>(params, xyz, ang);
+}
+
+// Given the lighthouse angle, predict the point in space
+template <bool CORRECT, typename T>
+static void Correct(T const* params, T * angle) {
+  if (CORRECT) {
     T ideal[2], pred[2], xyz[3];
     ideal[0] = angle[0];
     ideal[1] = angle[1];
@@ -258,7 +385,7 @@ static void Correct(T const* params, T * angle, bool correct) {
       xyz[0] = tan(ideal[0]);
       xyz[1] = tan(ideal[1]);
       xyz[2] = T(1.0);
-      Predict(params, xyz, pred, correct);
+      Predict<CORRECT>(params, xyz, pred);
       ideal[0] += (angle[0] - pred[0]);
       ideal[1] += (angle[1] - pred[1]);
     }
@@ -267,6 +394,118 @@ static void Correct(T const* params, T * angle, bool correct) {
   }
 }
 
+template <typename T>
+static void Correct(T const* params, T * angle, bool correct) {
+  if (correct)
+    Correct<true>(params, angle);
+  else
+    Correct<false>(params, angle);
+}
+
+// BATCHED LIGHTHOUSE MODEL
+
+// The batched kernels work on arrays in struct-of-arrays layout and use the
+// branch-free approximations below, so that their loops vectorize. Over the
+// range of lighthouse angles the approximations are accurate to about 1e-11
+// rad, which is far below the angular noise of a lighthouse.
+
+// Approximation of atan2(y, x) with an odd polynomial after reduction of the
+// argument to [0, tan(pi/8)]
+inline double FastAtan2(double y, double x) {
+  double ax = std::fabs(x), ay = std::fabs(y);
+  double mx = (ax > ay ? ax : ay), mn = (ax > ay ? ay : ax);
+  double t = (mx > 0.0 ? mn / mx : 0.0);
+  bool reduce = (t > 0.41421356237309503);
+  double u = (reduce ? (t - 1.0) / (t + 1.0) : t);
+  double v = u * u;
+  double r = u * (0.9999999998527529 + v * (-0.33333330064970007
+    + v * (0.1999978969869273 + v * (-0.14279716735290426
+    + v * (0.11022377739691865 + v * (-0.08372022684783853
+    + v * 0.045568153673383342))))));
+  r += (reduce ? 0.78539816339744831 : 0.0);
+  r = (ay > ax ? 1.5707963267948966 - r : r);
+  r = (x < 0.0 ? 3.1415926535897931 - r : r);
+  return std::copysign(r, y);
+}
+
+// Approximation of sin(x) with an odd polynomial after reduction of the
+// argument to [-pi/2, pi/2]
+inline double FastSin(double x) {
+  double k = std::nearbyint(x * 0.31830988618379067);
+  double u = (x - k * 3.1415926535897931) - k * 1.2246467991473532e-16;
+  double v = u * u;
+  double r = u * (0.99999999988995603 + v * (-0.16666666541505212
+    + v * (0.0083333292657689316 + v * (-0.00019840702973895538
+    + v * (2.7518859873773582e-06 + v * -2.3794773087234708e-08)))));
+  return (std::fabs(k - 2.0 * std::nearbyint(0.5 * k)) > 0.5 ? -r : r);
+}
+
+inline double FastCos(double x) {
+  return FastSin(x + 1.5707963267948966);
+}
+
+inline double FastTan(double x) {
+  return FastSin(x) / FastCos(x);
+}
+
+// Predict the angles of one point with the approximations
+template <bool CORRECT>
+inline void PredictFast(double const* params,
+  double x, double y, double z, double & ang0, double & ang1) {
+  if (CORRECT) {
+    double const* p0 = &params[0*NUM_PARAMS];
+    double const* p1 = &params[1*NUM_PARAMS];
+    ang0 = FastAtan2(x - (p0[PARAM_TILT] + p0[PARAM_CURVE] * y) * y, z);
+    ang1 = FastAtan2(y - (p1[PARAM_TILT] + p1[PARAM_CURVE] * x) * x, z);
+    ang0 -= p0[PARAM_PHASE] + p0[PARAM_GIB_MAG] * FastSin(ang0 + p0[PARAM_GIB_PHASE]);
+    ang1 -= p1[PARAM_PHASE] + p1[PARAM_GIB_MAG] * FastSin(ang1 + p1[PARAM_GIB_PHASE]);
+  } else {
+    ang0 = FastAtan2(x, z);
+    ang1 = FastAtan2(y, z);
+  }
+}
+
+// Given n points in space, predict their lighthouse angles
+template <bool CORRECT>
+static void PredictBatch(double const* params, size_t n,
+  double const* x, double const* y, double const* z,
+    double * ang0, double * ang1) {
+  for (size_t i = 0; i < n; i++)
+    PredictFast<CORRECT>(params, x[i], y[i], z[i], ang0[i], ang1[i]);
+}
+
+// Given n lighthouse angle pairs, correct them in place. Each block of pairs
+// stops iterating once all of its pairs have converged to within tolerance.
+template <bool CORRECT>
+static void CorrectBatch(double const* params, size_t n,
+  double * ang0, double * ang1, double tolerance = 1e-12) {
+  if (!CORRECT)
+    return;
+  for (size_t b = 0; b < n; b += NUM_SENSORS) {
+    size_t m = std::min(n - b, NUM_SENSORS);
+    double ideal0[NUM_SENSORS], ideal1[NUM_SENSORS];
+    std::copy(ang0 + b, ang0 + b + m, ideal0);
+    std::copy(ang1 + b, ang1 + b + m, ideal1);
+    for (size_t it = 0; it < 10; it++) {
+      int pending = 0;
+      for (size_t i = 0; i < m; i++) {
+        double pred0, pred1;
+        PredictFast<CORRECT>(params,
+          FastTan(ideal0[i]), FastTan(ideal1[i]), 1.0, pred0, pred1);
+        double d0 = ang0[b + i] - pred0;
+        double d1 = ang1[b + i] - pred1;
+        ideal0[i] += d0;
+        ideal1[i] += d1;
+        pending += (std::fabs(d0) > tolerance) | (std::fabs(d1) > tolerance);
+      }
+      if (pending == 0)
+        break;
+    }
+    std::copy(ideal0, ideal0 + m, ang0 + b);
+    std::copy(ideal1, ideal1 + m, ang1 + b);
+  }
+}
+
 
 #endif
 
@@ -0,0 +1,135 @@
+/*
+  Allocation helpers for the hot paths. Messages that are published by
+  pointer are recycled once nobody holds them, and the nodes of node-based
+  containers come from per-thread free lists, so that after warm-up neither
+  calls into the heap.
+*/
+
+#ifndef SRC_DEEPDIVE_ARENA_HH
+#define SRC_DEEPDIVE_ARENA_HH
+
+#include <boost/shared_ptr.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// Recycles messages that are published by pointer. A message is only handed
+// out again once no subscriber holds a reference to it, so nodelets in the
+// same manager never see it change underneath them. Vectors in a recycled
+// message keep their capacity. Not thread safe.
+template <typename M>
+class MessagePool {
+ public:
+  typedef boost::shared_ptr<M> Ptr;
+
+  // The pool keeps at most this many messages
+  explicit MessagePool(size_t capacity = 64) : capacity_(capacity), next_(0) {
+    pool_.reserve(capacity_);
+  }
+
+  // Get a message that nobody else references, allocating only during warm-up
+  // or when subscribers hold on to every message in the pool
+  Ptr Acquire() {
+    for (size_t i = 0; i < pool_.size(); i++) {
+      Ptr & msg = pool_[next_];
+      next_ = (next_ + 1) % pool_.size();
+      if (msg.unique())
+        return msg;
+    }
+    Ptr msg(new M);
+    if (pool_.size() < capacity_)
+      pool_.push_back(msg);
+    return msg;
+  }
+
+ private:
+  size_t capacity_;
+  size_t next_;
+  std::vector<Ptr> pool_;
+};
+
+// Free list of fixed-size blocks for the calling thread. Blocks go back to
+// the heap when the thread exits, and after that are freed directly.
+template <size_t SIZE>
+class BlockList {
+ public:
+  static void * Allocate() {
+    if (Dead() || !Local().head)
+      return ::operator new(SIZE);
+    Block * block = Local().head;
+    Local().head = block->next;
+    return block;
+  }
+
+  static void Release(void * ptr) {
+    if (Dead()) {
+      ::operator delete(ptr);
+      return;
+    }
+    Block * block = static_cast<Block*>(ptr);
+    block->next = Local().head;
+    Local().head = block;
+  }
+
+ private:
+  struct Block {
+    Block * next;
+  };
+  struct Holder {
+    Block * head = nullptr;
+    ~Holder() {
+      while (head) {
+        Block * block = head;
+        head = block->next;
+        ::operator delete(block);
+      }
+      Dead() = true;
+    }
+  };
+  static Holder & Local() {
+    static thread_local Holder holder;
+    return holder;
+  }
+  static bool & Dead() {
+    static thread_local bool dead = false;
+    return dead;
+  }
+};
+
+// Allocator for node-based containers such as std::map. Single objects are
+// recycled through a free list, and anything else goes to the heap.
+template <typename T>
+struct NodeAllocator {
+  typedef T value_type;
+  static constexpr size_t BLOCK = std::max(sizeof(T), sizeof(void*));
+
+  NodeAllocator() noexcept {}
+  template <typename U> NodeAllocator(NodeAllocator<U> const&) noexcept {}
+
+  T * allocate(size_t n) {
+    if (n != 1)
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    return static_cast<T*>(BlockList<BLOCK>::Allocate());
+  }
+
+  void deallocate(T * ptr, size_t n) noexcept {
+    if (n != 1)
+      ::operator delete(ptr);
+    else
+      BlockList<BLOCK>::Release(ptr);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(NodeAllocator<T> const&, NodeAllocator<U> const&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(NodeAllocator<T> const&, NodeAllocator<U> const&) {
+  return false;
+}
+
+#endif
@@ -0,0 +1,330 @@
+/*
+  Benchmarks for the hot paths shared by the solvers and the filter: the
+  lighthouse model, Kabsch, binning light into a store, per-epoch PnP and
+  evaluation of the group cost. The kernels run on synthetic data, and the
+  store, PnP and cost are timed on increasing lengths of a bag. Each result
+  is printed as one "name key=value ..." line, in the same format as the
+  benchmarks of the low-level driver, so that builds can be compared.
+*/
+
+// ROS includes
+#include <ros/ros.h>
+
+// Ceres
+#include <ceres/ceres.h>
+
+// C++ libraries
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Shared local code
+#include "deepdive.hh"
+#include "deepdive_cost.hh"
+#include "deepdive_pnp.hh"
+#include "deepdive_pool.hh"
+
+// Number of synthetic points pushed through the lighthouse model
+static constexpr size_t BENCH_POINTS = 100 * NUM_SENSORS;
+
+// Number of passes over the synthetic points and groups
+static constexpr size_t BENCH_PASSES = 20;
+
+// Number of solves for each Kabsch problem size
+static constexpr size_t BENCH_SOLVES = 1000;
+
+// Output checksum, so the compiler cannot discard the work
+double checksum_ = 0.0;
+
+// Lighthouse parameters, of a similar magnitude to real lighthouses
+double params_[NUM_MOTORS * NUM_PARAMS] = {
+  0.0243, -0.0047, 1.3828, 0.0041, 0.0012,
+  0.0378, 0.0031, 2.2031, -0.0036, 0.0008
+};
+
+// Light read from a bag, and the devices that produced it
+struct BagData {
+  LighthouseMap lighthouses;
+  TrackerMap trackers;
+  std::vector<deepdive_ros::Light::ConstPtr> light;
+};
+
+// Time some work that is repeated over a number of passes, and return the
+// nanoseconds spent per item
+template <typename Work>
+double TimeNs(size_t items, Work work) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t p = 0; p < BENCH_PASSES; p++)
+    work();
+  return ElapsedMs(start) * 1e6 / static_cast<double>(BENCH_PASSES * items);
+}
+
+// PREDICT AND CORRECT
+
+void BenchModel() {
+  std::mt19937 gen(42);
+  std::uniform_real_distribution<double> dxy(-0.5, 0.5), dz(1.0, 3.0);
+  std::vector<double> x(BENCH_POINTS), y(BENCH_POINTS), z(BENCH_POINTS);
+  for (size_t i = 0; i < BENCH_POINTS; i++) {
+    x[i] = dxy(gen);
+    y[i] = dxy(gen);
+    z[i] = dz(gen);
+  }
+  std::vector<double> ang0(BENCH_POINTS), ang1(BENCH_POINTS);
+  std::vector<double> ref0(BENCH_POINTS), ref1(BENCH_POINTS);
+
+  // Scalar and batched prediction, with and without corrections
+  double scalar = TimeNs(BENCH_POINTS, [&] {
+    for (size_t i = 0; i < BENCH_POINTS; i++) {
+      double xyz[3] = { x[i], y[i], z[i] }, ang[2];
+      Predict<false>(params_, xyz, ang);
+      checksum_ += ang[0] + ang[1];
+    }
+  });
+  double scalar_correct = TimeNs(BENCH_POINTS, [&] {
+    for (size_t i = 0; i < BENCH_POINTS; i++) {
+      double xyz[3] = { x[i], y[i], z[i] }, ang[2];
+      Predict<true>(params_, xyz, ang);
+      ref0[i] = ang[0];
+      ref1[i] = ang[1];
+    }
+  });
+  double batch = TimeNs(BENCH_POINTS, [&] {
+    PredictBatch<false>(params_, BENCH_POINTS,
+      x.data(), y.data(), z.data(), ang0.data(), ang1.data());
+    checksum_ += ang0[0] + ang1[0];
+  });
+  double batch_correct = TimeNs(BENCH_POINTS, [&] {
+    PredictBatch<true>(params_, BENCH_POINTS,
+      x.data(), y.data(), z.data(), ang0.data(), ang1.data());
+  });
+  double error = 0.0;
+  for (size_t i = 0; i < BENCH_POINTS; i++) {
+    error = std::max(error, std::fabs(ang0[i] - ref0[i]));
+    error = std::max(error, std::fabs(ang1[i] - ref1[i]));
+  }
+  printf("predict points=%zu scalar_ns=%.3f scalar_correct_ns=%.3f"
+    " batch_ns=%.3f batch_correct_ns=%.3f max_error=%.3e\n", BENCH_POINTS,
+      scalar, scalar_correct, batch, batch_correct, error);
+
+  // Scalar and batched correction of the predicted angles, which should
+  // recover the ideal angles of the points
+  double correct = TimeNs(BENCH_POINTS, [&] {
+    for (size_t i = 0; i < BENCH_POINTS; i++) {
+      double ang[2] = { ref0[i], ref1[i] };
+      Correct<true>(params_, ang);
+      ang0[i] = ang[0];
+      ang1[i] = ang[1];
+    }
+  });
+  double correct_error = 0.0;
+  for (size_t i = 0; i < BENCH_POINTS; i++) {
+    correct_error = std::max(correct_error,
+      std::fabs(ang0[i] - std::atan2(x[i], z[i])));
+    correct_error = std::max(correct_error,
+      std::fabs(ang1[i] - std::atan2(y[i], z[i])));
+  }
+  double correct_batch = TimeNs(BENCH_POINTS, [&] {
+    std::copy(ref0.begin(), ref0.end(), ang0.begin());
+    std::copy(ref1.begin(), ref1.end(), ang1.begin());
+    CorrectBatch<true>(params_, BENCH_POINTS, ang0.data(), ang1.data());
+  });
+  double batch_error = 0.0;
+  for (size_t i = 0; i < BENCH_POINTS; i++) {
+    batch_error = std::max(batch_error,
+      std::fabs(ang0[i] - std::atan2(x[i], z[i])));
+    batch_error = std::max(batch_error,
+      std::fabs(ang1[i] - std::atan2(y[i], z[i])));
+  }
+  printf("correct pairs=%zu scalar_ns=%.3f batch_ns=%.3f"
+    " scalar_error=%.3e batch_error=%.3e checksum=%.6e\n", BENCH_POINTS,
+      correct, correct_batch, correct_error, batch_error, checksum_);
+}
+
+// KABSCH
+
+void BenchKabsch(size_t points) {
+  std::mt19937 gen(points);
+  std::uniform_real_distribution<double> dist(-0.1, 0.1);
+  Eigen::Matrix<double, 3, Eigen::Dynamic> in(3, points), out(3, points);
+  for (size_t i = 0; i < points; i++)
+    in.col(i) << dist(gen), dist(gen), dist(gen);
+  Eigen::Affine3d T = Eigen::Translation3d(1.0, -2.0, 0.5)
+    * Eigen::AngleAxisd(0.7, Eigen::Vector3d(1.0, 2.0, 3.0).normalized());
+  out = T * in;
+  Eigen::Transform<double, 3, Eigen::Affine> A;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < BENCH_SOLVES; i++) {
+    Kabsch<double>(in, out, A, false);
+    checksum_ += A.translation()[0];
+  }
+  double us = ElapsedMs(start) * 1e3 / static_cast<double>(BENCH_SOLVES);
+  double error = ((A * in) - out).colwise().norm().maxCoeff();
+  printf("kabsch points=%zu us=%.3f max_error=%.3e\n", points, us, error);
+}
+
+// BAG DATA
+
+// Devices are added as they are first seen, so no configuration is needed
+bool ReadBagData(std::string const& bagfile, BagData & data) {
+  BagCallbacks cb;
+  cb.trackers = [&data](deepdive_ros::Trackers::ConstPtr const& msg) {
+    for (size_t i = 0; i < msg->trackers.size(); i++)
+      data.trackers[msg->trackers[i].serial];
+    TrackerCallback(msg, data.trackers, [](TrackerMap::iterator) {});
+  };
+  cb.lighthouses = [&data](deepdive_ros::Lighthouses::ConstPtr const& msg) {
+    for (size_t i = 0; i < msg->lighthouses.size(); i++)
+      data.lighthouses[msg->lighthouses[i].serial];
+    LighthouseCallback(msg, data.lighthouses, [](LighthouseMap::iterator) {});
+  };
+  cb.light = [&data](deepdive_ros::Light::ConstPtr const& msg) {
+    data.light.push_back(msg);
+  };
+  return ReadBag(bagfile, cb);
+}
+
+// Time the store, PnP and group cost on the first seconds of the light in a
+// bag, or all of it if the duration is not positive
+void BenchBag(BagData & data, double duration, double resolution,
+  bool correct, WorkerPool & pool) {
+  if (data.light.empty())
+    return;
+  ros::Time begin = data.light.front()->header.stamp;
+  MeasurementMap measurements;
+  for (size_t i = 0; i < data.light.size(); i++) {
+    ros::Time const& stamp = data.light[i]->header.stamp;
+    if (duration > 0.0 && (stamp - begin).toSec() > duration)
+      continue;
+    measurements[stamp].light = *data.light[i];
+  }
+  double seconds = (measurements.rbegin()->first
+    - measurements.begin()->first).toSec();
+
+  // Binning into the store
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  LightStore store;
+  store.Build(measurements, data.lighthouses, data.trackers, resolution);
+  printf("store seconds=%.3f measurements=%zu rows=%zu epochs=%zu ms=%.3f\n",
+    seconds, measurements.size(), store.angle.size(), store.NumEpochs(),
+      ElapsedMs(start));
+
+  // Initialization of every epoch with PnP
+  PnpOptions options;
+  options.correct = correct;
+  size_t epochs = 0, valid = 0;
+  double ms = 0.0;
+  LighthouseMap::iterator lt;
+  TrackerMap::iterator tt;
+  uint16_t l = 0, t = 0;
+  for (lt = data.lighthouses.begin(); lt != data.lighthouses.end(); lt++, l++) {
+    for (tt = data.trackers.begin(), t = 0; tt != data.trackers.end(); tt++, t++) {
+      std::pair<size_t, size_t> range = store.Epochs(l, t);
+      std::vector<size_t> list;
+      for (size_t e = range.first; e < range.second; e++)
+        list.push_back(e);
+      std::vector<PnpSolution> solutions;
+      start = std::chrono::steady_clock::now();
+      PnpSolve(store, list, tt->second.sensors, lt->second.params,
+        options, pool, solutions);
+      ms += ElapsedMs(start);
+      epochs += list.size();
+      for (size_t i = 0; i < solutions.size(); i++)
+        valid += (solutions[i].valid ? 1 : 0);
+    }
+  }
+  printf("pnp seconds=%.3f epochs=%zu valid=%zu threads=%zu ms=%.3f"
+    " us_per_epoch=%.3f\n", seconds, epochs, valid, pool.Size(), ms,
+      epochs ? 1e3 * ms / static_cast<double>(epochs) : 0.0);
+
+  // One group cost per epoch, evaluated at an arbitrary pose
+  double wTv[6] = { 0.1, -0.2, 0.3, 0.01, 0.02, 0.03 };
+  double wTb[6] = { 1.0, 2.0, 0.5, 0.1, 0.2, 0.3 };
+  std::vector<std::unique_ptr<ceres::CostFunction>> costs;
+  std::vector<std::vector<double*>> blocks;
+  size_t residuals = 0;
+  for (lt = data.lighthouses.begin(), l = 0; lt != data.lighthouses.end(); lt++, l++) {
+    for (tt = data.trackers.begin(), t = 0; tt != data.trackers.end(); tt++, t++) {
+      std::pair<size_t, size_t> range = store.Epochs(l, t);
+      for (size_t e = range.first; e < range.second; e++) {
+        Group group;
+        for (size_t r = store.Begin(e); r < store.End(e); r++)
+          group[std::make_pair(store.sensor[r], store.axis[r])] = store.angle[r];
+        blocks.emplace_back();
+        costs.emplace_back(GroupCost::Create(group, wTv, lt->second.vTl, wTb,
+          tt->second.bTh, tt->second.tTh, lt->second.params,
+            tt->second.sensors, correct, blocks.back()));
+        residuals += costs.back()->num_residuals();
+      }
+    }
+  }
+  if (costs.empty())
+    return;
+  std::vector<double> residual(NUM_SENSORS * 2);
+  std::vector<std::vector<double>> jacobian;
+  std::vector<double*> jacobians;
+  double residual_ns = TimeNs(costs.size(), [&] {
+    for (size_t i = 0; i < costs.size(); i++) {
+      costs[i]->Evaluate(blocks[i].data(), residual.data(), nullptr);
+      checksum_ += residual[0];
+    }
+  });
+  double jacobian_ns = TimeNs(costs.size(), [&] {
+    for (size_t i = 0; i < costs.size(); i++) {
+      std::vector<int32_t> const& sizes = costs[i]->parameter_block_sizes();
+      jacobian.resize(sizes.size());
+      jacobians.resize(sizes.size());
+      for (size_t b = 0; b < sizes.size(); b++) {
+        jacobian[b].resize(costs[i]->num_residuals() * sizes[b]);
+        jacobians[b] = jacobian[b].data();
+      }
+      costs[i]->Evaluate(blocks[i].data(), residual.data(), jacobians.data());
+      checksum_ += jacobian[0][0];
+    }
+  });
+  printf("cost seconds=%.3f groups=%zu residuals=%zu residual_us=%.3f"
+    " jacobian_us=%.3f checksum=%.6e\n", seconds, costs.size(), residuals,
+      residual_ns / 1e3, jacobian_ns / 1e3, checksum_);
+}
+
+// MAIN ENTRY POINT
+
+int main(int argc, char **argv) {
+  // Initialize ROS and create node handle
+  ros::init(argc, argv, "deepdive_bench");
+  ros::NodeHandle nh("~");
+
+  // Bag and the lengths of it to use, in seconds (zero is all of it)
+  std::string bag;
+  nh.param<std::string>("bag", bag, "");
+  std::vector<double> durations = { 10.0, 30.0, 60.0, 0.0 };
+  nh.getParam("durations", durations);
+  double resolution = 0.1;
+  nh.param<double>("resolution", resolution, resolution);
+  bool correct = true;
+  nh.param<bool>("correct", correct, correct);
+  int threads = std::thread::hardware_concurrency();
+  nh.param<int>("threads", threads, threads);
+  WorkerPool pool;
+  pool.Start(threads > 1 ? threads : 0);
+
+  // Kernels on synthetic data
+  BenchModel();
+  BenchKabsch(8);
+  BenchKabsch(NUM_SENSORS);
+
+  // Solver paths on real data
+  if (!bag.empty()) {
+    BagData data;
+    if (!ReadBagData(bag, data))
+      return 1;
+    for (size_t i = 0; i < durations.size(); i++)
+      BenchBag(data, durations[i], resolution, correct, pool);
+  }
+
+  // Success!
+  return 0;
+}
@@ -11,6 +11,12 @@ extern "C" {
 // ROS includes
 #include <ros/ros.h>
 
+// Nodelet includes
+#ifdef DEEPDIVE_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 // Standard messages
 #include <sensor_msgs/Imu.h>
 #include <geometry_msgs/Vector3.h>
@@ -20,18 +26,41 @@ extern "C" {
 // Non-standard messages
 #include <deepdive_ros/Button.h>
 #include <deepdive_ros/Light.h>
+#include <deepdive_ros/LightCompact.h>
 #include <deepdive_ros/Pulse.h>
 #include <deepdive_ros/Motor.h>
 #include <deepdive_ros/Sensor.h>
 #include <deepdive_ros/Lighthouses.h>
 #include <deepdive_ros/Trackers.h>
 
+// Device to host clock mapping
+#include "deepdive_clock.hh"
+
+// Recycled messages
+#include "deepdive_arena.hh"
+
+// Pipeline diagnostics
+#ifdef DEEPDIVE_METRICS
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include "deepdive.hh"
+#endif
+
 // C++ includes
+#include <csignal>
 #include <cstdint>
 #include <cmath>
 #include <map>
 #include <string>
 #include <limits>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <thread>
+
+// POSIX includes
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 // Various constants used by the Vive system
 static constexpr double GRAVITY         = 9.80665;
@@ -41,8 +70,26 @@ static constexpr double SWEEP_DURATION  = 400000.0;
 static constexpr double SWEEP_CENTER    = 200000.0;
 static constexpr double TICKS_PER_SEC   = 48e6;
 
+// Time (ms) between statistics, which is the longest we block when idle
+static constexpr int STATISTICS_PERIOD  = 1000;
+
 // DATA STRUCTURES
 
+// Publish compact light messages instead of full ones
+static bool compact_ = false;
+
+// Stamp messages with the device time mapped to the host clock
+static bool hardware_stamps_ = true;
+
+// Clock estimators for the light and IMU timecodes of each tracker. Both
+// count the same 48MHz ticks, but arrive on different paths and so are
+// fitted separately.
+struct Clocks {
+  ClockSync light;
+  ClockSync imu;
+};
+static std::map<std::string, Clocks> clocks_;
+
 // Data structures for storing lighthouses and trackers
 static std::map<std::string, deepdive_ros::Lighthouse> lighthouses_;
 static std::map<std::string, deepdive_ros::Tracker> trackers_;
@@ -52,8 +99,40 @@ static ros::Publisher pub_lighthouses_;
 static ros::Publisher pub_trackers_;
 static ros::Publisher pub_button_;
 static ros::Publisher pub_light_;
+static ros::Publisher pub_light_compact_;
 static ros::Publisher pub_imu_;
 
+// Messages are published by pointer and recycled once subscribers release
+// them, so that the steady-state publishing path does not allocate
+static MessagePool<deepdive_ros::Light> pool_light_;
+static MessagePool<deepdive_ros::LightCompact> pool_light_compact_;
+static MessagePool<sensor_msgs::Imu> pool_imu_;
+
+#ifdef DEEPDIVE_METRICS
+
+// Time from a driver callback being entered to its messages being published
+static ros::Publisher pub_diagnostics_;
+static Statistic light_publish_;
+static Statistic imu_publish_;
+
+// Feeds the time (us) between construction and destruction to a statistic,
+// spread evenly over some number of messages
+class PublishTimer {
+ public:
+  explicit PublishTimer(Statistic & stat, size_t num = 1)
+    : stat_(stat), num_(num), start_(std::chrono::steady_clock::now()) {}
+  ~PublishTimer() {
+    if (num_)
+      stat_.Feed(1e3 * ElapsedMs(start_) / num_);
+  }
+ private:
+  Statistic & stat_;
+  size_t num_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif
+
 // Quaternion :: ROS <-> DOUBLE
 
 template <typename T> inline
@@ -106,34 +185,92 @@ void Convert(const T from[3], geometry_msgs::Point & to) {
 
 // CALLBACKS
 
+// Get the host time at which a device timecode was measured
+ros::Time Stamp(ClockSync & clock, uint32_t ticks, ros::Time const& now) {
+  if (!hardware_stamps_)
+    return now;
+  return ros::Time(clock.Update(ticks, now.toSec()));
+}
+
+// Publish a sweep as a compact message, with the pulses in sensor order
+void PublishCompact(ros::Time const& stamp, uint16_t tracker,
+  uint8_t lighthouse, uint8_t axis, uint16_t num_sensors,
+  const uint16_t *sensors, const double *angles, const uint16_t *lengths) {
+  double a[MAX_NUM_SENSORS];
+  uint16_t d[MAX_NUM_SENSORS];
+  deepdive_ros::LightCompactPtr msg = pool_light_compact_.Acquire();
+  msg->header.stamp = stamp;
+  msg->tracker = tracker;
+  msg->lighthouse = lighthouse;
+  msg->axis = axis;
+  msg->mask = 0;
+  for (uint16_t i = 0; i < num_sensors; i++) {
+    if (sensors[i] >= MAX_NUM_SENSORS) continue;
+    msg->mask |= (1u << sensors[i]);
+    a[sensors[i]] = angles[i];
+    d[sensors[i]] = lengths[i];
+  }
+  msg->angles.clear();
+  msg->durations.clear();
+  msg->angles.reserve(MAX_NUM_SENSORS);
+  msg->durations.reserve(MAX_NUM_SENSORS);
+  for (uint32_t m = msg->mask; m; m &= m - 1) {
+    int i = __builtin_ctz(m);
+    msg->angles.push_back(a[i]);
+    msg->durations.push_back(d[i]);
+  }
+  pub_light_compact_.publish(msg);
+}
+
 // Callback to display light info
 void LightCallback(struct Tracker * tracker,
   struct Lighthouse * lighthouse, uint8_t axis, uint32_t synctime,
   uint16_t num_sensors, uint16_t *sensors, uint32_t *sweeptimes,
   uint32_t *angles, uint16_t *lengths) {
-  deepdive_ros::Light msg;
-  msg.header.frame_id = tracker->serial;
-  msg.header.stamp = ros::Time::now();
-  msg.lighthouse = lighthouse->serial;
+#ifdef DEEPDIVE_METRICS
+  PublishTimer timer(light_publish_);
+#endif
   // Make sure we convert to RHS
+  uint8_t ax;
   switch (axis) {
   case MOTOR_AXIS0:
-    msg.axis = deepdive_ros::Motor::AXIS_0;
+    ax = deepdive_ros::Motor::AXIS_0;
     break;
   case MOTOR_AXIS1:
-    msg.axis = deepdive_ros::Motor::AXIS_1;
+    ax = deepdive_ros::Motor::AXIS_1;
     break;
   default:
     ROS_WARN("Received light with invalid axis");
     return;
   }
-  // Add the pulses
-  msg.pulses.resize(num_sensors);
+  // The sweep started at the sync pulse
+  ros::Time stamp =
+    Stamp(clocks_[tracker->serial].light, synctime, ros::Time::now());
+  // Optionally publish the compact form instead
+  if (compact_) {
+    double a[MAX_NUM_SENSORS];
+    uint16_t n = std::min<uint16_t>(num_sensors, MAX_NUM_SENSORS);
+    for (uint16_t i = 0; i < n; i++)
+      a[i] = (M_PI / SWEEP_DURATION)
+        * (static_cast<double>(angles[i]) - SWEEP_CENTER);
+    PublishCompact(stamp, tracker->handle, lighthouse->id,
+      ax, n, sensors, a, lengths);
+    return;
+  }
+  // Published by pointer, so that nodelets in the same manager share it
+  deepdive_ros::LightPtr msg = pool_light_.Acquire();
+  msg->header.frame_id = tracker->serial;
+  msg->header.stamp = stamp;
+  msg->lighthouse = lighthouse->serial;
+  msg->axis = ax;
+  // Add the pulses, which never grows the buffer once it is full size
+  msg->pulses.reserve(MAX_NUM_SENSORS);
+  msg->pulses.resize(num_sensors);
   for (uint16_t i = 0; i < num_sensors; i++) {
-    msg.pulses[i].sensor = sensors[i];
-    msg.pulses[i].angle = (M_PI / SWEEP_DURATION)
+    msg->pulses[i].sensor = sensors[i];
+    msg->pulses[i].angle = (M_PI / SWEEP_DURATION)
       * (static_cast<double>(angles[i]) - SWEEP_CENTER);
-    msg.pulses[i].duration =
+    msg->pulses[i].duration =
       static_cast<double>(lengths[i]) / TICKS_PER_SEC;
   }
   // Publish the data
@@ -143,45 +280,249 @@ void LightCallback(struct Tracker * tracker,
 // Called back when new IMU data is available
 void ImuCallback(struct Tracker * tracker, uint32_t timecode,
   int16_t acc[3], int16_t gyr[3], int16_t mag[3]) {
+#ifdef DEEPDIVE_METRICS
+  PublishTimer timer(imu_publish_);
+#endif
   // Package up the IMU data
-  sensor_msgs::Imu msg;
-  msg.header.frame_id = tracker->serial;
-  msg.header.stamp = ros::Time::now();
-  msg.linear_acceleration.x =
+  sensor_msgs::ImuPtr msg = pool_imu_.Acquire();
+  msg->header.frame_id = tracker->serial;
+  msg->header.stamp =
+    Stamp(clocks_[tracker->serial].imu, timecode, ros::Time::now());
+  msg->linear_acceleration.x =
     static_cast<double>(acc[0]) * GRAVITY / ACC_SCALE;
-  msg.linear_acceleration.y =
+  msg->linear_acceleration.y =
     static_cast<double>(acc[1]) * GRAVITY / ACC_SCALE;
-  msg.linear_acceleration.z =
+  msg->linear_acceleration.z =
     static_cast<double>(acc[2]) * GRAVITY / ACC_SCALE;
-  msg.angular_velocity.x =
+  msg->angular_velocity.x =
     static_cast<double>(gyr[0]) * (1./GYRO_SCALE) * (M_PI/180.);
-  msg.angular_velocity.y =
+  msg->angular_velocity.y =
     static_cast<double>(gyr[1]) * (1./GYRO_SCALE) * (M_PI/180.);
-  msg.angular_velocity.z =
+  msg->angular_velocity.z =
     static_cast<double>(gyr[2]) * (1./GYRO_SCALE) * (M_PI/180.);
   // Publish the data
   pub_imu_.publish(msg);
 }
 
+// Called back with all light data received in a single poll
+void LightBatchCallback(struct Driver * drv, const struct LightBatch * batch) {
+#ifdef DEEPDIVE_METRICS
+  PublishTimer timer(light_publish_, batch->num_sweeps);
+#endif
+  // Convert all angles and durations in one tight loop
+  static std::vector<double> angles, durations;
+  angles.resize(batch->num_pulses);
+  durations.resize(batch->num_pulses);
+  for (uint32_t i = 0; i < batch->num_pulses; i++) {
+    angles[i] = (M_PI / SWEEP_DURATION)
+      * (static_cast<double>(batch->angle[i]) - SWEEP_CENTER);
+    durations[i] = static_cast<double>(batch->length[i]) / TICKS_PER_SEC;
+  }
+  // Package up one message per sweep
+  ros::Time now = ros::Time::now();
+  for (uint32_t s = 0; s < batch->num_sweeps; s++) {
+    struct Tracker * tracker =
+      deepdive_tracker_by_handle(drv, batch->tracker[s]);
+    struct Lighthouse * lighthouse =
+      deepdive_lighthouse_by_handle(drv, batch->lighthouse[s]);
+    if (!tracker || !lighthouse) continue;
+    uint8_t ax;
+    switch (batch->axis[s]) {
+    case MOTOR_AXIS0:
+      ax = deepdive_ros::Motor::AXIS_0;
+      break;
+    case MOTOR_AXIS1:
+      ax = deepdive_ros::Motor::AXIS_1;
+      break;
+    default:
+      ROS_WARN("Received light with invalid axis");
+      continue;
+    }
+    ros::Time stamp =
+      Stamp(clocks_[tracker->serial].light, batch->synctime[s], now);
+    if (compact_) {
+      uint32_t o = batch->offset[s];
+      PublishCompact(stamp, batch->tracker[s], batch->lighthouse[s], ax,
+        batch->count[s], &batch->sensor[o], &angles[o], &batch->length[o]);
+      continue;
+    }
+    deepdive_ros::LightPtr msg = pool_light_.Acquire();
+    msg->header.frame_id = tracker->serial;
+    msg->header.stamp = stamp;
+    msg->lighthouse = lighthouse->serial;
+    msg->axis = ax;
+    msg->pulses.reserve(MAX_NUM_SENSORS);
+    msg->pulses.resize(batch->count[s]);
+    for (uint16_t i = 0; i < batch->count[s]; i++) {
+      uint32_t p = batch->offset[s] + i;
+      msg->pulses[i].sensor = batch->sensor[p];
+      msg->pulses[i].angle = angles[p];
+      msg->pulses[i].duration = durations[p];
+    }
+    pub_light_.publish(msg);
+  }
+}
+
+// Called back with all IMU data received in a single poll
+void ImuBatchCallback(struct Driver * drv, const struct ImuBatch * batch) {
+#ifdef DEEPDIVE_METRICS
+  PublishTimer timer(imu_publish_, batch->num);
+#endif
+  ros::Time now = ros::Time::now();
+  for (uint32_t s = 0; s < batch->num; s++) {
+    struct Tracker * tracker =
+      deepdive_tracker_by_handle(drv, batch->tracker[s]);
+    if (!tracker) continue;
+    sensor_msgs::ImuPtr msg = pool_imu_.Acquire();
+    msg->header.frame_id = tracker->serial;
+    msg->header.stamp =
+      Stamp(clocks_[tracker->serial].imu, batch->timecode[s], now);
+    msg->linear_acceleration.x =
+      static_cast<double>(batch->acc[s][0]) * GRAVITY / ACC_SCALE;
+    msg->linear_acceleration.y =
+      static_cast<double>(batch->acc[s][1]) * GRAVITY / ACC_SCALE;
+    msg->linear_acceleration.z =
+      static_cast<double>(batch->acc[s][2]) * GRAVITY / ACC_SCALE;
+    msg->angular_velocity.x =
+      static_cast<double>(batch->gyr[s][0]) * (1./GYRO_SCALE) * (M_PI/180.);
+    msg->angular_velocity.y =
+      static_cast<double>(batch->gyr[s][1]) * (1./GYRO_SCALE) * (M_PI/180.);
+    msg->angular_velocity.z =
+      static_cast<double>(batch->gyr[s][2]) * (1./GYRO_SCALE) * (M_PI/180.);
+    pub_imu_.publish(msg);
+  }
+}
+
 // Called when a button is pressed
 void ButtonCallback(struct Tracker * tracker,
   uint32_t mask, uint16_t trigger, int16_t horizontal, int16_t vertical) {
   // Package up the button data
-  deepdive_ros::Button msg;
-  msg.tracker = tracker->serial;
-  msg.mask = mask;
-  msg.trigger_val = trigger;
-  msg.pad_x = horizontal;
-  msg.pad_y = vertical;
+  deepdive_ros::ButtonPtr msg(new deepdive_ros::Button);
+  msg->tracker = tracker->serial;
+  msg->mask = mask;
+  msg->trigger_val = trigger;
+  msg->pad_x = horizontal;
+  msg->pad_y = vertical;
   // Publish the data
   pub_button_.publish(msg);
 }
 
+// Send all trackers at once
+void PublishTrackers() {
+  deepdive_ros::Trackers msg;
+  msg.header.stamp = ros::Time::now();
+  msg.header.frame_id = "world";
+  std::map<std::string, deepdive_ros::Tracker>::iterator it;
+  for (it = trackers_.begin(); it != trackers_.end(); it++)
+    msg.trackers.push_back(it->second);
+  pub_trackers_.publish(msg);
+}
+
+// Update the queue statistics for a tracker, returning true on overflow
+bool UpdateTrackerStatistics(struct Tracker * t) {
+  if (!t) return false;
+  std::map<std::string, deepdive_ros::Tracker>::iterator it =
+    trackers_.find(t->serial);
+  if (it == trackers_.end()) return false;
+  it->second.lastcount = deepdive_lastcount(t);
+  uint32_t overflows = deepdive_overflows(t);
+  if (overflows == it->second.overflows) return false;
+  ROS_WARN_STREAM("Tracker " << t->serial << " dropped "
+    << (overflows - it->second.overflows) << " records");
+  it->second.overflows = overflows;
+  return true;
+}
+
+#ifdef DEEPDIVE_METRICS
+
+// Names of the driver counters, indexed by MetricType
+static const char * METRIC_NAMES[MAX_NUM_METRICS] = {
+  "transfers", "transfer_errors", "decode_faults", "ootx_frames",
+  "ootx_crc_errors", "sweeps", "dropped_sweeps", "imu_samples", "overflows"
+};
+
+// Failures seen for each tracker at the last report
+static std::map<std::string, uint64_t> failures_;
+
+// Add a key value pair to a diagnostic status
+template <typename T>
+void AddValue(diagnostic_msgs::DiagnosticStatus & status,
+  std::string const& key, T value) {
+  diagnostic_msgs::KeyValue kv;
+  kv.key = key;
+  kv.value = std::to_string(value);
+  status.values.push_back(kv);
+}
+
+// Publish the driver counters and latencies for every tracker, as well as
+// the cost of publishing since the last report
+void PublishDiagnostics(struct Driver * drv) {
+  diagnostic_msgs::DiagnosticArray msg;
+  msg.header.stamp = ros::Time::now();
+  struct Metrics metrics;
+  for (size_t i = 0; i < drv->num_trackers; i++) {
+    struct Tracker * t = drv->trackers[i];
+    if (!t || trackers_.find(t->serial) == trackers_.end())
+      continue;
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = std::string("deepdive_bridge: ") + t->serial;
+    status.hardware_id = t->serial;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.message = "OK";
+    if (deepdive_metrics(t, &metrics)) {
+      status.message = "Driver built without DEEPDIVE_METRICS";
+      msg.status.push_back(status);
+      continue;
+    }
+    for (size_t m = 0; m < MAX_NUM_METRICS; m++)
+      AddValue(status, METRIC_NAMES[m], metrics.counters[m]);
+    // Latencies are over the lifetime of the tracker
+    struct Histogram const& h = metrics.usb_to_callback;
+    AddValue(status, "usb_to_callback_us_p50",
+      1e-3 * deepdive_histogram_percentile(&h, 0.50));
+    AddValue(status, "usb_to_callback_us_p90",
+      1e-3 * deepdive_histogram_percentile(&h, 0.90));
+    AddValue(status, "usb_to_callback_us_p99",
+      1e-3 * deepdive_histogram_percentile(&h, 0.99));
+    AddValue(status, "usb_to_callback_us_max", 1e-3 * h.max);
+    // Warn if anything failed since the last report
+    uint64_t failures = metrics.counters[METRIC_TRANSFER_ERRORS]
+      + metrics.counters[METRIC_DECODE_FAULTS]
+      + metrics.counters[METRIC_OOTX_CRC_ERRORS]
+      + metrics.counters[METRIC_OVERFLOWS];
+    if (failures != failures_[t->serial]) {
+      status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+      status.message = std::to_string(failures - failures_[t->serial])
+        + " failures since the last report";
+      failures_[t->serial] = failures;
+    }
+    msg.status.push_back(status);
+  }
+  // Cost of converting and publishing messages
+  diagnostic_msgs::DiagnosticStatus status;
+  status.name = "deepdive_bridge: publish";
+  status.level = diagnostic_msgs::DiagnosticStatus::OK;
+  status.message = "OK";
+  AddValue(status, "light_messages", light_publish_.Count());
+  AddValue(status, "light_us", light_publish_.Mean());
+  AddValue(status, "light_us_dev", light_publish_.Deviation());
+  AddValue(status, "imu_messages", imu_publish_.Count());
+  AddValue(status, "imu_us", imu_publish_.Mean());
+  AddValue(status, "imu_us_dev", imu_publish_.Deviation());
+  light_publish_.Reset();
+  imu_publish_.Reset();
+  msg.status.push_back(status);
+  pub_diagnostics_.publish(msg);
+}
+
+#endif
+
 // Configuration call from the vive_tool
 void TrackerCallback(struct Tracker * t) {
   if (!t) return;
   deepdive_ros::Tracker & tracker = trackers_[t->serial];
   tracker.serial = t->serial;
+  tracker.handle = t->handle;
   tracker.sensors.resize(t->cal.num_channels);
   for (size_t i = 0; i < t->cal.num_channels; i++) {
     Convert(t->cal.positions[i], tracker.sensors[i].position);
@@ -199,13 +540,19 @@ void TrackerCallback(struct Tracker * t) {
   Convert(&t->cal.head_transform[0], tracker.head_transform.rotation);
   Convert(&t->cal.head_transform[4], tracker.head_transform.translation);
   // Send all trackers at once
-  deepdive_ros::Trackers msg;
-  msg.header.stamp = ros::Time::now();
-  msg.header.frame_id = "world";
-  std::map<std::string, deepdive_ros::Tracker>::iterator it;
-  for (it = trackers_.begin(); it != trackers_.end(); it++)
-    msg.trackers.push_back(it->second);
-  pub_trackers_.publish(msg);
+  PublishTrackers();
+}
+
+// Called when a tracker is unplugged
+void RemovedCallback(struct Tracker * t) {
+  if (!t) return;
+  ROS_INFO_STREAM("Tracker " << t->serial << " was removed");
+  trackers_.erase(t->serial);
+  clocks_.erase(t->serial);
+#ifdef DEEPDIVE_METRICS
+  failures_.erase(t->serial);
+#endif
+  PublishTrackers();
 }
 
 // Configuration call from the vive_tool
@@ -213,6 +560,7 @@ void LighthouseCallback(struct Lighthouse *l) {
   if (!l) return;
   deepdive_ros::Lighthouse & lighthouse = lighthouses_[l->serial];
   lighthouse.serial = l->serial;
+  lighthouse.handle = l->id;
   lighthouse.motors.resize(2);
   for (size_t i = 0; i < MAX_NUM_MOTORS; i++) {
     lighthouse.motors[i].axis = i;
@@ -234,11 +582,69 @@ void LighthouseCallback(struct Lighthouse *l) {
   pub_lighthouses_.publish(msg);
 }
 
-// Main entry point of application
-int main(int argc, char **argv) {
-  // Initialize ROS
-  ros::init(argc, argv, "deepdive_bridge");
-  ros::NodeHandle nh;
+// BRIDGE LIFECYCLE
+
+// Driver context and polling mode. This state is global, so there can only
+// be one bridge per process.
+static struct Driver * driver_ = nullptr;
+static bool threaded_ = false;
+static ros::Time last_statistics_;
+
+// The descriptors to wait on: an eventfd that interrupts the wait, followed
+// by those of the driver, which are fetched again whenever they change. In
+// threaded mode the driver only has one, which is readable when data is
+// queued.
+static std::vector<struct pollfd> fds_;
+static std::atomic<bool> fds_changed_{true};
+static int wake_ = -1;
+
+// Interrupt the wait for events. This is safe to call from a signal handler.
+void BridgeWake() {
+  if (wake_ < 0)
+    return;
+  uint64_t one = 1;
+  ssize_t ret = write(wake_, &one, sizeof(one));
+  static_cast<void>(ret);
+}
+
+// Called by the driver, on any of its threads, when a device is opened or
+// closed and the descriptors to wait on change
+void PollfdAdded(int fd, short events, void * user) {
+  fds_changed_ = true;
+  BridgeWake();
+}
+
+void PollfdRemoved(int fd, void * user) {
+  fds_changed_ = true;
+  BridgeWake();
+}
+
+// Fetch the descriptors of the driver, after the wake descriptor
+void FetchPollfds() {
+  fds_.resize(1);
+  fds_[0].fd = wake_;
+  fds_[0].events = POLLIN;
+  int num;
+  while ((num = deepdive_get_pollfds(driver_, fds_.data() + 1,
+    fds_.size() - 1)) > static_cast<int>(fds_.size()) - 1)
+      fds_.resize(num + 1);
+  fds_.resize(std::max(num, 0) + 1);
+}
+
+// Advertise topics, open the driver and install the callbacks
+bool BridgeStart(ros::NodeHandle & nh, ros::NodeHandle & nhp) {
+  // Should we handle USB events in a separate thread?
+  nhp.param<bool>("threaded", threaded_, false);
+
+  // Should light and IMU data be delivered in batches?
+  bool batched;
+  nhp.param<bool>("batched", batched, false);
+
+  // Should light be published in the compact form?
+  nhp.param<bool>("compact", compact_, false);
+
+  // Should messages be stamped with the device clock, or on arrival?
+  nhp.param<bool>("hardware_stamps", hardware_stamps_, true);
 
   // Latched publishers
   pub_lighthouses_ =
@@ -247,35 +653,211 @@ int main(int argc, char **argv) {
     nh.advertise<deepdive_ros::Trackers>("trackers", 10, true);
 
   // Non-latched publishers
-  pub_light_ = nh.advertise<deepdive_ros::Light>("light", 10);
+  if (compact_)
+    pub_light_compact_ =
+      nh.advertise<deepdive_ros::LightCompact>("light_compact", 10);
+  else
+    pub_light_ = nh.advertise<deepdive_ros::Light>("light", 10);
   pub_button_ = nh.advertise<deepdive_ros::Button>("button", 10);
   pub_imu_ = nh.advertise<sensor_msgs::Imu>("imu", 10);
+#ifdef DEEPDIVE_METRICS
+  pub_diagnostics_ =
+    nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 10);
+  if (!deepdive_metrics_enabled())
+    ROS_WARN("Driver built without DEEPDIVE_METRICS, so only publish costs"
+      " will be reported");
+#endif
 
   // Try to initialize vive
-  struct Driver *driver = deepdive_init();
-  if (!driver) {
+  driver_ = deepdive_init();
+  if (!driver_) {
     ROS_ERROR("Deepdive initialization failed");
-    return 1;
+    return false;
   }
 
   // Install the callbacks
-  deepdive_install_light_fn(driver, LightCallback);
-  deepdive_install_imu_fn(driver, ImuCallback);
-  deepdive_install_button_fn(driver, ButtonCallback);
-  deepdive_install_lighthouse_fn(driver, LighthouseCallback);
-  deepdive_install_tracker_fn(driver, TrackerCallback);
+  deepdive_install_light_fn(driver_, LightCallback);
+  deepdive_install_imu_fn(driver_, ImuCallback);
+  deepdive_install_button_fn(driver_, ButtonCallback);
+  deepdive_install_lighthouse_fn(driver_, LighthouseCallback);
+  deepdive_install_tracker_fn(driver_, TrackerCallback);
+  deepdive_install_removed_fn(driver_, RemovedCallback);
+  if (batched) {
+    if (deepdive_install_light_batch_fn(driver_, LightBatchCallback)
+      || deepdive_install_imu_batch_fn(driver_, ImuBatchCallback)) {
+      ROS_ERROR("Could not install the batched callbacks");
+      deepdive_close(driver_);
+      driver_ = nullptr;
+      return false;
+    }
+  }
+
+  // Wait on the driver's descriptors ourselves. Without a USB thread they
+  // change as devices come and go.
+  wake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_ < 0 || (!threaded_ && deepdive_install_pollfd_fns(driver_,
+    PollfdAdded, PollfdRemoved, nullptr))) {
+    ROS_ERROR("Could not wait on the deepdive file descriptors");
+    deepdive_close(driver_);
+    driver_ = nullptr;
+    if (wake_ >= 0)
+      close(wake_);
+    wake_ = -1;
+    return false;
+  }
+  fds_changed_ = true;
+
+  // Optionally decouple USB handling from ROS publishing
+  if (threaded_) {
+    if (deepdive_start(driver_)) {
+      ROS_ERROR("Could not start the deepdive USB thread");
+      deepdive_close(driver_);
+      driver_ = nullptr;
+      close(wake_);
+      wake_ = -1;
+      return false;
+    }
+    ROS_INFO("Handling USB events in a dedicated thread");
+  }
+  last_statistics_ = ros::Time::now();
+  return true;
+}
+
+// Block until the driver has events, it next needs servicing, statistics
+// are due or we are woken, and then service it. There is no timeout to
+// honour in threaded mode, where deepdive_get_timeout fails.
+void WaitForEvents() {
+  if (fds_changed_.exchange(false))
+    FetchPollfds();
+  int ms = STATISTICS_PERIOD - static_cast<int>(
+    1e3 * (ros::Time::now() - last_statistics_).toSec());
+  struct timeval tv;
+  if (deepdive_get_timeout(driver_, &tv) == 1)
+    ms = std::min<int>(ms, tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+  if (poll(fds_.data(), fds_.size(), std::max(ms, 0)) > 0
+    && (fds_[0].revents & POLLIN)) {
+    uint64_t count;
+    ssize_t ret = read(wake_, &count, sizeof(count));
+    static_cast<void>(ret);
+  }
+  deepdive_events_ready(driver_);
+}
 
-  // Set active to true on initialization
+// Service the driver once, blocking until there is something to do
+void BridgeSpinOnce() {
+  if (!driver_)
+    return;
+  WaitForEvents();
+  // Report statistics no faster than once a second
+  ros::Time now = ros::Time::now();
+  if (1e3 * (now - last_statistics_).toSec() < STATISTICS_PERIOD)
+    return;
+  last_statistics_ = now;
+#ifdef DEEPDIVE_METRICS
+  PublishDiagnostics(driver_);
+#endif
+  // Queue statistics only exist in threaded mode
+  if (!threaded_)
+    return;
+  bool overflow = false;
+  for (size_t i = 0; i < driver_->num_trackers; i++)
+    overflow |= UpdateTrackerStatistics(driver_->trackers[i]);
+  if (overflow)
+    PublishTrackers();
+}
+
+// Close the driver
+void BridgeStop() {
+  if (driver_)
+    deepdive_close(driver_);
+  driver_ = nullptr;
+  if (wake_ >= 0)
+    close(wake_);
+  wake_ = -1;
+}
+
+#ifdef DEEPDIVE_NODELET
+
+namespace deepdive_ros {
+
+// The bridge as a nodelet. Messages are published by pointer, so nodelets
+// loaded into the same manager receive them without serialization. The
+// driver and all callbacks share global state, so only one bridge can be
+// loaded per manager, and any other refuses to start.
+class BridgeNodelet : public nodelet::Nodelet {
+ public:
+  ~BridgeNodelet() {
+    if (!owner_)
+      return;
+    running_ = false;
+    BridgeWake();
+    if (thread_.joinable())
+      thread_.join();
+    BridgeStop();
+    loaded_ = false;
+  }
+
+ private:
+  void onInit() {
+    if (loaded_.exchange(true)) {
+      NODELET_ERROR("Only one deepdive bridge can be loaded per manager");
+      return;
+    }
+    owner_ = true;
+    if (!BridgeStart(getNodeHandle(), getPrivateNodeHandle()))
+      return;
+    // The manager spins ROS, so we only need to service the driver
+    running_ = true;
+    thread_ = std::thread([this]() {
+      while (running_ && ros::ok())
+        BridgeSpinOnce();
+    });
+  }
+
+  static std::atomic<bool> loaded_;
+  bool owner_ = false;
+  std::atomic<bool> running_{false};
+  std::thread thread_;
+};
+
+std::atomic<bool> BridgeNodelet::loaded_{false};
+
+}  // namespace deepdive_ros
+
+PLUGINLIB_EXPORT_CLASS(deepdive_ros::BridgeNodelet, nodelet::Nodelet)
+
+#else
+
+// Shut down, and stop waiting on the driver
+void SigintHandler(int sig) {
+  ros::requestShutdown();
+  BridgeWake();
+}
+
+// Main entry point of application
+int main(int argc, char **argv) {
+  // Initialize ROS
+  ros::init(argc, argv, "deepdive_bridge", ros::init_options::NoSigintHandler);
+  ros::NodeHandle nh, nhp("~");
+
+  // Make sure that an interrupt does not wait for the driver to be serviced
+  signal(SIGINT, SigintHandler);
+
+  // Open the driver
+  if (!BridgeStart(nh, nhp))
+    return 1;
+
+  // Alternate between the driver and the ROS messaging queue
   while (ros::ok()) {
-    // Poll the ros driver for activity
-    deepdive_poll(driver);
-    // Flush the ROS messaging queue
+    BridgeSpinOnce();
     ros::spinOnce();
   }
 
   // Close the vive context
-  deepdive_close(driver);
+  BridgeStop();
 
   // Success!
   return 0;
-}
\ No newline at end of file
+}
+
+#endif
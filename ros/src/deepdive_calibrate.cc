@@ -3,9 +3,6 @@
 #include <tf2_ros/transform_broadcaster.h>
 #include <tf2_ros/static_transform_broadcaster.h>
 
-// We will use OpenCV to bootstrap solution
-#include <opencv2/calib3d/calib3d.hpp>
-
 // Third-party includes
 #include <geometry_msgs/TransformStamped.h>
 #include <visualization_msgs/MarkerArray.h>
@@ -22,20 +19,26 @@
 #include <Eigen/Geometry>
 
 // C++ libraries
+#include <algorithm>
+#include <iterator>
 #include <map>
 #include <vector>
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <thread>
 
 // Shared local code
 #include "deepdive.hh"
+#include "deepdive_pnp.hh"
 
 // GLOBAL PARAMETERS
 
 // List of lighthouses
 TrackerMap trackers_;
 LighthouseMap lighthouses_;
+HandleMap tracker_handles_;
+HandleMap lighthouse_handles_;
 MeasurementMap measurements_;
 CorrectionMap corrections_;
 
@@ -54,6 +57,11 @@ double thresh_duration_ = 1.0;
 // Are we running in "offline" mode
 bool offline_ = false;
 
+// Bag to read directly in offline mode, instead of subscribing, and how
+// many seconds of it to read (all of it if not positive)
+std::string bag_;
+double bag_duration_ = 0.0;
+
 // Should we publish rviz markers
 bool visualize_ = true;
 
@@ -72,6 +80,10 @@ std::vector<double> offset_;
 // World -> vive registatration
 double wTv_[6];
 
+// Initialization with PnP, solved in parallel over epochs
+PnpOptions pnp_options_;
+WorkerPool pool_;
+
 // Sensor visualization publisher
 ros::Publisher pub_truth_;
 std::map<std::string, ros::Publisher> pub_sensors_;
@@ -95,6 +107,12 @@ bool Solve() {
       << measurements_.rbegin()->first);
   }
 
+  // The first lighthouse defines the vive frame
+  if (lighthouses_.empty()) {
+    ROS_WARN("No lighthouses received, so cannot solve problem.");
+    return false;
+  }
+
   // Check corrections
   if (corrections_.empty()) {
     ROS_INFO("No corrections in dataset. Assuming first body pose at origin.");
@@ -108,18 +126,7 @@ bool Solve() {
 
   // Data storage for the upcoming steps
 
-  typedef std::map<ros::Time,             // Time
-            std::map<uint8_t,             // Sensor
-              std::map<uint8_t,           // Axis
-                std::vector<double>       // Sample
-              >
-            >
-          > Bundle;
-  std::map<std::string,                   // Tracker
-    std::map<std::string,                 // Lighthouse
-      Bundle
-    >
-  > bundle;
+  LightStore store;                       // Binned measurements
 
   std::map<ros::Time, double[6]> cor;     // Corrections
 
@@ -129,16 +136,7 @@ bool Solve() {
   // us to take the average of the measurements to improve accuracy
   {
     ROS_INFO("Bundling measurements into larger discrete time units.");
-    MeasurementMap::iterator mt;
-    for (mt = measurements_.begin(); mt != measurements_.end(); mt++) {
-      std::string const& tserial = mt->second.light.header.frame_id;
-      std::string const& lserial = mt->second.light.lighthouse;
-      size_t const& a = mt->second.light.axis;
-      ros::Time t = ros::Time(round(mt->first.toSec() / res_) * res_);
-      std::vector<deepdive_ros::Pulse>::iterator pt;
-      for (pt = mt->second.light.pulses.begin(); pt != mt->second.light.pulses.end(); pt++)
-        bundle[tserial][lserial][t][pt->sensor][a].push_back(pt->angle);
-    }
+    store.Build(measurements_, lighthouses_, trackers_, res_);
     ROS_INFO("Bundling corrections into larger discrete time units.");
     CorrectionMap::iterator ct;
     for (ct = corrections_.begin(); ct != corrections_.end(); ct++) {
@@ -180,138 +178,113 @@ bool Solve() {
   // ondences (photosensors). We want to calibrate this stereo pair.
   {
     ROS_INFO("Using P3P to estimate pose sequence in every lighthouse frame.");
-    double fov = 2.0944;                          // 120deg FOV
-    double w = 1.0;                               // 1m synthetic image plane
-    double z = w / (2.0 * std::tan(fov / 2.0));   // Principle distance
     uint32_t count = 0;                           // Track num transforms
     // Iterate over lighthouses
     LighthouseMap::iterator lt;
-    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+    uint16_t l = 0;
+    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++, l++) {
       // Iterate over trackers
       TrackerMap::iterator tt;
-      for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+      uint16_t t = 0;
+      for (tt = trackers_.begin(); tt != trackers_.end(); tt++, t++) {
         ROS_INFO_STREAM("- Slave " << lt->first << " and tracker " << tt->first);
-        // Iterate over time epochs
-        Bundle::iterator bt;
-        for (bt = bundle[tt->first][lt->first].begin();
-          bt != bundle[tt->first][lt->first].end(); bt++) {
-          // One for each time instance
-          std::vector<cv::Point3f> obj;
-          std::vector<cv::Point2f> img;
-          // Try and find correspondences for every possible sensor
-          for (uint8_t s = 0; s < NUM_SENSORS; s++) {
-            // Mean angles for the <lighthouse, axis>
-            double angles[2];
-            // Check that we have azimuth/elevation for both lighthouses
-            if (!Mean(bundle[tt->first][lt->first][bt->first][s][0], angles[0]) ||
-                !Mean(bundle[tt->first][lt->first][bt->first][s][1], angles[1]))
-              continue;
-            // Correct the angles using the lighthouse parameters
-            Correct(lt->second.params, angles, correct_);
-            // Push on the correct world sensor position
-            obj.push_back(cv::Point3f(
-              trackers_[tt->first].sensors[s * 6 + 0],
-              trackers_[tt->first].sensors[s * 6 + 1],
-              trackers_[tt->first].sensors[s * 6 + 2]));
-            // Push on the coordinate in the slave image plane
-            img.push_back(cv::Point2f(z * tan(angles[0]), z * tan(angles[1])));
-          }
-          // In the case that we have 4 or more measurements, then we can try
-          // and estimate the trackers location in the lighthouse frame.
-          if (obj.size() > 6) {
-            cv::Mat cam = cv::Mat::eye(3, 3, cv::DataType<double>::type);
-            cv::Mat dist;
-            cam.at<double>(0, 0) = z;
-            cam.at<double>(1, 1) = z;
-            cv::Mat R(3, 1, cv::DataType<double>::type);
-            cv::Mat T(3, 1, cv::DataType<double>::type);
-            cv::Mat C(3, 3, cv::DataType<double>::type);
-            if (cv::solvePnPRansac(obj, img, cam, dist, R, T,  false,
-              100, 8.0, 0.99, cv::noArray(), cv::SOLVEPNP_UPNP)) {
-              cv::Rodrigues(R, C);
-              Eigen::Matrix3d rot;
-              for (size_t r = 0; r < 3; r++)
-                for (size_t c = 0; c < 3; c++)
-                  rot(r, c) = C.at<double>(r, c);
-              Eigen::AngleAxisd aa(rot);
-              poses[tt->first][bt->first][lt->first][0] = T.at<double>(0, 0);
-              poses[tt->first][bt->first][lt->first][1] = T.at<double>(1, 0);
-              poses[tt->first][bt->first][lt->first][2] = T.at<double>(2, 0);
-              poses[tt->first][bt->first][lt->first][3] = aa.angle() * aa.axis()[0];
-              poses[tt->first][bt->first][lt->first][4] = aa.angle() * aa.axis()[1];
-              poses[tt->first][bt->first][lt->first][5] = aa.angle() * aa.axis()[2];
-              count++;
-            }
-          }
+        // Solve every time epoch in parallel
+        std::pair<size_t, size_t> epochs = store.Epochs(l, t);
+        std::vector<size_t> pnp_epochs;
+        for (size_t e = epochs.first; e < epochs.second; e++)
+          pnp_epochs.push_back(e);
+        std::vector<PnpSolution> pnp;
+        PnpSolve(store, pnp_epochs, tt->second.sensors, lt->second.params,
+          pnp_options_, pool_, pnp);
+        // Collect the solutions in time order
+        for (size_t k = 0; k < pnp.size(); k++) {
+          if (!pnp[k].valid)
+            continue;
+          ros::Time const stamp = store.Time(pnp_epochs[k]);
+          for (size_t i = 0; i < 6; i++)
+            poses[tt->first][stamp][lt->first][i] = pnp[k].lTt[i];
+          count++;
         }
       }
     }
     ROS_INFO_STREAM("Using " << count << " PNP solutions");
   }
   // We now have a separate pose sequence for each tracker in each lighthouse
-  // frame. We now need to find the transform from the slave to master light-
-  // house in a way that projects one pose sequence into the other.
+  // frame. The first lighthouse defines the vive frame, and every other one
+  // is placed by projecting its pose sequence onto those of lighthouses that
+  // are already placed. Lighthouses are placed in order of how many epochs
+  // they share, so they need not all overlap with the first one.
+  std::map<std::string, Eigen::Affine3d> placed;
   {
-    ROS_INFO("Estimating master -> slave lighthouse transforms.");
-    // Add residual blocks to the problem
+    ROS_INFO("Estimating lighthouse -> vive transforms.");
     LighthouseMap::iterator lm = lighthouses_.begin();  // First is master
-    LighthouseMap::iterator lt;                         //
-    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
-      // Master lighthouse
-      if (lt == lighthouses_.begin()) {
-        for (size_t i = 0; i < 6; i++)
-          lt->second.vTl[0] = 0;
-        continue;
-      }
-      // Correspondences
-      std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> corresp;
-      // Slave lighthouse
-      if (lt != lighthouses_.begin()) {
+    for (size_t i = 0; i < 6; i++)
+      lm->second.vTl[i] = 0;
+    placed[lm->first] = Eigen::Affine3d::Identity();
+    while (placed.size() < lighthouses_.size()) {
+      // Find the lighthouse with the most correspondences to placed ones
+      LighthouseMap::iterator best = lighthouses_.end();
+      std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> best_corresp;
+      LighthouseMap::iterator lt;
+      for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+        if (placed.find(lt->first) != placed.end())
+          continue;
+        std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> corresp;
         TrackerMap::iterator tt;
         for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
           std::map<ros::Time, std::map<std::string, double[6]>>::iterator pt;
           for (pt = poses[tt->first].begin(); pt != poses[tt->first].end(); pt++) {
-            // We must have a pose for both the master AND the slave
-            if (pt->second.find(lt->first) == pt->second.end() ||
-                pt->second.find(lm->first) == pt->second.end()) continue;
-            // If we get here, then we have a correspondence
-            corresp.push_back(std::pair<Eigen::Vector3d, Eigen::Vector3d>(
-              Eigen::Vector3d(
-                pt->second[lt->first][0],
-                pt->second[lt->first][1],
-                pt->second[lt->first][2]
-              ),
-              Eigen::Vector3d(
-                pt->second[lm->first][0],
-                pt->second[lm->first][1],
-                pt->second[lm->first][2])
-              )
-            );
+            std::map<std::string, double[6]>::iterator st =
+              pt->second.find(lt->first);
+            if (st == pt->second.end())
+              continue;
+            // Every placed lighthouse seeing the tracker gives a correspondence
+            std::map<std::string, Eigen::Affine3d>::iterator mt;
+            for (mt = placed.begin(); mt != placed.end(); mt++) {
+              std::map<std::string, double[6]>::iterator rt =
+                pt->second.find(mt->first);
+              if (rt == pt->second.end())
+                continue;
+              corresp.push_back(std::pair<Eigen::Vector3d, Eigen::Vector3d>(
+                Eigen::Vector3d(st->second[0], st->second[1], st->second[2]),
+                mt->second * Eigen::Vector3d(
+                  rt->second[0], rt->second[1], rt->second[2])));
+            }
           }
         }
+        if (corresp.size() > best_corresp.size()) {
+          best = lt;
+          best_corresp.swap(corresp);
+        }
       }
-      // Run kabsch to determine the projection from the slave to master
-      Eigen::Matrix<double, 3, Eigen::Dynamic> pti(3, corresp.size());
-      Eigen::Matrix<double, 3, Eigen::Dynamic> ptj(3, corresp.size());
-      for (size_t i = 0; i < corresp.size(); i++) {
-        pti.block<3, 1>(0, i) = corresp[i].first;
-        ptj.block<3, 1>(0, i) = corresp[i].second;
+      if (best == lighthouses_.end() || best_corresp.size() < 3) {
+        ROS_WARN("- Remaining lighthouses never see a tracker with the others");
+        break;
+      }
+      // Run kabsch to determine the projection into the vive frame
+      Eigen::Matrix<double, 3, Eigen::Dynamic> pti(3, best_corresp.size());
+      Eigen::Matrix<double, 3, Eigen::Dynamic> ptj(3, best_corresp.size());
+      for (size_t i = 0; i < best_corresp.size(); i++) {
+        pti.block<3, 1>(0, i) = best_corresp[i].first;
+        ptj.block<3, 1>(0, i) = best_corresp[i].second;
       }
       // Perform a KABSCH transform on the two matrices
-      ROS_INFO_STREAM("- Using " << corresp.size() << " correspondences");
-      Eigen::Affine3d A;
+      ROS_INFO_STREAM("- Lighthouse " << best->first << " using "
+        << best_corresp.size() << " correspondences");
+      Eigen::Affine3d A = Eigen::Affine3d::Identity();
       if (Kabsch<double>(pti, ptj, A, false))
         ROS_INFO_STREAM("- Solution " << A.translation().norm());
       else
         ROS_INFO("- Solution not found");
       // Write the solution
-      lt->second.vTl[0] = A.translation()[0];
-      lt->second.vTl[1] = A.translation()[1];
-      lt->second.vTl[2] = A.translation()[2];
+      best->second.vTl[0] = A.translation()[0];
+      best->second.vTl[1] = A.translation()[1];
+      best->second.vTl[2] = A.translation()[2];
       Eigen::AngleAxisd aa(A.linear());
-      lt->second.vTl[3] =  aa.angle() * aa.axis()[0];
-      lt->second.vTl[4] =  aa.angle() * aa.axis()[1];
-      lt->second.vTl[5] =  aa.angle() * aa.axis()[2];
+      best->second.vTl[3] =  aa.angle() * aa.axis()[0];
+      best->second.vTl[4] =  aa.angle() * aa.axis()[1];
+      best->second.vTl[5] =  aa.angle() * aa.axis()[2];
+      placed[best->first] = A;
     }
   }
 
@@ -321,8 +294,6 @@ bool Solve() {
   // is fixed, so we can take the average from the corrections 
   {
     ROS_INFO("Using corrections to register vive to world frame.");
-    // The vive frame is the same as the maste rlighthouse
-    std::string lm = lighthouses_.begin()->first;
     // This will store the correspondences
     std::vector<std::pair<Eigen::Vector3d, Eigen::Vector3d>> corresp;
     // Iterate over all corrections
@@ -332,13 +303,24 @@ bool Solve() {
       size_t n = 0;
       TrackerMap::iterator tt;
       for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
-        if (poses.find(tt->first) != poses.end() &&
-          poses[tt->first].find(ct->first) != poses[tt->first].end() &&
-          poses[tt->first][ct->first].find(lm) != poses[tt->first][ct->first].end()) {
-          x += poses[tt->first][ct->first][lm][0];
-          y += poses[tt->first][ct->first][lm][1];
-          z += poses[tt->first][ct->first][lm][2];
+        if (poses.find(tt->first) == poses.end() ||
+          poses[tt->first].find(ct->first) == poses[tt->first].end())
+          continue;
+        // Take the tracker position in the vive frame from any lighthouse
+        std::map<std::string, double[6]> & seen = poses[tt->first][ct->first];
+        std::map<std::string, double[6]>::iterator st;
+        for (st = seen.begin(); st != seen.end(); st++) {
+          std::map<std::string, Eigen::Affine3d>::iterator mt =
+            placed.find(st->first);
+          if (mt == placed.end())
+            continue;
+          Eigen::Vector3d p = mt->second
+            * Eigen::Vector3d(st->second[0], st->second[1], st->second[2]);
+          x += p[0];
+          y += p[1];
+          z += p[2];
           n++;
+          break;
         }
       }
       // Only if we have data from all trackers
@@ -477,22 +459,23 @@ void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
     lighthouses_.find(msg->lighthouse) == lighthouses_.end() ||
     !trackers_[msg->header.frame_id].ready ||
     !lighthouses_[msg->lighthouse].ready) return;
-  // Copy over the data
-  size_t deleted = 0;
-  deepdive_ros::Light data = *msg;
-  std::vector<deepdive_ros::Pulse>::iterator it = data.pulses.end();
-  while (it-- > data.pulses.begin()) {
-    // std::cout << it->duration << std::endl;
-    if (it->angle > thresh_angle_ / 57.2958 ||     // Check angle
-        it->duration < thresh_duration_ / 1e6) {  // Check duration
-      it = data.pulses.erase(it);
-      deleted++;
-    }
-  }
-  if (data.pulses.size() < thresh_count_)
-    return; 
-  // Add the data
-  measurements_[ros::Time::now()].light = data;
+  // Count the pulses that pass the thresholds, without copying the message
+  auto keep = [](deepdive_ros::Pulse const& pulse) {
+    return !(pulse.angle > thresh_angle_ / 57.2958 ||     // Check angle
+             pulse.duration < thresh_duration_ / 1e6);    // Check duration
+  };
+  size_t count = std::count_if(msg->pulses.begin(), msg->pulses.end(), keep);
+  if (count < thresh_count_)
+    return;
+  // Add the data, copying only the pulses that are kept
+  deepdive_ros::Light & data = measurements_[msg->header.stamp].light;
+  data.header = msg->header;
+  data.lighthouse = msg->lighthouse;
+  data.axis = msg->axis;
+  data.pulses.clear();
+  data.pulses.reserve(count);
+  std::copy_if(msg->pulses.begin(), msg->pulses.end(),
+    std::back_inserter(data.pulses), keep);
 }
 
 bool TriggerCallback(std_srvs::Trigger::Request  &req,
@@ -527,7 +510,9 @@ void CorrectionCallback(tf2_msgs::TFMessage::ConstPtr const& msg) {
   for (it = msg->transforms.begin(); it != msg->transforms.end(); it++) {
     if (it->header.frame_id == frame_world_ &&
         it->child_frame_id == frame_body_) {
-      corrections_[ros::Time::now()] = *it;
+      // Keyed by measurement time, falling back to arrival for unstamped data
+      corrections_[it->header.stamp.isZero()
+        ? ros::Time::now() : it->header.stamp] = *it;
     }
   }
 }
@@ -612,6 +597,8 @@ int main(int argc, char **argv) {
     ROS_INFO("We are in offline mode. Speed-up is possible.");
     recording_ = true;
   }
+  nh.param<std::string>("bag", bag_, "");
+  nh.param<double>("bag_duration", bag_duration_, 0.0);
 
   // Reset the registration information
   for (size_t i = 0; i < 6; i++)
@@ -657,6 +644,18 @@ int main(int argc, char **argv) {
   if (offset_.size() != 3)
     ROS_FATAL("Failed to parse lighthouse transform.");
 
+  // Parallel initialization
+  int pnp_threads = std::thread::hardware_concurrency();
+  int pnp_fast_points = pnp_options_.fast_points;
+  nh.param<int>("pnp/threads", pnp_threads, pnp_threads);
+  nh.param<int>("pnp/fast_points", pnp_fast_points, pnp_fast_points);
+  nh.param<double>("pnp/fast_tolerance", pnp_options_.fast_tolerance,
+    pnp_options_.fast_tolerance);
+  pnp_options_.fast_points = pnp_fast_points;
+  pnp_options_.min_points = 7;
+  pnp_options_.correct = correct_;
+  pool_.Start(pnp_threads > 1 ? pnp_threads : 0);
+
   // Get the parent information
   std::vector<std::string> lighthouses;
   if (!nh.getParam("lighthouses", lighthouses))
@@ -734,11 +733,52 @@ int main(int argc, char **argv) {
         NewLighthouseCallback));
   ros::Subscriber sub_light =
     nh.subscribe("/light", 1000, LightCallback);
+  ros::Subscriber sub_tracker_handles =
+    nh.subscribe<deepdive_ros::Trackers>("/trackers", 1000, std::bind(
+      TrackerHandleCallback, std::placeholders::_1,
+        std::ref(tracker_handles_)));
+  ros::Subscriber sub_lighthouse_handles =
+    nh.subscribe<deepdive_ros::Lighthouses>("/lighthouses", 1000, std::bind(
+      LighthouseHandleCallback, std::placeholders::_1,
+        std::ref(lighthouse_handles_)));
+  ros::Subscriber sub_light_compact =
+    nh.subscribe<deepdive_ros::LightCompact>("/light_compact", 1000,
+      std::bind(LightCompactCallback, std::placeholders::_1,
+        std::cref(tracker_handles_), std::cref(lighthouse_handles_),
+          LightCallback));
   ros::Subscriber sub_corrections =
     nh.subscribe("/tf", 1000, CorrectionCallback);
   ros::ServiceServer service =
     nh.advertiseService("/trigger", TriggerCallback);
 
+  // Read a bag directly at disk speed and solve as soon as it is done
+  if (!bag_.empty()) {
+    ROS_INFO_STREAM("Reading bag " << bag_);
+    recording_ = true;
+    BagCallbacks cb;
+    cb.trackers = std::bind(TrackerCallback, std::placeholders::_1,
+      std::ref(trackers_), NewTrackerCallback);
+    cb.lighthouses = std::bind(LighthouseCallback, std::placeholders::_1,
+      std::ref(lighthouses_), NewLighthouseCallback);
+    cb.light = LightCallback;
+    cb.tf = CorrectionCallback;
+    if (!ReadBag(bag_, cb, bag_duration_))
+      return 1;
+    size_t count = measurements_.size();
+    double seconds = measurements_.empty() ? 0.0 : (measurements_.rbegin()->first
+      - measurements_.begin()->first).toSec();
+    std_srvs::Trigger::Request req;
+    std_srvs::Trigger::Response res;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    TriggerCallback(req, res);
+    double ms = ElapsedMs(start);
+    ROS_INFO_STREAM(res.message);
+    // One line per solve, in the same format as the benchmarks
+    printf("calibrate measurements=%zu seconds=%.3f solve_ms=%.3f success=%d\n",
+      count, seconds, ms, res.success ? 1 : 0);
+    return 0;
+  }
+
   // Setup a timer to automatically trigger solution on end of experiment
   timer_ = nh.createTimer(ros::Duration(1.0), TimerCallback, true, false);
 
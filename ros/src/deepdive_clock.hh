@@ -0,0 +1,94 @@
+/*
+  Maps device timecodes onto host time. Each tracker counts time with its
+  own free-running 32 bit clock, which wraps roughly every 90 seconds at
+  48MHz. The clock is unwrapped, and an exponentially-weighted linear fit
+  of host arrival time against device time then averages out the USB and
+  scheduling jitter, while tracking slow drift between the two clocks.
+*/
+
+#ifndef SRC_DEEPDIVE_CLOCK_HH
+#define SRC_DEEPDIVE_CLOCK_HH
+
+#include <cstdint>
+#include <cmath>
+
+class ClockSync {
+ public:
+  // Constructor and initialization
+  ClockSync(double ticks_per_sec = 48e6, double forget = 0.999,
+    double max_error = 0.5) : rate_(ticks_per_sec), forget_(forget),
+      max_error_(max_error) { Reset(); }
+
+  // Feed a device timecode that arrived at the given host time, and get
+  // back the host time at which it was measured
+  double Update(uint32_t ticks, double host) {
+    double x = Unwrap(ticks);
+    // Restart the fit if the device resets, or after a long gap
+    if (w_ > 0 && std::fabs(Predict(x) - host) > max_error_) {
+      Reset();
+      x = Unwrap(ticks);
+    }
+    // Exponentially-weighted means and co-moments, centered for precision
+    w_ = forget_ * w_ + 1.0;
+    double dx = x - mx_;
+    mx_ += dx / w_;
+    my_ += (host - my_) / w_;
+    cxx_ = forget_ * cxx_ + dx * (x - mx_);
+    cxy_ = forget_ * cxy_ + dx * (host - my_);
+    return Predict(x);
+  }
+
+  // Get the host time of a device timecode without updating the fit
+  double Convert(uint32_t ticks) const {
+    int32_t delta = static_cast<int32_t>(ticks - last_);
+    return Predict(epoch_ + static_cast<double>(delta) / rate_);
+  }
+
+  // Reset the estimator
+  void Reset() {
+    init_ = false;
+    last_ = 0;
+    epoch_ = 0.0;
+    w_ = mx_ = my_ = cxx_ = cxy_ = 0.0;
+  }
+
+ private:
+  // Convert ticks to seconds on a continuous device timeline. Timecodes
+  // from different endpoints may arrive slightly out of order.
+  double Unwrap(uint32_t ticks) {
+    if (!init_) {
+      init_ = true;
+      last_ = ticks;
+      epoch_ = 0.0;
+      return epoch_;
+    }
+    int32_t delta = static_cast<int32_t>(ticks - last_);
+    last_ = ticks;
+    epoch_ += static_cast<double>(delta) / rate_;
+    return epoch_;
+  }
+
+  // Predict host time from device seconds. Until the fit spans a second or
+  // so the nominal rate is assumed, and the skew is always kept sensible.
+  double Predict(double x) const {
+    double skew = 1.0;
+    if (cxx_ > 1.0) {
+      skew = cxy_ / cxx_;
+      if (skew < 0.99 || skew > 1.01)
+        skew = 1.0;
+    }
+    return my_ + skew * (x - mx_);
+  }
+
+  double rate_;       // Nominal device ticks per second
+  double forget_;     // Forgetting factor applied per sample
+  double max_error_;  // Prediction error in seconds that restarts the fit
+  bool init_;         // Have we seen a timecode yet?
+  uint32_t last_;     // Last timecode
+  double epoch_;      // Unwrapped device time in seconds
+  double w_;          // Sum of weights
+  double mx_, my_;    // Weighted means of device and host time
+  double cxx_, cxy_;  // Weighted co-moments
+};
+
+#endif
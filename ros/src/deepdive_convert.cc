@@ -0,0 +1,32 @@
+/*
+  Converts a calibration between the text and binary formats. The format of
+  each file follows from its name, and every transform is copied exactly.
+*/
+
+// C++ libraries
+#include <cstdio>
+#include <vector>
+
+// Shared local code
+#include "deepdive.hh"
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    printf("Usage: deepdive_convert <input> <output>\n");
+    printf("Files ending in %s are binary, and all others are text\n",
+      CONFIG_BINARY_EXTENSION);
+    return 1;
+  }
+  std::vector<ConfigEntry> entries;
+  if (!ReadConfigEntries(argv[1], entries)) {
+    printf("Could not read %s\n", argv[1]);
+    return 1;
+  }
+  if (!WriteConfigEntries(argv[2], entries)) {
+    printf("Could not write %s\n", argv[2]);
+    return 1;
+  }
+  printf("Converted %zu transforms from %s to %s\n",
+    entries.size(), argv[1], argv[2]);
+  return 0;
+}
@@ -0,0 +1,166 @@
+/*
+  Residual error between a group of light measurements and their predicted
+  lighthouse angles, shared by the refinement solver and the benchmarks. The
+  transform chain is composed once per evaluation, and the choice of
+  lighthouse model is made once per cost rather than once per measurement.
+*/
+
+#ifndef SRC_DEEPDIVE_COST_HH
+#define SRC_DEEPDIVE_COST_HH
+
+// Ceres
+#include <ceres/ceres.h>
+#include <ceres/rotation.h>
+
+// C++ libraries
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Shared local code
+#include "deepdive.hh"
+
+// Group of light measurements -- essential for accuracy
+typedef std::map<std::pair<uint16_t, uint8_t>, double> Group;
+
+// Helper function to convert a transform to a matrix form x' = Rx + t
+template <typename T> inline
+void TransformToMatrix(const T transform[6], T R[9], T t[3], bool invert) {
+  ceres::AngleAxisToRotationMatrix(&transform[3],
+    ceres::RowMajorAdapter3x3(R));
+  for (size_t i = 0; i < 3; i++)
+    t[i] = transform[i];
+  if (!invert)
+    return;
+  for (size_t r = 0; r < 3; r++)
+    for (size_t c = r + 1; c < 3; c++)
+      std::swap(R[3*r+c], R[3*c+r]);
+  T tmp[3] = { t[0], t[1], t[2] };
+  for (size_t r = 0; r < 3; r++)
+    t[r] = -(R[3*r+0] * tmp[0] + R[3*r+1] * tmp[1] + R[3*r+2] * tmp[2]);
+}
+
+// Helper function to prepend a transform to a chain, (R, t) <- (A, a)(R, t)
+template <typename T> inline
+void ComposeInPlace(const T transform[6], bool invert, T R[9], T t[3]) {
+  T A[9], a[3], tmp[9];
+  TransformToMatrix(transform, A, a, invert);
+  for (size_t r = 0; r < 3; r++)
+    for (size_t c = 0; c < 3; c++)
+      tmp[3*r+c] = A[3*r+0] * R[c] + A[3*r+1] * R[3+c] + A[3*r+2] * R[6+c];
+  for (size_t r = 0; r < 3; r++)
+    a[r] += A[3*r+0] * t[0] + A[3*r+1] * t[1] + A[3*r+2] * t[2];
+  std::copy(tmp, tmp + 9, R);
+  std::copy(a, a + 3, t);
+}
+
+// Number of derivatives evaluated in each pass over a group
+static constexpr int GROUP_STRIDE = 10;
+
+// Residual error between predicted angles to a lighthouse. Only the sensors
+// observed in the group are exposed to the solver, each as its own position
+// block, and the transform chain from tracking to lighthouse frame is
+// composed once per evaluation rather than once per measurement.
+struct GroupCost {
+  // Parameter block layout. Sensor positions follow the fixed blocks.
+  enum Blocks {
+    BLOCK_WTV,          // Vive -> World
+    BLOCK_VTL,          // Lighthouse -> vive
+    BLOCK_WTB_POS_XY,   // Body -> world (pos xy)
+    BLOCK_WTB_POS_Z,    // Body -> world (pos z)
+    BLOCK_WTB_ROT_XY,   // Body -> world (rot xy)
+    BLOCK_WTB_ROT_Z,    // Body -> world (rot z)
+    BLOCK_BTH,          // Head -> body
+    BLOCK_TTH,          // Head -> tracking (light)
+    BLOCK_PARAMS,       // Lighthouse calibration
+    NUM_BLOCKS
+  };
+
+  GroupCost(Group const& group, bool correct) : correct_(correct) {
+    Group::const_iterator gt;
+    for (gt = group.begin(); gt != group.end(); gt++) {
+      if (sensors_.empty() || sensors_.back() != gt->first.first)
+        sensors_.push_back(gt->first.first);
+      Observation obs;
+      obs.block = NUM_BLOCKS + sensors_.size() - 1;
+      obs.axis = gt->first.second;
+      obs.angle = gt->second;
+      obs_.push_back(obs);
+    }
+  }
+
+  // Create the cost and the list of parameter blocks it acts on
+  static ceres::CostFunction* Create(Group const& group,
+    double * wTv, double * vTl, double * wTb, double * bTh, double * tTh,
+      double * params, double * sensors, bool correct,
+        std::vector<double*> & blocks) {
+    GroupCost * functor = new GroupCost(group, correct);
+    ceres::DynamicAutoDiffCostFunction<GroupCost, GROUP_STRIDE>* cost =
+      new ceres::DynamicAutoDiffCostFunction<GroupCost, GROUP_STRIDE>(functor);
+    blocks = { wTv, vTl, &wTb[0], &wTb[2], &wTb[3], &wTb[5], bTh, tTh, params };
+    int sizes[NUM_BLOCKS] = { 6, 6, 2, 1, 2, 1, 6, 6, NUM_PARAMS * 2 };
+    for (size_t i = 0; i < NUM_BLOCKS; i++)
+      cost->AddParameterBlock(sizes[i]);
+    for (size_t i = 0; i < functor->sensors_.size(); i++) {
+      blocks.push_back(&sensors[6 * functor->sensors_[i]]);
+      cost->AddParameterBlock(3);
+    }
+    cost->SetNumResiduals(functor->obs_.size());
+    return cost;
+  }
+
+  // Called by ceres-solver to calculate error
+  template <typename T>
+  bool operator()(T const* const* p, T* residual) const {
+    if (correct_)
+      return Evaluate<true>(p, residual);
+    return Evaluate<false>(p, residual);
+  }
+
+  // Error with the choice of lighthouse model fixed at compile time
+  template <bool CORRECT, typename T>
+  bool Evaluate(T const* const* p, T* residual) const {
+    // Reconstruct a transform from the components
+    T wTb[6];
+    wTb[0] = p[BLOCK_WTB_POS_XY][0];
+    wTb[1] = p[BLOCK_WTB_POS_XY][1];
+    wTb[2] = p[BLOCK_WTB_POS_Z][0];
+    wTb[3] = p[BLOCK_WTB_ROT_XY][0];
+    wTb[4] = p[BLOCK_WTB_ROT_XY][1];
+    wTb[5] = p[BLOCK_WTB_ROT_Z][0];
+    // Compose the chain tracking -> lighthouse once for the whole group
+    T R[9], t[3];
+    TransformToMatrix(p[BLOCK_TTH], R, t, true);    // light -> head
+    ComposeInPlace(p[BLOCK_BTH], false, R, t);      // head -> body
+    ComposeInPlace(wTb, false, R, t);               // body -> world
+    ComposeInPlace(p[BLOCK_WTV], true, R, t);       // world -> vive
+    ComposeInPlace(p[BLOCK_VTL], true, R, t);       // vive -> lighthouse
+    // Iterate over all measurements
+    for (size_t i = 0; i < obs_.size(); i++) {
+      // Project the sensor position into the lighthouse frame
+      T const* s = p[obs_[i].block];
+      T x[3], angle[2];
+      for (size_t r = 0; r < 3; r++)
+        x[r] = R[3*r+0] * s[0] + R[3*r+1] * s[1] + R[3*r+2] * s[2] + t[r];
+      // Predict the angles
+      Predict<CORRECT>(p[BLOCK_PARAMS], x, angle);
+      // The residual angle error for the specific axis
+      residual[i] = angle[obs_[i].axis] - T(obs_[i].angle);
+    }
+    return true;
+  }
+
+ // Internal variables
+ private:
+  struct Observation {
+    size_t block;
+    uint8_t axis;
+    double angle;
+  };
+  bool correct_;
+  std::vector<uint16_t> sensors_;
+  std::vector<Observation> obs_;
+};
+
+#endif
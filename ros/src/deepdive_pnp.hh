@@ -0,0 +1,134 @@
+/*
+  Pose of a tracker in the frame of a lighthouse, estimated independently for
+  each epoch of a light store by treating the lighthouse as a pinhole camera.
+  Epochs are shared out between the workers of a pool, and every solution is
+  written into its own preallocated slot, so the result does not depend on
+  the number of workers.
+*/
+
+#ifndef SRC_DEEPDIVE_PNP_HH
+#define SRC_DEEPDIVE_PNP_HH
+
+// We will use OpenCV to bootstrap solution
+#include <opencv2/calib3d/calib3d.hpp>
+
+// C++ libraries
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Shared local code
+#include "deepdive.hh"
+#include "deepdive_pool.hh"
+
+// Synthetic camera for a lighthouse
+static constexpr double PNP_FOV = 2.0944;                           // 120deg
+static constexpr double PNP_WIDTH = 1.0;                            // 1m plane
+static const double PNP_FOCAL = PNP_WIDTH / (2.0 * std::tan(PNP_FOV / 2.0));
+
+// Options for solving
+struct PnpOptions {
+  size_t min_points = 4;          // Correspondences needed for a solution
+  bool correct = false;           // Apply the lighthouse corrections
+  size_t fast_points = 8;         // Correspondences needed to skip RANSAC
+  double fast_tolerance = 1e-3;   // Reprojection error needed to skip RANSAC
+};
+
+// Solution for one epoch
+struct PnpSolution {
+  bool valid = false;             // Whether a pose was found
+  size_t points = 0;              // Number of correspondences used
+  double lTt[6];                  // Tracking -> lighthouse
+};
+
+// Scratch space, reused between the epochs solved by one worker
+struct PnpBuffer {
+  std::vector<uint8_t> sensor;
+  std::vector<double> ang0, ang1;
+  std::vector<cv::Point3f> obj;
+  std::vector<cv::Point2f> img;
+  std::vector<cv::Point2f> proj;
+  cv::Mat cam, dist, R, T;
+  PnpBuffer() : cam(cv::Mat::eye(3, 3, cv::DataType<double>::type)),
+    R(3, 1, cv::DataType<double>::type), T(3, 1, cv::DataType<double>::type) {
+    cam.at<double>(0, 0) = PNP_FOCAL;
+    cam.at<double>(1, 1) = PNP_FOCAL;
+  }
+};
+
+// Collect the correspondences in an epoch for sensors seen on both axes
+inline void PnpCorrespondences(LightStore const& store, size_t epoch,
+  double const* sensors, double const* params, bool correct, PnpBuffer & buf) {
+  buf.sensor.clear();
+  buf.ang0.clear();
+  buf.ang1.clear();
+  for (size_t r = store.Begin(epoch); r + 1 < store.End(epoch); r++) {
+    if (store.sensor[r] != store.sensor[r + 1] ||
+        store.axis[r] != 0 || store.axis[r + 1] != 1)
+      continue;
+    buf.sensor.push_back(store.sensor[r]);
+    buf.ang0.push_back(store.angle[r]);
+    buf.ang1.push_back(store.angle[r + 1]);
+  }
+  // Correct the angles using the lighthouse parameters
+  if (correct)
+    CorrectBatch<true>(params, buf.sensor.size(), buf.ang0.data(), buf.ang1.data());
+  // Push on the sensor positions and their coordinates in the image plane
+  buf.obj.clear();
+  buf.img.clear();
+  for (size_t i = 0; i < buf.sensor.size(); i++) {
+    uint8_t s = buf.sensor[i];
+    buf.obj.push_back(cv::Point3f(
+      sensors[s * 6 + 0], sensors[s * 6 + 1], sensors[s * 6 + 2]));
+    buf.img.push_back(cv::Point2f(
+      PNP_FOCAL * tan(buf.ang0[i]), PNP_FOCAL * tan(buf.ang1[i])));
+  }
+}
+
+// Solve a single epoch. When there are enough correspondences a direct
+// solution is tried first, and RANSAC is only used if it fits poorly.
+inline void PnpSolve(LightStore const& store, size_t epoch,
+  double const* sensors, double const* params, PnpOptions const& options,
+    PnpBuffer & buf, PnpSolution & solution) {
+  solution.valid = false;
+  PnpCorrespondences(store, epoch, sensors, params, options.correct, buf);
+  solution.points = buf.obj.size();
+  if (buf.obj.size() < options.min_points)
+    return;
+  bool solved = false;
+  if (buf.obj.size() >= options.fast_points &&
+      cv::solvePnP(buf.obj, buf.img, buf.cam, buf.dist, buf.R, buf.T, false,
+        cv::SOLVEPNP_EPNP)) {
+    cv::projectPoints(buf.obj, buf.R, buf.T, buf.cam, buf.dist, buf.proj);
+    double err = 0.0;
+    for (size_t i = 0; i < buf.img.size(); i++)
+      err = std::max(err, static_cast<double>(cv::norm(buf.proj[i] - buf.img[i])));
+    solved = (err < options.fast_tolerance);
+  }
+  if (!solved && !cv::solvePnPRansac(buf.obj, buf.img, buf.cam, buf.dist,
+      buf.R, buf.T, false, 100, 8.0, 0.99, cv::noArray(), cv::SOLVEPNP_UPNP))
+    return;
+  for (size_t i = 0; i < 3; i++) {
+    solution.lTt[i] = buf.T.at<double>(i, 0);
+    solution.lTt[3 + i] = buf.R.at<double>(i, 0);
+  }
+  solution.valid = true;
+}
+
+// Solve a list of epochs in parallel, one solution per epoch
+inline void PnpSolve(LightStore const& store, std::vector<size_t> const& epochs,
+  double const* sensors, double const* params, PnpOptions const& options,
+    WorkerPool & pool, std::vector<PnpSolution> & solutions) {
+  solutions.assign(epochs.size(), PnpSolution());
+  size_t n = std::max<size_t>(pool.Size(), 1);
+  for (size_t w = 0; w < n; w++) {
+    pool.Dispatch(w, [&, w, n] {
+      PnpBuffer buf;
+      for (size_t i = w; i < epochs.size(); i += n)
+        PnpSolve(store, epochs[i], sensors, params, options, buf, solutions[i]);
+    });
+  }
+  pool.Flush();
+}
+
+#endif
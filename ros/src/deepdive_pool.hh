@@ -0,0 +1,215 @@
+/*
+  A fixed pool of worker threads, each of which drains its own queue. Work is
+  dispatched against a key, and all work with the same key runs in order on
+  the same worker, so state owned by a key needs no locking of its own.
+  Small closures are stored inline and each queue is a ring that only ever
+  grows, so steady-state dispatching does not allocate.
+*/
+
+#ifndef SRC_DEEPDIVE_POOL_HH
+#define SRC_DEEPDIVE_POOL_HH
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Type-erased work. Closures up to CAPACITY bytes are stored inline, and
+// larger ones are moved to the heap.
+class Task {
+ public:
+  static constexpr size_t CAPACITY = 48;
+
+  // Constructors and destructor
+  Task() : ops_(nullptr) {}
+  template <typename F, typename = typename std::enable_if<
+    !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+  Task(F f) : ops_(nullptr) {
+    Store(std::move(f), std::integral_constant<bool,
+      sizeof(F) <= CAPACITY && alignof(F) <= alignof(std::max_align_t)>());
+  }
+  Task(Task && other) : ops_(nullptr) { *this = std::move(other); }
+  Task & operator=(Task && other) {
+    if (this != &other) {
+      Reset();
+      ops_ = other.ops_;
+      if (ops_)
+        ops_->move(&other.storage_, &storage_);
+      other.ops_ = nullptr;
+    }
+    return *this;
+  }
+  ~Task() { Reset(); }
+
+  // Run the work
+  void operator()() { ops_->call(&storage_); }
+
+  // Drop the work, if any
+  void Reset() {
+    if (ops_)
+      ops_->destroy(&storage_);
+    ops_ = nullptr;
+  }
+
+ private:
+  struct Ops {
+    void (*call)(void*);
+    void (*move)(void*, void*);
+    void (*destroy)(void*);
+  };
+
+  // Closure that is too large to store inline
+  template <typename F>
+  struct Boxed {
+    void operator()() { (*f)(); }
+    std::unique_ptr<F> f;
+  };
+
+  // Store a closure inline
+  template <typename F>
+  void Store(F f, std::true_type) {
+    static const Ops ops = {
+      [](void* p) { (*static_cast<F*>(p))(); },
+      [](void* from, void* to) {
+        new (to) F(std::move(*static_cast<F*>(from)));
+        static_cast<F*>(from)->~F();
+      },
+      [](void* p) { static_cast<F*>(p)->~F(); }
+    };
+    new (&storage_) F(std::move(f));
+    ops_ = &ops;
+  }
+
+  // Store a closure on the heap
+  template <typename F>
+  void Store(F f, std::false_type) {
+    Store(Boxed<F>{std::unique_ptr<F>(new F(std::move(f)))}, std::true_type());
+  }
+
+  typename std::aligned_storage<CAPACITY, alignof(std::max_align_t)>::type
+    storage_;
+  Ops const* ops_;
+};
+
+class WorkerPool {
+ public:
+  // Constructor and destructor
+  WorkerPool() : pending_(0) {}
+  ~WorkerPool() { Stop(); }
+
+  // Start some number of workers. With no workers, work runs inline.
+  void Start(size_t num) {
+    Stop();
+    for (size_t i = 0; i < num; i++) {
+      workers_.emplace_back(new Worker);
+      workers_.back()->thread =
+        std::thread(&WorkerPool::Run, this, workers_.back().get());
+    }
+  }
+
+  // Finish all queued work and stop the workers
+  void Stop() {
+    for (size_t i = 0; i < workers_.size(); i++) {
+      {
+        std::lock_guard<std::mutex> lock(workers_[i]->mutex);
+        workers_[i]->stop = true;
+      }
+      workers_[i]->cv.notify_one();
+    }
+    for (size_t i = 0; i < workers_.size(); i++)
+      workers_[i]->thread.join();
+    workers_.clear();
+  }
+
+  // Queue work on the worker that owns the key
+  void Dispatch(size_t key, Task work) {
+    if (workers_.empty()) {
+      work();
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_++;
+    }
+    Worker * worker = workers_[key % workers_.size()].get();
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      worker->Push(std::move(work));
+    }
+    worker->cv.notify_one();
+  }
+
+  // Number of workers, which is zero when work runs inline
+  size_t Size() const { return workers_.size(); }
+
+  // Block until all dispatched work has completed
+  void Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return pending_ == 0; });
+  }
+
+ private:
+  struct Worker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Task> ring;         // Queued work, in a ring that only grows
+    size_t head = 0;                // Oldest queued work
+    size_t size = 0;                // Amount of queued work
+    bool stop = false;
+
+    // Queue work, growing the ring if it is full
+    void Push(Task && work) {
+      if (size == ring.size()) {
+        std::vector<Task> grown(std::max<size_t>(16, 2 * ring.size()));
+        for (size_t i = 0; i < size; i++)
+          grown[i] = std::move(ring[(head + i) % ring.size()]);
+        ring.swap(grown);
+        head = 0;
+      }
+      ring[(head + size++) % ring.size()] = std::move(work);
+    }
+
+    // Take the oldest work off the ring
+    Task Pop() {
+      Task work = std::move(ring[head]);
+      head = (head + 1) % ring.size();
+      size--;
+      return work;
+    }
+  };
+
+  // Worker loop, which exits once stopped and drained
+  void Run(Worker * worker) {
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    while (true) {
+      worker->cv.wait(lock, [worker] {
+        return worker->stop || worker->size > 0;
+      });
+      if (worker->size == 0)
+        return;
+      Task work = worker->Pop();
+      lock.unlock();
+      work();
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (--pending_ == 0)
+          idle_.notify_all();
+      }
+      lock.lock();
+    }
+  }
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::mutex mutex_;
+  std::condition_variable idle_;
+  size_t pending_;
+};
+
+#endif
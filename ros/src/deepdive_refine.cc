@@ -18,12 +18,11 @@
 #include <ceres/ceres.h>
 #include <ceres/rotation.h>
 
-// We will use OpenCV to bootstrap solution
-#include <opencv2/calib3d/calib3d.hpp>
-
 // Ceres and logging
 #include <Eigen/Core>
 #include <Eigen/Geometry>
+#include <Eigen/Cholesky>
+#include <Eigen/LU>
 
 // C++ libraries
 #include <map>
@@ -31,15 +30,26 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <set>
+#include <memory>
+#include <cmath>
 
 // Shared local code
 #include "deepdive.hh"
+#include "deepdive_cost.hh"
+#include "deepdive_pnp.hh"
 
 // GLOBAL PARAMETERS
 
 // List of lighthouses
 LighthouseMap lighthouses_;
 TrackerMap trackers_;
+HandleMap tracker_handles_;
+HandleMap lighthouse_handles_;
 MeasurementMap measurements_;
 CorrectionMap corrections_;
 
@@ -64,6 +74,12 @@ double thresh_duration_ = 1.0;
 
 // Solver parameters
 ceres::Solver::Options options_;
+bool persist_ = false;                  // Keep the problem between solves
+bool covariance_ = false;               // Report calibration uncertainty
+
+// Initialization with PnP, solved in parallel over epochs
+PnpOptions pnp_options_;
+WorkerPool pool_;
 
 // What to solve for
 bool refine_trajectory_ = true;
@@ -77,6 +93,11 @@ bool refine_params_ = false;
 // Are we running in "offline" mode
 bool offline_ = false;
 
+// Bag to read directly in offline mode, instead of subscribing, and how
+// many seconds of it to read (all of it if not positive)
+std::string bag_;
+double bag_duration_ = 0.0;
+
 // Should we publish rviz markers
 bool visualize_ = true;
 
@@ -92,6 +113,12 @@ double wTv_[6];
 // Smoothing factor
 double smoothing_ = 10.0;
 
+// Online mode solves continuously over a sliding window of recent data
+bool online_ = false;
+double online_window_ = 30.0;           // Length of the window (s)
+double online_period_ = 10.0;           // Time between solves (s)
+double online_forget_ = 0.5;            // Weight of the prior on each solve
+
 // Sensor visualization publisher
 ros::Publisher pub_sensors_;
 ros::Publisher pub_path_;
@@ -102,87 +129,6 @@ ros::Timer timer_;
 
 // CERES SOLVER
 
-// Helper function to apply a transform b = Ra + t
-template <typename T> inline
-void TransformInPlace(const T transform[6], T x[3]) {
-  T tmp[3];
-  ceres::AngleAxisRotatePoint(&transform[3], x, tmp);
-  x[0] = tmp[0] + transform[0];
-  x[1] = tmp[1] + transform[1];
-  x[2] = tmp[2] + transform[2];
-}
-
-// Helper function to invert a transform a = R'(b - t)
-template <typename T> inline
-void InverseTransformInPlace(const T transform[6], T x[3]) {
-  T aa[3], tmp[3];
-  tmp[0] = x[0] - transform[0];
-  tmp[1] = x[1] - transform[1];
-  tmp[2] = x[2] - transform[2];
-  aa[0] = -transform[3];
-  aa[1] = -transform[4];
-  aa[2] = -transform[5];
-  ceres::AngleAxisRotatePoint(aa, tmp, x);
-}
-
-// Group of light measurements -- essential for accuracy
-typedef std::map<std::pair<uint16_t, uint8_t>, double> Group;
-
-// Residual error between predicted angles to a lighthouse
-struct GroupCost {
-  explicit GroupCost(Group const& group) : group_(group) {}
-  // Called by ceres-solver to calculate error
-  template <typename T>
-  bool operator()(const T* const wTv,         // Vive -> World
-                  const T* const vTl,         // Lighthouse -> vive
-                  const T* const wTb_pos_xy,  // Body -> world (pos xy)
-                  const T* const wTb_pos_z,   // Body -> world (pos z)
-                  const T* const wTb_rot_xy,  // Body -> world (rot xy)
-                  const T* const wTb_rot_z,   // Body -> world (rot z)
-                  const T* const bTh,         // Head -> body
-                  const T* const tTh,         // Head -> tracking (light)
-                  const T* const sensors,     // Lighthouse calibration
-                  const T* const params,      // Tracker extrinsics
-                  T* residual) const {
-    // The position of the sensor
-    T x[3], angle[2], wTb[6];
-    // Reconstruct a transform from the components
-    wTb[0] = wTb_pos_xy[0];
-    wTb[1] = wTb_pos_xy[1];
-    wTb[2] = wTb_pos_z[0];
-    wTb[3] = wTb_rot_xy[0];
-    wTb[4] = wTb_rot_xy[1];
-    wTb[5] = wTb_rot_z[0];
-    // Used to index the residual
-    size_t cnt = 0;
-    // Iterate over all measurements
-    Group::const_iterator gt;
-    for (gt = group_.begin(); gt != group_.end(); gt++) {
-      // Get the sensor and axis for this group
-      uint16_t const& s = gt->first.first;
-      uint8_t const& a = gt->first.second;
-      // Get the sensor position in the tracking frame
-      x[0] = sensors[6*s+0];
-      x[1] = sensors[6*s+1];
-      x[2] = sensors[6*s+2];
-      // Project the sensor position into the lighthouse frame
-      InverseTransformInPlace(tTh, x);    // light -> head
-      TransformInPlace(bTh, x);           // head -> body
-      TransformInPlace(wTb, x);           // body -> world
-      InverseTransformInPlace(wTv, x);    // world -> vive
-      InverseTransformInPlace(vTl, x);    // vive -> lighthouse
-      // Predict the angles - Note that the 
-      Predict(params, x, angle, correct_);
-      // The residual angle error for the specific axis
-      residual[cnt++] = angle[a] - T(gt->second);
-    }
-    return true;
-  }
- // Internal variables
- private:
-  Group group_;
-};
-
 // Residual error between sequential poses
 struct MotionCost {
   explicit MotionCost() {}
@@ -209,50 +155,207 @@ struct MotionCost {
   }
 };
 
-// Solve the problem
-bool Solve() {
+// Marginalized information on one calibration block
+struct PriorBlock {
+  ceres::Vector mean;
+  ceres::Matrix sqrt_info;
+};
+
+// State carried between solves in online mode
+struct Window {
+  std::map<std::string, PriorBlock> prior;          // Calibration prior
+  std::map<ros::Time, std::array<double, 6>> poses;  // Last trajectory
+};
+
+// A calibration parameter block, named so that it survives copies
+struct Block {
+  std::string name;
+  double * data;
+  int size;
+};
+
+// List the calibration blocks that are being refined
+std::vector<Block> CalibrationBlocks(LighthouseMap & lighthouses,
+  TrackerMap & trackers, double wTv[6]) {
+  std::vector<Block> blocks;
+  if (refine_registration_)
+    blocks.push_back({"registration", wTv, 6});
+  LighthouseMap::iterator lt;
+  for (lt = lighthouses.begin(); lt != lighthouses.end(); lt++) {
+    if (refine_lighthouses_ && lt != lighthouses.begin())
+      blocks.push_back({lt->first + "/vTl", lt->second.vTl, 6});
+    if (refine_params_)
+      blocks.push_back({lt->first + "/params", lt->second.params,
+        NUM_MOTORS * NUM_PARAMS});
+  }
+  TrackerMap::iterator tt;
+  for (tt = trackers.begin(); tt != trackers.end(); tt++) {
+    if (refine_extrinsics_)
+      blocks.push_back({tt->first + "/bTh", tt->second.bTh, 6});
+    if (refine_head_)
+      blocks.push_back({tt->first + "/tTh", tt->second.tTh, 6});
+    if (refine_sensors_)
+      for (size_t s = 0; s < NUM_SENSORS; s++)
+        blocks.push_back({tt->first + "/sensor" + std::to_string(s),
+          &tt->second.sensors[6 * s], 3});
+  }
+  return blocks;
+}
+
+// Add the prior from earlier windows to the problem
+void AddPrior(ceres::Problem & problem, std::vector<Block> const& blocks,
+  Window const& window) {
+  std::vector<Block>::const_iterator bt;
+  for (bt = blocks.begin(); bt != blocks.end(); bt++) {
+    std::map<std::string, PriorBlock>::const_iterator pt =
+      window.prior.find(bt->name);
+    if (pt == window.prior.end() || !problem.HasParameterBlock(bt->data) ||
+        pt->second.mean.size() != bt->size)
+      continue;
+    problem.AddResidualBlock(
+      new ceres::NormalPrior(pt->second.sqrt_info, pt->second.mean),
+        nullptr, bt->data);
+  }
+}
+
+// Compute the marginal covariance of each calibration block in the problem.
+// Only the diagonal blocks are requested, which keeps the computation small.
+bool CalibrationCovariance(ceres::Problem & problem,
+  std::vector<Block> const& blocks, std::map<std::string, ceres::Matrix> & covs) {
+  std::vector<std::pair<const double*, const double*>> pairs;
+  std::vector<Block>::const_iterator bt;
+  for (bt = blocks.begin(); bt != blocks.end(); bt++)
+    if (problem.HasParameterBlock(bt->data))
+      pairs.push_back(std::make_pair(bt->data, bt->data));
+  if (pairs.empty())
+    return false;
+  ceres::Covariance::Options options;
+  options.num_threads = options_.num_threads;
+  ceres::Covariance covariance(options);
+  if (!covariance.Compute(pairs, &problem))
+    return false;
+  for (bt = blocks.begin(); bt != blocks.end(); bt++) {
+    if (!problem.HasParameterBlock(bt->data))
+      continue;
+    ceres::Matrix & cov = covs[bt->name];
+    cov.resize(bt->size, bt->size);
+    covariance.GetCovarianceBlock(bt->data, bt->data, cov.data());
+  }
+  return true;
+}
+
+// Marginalize the trajectory of a solved window into a prior on the
+// calibration. Cross-correlations between blocks are dropped, and the
+// information is discounted so that overlapping windows do not count the
+// same data many times over.
+void UpdatePrior(ceres::Problem & problem, std::vector<Block> const& blocks,
+  Window & window) {
+  std::map<std::string, ceres::Matrix> covs;
+  if (!CalibrationCovariance(problem, blocks, covs)) {
+    ROS_WARN("Could not marginalize the window, so keeping the old prior.");
+    return;
+  }
+  std::vector<Block>::const_iterator bt;
+  for (bt = blocks.begin(); bt != blocks.end(); bt++) {
+    std::map<std::string, ceres::Matrix>::const_iterator ct = covs.find(bt->name);
+    if (ct == covs.end())
+      continue;
+    Eigen::MatrixXd info = online_forget_ * Eigen::MatrixXd(ct->second).inverse();
+    Eigen::LLT<Eigen::MatrixXd> llt(info);
+    if (llt.info() != Eigen::Success)
+      continue;
+    PriorBlock & prior = window.prior[bt->name];
+    prior.mean = Eigen::Map<const Eigen::VectorXd>(bt->data, bt->size);
+    prior.sqrt_info = llt.matrixU();
+  }
+}
+
+// A problem that is kept between offline solves. Each solve appends the
+// residuals of newly recorded data, and starts everything already in it from
+// where the last solve left it. The problem is declared last, so that it is
+// destroyed before the loss and poses that it points to.
+struct Session {
+  ceres::HuberLoss loss{1.0};
+  std::map<ros::Time, double[6]> wTb;
+  std::unique_ptr<ceres::Problem> problem;
+  ceres::CostFunction* motion = nullptr;
+  uint32_t count = 0;
+};
+Session session_;
+
+// Order the poses before the calibration, so that Schur solvers eliminate
+// the trajectory and only factorize the small calibration system
+void OrderPosesFirst(ceres::Problem & problem,
+  std::map<ros::Time, double[6]> & wTb, ceres::ParameterBlockOrdering * ordering) {
+  std::set<double*> poses;
+  std::map<ros::Time, double[6]>::iterator it;
+  for (it = wTb.begin(); it != wTb.end(); it++) {
+    poses.insert(&it->second[0]);
+    poses.insert(&it->second[2]);
+    poses.insert(&it->second[3]);
+    poses.insert(&it->second[5]);
+  }
+  std::vector<double*> parameters;
+  problem.GetParameterBlocks(&parameters);
+  std::vector<double*>::iterator pt;
+  for (pt = parameters.begin(); pt != parameters.end(); pt++)
+    ordering->AddElementToGroup(*pt, poses.count(*pt) ? 0 : 1);
+}
+
+// Print the standard deviation of every refined calibration parameter
+void ReportCovariance(ceres::Problem & problem, std::vector<Block> const& blocks) {
+  std::map<std::string, ceres::Matrix> covs;
+  if (!CalibrationCovariance(problem, blocks, covs)) {
+    ROS_WARN("Could not compute the covariance of the calibration.");
+    return;
+  }
+  std::map<std::string, ceres::Matrix>::iterator ct;
+  for (ct = covs.begin(); ct != covs.end(); ct++) {
+    std::stringstream ss;
+    for (int i = 0; i < ct->second.rows(); i++)
+      ss << " " << std::sqrt(ct->second(i, i));
+    ROS_INFO_STREAM("- " << ct->first << " std dev:" << ss.str());
+  }
+}
+
+// Solve the problem, starting from and updating the given calibration. The
+// window is optional, and carries a prior and trajectory between solves. The
+// session is optional too, and keeps the problem itself between solves.
+bool Solve(MeasurementMap const& measurements,
+  CorrectionMap const& corrections, LighthouseMap & lighthouses,
+  TrackerMap & trackers, double wTv[6], Window * window,
+    Session * session = nullptr) {
   // Create the ceres problem
   ceres::Problem problem;
 
   // BASIC SANITY CHECKS
 
   // Check measurements
-  if (measurements_.empty()) {
+  if (measurements.empty()) {
     ROS_WARN("No measurements received, so cannot solve the problem.");
     return false;
   } else {
-    double t = (measurements_.rbegin()->first - measurements_.begin()->first).toSec();
-    ROS_INFO_STREAM("Processing " << measurements_.size()
+    double t = (measurements.rbegin()->first - measurements.begin()->first).toSec();
+    ROS_INFO_STREAM("Processing " << measurements.size()
       << " measurements running for " << t << " seconds from "
-      << measurements_.begin()->first << " to "
-      << measurements_.rbegin()->first);
+      << measurements.begin()->first << " to "
+      << measurements.rbegin()->first);
   }
 
   // Check corrections
-  if (corrections_.empty()) {
+  if (corrections.empty()) {
     ROS_INFO("No corrections in dataset. Assuming first body pose at origin.");
   } else {
-    double t = (corrections_.rbegin()->first - corrections_.begin()->first).toSec();
-    ROS_INFO_STREAM("Processing " << corrections_.size()
+    double t = (corrections.rbegin()->first - corrections.begin()->first).toSec();
+    ROS_INFO_STREAM("Processing " << corrections.size()
       << " corrections running for " << t << " seconds from "
-      << corrections_.begin()->first << " to "
-      << corrections_.rbegin()->first);
+      << corrections.begin()->first << " to "
+      << corrections.rbegin()->first);
   }
 
   // BUNDLE DATA AND CORRECTIONS
 
-  typedef std::map<ros::Time,             // Time
-            std::map<uint8_t,             // Sensor
-              std::map<uint8_t,           // Axis
-                std::vector<double>       // Sample
-              >
-            >
-          > Bundle;
-  std::map<std::string,                   // Tracker
-    std::map<std::string,                 // Lighthouse
-      Bundle
-    >
-  > bundle;
+  LightStore store;
 
   std::map<ros::Time, double[6]> corr;
 
@@ -260,19 +363,10 @@ bool Solve() {
   // us to take the average of the measurements to improve accuracy
   {
     ROS_INFO("Bundling measurements into larger discrete time units.");
-    MeasurementMap::iterator mt;
-    for (mt = measurements_.begin(); mt != measurements_.end(); mt++) {
-      std::string const& tserial = mt->second.light.header.frame_id;
-      std::string const& lserial = mt->second.light.lighthouse;
-      size_t const& a = mt->second.light.axis;
-      ros::Time t = ros::Time(round(mt->first.toSec() / res_) * res_);
-      std::vector<deepdive_ros::Pulse>::iterator pt;
-      for (pt = mt->second.light.pulses.begin(); pt != mt->second.light.pulses.end(); pt++)
-        bundle[tserial][lserial][t][pt->sensor][a].push_back(pt->angle);
-    }
+    store.Build(measurements, lighthouses, trackers, res_);
     ROS_INFO("Bundling corrections into larger discrete time units.");
-    CorrectionMap::iterator ct;
-    for (ct = corrections_.begin(); ct != corrections_.end(); ct++) {
+    CorrectionMap::const_iterator ct;
+    for (ct = corrections.begin(); ct != corrections.end(); ct++) {
       ros::Time t = ros::Time(round(ct->first.toSec() / res_) * res_);
       Eigen::Quaterniond q(
         ct->second.transform.rotation.w,
@@ -289,8 +383,9 @@ bool Solve() {
     }
   }
 
-  // The ultimate quantity we are solving for
-  std::map<ros::Time, double[6]> wTb;
+  // The ultimate quantity we are solving for, which a session keeps
+  std::map<ros::Time, double[6]> local_wTb;
+  std::map<ros::Time, double[6]> & wTb = session ? session->wTb : local_wTb;
 
   // We are going to estimate the pose of each slave lighthouse in the frame
   // of the master lighthouse (vive frame) using PNP. We can think of the
@@ -298,146 +393,149 @@ bool Solve() {
   // ondences (photosensors). We want to calibrate this stereo pair.
   {
     ROS_INFO("Using P3P to estimate tracker pose in light frame.");
-    // Create a new ceres problem to solve
-    ceres::Problem problem;
-    // Various lighjthouse parameters
-    double fov = 2.0944;                          // 120deg FOV
-    double w = 1.0;                               // 1m synthetic image plane
-    double z = w / (2.0 * std::tan(fov / 2.0));   // Principle distance
-    uint32_t count = 0;                           // Track num transforms
+    // Create a new ceres problem to solve, or continue the one in the
+    // session. Every residual shares one loss function, which the problem
+    // does not own, so it is declared first.
+    ceres::HuberLoss local_loss(1.0);
+    ceres::Problem::Options problem_options;
+    problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    std::unique_ptr<ceres::Problem> local_problem;
+    if (!session)
+      local_problem.reset(new ceres::Problem(problem_options));
+    else if (!session->problem)
+      session->problem.reset(new ceres::Problem(problem_options));
+    ceres::Problem & problem = session ? *session->problem : *local_problem;
+    ceres::LossFunction * loss = session ? &session->loss : &local_loss;
+    // The motion cost has no state, so it is shared too. The problem owns
+    // it and deletes it once, however many residuals use it.
+    ceres::CostFunction* local_motion = nullptr;
+    ceres::CostFunction* & motion = session ? session->motion : local_motion;
+    uint32_t local_count = 0;
+    uint32_t & count = session ? session->count : local_count;
     // This recursively calculates the mean, std dev for a variable
     Statistic height;
     // Iterate over lighthouses
     LighthouseMap::iterator lt;
-    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+    uint16_t l = 0;
+    for (lt = lighthouses.begin(); lt != lighthouses.end(); lt++, l++) {
       // Iterate over trackers
       TrackerMap::iterator tt;
-      for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+      uint16_t t = 0;
+      for (tt = trackers.begin(); tt != trackers.end(); tt++, t++) {
         ROS_INFO_STREAM("- Slave " << lt->first << " and tracker " << tt->first);
         // Iterate over time epochs
-        Bundle::iterator bt;
-        for (bt = bundle[tt->first][lt->first].begin();
-          bt != bundle[tt->first][lt->first].end(); bt++) {
+        std::pair<size_t, size_t> epochs = store.Epochs(l, t);
+        // If we are solving for trajectory, solve PnP up front in parallel
+        // for every epoch that has no better initial estimate
+        std::vector<size_t> pnp_epochs;
+        if (refine_trajectory_)
+          for (size_t e = epochs.first; e < epochs.second; e++)
+            if ((!window || !window->poses.count(store.Time(e))) &&
+                (!session || !wTb.count(store.Time(e))))
+              pnp_epochs.push_back(e);
+        std::vector<PnpSolution> pnp;
+        PnpSolve(store, pnp_epochs, tt->second.sensors, lt->second.params,
+          pnp_options_, pool_, pnp);
+        size_t k = 0;
+        for (size_t e = epochs.first; e < epochs.second; e++) {
+          ros::Time const stamp = store.Time(e);
+          // PnP solution for this epoch, if one was attempted
+          PnpSolution * solution = nullptr;
+          if (k < pnp_epochs.size() && pnp_epochs[k] == e)
+            solution = &pnp[k++];
           // One for each time instance
-          std::vector<cv::Point3f> obj;
-          std::vector<cv::Point2f> img;
           Group group;
-          // Try and find correspondences for every possible sensor
-          for (uint8_t s = 0; s < NUM_SENSORS; s++) {
-            // Mean angles for the <lighthouse, axis>
-            double angles[2];
-            // Check that we have azimuth/elevation for both lighthouses
-            if (!Mean(bundle[tt->first][lt->first][bt->first][s][0], angles[0]) ||
-                !Mean(bundle[tt->first][lt->first][bt->first][s][1], angles[1]))
+          size_t points = 0;
+          // Try and find correspondences for every sensor, whose rows are
+          // sorted by axis so that both axes appear as adjacent rows
+          for (size_t r = store.Begin(e); r + 1 < store.End(e); r++) {
+            // Check that we have azimuth/elevation for the lighthouse
+            if (store.sensor[r] != store.sensor[r + 1] ||
+                store.axis[r] != 0 || store.axis[r + 1] != 1)
               continue;
+            uint8_t s = store.sensor[r];
             // Add the pre-corrected angles to the light group
-            group[std::pair<uint16_t, uint8_t>(s, 0)] = angles[0];
-            group[std::pair<uint16_t, uint8_t>(s, 1)] = angles[1];
-            // Correct the angles using the lighthouse parameters
-            Correct(lt->second.params, angles, correct_);
-            // Push on the correct world sensor position
-            obj.push_back(cv::Point3f(
-              trackers_[tt->first].sensors[s * 6 + 0],
-              trackers_[tt->first].sensors[s * 6 + 1],
-              trackers_[tt->first].sensors[s * 6 + 2]));
-            // Push on the coordinate in the slave image plane
-            img.push_back(cv::Point2f(z * tan(angles[0]), z * tan(angles[1])));
+            group[std::pair<uint16_t, uint8_t>(s, 0)] = store.angle[r];
+            group[std::pair<uint16_t, uint8_t>(s, 1)] = store.angle[r + 1];
+            points++;
           }
           // In the case that we have 4 or more measurements, then we can try
           // and estimate the trackers location in the lighthouse frame.
-          if (obj.size() > 3) {
+          if (points > 3) {
             // If we do't want to refine the trajectory, just use the corrections
             // as estimates of the sensor trajectory. This is mainly to help
             // solve for extrinsics and lighthouse prameters.
-            if (!refine_trajectory_) {
-              std::map<ros::Time, double[6]>::iterator ct = corr.find(bt->first);
+            // Poses already in the session continue from their last solution
+            if (session && wTb.count(stamp)) {
+            } else if (!refine_trajectory_) {
+              std::map<ros::Time, double[6]>::iterator ct = corr.find(stamp);
               if (ct == corr.end())
                 continue;
               for (size_t i = 0; i < 6; i++)
-                wTb[bt->first][i] = ct->second[i];
+                wTb[stamp][i] = ct->second[i];
+            // If this pose was solved in the previous window, start from it
+            } else if (window && window->poses.count(stamp)) {
+              for (size_t i = 0; i < 6; i++)
+                wTb[stamp][i] = window->poses[stamp][i];
             // If we are solving for trajectory, get a nice initial estimate
             // using PNP. Otherwise, the majority of the solvers effort goes
             // into moving each pose in the trajectory.
             } else {
-              cv::Mat cam = cv::Mat::eye(3, 3, cv::DataType<double>::type);
-              cv::Mat dist;
-              cam.at<double>(0, 0) = z;
-              cam.at<double>(1, 1) = z;
-              cv::Mat R(3, 1, cv::DataType<double>::type);
-              cv::Mat T(3, 1, cv::DataType<double>::type);
-              cv::Mat C(3, 3, cv::DataType<double>::type);
-              if (!cv::solvePnPRansac(obj, img, cam, dist, R, T,  false,
-                100, 8.0, 0.99, cv::noArray(), cv::SOLVEPNP_UPNP)) continue;
-              cv::Rodrigues(R, C);
-              Eigen::Matrix3d rot;
-              for (size_t r = 0; r < 3; r++)
-                for (size_t c = 0; c < 3; c++)
-                  rot(r, c) = C.at<double>(r, c);
+              if (!solution || !solution->valid)
+                continue;
               // Get the transform from the trackng to lighthouse frame
-              Eigen::Affine3d lTt;
-              lTt.translation()[0] = T.at<double>(0, 0);
-              lTt.translation()[1] = T.at<double>(1, 0);
-              lTt.translation()[2] = T.at<double>(2, 0);
-              lTt.linear() = rot;
+              Eigen::Affine3d lTt = CeresToEigen(solution->lTt);
               // This is a great initial estimate of the true location
               Eigen::Affine3d obs;
-              obs = CeresToEigen(wTv_)                  // vive -> world
+              obs = CeresToEigen(wTv)                  // vive -> world
                   * CeresToEigen(lt->second.vTl)        // lighthouse -> vive
                   * lTt                                 // tracking -> lighthouse
                   * CeresToEigen(tt->second.tTh)        // head -> tracking
                   * CeresToEigen(tt->second.bTh, true); // body -> head
               // Set the initial estimate to this pose
               Eigen::AngleAxisd aa(obs.linear());
-              wTb[bt->first][0] = obs.translation()[0];
-              wTb[bt->first][1] = obs.translation()[1];
-              wTb[bt->first][2] = obs.translation()[2];
-              wTb[bt->first][3] = aa.angle() * aa.axis()[0];
-              wTb[bt->first][4] = aa.angle() * aa.axis()[1];
-              wTb[bt->first][5] = aa.angle() * aa.axis()[2];
+              wTb[stamp][0] = obs.translation()[0];
+              wTb[stamp][1] = obs.translation()[1];
+              wTb[stamp][2] = obs.translation()[2];
+              wTb[stamp][3] = aa.angle() * aa.axis()[0];
+              wTb[stamp][4] = aa.angle() * aa.axis()[1];
+              wTb[stamp][5] = aa.angle() * aa.axis()[2];
             }
             // Recursive calculation of mean
-            height.Feed(wTb[bt->first][2]);
+            height.Feed(wTb[stamp][2]);
             // Add the cost function
-            ceres::CostFunction* cost = new ceres::AutoDiffCostFunction<GroupCost,
-              ceres::DYNAMIC, 6, 6, 2, 1, 2, 1, 6, 6, NUM_SENSORS * 6,
-                NUM_PARAMS * 2>(new GroupCost(group), group.size());
+            std::vector<double*> blocks;
+            ceres::CostFunction* cost = GroupCost::Create(group, wTv,
+              lt->second.vTl, wTb[stamp], tt->second.bTh, tt->second.tTh,
+                lt->second.params, tt->second.sensors, correct_, blocks);
             // Add the residual block
-            problem.AddResidualBlock(cost, new ceres::HuberLoss(1.0),
-              reinterpret_cast<double*>(wTv_),
-              reinterpret_cast<double*>(lt->second.vTl),
-              reinterpret_cast<double*>(&wTb[bt->first][0]),
-              reinterpret_cast<double*>(&wTb[bt->first][2]),
-              reinterpret_cast<double*>(&wTb[bt->first][3]),
-              reinterpret_cast<double*>(&wTb[bt->first][5]),
-              reinterpret_cast<double*>(tt->second.bTh),
-              reinterpret_cast<double*>(tt->second.tTh),
-              reinterpret_cast<double*>(tt->second.sensors),
-              reinterpret_cast<double*>(lt->second.params));
+            problem.AddResidualBlock(cost, loss, blocks);
             // If we do not want the trajectory refined then mark all parts of
             // the trajectory as constant blocks
             if (!refine_trajectory_) {
-              problem.SetParameterBlockConstant(&wTb[bt->first][0]);
-              problem.SetParameterBlockConstant(&wTb[bt->first][2]);
-              problem.SetParameterBlockConstant(&wTb[bt->first][3]);
-              problem.SetParameterBlockConstant(&wTb[bt->first][5]);
+              problem.SetParameterBlockConstant(&wTb[stamp][0]);
+              problem.SetParameterBlockConstant(&wTb[stamp][2]);
+              problem.SetParameterBlockConstant(&wTb[stamp][3]);
+              problem.SetParameterBlockConstant(&wTb[stamp][5]);
             } 
             // If we are forcing 3D, then set the pitch and roll
             if (force2d_) {
-              wTb[bt->first][3] = 0.0;    // Pitch
-              wTb[bt->first][4] = 0.0;    // Roll
-              problem.SetParameterBlockConstant(&wTb[bt->first][2]);
-              problem.SetParameterBlockConstant(&wTb[bt->first][3]);
+              wTb[stamp][3] = 0.0;    // Pitch
+              wTb[stamp][4] = 0.0;    // Roll
+              problem.SetParameterBlockConstant(&wTb[stamp][2]);
+              problem.SetParameterBlockConstant(&wTb[stamp][3]);
             }
             // If we have a previous node, then link with a motion cost
             if (smoothing_ > 0) {
-              std::map<ros::Time, double[6]>::iterator c = wTb.find(bt->first);
+              std::map<ros::Time, double[6]>::iterator c = wTb.find(stamp);
               std::map<ros::Time, double[6]>::iterator p = std::prev(c);
               if (c != wTb.end() && p != c) {
                 // Create a cost function to represent motion
-                ceres::CostFunction* cost = new ceres::AutoDiffCostFunction
-                      <MotionCost, 6, 2, 1, 2, 1, 2, 1, 2, 1>(new MotionCost());
+                if (!motion)
+                  motion = new ceres::AutoDiffCostFunction
+                    <MotionCost, 6, 2, 1, 2, 1, 2, 1, 2, 1>(new MotionCost());
                 // Add a residual block for error
-                problem.AddResidualBlock(cost, new ceres::HuberLoss(1.0),
+                problem.AddResidualBlock(motion, loss,
                   reinterpret_cast<double*>(&p->second[0]),  // pos: xy
                   reinterpret_cast<double*>(&p->second[2]),  // pos: z
                   reinterpret_cast<double*>(&p->second[3]),  // rot: xy
@@ -457,16 +555,23 @@ bool Solve() {
         if (!refine_head_)
           problem.SetParameterBlockConstant(tt->second.tTh);
         if (!refine_sensors_)
-          problem.SetParameterBlockConstant(tt->second.sensors);
+          for (size_t s = 0; s < NUM_SENSORS; s++)
+            if (problem.HasParameterBlock(&tt->second.sensors[6 * s]))
+              problem.SetParameterBlockConstant(&tt->second.sensors[6 * s]);
       }
        // Fix lighthouse parameters
-      if (!refine_lighthouses_ || lt == lighthouses_.begin())
+      if (!refine_lighthouses_ || lt == lighthouses.begin())
         problem.SetParameterBlockConstant(lt->second.vTl);
       if (!refine_params_)
         problem.SetParameterBlockConstant(lt->second.params);
     }
     if (!refine_registration_)
-      problem.SetParameterBlockConstant(wTv_);
+      problem.SetParameterBlockConstant(wTv);
+
+    // In online mode, earlier windows act as a prior on the calibration
+    std::vector<Block> blocks = CalibrationBlocks(lighthouses, trackers, wTv);
+    if (window)
+      AddPrior(problem, blocks, *window);
 
     // If we have a fixed the height use the mean height estimate
     if (force2d_) {
@@ -478,7 +583,7 @@ bool Solve() {
     // Lighthouse after solving
     {
       LighthouseMap::iterator lt;
-      for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+      for (lt = lighthouses.begin(); lt != lighthouses.end(); lt++) {
         ROS_INFO_STREAM("Lighthouse BEFORE solving: " << lt->first);
         ROS_INFO_STREAM("- px: " << lt->second.vTl[0]);
         ROS_INFO_STREAM("- py: " << lt->second.vTl[1]);
@@ -492,7 +597,7 @@ bool Solve() {
     // Extrinsocs before solving
     {
       TrackerMap::iterator tt;
-      for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+      for (tt = trackers.begin(); tt != trackers.end(); tt++) {
         ROS_INFO_STREAM("Extrinsics BEFORE solving: " << tt->first);
         ROS_INFO_STREAM("- px: " << tt->second.bTh[0]);
         ROS_INFO_STREAM("- py: " << tt->second.bTh[1]);
@@ -506,7 +611,7 @@ bool Solve() {
     // Parameters before solving
     {
       LighthouseMap::iterator lt;
-      for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+      for (lt = lighthouses.begin(); lt != lighthouses.end(); lt++) {
         ROS_INFO_STREAM("Parameters BEFORE solving: " << lt->first);
         for (uint8_t a = 0; a < 2; a++) {
           ROS_INFO_STREAM("AXIS " << a);
@@ -521,10 +626,28 @@ bool Solve() {
 
     // Now solve the problem
     ROS_INFO_STREAM("Solving optimization problem with " << count << " obs");
+    ceres::Solver::Options options = options_;
+    if (ceres::IsSchurType(options.linear_solver_type)) {
+      options.linear_solver_ordering.reset(new ceres::ParameterBlockOrdering);
+      OrderPosesFirst(problem, wTb, options.linear_solver_ordering.get());
+    }
     ceres::Solver::Summary summary;
-    ceres::Solve(options_, &problem, &summary);
+    ceres::Solve(options, &problem, &summary);
     if (summary.IsSolutionUsable()) {
       ROS_INFO("Usable solution found.");
+      if (covariance_) {
+        ROS_INFO("- Computing the calibration covariance");
+        ReportCovariance(problem, blocks);
+      }
+      if (window) {
+        ROS_INFO("- Marginalizing the window");
+        UpdatePrior(problem, blocks, *window);
+        window->poses.clear();
+        std::map<ros::Time, double[6]>::iterator it;
+        for (it = wTb.begin(); it != wTb.end(); it++)
+          for (size_t i = 0; i < 6; i++)
+            window->poses[it->first][i] = it->second[i];
+      }
       if (visualize_) {
         ROS_INFO("- Visualizing");
         nav_msgs::Path msg;
@@ -602,7 +725,7 @@ bool Solve() {
       }
       // Update transforms so we can see the solution iun rviz
       SendTransforms(frame_world_, frame_vive_, frame_body_,
-        wTv_, lighthouses_, trackers_);
+        wTv, lighthouses, trackers);
     } else {
       ROS_WARN("Solution is not usable.");
       return false;
@@ -612,7 +735,7 @@ bool Solve() {
   // Lighthouse after solving
   {
     LighthouseMap::iterator lt;
-    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+    for (lt = lighthouses.begin(); lt != lighthouses.end(); lt++) {
       ROS_INFO_STREAM("Lighthouse AFTER solving: " << lt->first);
       ROS_INFO_STREAM("- px: " << lt->second.vTl[0]);
       ROS_INFO_STREAM("- py: " << lt->second.vTl[1]);
@@ -626,7 +749,7 @@ bool Solve() {
   // Extrinsics after solving
   {
     TrackerMap::iterator tt;
-    for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+    for (tt = trackers.begin(); tt != trackers.end(); tt++) {
       ROS_INFO_STREAM("Extrinsics AFTER solving: " << tt->first);
       ROS_INFO_STREAM("- px: " << tt->second.bTh[0]);
       ROS_INFO_STREAM("- py: " << tt->second.bTh[1]);
@@ -640,7 +763,7 @@ bool Solve() {
   // Parameters before solving
   {
     LighthouseMap::iterator lt;
-    for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+    for (lt = lighthouses.begin(); lt != lighthouses.end(); lt++) {
       ROS_INFO_STREAM("Parameters AFTER solving: " << lt->first);
       for (uint8_t a = 0; a < 2; a++) {
         ROS_INFO_STREAM("AXIS " << a);
@@ -661,29 +784,36 @@ bool Solve() {
 
 void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
   // Reset the timer use din offline mode to determine the end of experiment
-  timer_.stop();
-  timer_.start();
+  if (!online_) {
+    timer_.stop();
+    timer_.start();
+  }
   // Check that we are recording and that the tracker/lighthouse is ready
   if (!recording_ ||
     trackers_.find(msg->header.frame_id) == trackers_.end() ||
     lighthouses_.find(msg->lighthouse) == lighthouses_.end() ||
     !trackers_[msg->header.frame_id].ready ||
     !lighthouses_[msg->lighthouse].ready) return;
-  // Copy over the data
-  size_t deleted = 0;
-  deepdive_ros::Light data = *msg;
-  std::vector<deepdive_ros::Pulse>::iterator it = data.pulses.end();
-  while (it-- > data.pulses.begin()) {
-    if (it->angle > thresh_angle_ / 57.2958 &&    // Check angle
-        it->duration < thresh_duration_ / 1e-6) {  // Check duration
-      it = data.pulses.erase(it);
-      deleted++;
-    }
-  }
-  if (data.pulses.size() < thresh_count_)
-    return; 
-  // Add the data
-  measurements_[ros::Time::now()].light = data;
+  // Count the pulses that pass the thresholds, without copying the message
+  size_t count = 0;
+  std::vector<deepdive_ros::Pulse>::const_iterator it;
+  for (it = msg->pulses.begin(); it != msg->pulses.end(); it++)
+    if (!(it->angle > thresh_angle_ / 57.2958 &&    // Check angle
+          it->duration < thresh_duration_ / 1e-6))  // Check duration
+      count++;
+  if (count < thresh_count_)
+    return;
+  // Add the data, copying only the pulses that are kept
+  deepdive_ros::Light & data = measurements_[msg->header.stamp].light;
+  data.header = msg->header;
+  data.lighthouse = msg->lighthouse;
+  data.axis = msg->axis;
+  data.pulses.clear();
+  data.pulses.reserve(count);
+  for (it = msg->pulses.begin(); it != msg->pulses.end(); it++)
+    if (!(it->angle > thresh_angle_ / 57.2958 &&
+          it->duration < thresh_duration_ / 1e-6))
+      data.pulses.push_back(*it);
 }
 
 void CorrectionCallback(tf2_msgs::TFMessage::ConstPtr const& msg) {
@@ -694,7 +824,9 @@ void CorrectionCallback(tf2_msgs::TFMessage::ConstPtr const& msg) {
   for (it = msg->transforms.begin(); it != msg->transforms.end(); it++) {
     if (it->header.frame_id == frame_world_ &&
         it->child_frame_id == frame_body_) {
-      corrections_[ros::Time::now()] = *it;
+      // Keyed by measurement time, falling back to arrival for unstamped data
+      corrections_[it->header.stamp.isZero()
+        ? ros::Time::now() : it->header.stamp] = *it;
     }
   }
 }
@@ -708,7 +840,8 @@ bool TriggerCallback(std_srvs::Trigger::Request  &req,
   }
   if (recording_) {
     // Solve the problem
-    res.success = Solve();
+    res.success = Solve(measurements_, corrections_,
+      lighthouses_, trackers_, wTv_, nullptr, persist_ ? &session_ : nullptr);
     if (res.success)
       res.message = "Recording stopped. Solution found.";
     else
@@ -723,6 +856,76 @@ bool TriggerCallback(std_srvs::Trigger::Request  &req,
   return true;
 }
 
+// ONLINE MODE
+
+// A solve running in the background, on a copy of the data
+struct Job {
+  MeasurementMap measurements;
+  CorrectionMap corrections;
+  LighthouseMap lighthouses;
+  TrackerMap trackers;
+  double wTv[6];
+  bool success;
+};
+Job job_;
+Window window_;
+std::thread solver_;
+std::atomic<bool> solving_(false);
+ros::Timer online_timer_;
+
+// Apply the result of the last solve, and then start another on the data
+// that is still inside the window
+void OnlineCallback(ros::TimerEvent const& event) {
+  if (solving_)
+    return;
+  if (solver_.joinable()) {
+    solver_.join();
+    if (job_.success) {
+      LighthouseMap::iterator lt, ljt;
+      for (lt = lighthouses_.begin(); lt != lighthouses_.end(); lt++) {
+        ljt = job_.lighthouses.find(lt->first);
+        if (ljt == job_.lighthouses.end())
+          continue;
+        std::copy(ljt->second.vTl, ljt->second.vTl + 6, lt->second.vTl);
+        std::copy(ljt->second.params, ljt->second.params
+          + NUM_MOTORS * NUM_PARAMS, lt->second.params);
+      }
+      TrackerMap::iterator tt, tjt;
+      for (tt = trackers_.begin(); tt != trackers_.end(); tt++) {
+        tjt = job_.trackers.find(tt->first);
+        if (tjt == job_.trackers.end())
+          continue;
+        std::copy(tjt->second.bTh, tjt->second.bTh + 6, tt->second.bTh);
+        std::copy(tjt->second.tTh, tjt->second.tTh + 6, tt->second.tTh);
+        std::copy(tjt->second.sensors, tjt->second.sensors
+          + NUM_SENSORS * 6, tt->second.sensors);
+      }
+      std::copy(job_.wTv, job_.wTv + 6, wTv_);
+      SendTransforms(frame_world_, frame_vive_, frame_body_,
+        wTv_, lighthouses_, trackers_);
+    }
+  }
+  // Forget data that has left the window
+  if (measurements_.empty())
+    return;
+  ros::Time start =
+    measurements_.rbegin()->first - ros::Duration(online_window_);
+  measurements_.erase(measurements_.begin(), measurements_.lower_bound(start));
+  corrections_.erase(corrections_.begin(), corrections_.lower_bound(start));
+  // Solve a copy in the background, warm started from the current solution
+  job_.measurements = measurements_;
+  job_.corrections = corrections_;
+  job_.lighthouses = lighthouses_;
+  job_.trackers = trackers_;
+  std::copy(wTv_, wTv_ + 6, job_.wTv);
+  solving_ = true;
+  solver_ = std::thread([] {
+    job_.success = Solve(job_.measurements, job_.corrections,
+      job_.lighthouses, job_.trackers, job_.wTv, &window_);
+    solving_ = false;
+  });
+}
+
 // Fake a trigger when the timer expires
 void TimerCallback(ros::TimerEvent const& event) {
   std_srvs::Trigger::Request req;
@@ -804,6 +1007,8 @@ int main(int argc, char **argv) {
     ROS_INFO("We are in offline mode. Speed-up is possible.");
     recording_ = true;
   }
+  nh.param<std::string>("bag", bag_, "");
+  nh.param<double>("bag_duration", bag_duration_, 0.0);
 
   // Get the calibration file
   if (!nh.getParam("calfile", calfile_))
@@ -823,6 +1028,16 @@ int main(int argc, char **argv) {
   if (!nh.getParam("frames/truth", frame_truth_))
     ROS_FATAL("Failed to get frames/truth parameter.");
 
+  // Optionally solve continuously over a sliding window
+  nh.param<bool>("online/enabled", online_, false);
+  nh.param<double>("online/window", online_window_, 30.0);
+  nh.param<double>("online/period", online_period_, 10.0);
+  nh.param<double>("online/forget", online_forget_, 0.5);
+  if (online_) {
+    ROS_INFO("We are in online mode. Solving every few seconds.");
+    recording_ = true;
+  }
+
   // Get the pose graph resolution
   if (!nh.getParam("resolution", res_))
     ROS_FATAL("Failed to get resolution parameter.");
@@ -864,7 +1079,19 @@ int main(int argc, char **argv) {
     ROS_FATAL("Failed to get refine/params parameter.");
 
   // Define the ceres problem
-  options_.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
+  std::string linear_solver = "sparse_normal_cholesky";
+  nh.param<std::string>("solver/linear_solver", linear_solver, linear_solver);
+  std::transform(linear_solver.begin(), linear_solver.end(),
+    linear_solver.begin(), ::toupper);
+  if (!ceres::StringToLinearSolverType(linear_solver,
+      &options_.linear_solver_type)) {
+    ROS_WARN_STREAM("Unknown linear solver " << linear_solver);
+    options_.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
+  }
+  if (options_.linear_solver_type == ceres::ITERATIVE_SCHUR)
+    options_.preconditioner_type = ceres::SCHUR_JACOBI;
+  nh.param<bool>("solver/persist", persist_, persist_);
+  nh.param<bool>("solver/covariance", covariance_, covariance_);
   if (!nh.getParam("solver/max_time", options_.max_solver_time_in_seconds))
     ROS_FATAL("Failed to get the solver/max_time parameter.");
   if (!nh.getParam("solver/max_iterations", options_.max_num_iterations))
@@ -874,6 +1101,18 @@ int main(int argc, char **argv) {
   if (!nh.getParam("solver/debug", options_.minimizer_progress_to_stdout))
     ROS_FATAL("Failed to get the solver/debug parameter.");
 
+  // Parallel initialization
+  int pnp_threads = std::thread::hardware_concurrency();
+  int pnp_fast_points = pnp_options_.fast_points;
+  nh.param<int>("pnp/threads", pnp_threads, pnp_threads);
+  nh.param<int>("pnp/fast_points", pnp_fast_points, pnp_fast_points);
+  nh.param<double>("pnp/fast_tolerance", pnp_options_.fast_tolerance,
+    pnp_options_.fast_tolerance);
+  pnp_options_.fast_points = pnp_fast_points;
+  pnp_options_.min_points = 4;
+  pnp_options_.correct = correct_;
+  pool_.Start(pnp_threads > 1 ? pnp_threads : 0);
+
   // Visualization option
   if (!nh.getParam("visualize", visualize_))
     ROS_FATAL("Failed to get the visualize parameter.");
@@ -963,10 +1202,25 @@ int main(int argc, char **argv) {
         NewLighthouseCallback));
   ros::Subscriber sub_light =
     nh.subscribe("/light", 1000, LightCallback);
+  ros::Subscriber sub_tracker_handles =
+    nh.subscribe<deepdive_ros::Trackers>("/trackers", 1000, std::bind(
+      TrackerHandleCallback, std::placeholders::_1,
+        std::ref(tracker_handles_)));
+  ros::Subscriber sub_lighthouse_handles =
+    nh.subscribe<deepdive_ros::Lighthouses>("/lighthouses", 1000, std::bind(
+      LighthouseHandleCallback, std::placeholders::_1,
+        std::ref(lighthouse_handles_)));
+  ros::Subscriber sub_light_compact =
+    nh.subscribe<deepdive_ros::LightCompact>("/light_compact", 1000,
+      std::bind(LightCompactCallback, std::placeholders::_1,
+        std::cref(tracker_handles_), std::cref(lighthouse_handles_),
+          LightCallback));
   ros::Subscriber sub_corrections =
     nh.subscribe("/tf", 1000, CorrectionCallback);
-  ros::ServiceServer service =
-    nh.advertiseService("/trigger", TriggerCallback);
+  // In online mode the window is solved periodically and never stops
+  ros::ServiceServer service;
+  if (!online_)
+    service = nh.advertiseService("/trigger", TriggerCallback);
 
   // Publish sensor location and body trajectory 
   pub_sensors_ =
@@ -976,12 +1230,49 @@ int main(int argc, char **argv) {
   pub_ekf_ =
     nh.advertise<nav_msgs::Path>("/truth", 10, true);
 
-  // Setup a timer to automatically trigger solution on end of experiment
-  timer_ = nh.createTimer(ros::Duration(1.0), TimerCallback, true, false);
+  // Read a bag directly at disk speed and solve as soon as it is done
+  if (!bag_.empty()) {
+    ROS_INFO_STREAM("Reading bag " << bag_);
+    recording_ = true;
+    BagCallbacks cb;
+    cb.trackers = std::bind(TrackerCallback, std::placeholders::_1,
+      std::ref(trackers_), NewTrackerCallback);
+    cb.lighthouses = std::bind(LighthouseCallback, std::placeholders::_1,
+      std::ref(lighthouses_), NewLighthouseCallback);
+    cb.light = LightCallback;
+    cb.tf = CorrectionCallback;
+    if (!ReadBag(bag_, cb, bag_duration_))
+      return 1;
+    size_t count = measurements_.size();
+    double seconds = measurements_.empty() ? 0.0 : (measurements_.rbegin()->first
+      - measurements_.begin()->first).toSec();
+    std_srvs::Trigger::Request req;
+    std_srvs::Trigger::Response res;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    TriggerCallback(req, res);
+    double ms = ElapsedMs(start);
+    ROS_INFO_STREAM(res.message);
+    // One line per solve, in the same format as the benchmarks
+    printf("refine measurements=%zu seconds=%.3f solve_ms=%.3f success=%d\n",
+      count, seconds, ms, res.success ? 1 : 0);
+    return 0;
+  }
+
+  // Setup a timer to periodically solve in online mode, or otherwise one to
+  // automatically trigger solution on end of experiment
+  if (online_)
+    online_timer_ = nh.createTimer(
+      ros::Duration(online_period_), OnlineCallback);
+  else
+    timer_ = nh.createTimer(ros::Duration(1.0), TimerCallback, true, false);
 
   // Block until safe shutdown
   ros::spin();
 
+  // Wait for any background solve to finish
+  if (solver_.joinable())
+    solver_.join();
+
   // Success!
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,163 @@
+/*
+  The latest state of a tracked body, shared with other processes through a
+  POSIX shared memory segment guarded by a sequence lock. The tracker is the
+  only writer. Readers never block it, and retry if they catch it mid-write.
+  This header has no ROS dependencies so that external processes can use it.
+*/
+
+#ifndef SRC_DEEPDIVE_SNAPSHOT_HH
+#define SRC_DEEPDIVE_SNAPSHOT_HH
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// State of a body in the world frame, in the same convention as the filter
+struct SnapshotData {
+  double stamp;                      // Measurement time (s)
+  double position[3];                // Position (m)
+  double attitude[4];                // Attitude quaternion (x, y, z, w)
+  double velocity[3];                // Velocity (m/s)
+  double omega[3];                   // Angular velocity (rad/s)
+  double covariance[36];             // Pose covariance (position, attitude)
+};
+
+// Layout of the shared memory segment
+struct SnapshotSegment {
+  uint32_t magic;                    // Set once the segment is initialized
+  uint32_t version;                  // Layout version
+  std::atomic<uint32_t> sequence;    // Odd while a write is in progress
+  SnapshotData data;                 // Latest state
+};
+
+static constexpr uint32_t SNAPSHOT_MAGIC = 0x53504444;
+static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+// Writer side, owned by the tracker
+class SnapshotWriter {
+ public:
+  SnapshotWriter() : segment_(nullptr) {}
+  ~SnapshotWriter() { Close(); }
+
+  // Create or reuse a segment, eg. "/deepdive_truth"
+  bool Open(std::string const& name) {
+    Close();
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+      return false;
+    if (ftruncate(fd, sizeof(SnapshotSegment)) < 0) {
+      close(fd);
+      return false;
+    }
+    void * ptr = mmap(nullptr, sizeof(SnapshotSegment),
+      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+      return false;
+    segment_ = static_cast<SnapshotSegment*>(ptr);
+    segment_->sequence.store(0, std::memory_order_relaxed);
+    segment_->version = SNAPSHOT_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    segment_->magic = SNAPSHOT_MAGIC;
+    name_ = name;
+    return true;
+  }
+
+  // Unmap and remove the segment
+  void Close() {
+    if (!segment_)
+      return;
+    munmap(segment_, sizeof(SnapshotSegment));
+    shm_unlink(name_.c_str());
+    segment_ = nullptr;
+  }
+
+  // Publish a new state
+  void Write(SnapshotData const& data) {
+    if (!segment_)
+      return;
+    uint32_t seq = segment_->sequence.load(std::memory_order_relaxed);
+    segment_->sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(&segment_->data, &data, sizeof(SnapshotData));
+    segment_->sequence.store(seq + 2, std::memory_order_release);
+  }
+
+ private:
+  SnapshotSegment * segment_;
+  std::string name_;
+};
+
+// Reader side, for use by other processes
+class SnapshotReader {
+ public:
+  SnapshotReader() : segment_(nullptr) {}
+  ~SnapshotReader() {
+    if (segment_)
+      munmap(const_cast<SnapshotSegment*>(segment_), sizeof(SnapshotSegment));
+  }
+
+  // Attach to a segment created by the tracker
+  bool Open(std::string const& name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+      return false;
+    void * ptr = mmap(nullptr, sizeof(SnapshotSegment),
+      PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+      return false;
+    segment_ = static_cast<SnapshotSegment const*>(ptr);
+    return true;
+  }
+
+  // Copy out the latest state. Returns false if there is none yet.
+  bool Read(SnapshotData & data) const {
+    if (!segment_ || segment_->magic != SNAPSHOT_MAGIC)
+      return false;
+    uint32_t before, after;
+    do {
+      before = segment_->sequence.load(std::memory_order_acquire);
+      std::memcpy(&data, &segment_->data, sizeof(SnapshotData));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = segment_->sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return (before > 0);
+  }
+
+  // Copy out the latest state, extrapolated to the given time with the
+  // constant velocity part of the motion model
+  bool Read(double stamp, SnapshotData & data) const {
+    if (!Read(data))
+      return false;
+    double dt = stamp - data.stamp;
+    for (size_t i = 0; i < 3; i++)
+      data.position[i] += data.velocity[i] * dt;
+    double w[3] = { data.omega[0] * dt, data.omega[1] * dt, data.omega[2] * dt };
+    double angle = std::sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
+    if (angle > 0) {
+      double s = std::sin(0.5 * angle) / angle;
+      double d[4] = { w[0] * s, w[1] * s, w[2] * s, std::cos(0.5 * angle) };
+      double q[4];
+      std::memcpy(q, data.attitude, sizeof(q));
+      data.attitude[0] = d[3] * q[0] + d[0] * q[3] + d[1] * q[2] - d[2] * q[1];
+      data.attitude[1] = d[3] * q[1] - d[0] * q[2] + d[1] * q[3] + d[2] * q[0];
+      data.attitude[2] = d[3] * q[2] + d[0] * q[1] - d[1] * q[0] + d[2] * q[3];
+      data.attitude[3] = d[3] * q[3] - d[0] * q[0] - d[1] * q[1] - d[2] * q[2];
+    }
+    data.stamp = stamp;
+    return true;
+  }
+
+ private:
+  SnapshotSegment const* segment_;
+};
+
+#endif
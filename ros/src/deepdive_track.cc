@@ -8,6 +8,12 @@
 #include <tf2_ros/transform_broadcaster.h>
 #include <tf2_ros/static_transform_broadcaster.h>
 
+// Nodelet includes
+#ifdef DEEPDIVE_NODELET
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#endif
+
 // General messages
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
 #include <geometry_msgs/TwistWithCovarianceStamped.h>
@@ -16,10 +22,14 @@
 #include <deepdive_ros/Trackers.h>
 #include <deepdive_ros/Light.h>
 #include <deepdive_ros/Lighthouses.h>
+#ifdef DEEPDIVE_METRICS
+#include <diagnostic_msgs/DiagnosticArray.h>
+#endif
 
 // Eigen includes
 #include <Eigen/Core>
 #include <Eigen/Geometry>
+#include <Eigen/StdVector>
 
 // UKF includes
 #include <UKF/Types.h>
@@ -31,9 +41,14 @@
 // C++ includes
 #include <vector>
 #include <functional>
+#include <thread>
+#include <algorithm>
+#include <utility>
 
 // Deepdive internal
 #include "deepdive.hh"
+#include "deepdive_pool.hh"
+#include "deepdive_snapshot.hh"
 
 // FILTER KEYS
 
@@ -54,17 +69,24 @@ enum Keys : uint8_t {
   // MEASUREMENTS
   Accelerometer,        // Acceleration (body frame, m/s^2)
   Gyroscope,            // Gyroscope (body frame, rads/s)
-  Angle
+  Angle                 // Angle of sensor 0, followed by one key per sensor
 };
+static_assert(Angle + NUM_SENSORS <= 256, "Too many sensors for the keys");
 
 // OBSERVATION
 
-// Observation vector
-using Observation = UKF::DynamicMeasurementVector<
-  UKF::Field<Accelerometer, UKF::Vector<3>>,
-  UKF::Field<Gyroscope, UKF::Vector<3>>,
-  UKF::Field<Angle, real_t>
->;
+// Observation vector, with one angle field per sensor so that a whole sweep
+// bundle is applied to the filters in a single update
+template <typename Sequence> struct Fields;
+template <int... I> struct Fields<std::integer_sequence<int, I...>> {
+  using Observation = UKF::DynamicMeasurementVector<
+    UKF::Field<Accelerometer, UKF::Vector<3>>,
+    UKF::Field<Gyroscope, UKF::Vector<3>>,
+    UKF::Field<Angle + I, real_t>...
+  >;
+};
+using Observation =
+  Fields<std::make_integer_sequence<int, NUM_SENSORS>>::Observation;
 
 // TRACKING FILTER
 
@@ -124,8 +146,9 @@ std::string frame_truth_ = "truth";     // Vive solution
 
 LighthouseMap lighthouses_;          // List of lighthouses
 TrackerMap trackers_;                // List of trackers
+HandleMap tracker_handles_;          // Bridge handle -> tracker serial
+HandleMap lighthouse_handles_;       // Bridge handle -> lighthouse serial
 ErrorMap errors_;                    // List of error filters
-TrackingFilter filter_;              // Tracking filter
 std::string frame_parent_;           // Parent frame, eg "world"
 std::string frame_child_;            // Child frame, eg "truth"
 double rate_ = 10.0;                 // Desired tracking rate in Hz
@@ -135,11 +158,97 @@ double thresh_duration_ = 1.0;       // Duration threshold in micorseconds
 bool use_gyroscope_ = true;          // Input measurements from gyroscope
 bool use_accelerometer_ = true;      // Input measurements from accelerometer
 bool use_light_ = true;              // Input measurements from light
+bool imu_rate_ = false;              // Publish after every IMU update
+std::string snapshot_;               // Shared memory prefix, if sharing state
+std::string bag_;                    // Bag to filter at disk speed, if any
+double bag_duration_ = 0.0;          // Seconds of the bag to read (0 = all)
 double registration_[6];             // World -> vive
+int history_size_ = 256;             // Measurements kept for late arrivals
+double history_lag_ = 0.1;           // How late a measurement may be (s)
+
+// A fixed number of the most recent items, oldest first. Pushing onto a full
+// ring overwrites the oldest item, so after warm-up it never allocates.
+template <typename T>
+class Ring {
+ public:
+  void Reserve(size_t capacity) {
+    items_.resize(capacity);
+    head_ = 0;
+    size_ = 0;
+  }
+  size_t Capacity() const { return items_.size(); }
+  size_t Size() const { return size_; }
+  T & operator[](size_t i) { return items_[(head_ + i) % items_.size()]; }
+  // Add an item after the newest one, and return it to be filled in
+  T & Push() {
+    if (size_ < items_.size())
+      size_++;
+    else
+      head_ = (head_ + 1) % items_.size();
+    return (*this)[size_ - 1];
+  }
+  // Drop everything from the given item onwards
+  void Truncate(size_t size) { size_ = std::min(size_, size); }
+  void Clear() { size_ = 0; }
+ private:
+  std::vector<T, Eigen::aligned_allocator<T>> items_;
+  size_t head_ = 0;
+  size_t size_ = 0;
+};
+
+// A light bundle or IMU sample that has passed its checks, copied out of
+// its message so that it can be fused again without holding on to it
+struct Input {
+  ros::Time stamp;                   // Measurement time
+  bool light;                        // A light bundle, otherwise IMU
+  size_t tracker;                    // Index into the tracker table
+  size_t lighthouse;                 // Index into the lighthouse table
+  ErrorFilter * error;               // Error filter of the tracker
+  uint8_t axis;                      // Light: axis of the sweep
+  uint32_t mask;                     // Light: sensors in the bundle
+  size_t count;                      // Light: number of pulses
+  uint8_t sensors[NUM_SENSORS];      // Light: sensor of each pulse
+  double angles[NUM_SENSORS];        // Light: angle of each pulse
+  Eigen::Vector3d acc;               // IMU: accelerometer
+  Eigen::Vector3d gyr;               // IMU: gyroscope
+};
+
+// A fused measurement, along with the filter states from just before it
+struct Sample {
+  Input input;                       // Measurement
+  ros::Time prior;                   // Filter time before the measurement
+  State state;                       // Tracking filter before
+  State::CovarianceMatrix covariance;
+  Error error_state;                 // Error filter before
+  Error::CovarianceMatrix error_covariance;
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+// A rigid body, tracked by its own filter from one or more trackers
+struct Body {
+  size_t index;                      // Index, which selects the worker
+  std::string frame;                 // Child frame of the solution
+  TrackingFilter filter;             // Tracking filter
+  ros::Time stamp;                   // Time up to which filter is propagated
+  ros::Publisher pub_pose;           // Pose publisher
+  ros::Publisher pub_twist;          // Twist publisher
+  SnapshotWriter snapshot;           // Latest state for other processes
+  Statistic light_cost;              // Innovation time per light bundle (us)
+  Statistic imu_cost;                // Innovation time per IMU sample (us)
+  Statistic replays;                 // Measurements fused again per late one
+  Ring<Sample> history;              // Recently fused measurements
+  std::vector<Input> pending;        // Scratch space for replaying
+  std::vector<ErrorFilter*> restored;// Scratch space for replaying
+#ifdef DEEPDIVE_METRICS
+  Statistic latency;                 // Measurement -> pose published (ms)
+#endif
+};
+typedef std::map<std::string, Body> BodyMap;
+typedef std::map<std::string, Body*> BodyLookup;
 
-// ROS publishers
-ros::Publisher pub_pose_;
-ros::Publisher pub_twist_;
+BodyMap bodies_;                     // List of bodies
+BodyLookup tracker_bodies_;          // Tracker serial -> body
+WorkerPool pool_;                    // Workers, each owning some bodies
 
 // Default measurement errors
 bool correct_ = false;               // Whether to correct light parameters
@@ -155,18 +264,118 @@ TransformMap bTh_;                   // ALL: head -> body
 TransformMap tTh_;                   // ALL: head -> tracking
 TransformMap tTi_;                   // ALL: imu -> tracking
 
+// Constant transforms of a tracker, composed once the devices are ready
+struct TrackerEntry {
+  Eigen::Affine3d iTb;                   // body -> imu
+  Eigen::Vector3d sensors[NUM_SENSORS];  // Sensor positions (body frame)
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+typedef std::vector<TrackerEntry,
+  Eigen::aligned_allocator<TrackerEntry>> TrackerTable;
+
+// Constant transforms of a lighthouse, composed once the devices are ready
+struct LighthouseEntry {
+  Eigen::Affine3d lTw;                   // world -> lighthouse
+  double const* params;                  // Lighthouse parameters
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+typedef std::vector<LighthouseEntry,
+  Eigen::aligned_allocator<LighthouseEntry>> LighthouseTable;
+
+// Index of each device in the tables
+typedef std::map<std::string, size_t> IndexMap;
+
+TrackerTable tracker_table_;         // Tracker transforms
+LighthouseTable lighthouse_table_;   // Lighthouse transforms
+IndexMap tracker_index_;             // Tracker serial -> table index
+IndexMap lighthouse_index_;          // Lighthouse serial -> table index
+
 // Context data
 struct Context {
-  std::string lighthouse;            // Active lighthouse
-  std::string tracker;               // Active tracker
-  Eigen::Vector3d sensor;            // Active sensor
+  TrackerEntry const* tracker;       // Active tracker
+  LighthouseEntry const* lighthouse; // Active lighthouse
   uint8_t axis;                      // Active axis
+  uint32_t mask = 0;                 // Sensors in the light bundle
+  // Predictions for the last sigma point seen
+  mutable bool cached = false;       // Are the predictions valid?
+  mutable UKF::Vector<3> position;   // Sigma point position
+  mutable UKF::Quaternion attitude;  // Sigma point attitude
+  mutable double angles[NUM_SENSORS];// Predicted angle of each sensor
 };
 
 
 // Are we initialized and ready to track
 bool initialized_ = false;
 
+// Predict the angle of one sensor in a light bundle. The filters evaluate
+// every sensor against a sigma point before moving to the next one, so all
+// sensors in the bundle are predicted in one batch when the pose changes.
+real_t PredictAngle(State const& state, Context const& context, int sensor) {
+  UKF::Vector<3> position = state.get_field<Position>();
+  UKF::Quaternion attitude = state.get_field<Attitude>();
+  if (!context.cached || position != context.position
+    || attitude.coeffs() != context.attitude.coeffs()) {
+    Eigen::Affine3d wTb;
+    wTb.translation() = position;
+    wTb.linear() = attitude.toRotationMatrix();
+    Eigen::Affine3d lTb = context.lighthouse->lTw * wTb;
+    // Sensor positions in the lighthouse frame
+    double x[NUM_SENSORS], y[NUM_SENSORS], z[NUM_SENSORS];
+    double ang[NUM_MOTORS][NUM_SENSORS];
+    uint8_t idx[NUM_SENSORS];
+    size_t n = 0;
+    for (size_t s = 0; s < NUM_SENSORS; s++) {
+      if (!(context.mask & (1u << s)))
+        continue;
+      Eigen::Vector3d v = lTb * context.tracker->sensors[s];
+      x[n] = v[0];
+      y[n] = v[1];
+      z[n] = v[2];
+      idx[n++] = s;
+    }
+    if (correct_)
+      PredictBatch<true>(context.lighthouse->params, n, x, y, z, ang[0], ang[1]);
+    else
+      PredictBatch<false>(context.lighthouse->params, n, x, y, z, ang[0], ang[1]);
+    for (size_t i = 0; i < n; i++)
+      context.angles[idx[i]] = ang[context.axis][i];
+    context.position = position;
+    context.attitude = attitude;
+    context.cached = true;
+  }
+  return context.angles[sensor];
+}
+
+// Set the angle for a sensor, which is only known at run time
+template <int N>
+void SetAngle(Observation & obs, real_t angle) {
+  obs.set_field<Angle + N>(angle);
+}
+
+template <int... I>
+void SetAngle(Observation & obs, size_t sensor, real_t angle,
+  std::integer_sequence<int, I...>) {
+  static void (* const table[])(Observation &, real_t) = { &SetAngle<I>... };
+  table[sensor](obs, angle);
+}
+
+void SetAngle(Observation & obs, size_t sensor, real_t angle) {
+  SetAngle(obs, sensor, angle, std::make_integer_sequence<int, NUM_SENSORS>());
+}
+
+// Each sensor in a light bundle is measured through its own angle key
+#define ANGLE_MEASUREMENT(N)                                                  \
+  template <> template <> real_t                                              \
+  Observation::expected_measurement<State, Angle + N, Error, Context>(        \
+    State const& state, Error const& error, Context const& context) {         \
+    return PredictAngle(state, context, N);                                   \
+  }                                                                           \
+  template <> template <> real_t                                              \
+  Observation::expected_measurement<Error, Angle + N, State, Context>(        \
+    Error const& errors, State const& state, Context const& context) {        \
+    return PredictAngle(state, context, N);                                   \
+  }
+
 // TRACKING FILTER
 
 namespace UKF {
@@ -178,7 +387,7 @@ namespace UKF {
     (Observation::CovarianceVector() << 
       1.0e-4, 1.0e-4, 1.0e-4,   // Accel
       1.0e-6, 1.0e-6, 1.0e-6,   // Gyro
-      1.0e-8).finished());
+      UKF::Vector<NUM_SENSORS>::Constant(1.0e-8)).finished());  // Angles
 
   // TRACKING FILTER
 
@@ -202,9 +411,7 @@ namespace UKF {
   template <> template <> UKF::Vector<3>
   Observation::expected_measurement<State, Accelerometer, Error, Context>(
     State const& state, Error const& error, Context const& context) {
-    Eigen::Affine3d iTb = tTi_[context.tracker].inverse()    // light -> imu
-                        * tTh_[context.tracker]              // head -> light
-                        * bTh_[context.tracker].inverse();   // body -> head
+    Eigen::Affine3d const& iTb = context.tracker->iTb;      // body -> imu
     Eigen::Vector3d r = iTb.translation();
     Eigen::Vector3d w = state.get_field<Omega>();
     return error.get_field<AccelerometerScale>().cwiseInverse().cwiseProduct(
@@ -218,34 +425,25 @@ namespace UKF {
   template <> template <> UKF::Vector<3>
   Observation::expected_measurement<State, Gyroscope, Error, Context>(
     State const& state, Error const& error, Context const& context) {
-    Eigen::Affine3d iTb = tTi_[context.tracker].inverse()    // light -> imu
-                        * tTh_[context.tracker]              // head -> light
-                        * bTh_[context.tracker].inverse();   // body -> head
+    Eigen::Affine3d const& iTb = context.tracker->iTb;      // body -> imu
     return error.get_field<GyroscopeScale>().cwiseInverse().cwiseProduct(
         iTb.linear() * state.get_field<Omega>()
       - error.get_field<GyroscopeBias>());
   }
 
   // Lighthouse angle prediction
-  template <> template <> real_t
-  Observation::expected_measurement<State, Angle, Error, Context>(
-    State const& state, Error const& error, Context const& context) {
-    Eigen::Affine3d wTb;
-    wTb.translation() = state.get_field<Position>();
-    wTb.linear() = state.get_field<Attitude>().toRotationMatrix();
-    UKF::Vector<3> x = wTv_.inverse()                      // world -> vive
-                     * vTl_[context.lighthouse].inverse()  // vive -> lh
-                     * wTb                                 // body -> world
-                     * bTh_[context.tracker]               // head -> body
-                     * tTh_[context.tracker].inverse()     // tracker -> head
-                     * context.sensor;
-    double xyz[3], ang[2];
-    xyz[0] = x[0];
-    xyz[1] = x[1];
-    xyz[2] = x[2];
-    Predict(lighthouses_[context.lighthouse].params, xyz, ang, correct_);
-    return ang[context.axis];
-  }
+  static_assert(NUM_SENSORS == 32, "One angle measurement per sensor");
+  ANGLE_MEASUREMENT(0)  ANGLE_MEASUREMENT(1)  ANGLE_MEASUREMENT(2)
+  ANGLE_MEASUREMENT(3)  ANGLE_MEASUREMENT(4)  ANGLE_MEASUREMENT(5)
+  ANGLE_MEASUREMENT(6)  ANGLE_MEASUREMENT(7)  ANGLE_MEASUREMENT(8)
+  ANGLE_MEASUREMENT(9)  ANGLE_MEASUREMENT(10) ANGLE_MEASUREMENT(11)
+  ANGLE_MEASUREMENT(12) ANGLE_MEASUREMENT(13) ANGLE_MEASUREMENT(14)
+  ANGLE_MEASUREMENT(15) ANGLE_MEASUREMENT(16) ANGLE_MEASUREMENT(17)
+  ANGLE_MEASUREMENT(18) ANGLE_MEASUREMENT(19) ANGLE_MEASUREMENT(20)
+  ANGLE_MEASUREMENT(21) ANGLE_MEASUREMENT(22) ANGLE_MEASUREMENT(23)
+  ANGLE_MEASUREMENT(24) ANGLE_MEASUREMENT(25) ANGLE_MEASUREMENT(26)
+  ANGLE_MEASUREMENT(27) ANGLE_MEASUREMENT(28) ANGLE_MEASUREMENT(29)
+  ANGLE_MEASUREMENT(30) ANGLE_MEASUREMENT(31)
 
   // ERROR FILTER
 
@@ -267,59 +465,100 @@ namespace UKF {
     return expected_measurement<State, Gyroscope, Error, Context>(
       state, errors, context);
   }
+}
 
-  template <> template <> real_t
-  Observation::expected_measurement<Error, Angle, State, Context>(
-    Error const& errors, State const& state, Context const& context) {
-    return expected_measurement<State, Angle, Error, Context>(
-      state, errors, context);
+// UTILITY FUNCTIONS
+
+// Remember the filter states from just before a measurement is fused, and
+// move the filter time on to the measurement
+void Record(Body & body, Input const& input) {
+  if (body.history.Capacity() > 0) {
+    Sample & sample = body.history.Push();
+    sample.input = input;
+    sample.prior = body.stamp;
+    sample.state = body.filter.state;
+    sample.covariance = body.filter.covariance;
+    sample.error_state = input.error->state;
+    sample.error_covariance = input.error->covariance;
   }
+  if (input.stamp > body.stamp)
+    body.stamp = input.stamp;
 }
 
-// UTILITY FUNCTIONS
+// Share the latest state of a body with other processes
+void Share(Body & body) {
+  if (snapshot_.empty())
+    return;
+  TrackingFilter const& filter = body.filter;
+  SnapshotData data;
+  data.stamp = body.stamp.toSec();
+  UKF::Vector<3> position = filter.state.get_field<Position>();
+  UKF::Quaternion attitude = filter.state.get_field<Attitude>();
+  UKF::Vector<3> velocity = filter.state.get_field<Velocity>();
+  UKF::Vector<3> omega = filter.state.get_field<Omega>();
+  for (size_t i = 0; i < 3; i++) {
+    data.position[i] = position[i];
+    data.velocity[i] = velocity[i];
+    data.omega[i] = omega[i];
+  }
+  data.attitude[0] = attitude.x();
+  data.attitude[1] = attitude.y();
+  data.attitude[2] = attitude.z();
+  data.attitude[3] = attitude.w();
+  for (size_t i = 0; i < 6; i++)
+    for (size_t j = 0; j < 6; j++)
+      data.covariance[i*6 + j] = filter.covariance(i, j);
+  body.snapshot.Write(data);
+}
 
-bool Delta(double & dt) {
-  static ros::Time last = ros::Time::now(), now;
-  now = ros::Time::now();
-  dt = (now - last).toSec();
-  if (dt > 0)
-    last = now;
-  return (dt > 0 && dt < 1.0);
+// Publish the state of a body, on the worker that owns it
+void Publish(Body & body);
+
+// Find the body to which a tracker is attached
+Body * FindBody(std::string const& serial) {
+  BodyLookup::iterator it = tracker_bodies_.find(serial);
+  if (it == tracker_bodies_.end()) {
+    ROS_INFO_STREAM_THROTTLE(1, "Tracker not attached to a body");
+    return nullptr;
+  }
+  return it->second;
 }
 
 // CALLBACKS
 
-// This will be called at approximately 120Hz
-// - Single lighthouse in 'A' mode : 120Hz (60Hz per axis)
-// - Dual lighthouses in b/A or b/c modes : 120Hz (30Hz per axis)
-void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
-  static double dt;
-  if (!use_light_ || !initialized_ || !Delta(dt))
-    return;
-
+// Check a light bundle, and copy out the pulses that pass, keeping one pulse
+// per sensor. Returns false if the bundle cannot be used.
+bool DecodeLight(deepdive_ros::Light::ConstPtr const& msg, Input & input) {
   // Check that we are recording and that the tracker/lighthouse is ready
-  TrackerMap::iterator tracker = trackers_.find(msg->header.frame_id);
-  if (tracker == trackers_.end() || !tracker->second.ready) {
+  IndexMap::const_iterator tracker = tracker_index_.find(msg->header.frame_id);
+  if (tracker == tracker_index_.end()) {
     ROS_INFO_STREAM_THROTTLE(1, "Tracker not found or ready");
-    return;
+    return false;
   }
 
   // Check that we are recording and that the tracker/lighthouse is ready
-  LighthouseMap::iterator lighthouse = lighthouses_.find(msg->lighthouse);
-  if (lighthouse == lighthouses_.end() || !lighthouse->second.ready) {
+  IndexMap::const_iterator lighthouse = lighthouse_index_.find(msg->lighthouse);
+  if (lighthouse == lighthouse_index_.end()) {
     ROS_INFO_STREAM_THROTTLE(1, "Lighthouse not found or ready");
-    return;
+    return false;
   }
 
   // Make sure we have a filter setup for this
   ErrorMap::iterator error = errors_.find(msg->header.frame_id);
   if (error == errors_.end()) {
     ROS_INFO_STREAM_THROTTLE(1, "Tracker error filter not initialized");
-    return;
+    return false;
   }
 
-  // Clean up the measurments
-  std::vector<deepdive_ros::Pulse> data;
+  // Bundle up the measurments that pass, keeping one pulse per sensor
+  input.stamp = msg->header.stamp;
+  input.light = true;
+  input.tracker = tracker->second;
+  input.lighthouse = lighthouse->second;
+  input.error = &error->second;
+  input.axis = msg->axis;
+  input.mask = 0;
+  input.count = 0;
   for (size_t i = 0; i < msg->pulses.size(); i++) {
     // Basic sanity checks on the data
     if (fabs(msg->pulses[i].angle) > thresh_angle_ / 57.2958) {
@@ -334,107 +573,234 @@ void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
       ROS_INFO_STREAM_THROTTLE(1.0, "Rejected based on invalid sensor id");
       continue;
     }
-    data.push_back(msg->pulses[i]);
+    if (input.mask & (1u << msg->pulses[i].sensor))
+      continue;
+    input.mask |= (1u << msg->pulses[i].sensor);
+    input.sensors[input.count] = msg->pulses[i].sensor;
+    input.angles[input.count] = msg->pulses[i].angle;
+    input.count++;
   }
-  if (thresh_count_ > 0 && data.size() < thresh_count_) {
+  if (thresh_count_ > 0 && input.count < thresh_count_) {
     ROS_INFO_STREAM_THROTTLE(1, "Not enough data so skipping bundle.");
-    return;
+    return false;
   }
-
-  // Set the context correctly
-  Context context;
-  context.tracker = msg->header.frame_id;
-  context.lighthouse = msg->lighthouse;
-  context.axis = msg->axis;
-
-  // Correct the error filter
-  error->second.a_priori_step(dt);
-  for (size_t i = 0; i < data.size(); i++) {
-    // Set the context correctly
-    context.sensor[0] = tracker->second.sensors[6 * data[i].sensor + 0];
-    context.sensor[1] = tracker->second.sensors[6 * data[i].sensor + 1];
-    context.sensor[2] = tracker->second.sensors[6 * data[i].sensor + 2];
-    // Create the observation
-    Observation obs;
-    obs.set_field<Angle>(data[i].angle);
-    error->second.innovation_step(obs, filter_.state, context);
-  }
-  error->second.a_posteriori_step();
-
-  // Correct the tracking filter
-  filter_.a_priori_step(dt);
-  for (size_t i = 0; i < data.size(); i++) {
-    // Set the context correctly
-    context.sensor[0] = tracker->second.sensors[6 * data[i].sensor + 0];
-    context.sensor[1] = tracker->second.sensors[6 * data[i].sensor + 1];
-    context.sensor[2] = tracker->second.sensors[6 * data[i].sensor + 2];
-    // Create the observation
-    Observation obs;
-    obs.set_field<Angle>(data[i].angle);
-    filter_.innovation_step(obs, error->second.state, context);
-  }
-  filter_.a_posteriori_step();
+  return true;
 }
-// This will be called at approximately 250Hz
-void ImuCallback(sensor_msgs::Imu::ConstPtr const& msg) {
-  static double dt;
-  if ((!use_accelerometer_ && !use_gyroscope_) || !initialized_ || !Delta(dt))
-    return;
 
+// Check an IMU sample, and copy out its measurements
+bool DecodeImu(sensor_msgs::Imu::ConstPtr const& msg, Input & input) {
   // Check that we are recording and that the tracker/lighthouse is ready
-  TrackerMap::iterator tracker = trackers_.find(msg->header.frame_id);
-  if (tracker == trackers_.end() || !tracker->second.ready) {
+  IndexMap::const_iterator tracker = tracker_index_.find(msg->header.frame_id);
+  if (tracker == tracker_index_.end()) {
     ROS_INFO_STREAM_THROTTLE(1, "Tracker not found or ready");
-    return;
+    return false;
   }
 
   // Make sure we have a filter setup for this
   ErrorMap::iterator error = errors_.find(msg->header.frame_id);
   if (error == errors_.end()) {
     ROS_INFO_STREAM_THROTTLE(1, "Tracker error filter not initialized");
-    return;
+    return false;
   }
 
   // Get the measurements
-  Eigen::Vector3d acc(
+  input.stamp = msg->header.stamp;
+  input.light = false;
+  input.tracker = tracker->second;
+  input.error = &error->second;
+  input.acc = Eigen::Vector3d(
     msg->linear_acceleration.x,
     msg->linear_acceleration.y,
     msg->linear_acceleration.z);
-  Eigen::Vector3d gyr(
+  input.gyr = Eigen::Vector3d(
     msg->angular_velocity.x,
     msg->angular_velocity.y,
     msg->angular_velocity.z);
+  return true;
+}
+
+// This will be called at approximately 120Hz
+// - Single lighthouse in 'A' mode : 120Hz (60Hz per axis)
+// - Dual lighthouses in b/A or b/c modes : 120Hz (30Hz per axis)
+// The update runs on the worker that owns the body.
+void LightStep(Body & body, Input const& input, double dt) {
+  Observation obs;
+  for (size_t i = 0; i < input.count; i++)
+    SetAngle(obs, input.sensors[i], input.angles[i]);
 
   // Set the context correctly
   Context context;
-  context.tracker = msg->header.frame_id;
+  context.tracker = &tracker_table_[input.tracker];
+  context.lighthouse = &lighthouse_table_[input.lighthouse];
+  context.axis = input.axis;
+  context.mask = input.mask;
+
+  // Time spent in the innovation steps
+  std::chrono::steady_clock::time_point start;
+  double ms = 0.0;
+
+  // Correct the error filter
+  ErrorFilter & error = *input.error;
+  Record(body, input);
+  error.a_priori_step(dt);
+  start = std::chrono::steady_clock::now();
+  error.innovation_step(obs, body.filter.state, context);
+  ms += ElapsedMs(start);
+  error.a_posteriori_step();
+
+  // Correct the tracking filter
+  body.filter.a_priori_step(dt);
+  start = std::chrono::steady_clock::now();
+  body.filter.innovation_step(obs, error.state, context);
+  ms += ElapsedMs(start);
+  body.filter.a_posteriori_step();
+  body.light_cost.Feed(1e3 * ms);
+}
+
+// This will be called at approximately 250Hz
+void ImuStep(Body & body, Input const& input, double dt) {
+  // Set the context correctly
+  Context context;
+  context.tracker = &tracker_table_[input.tracker];
 
   // Create a measurement
   Observation obs;
   if (use_accelerometer_)
-    obs.set_field<Accelerometer>(acc);
+    obs.set_field<Accelerometer>(input.acc);
   if (use_gyroscope_)
-    obs.set_field<Gyroscope>(gyr);
+    obs.set_field<Gyroscope>(input.gyr);
+
+  // Time spent in the innovation steps
+  std::chrono::steady_clock::time_point start;
+  double ms = 0.0;
 
   // Step the parameter filter
-  error->second.a_priori_step(dt);
-  error->second.innovation_step(obs, filter_.state, context);
-  error->second.a_posteriori_step(); 
+  ErrorFilter & error = *input.error;
+  Record(body, input);
+  error.a_priori_step(dt);
+  start = std::chrono::steady_clock::now();
+  error.innovation_step(obs, body.filter.state, context);
+  ms += ElapsedMs(start);
+  error.a_posteriori_step(); 
 
   // Propagate the filter
-  filter_.a_priori_step(dt);
-  filter_.innovation_step(obs, error->second.state, context);
-  filter_.a_posteriori_step();
+  body.filter.a_priori_step(dt);
+  start = std::chrono::steady_clock::now();
+  body.filter.innovation_step(obs, error.state, context);
+  ms += ElapsedMs(start);
+  body.filter.a_posteriori_step();
+  body.imu_cost.Feed(1e3 * ms);
 }
 
-// This will be called back at the desired tracking rate
-void TimerCallback(ros::TimerEvent const& info) {
-  static double dt;
-  if (!initialized_ || !Delta(dt))
+// Fuse a measurement that follows the current filter time
+void Step(Body & body, Input const& input) {
+  double dt = std::max((input.stamp - body.stamp).toSec(), 0.0);
+  if (input.light)
+    LightStep(body, input, dt);
+  else
+    ImuStep(body, input, dt);
+}
+
+// Insert a late measurement into the history, by rewinding the filters to
+// just before it and then fusing it and everything after it again. Returns
+// false if the history does not reach back far enough.
+bool Replay(Body & body, Input const& input) {
+  ros::Time const& stamp = input.stamp;
+  size_t k = body.history.Size();
+  while (k > 0 && body.history[k - 1].input.stamp > stamp)
+    k--;
+  if (k == body.history.Size() || body.history[k].prior > stamp)
+    return false;
+  // Rewind the tracking filter, and every error filter updated since
+  Sample & first = body.history[k];
+  body.filter.state = first.state;
+  body.filter.covariance = first.covariance;
+  body.stamp = first.prior;
+  body.pending.clear();
+  body.restored.clear();
+  for (size_t i = k; i < body.history.Size(); i++) {
+    Sample & sample = body.history[i];
+    body.pending.push_back(sample.input);
+    ErrorFilter * error = sample.input.error;
+    if (std::find(body.restored.begin(), body.restored.end(), error)
+        != body.restored.end())
+      continue;
+    error->state = sample.error_state;
+    error->covariance = sample.error_covariance;
+    body.restored.push_back(error);
+  }
+  body.history.Truncate(k);
+  // Fuse the late measurement, and then everything that followed it
+  Step(body, input);
+  for (size_t i = 0; i < body.pending.size(); i++)
+    Step(body, body.pending[i]);
+  body.replays.Feed(body.pending.size());
+  return true;
+}
+
+// Fuse a measurement at its own time. The light and IMU stamps come from
+// separate device clocks and queues, so measurements that arrive up to the
+// lag late are inserted at their true time. Without a history, or if they
+// are later still, they are applied at the current filter time if they are
+// only slightly late, and dropped otherwise.
+bool Fuse(Body & body, Input const& input) {
+  ros::Time const& stamp = input.stamp;
+  if (body.stamp.isZero()) {
+    body.stamp = stamp;
+    return false;
+  }
+  bool fused = false;
+  double dt = (stamp - body.stamp).toSec();
+  if (dt >= 1.0) {
+    body.stamp = stamp;
+    body.history.Clear();
+  } else if (dt >= 0) {
+    Step(body, input);
+    fused = true;
+  } else if (-dt <= history_lag_ && Replay(body, input)) {
+    fused = true;
+  } else if (dt > -0.01) {
+    Step(body, input);
+    fused = true;
+  }
+  if (fused)
+    Share(body);
+  return fused;
+}
+
+void LightUpdate(Body & body, deepdive_ros::Light::ConstPtr const& msg) {
+  Input input;
+  if (DecodeLight(msg, input))
+    Fuse(body, input);
+}
+
+void ImuUpdate(Body & body, sensor_msgs::Imu::ConstPtr const& msg) {
+  // Control loops may want the pose at IMU rate
+  Input input;
+  if (DecodeImu(msg, input) && Fuse(body, input) && imu_rate_)
+    Publish(body);
+}
+
+void LightCallback(deepdive_ros::Light::ConstPtr const& msg) {
+  if (!use_light_ || !initialized_)
     return;
+  Body * body = FindBody(msg->header.frame_id);
+  if (body)
+    pool_.Dispatch(body->index, std::bind(LightUpdate, std::ref(*body), msg));
+}
+
+void ImuCallback(sensor_msgs::Imu::ConstPtr const& msg) {
+  if ((!use_accelerometer_ && !use_gyroscope_) || !initialized_)
+    return;
+  Body * body = FindBody(msg->header.frame_id);
+  if (body)
+    pool_.Dispatch(body->index, std::bind(ImuUpdate, std::ref(*body), msg));
+}
 
-  // Propagate the filter forward
-  filter_.a_priori_step(dt);
+void Publish(Body & body) {
+  if (body.stamp.isZero())
+    return;
+  TrackingFilter const& filter = body.filter;
 
   // Debug
   /*
@@ -443,69 +809,179 @@ void TimerCallback(ros::TimerEvent const& info) {
     ROS_INFO_STREAM(it->first << ":");
     ROS_INFO_STREAM(it->second.state);
   }
-  ROS_INFO_STREAM(filter_.state);
+  ROS_INFO_STREAM(filter.state);
   ROS_INFO_STREAM("Filter:");
-  ROS_INFO_STREAM(filter_.state);
+  ROS_INFO_STREAM(filter.state);
   */
 
-  // The filter relates WORLD and IMU frames
-  ros::Time now = ros::Time::now();
+  // The filter relates WORLD and IMU frames at the last measurement time
+  ros::Time now = body.stamp;
 
   // Broadcast the tracker pose on TF2
   static tf2_ros::TransformBroadcaster br;
   geometry_msgs::TransformStamped tfs;
   tfs.header.stamp = now;
   tfs.header.frame_id = frame_world_;
-  tfs.child_frame_id = frame_truth_;
-  tfs.transform.translation.x = filter_.state.get_field<Position>()[0];
-  tfs.transform.translation.y = filter_.state.get_field<Position>()[1];
-  tfs.transform.translation.z = filter_.state.get_field<Position>()[2];
-  tfs.transform.rotation.w = filter_.state.get_field<Attitude>().w();
-  tfs.transform.rotation.x = filter_.state.get_field<Attitude>().x();
-  tfs.transform.rotation.y = filter_.state.get_field<Attitude>().y();
-  tfs.transform.rotation.z = filter_.state.get_field<Attitude>().z();
+  tfs.child_frame_id = body.frame;
+  tfs.transform.translation.x = filter.state.get_field<Position>()[0];
+  tfs.transform.translation.y = filter.state.get_field<Position>()[1];
+  tfs.transform.translation.z = filter.state.get_field<Position>()[2];
+  tfs.transform.rotation.w = filter.state.get_field<Attitude>().w();
+  tfs.transform.rotation.x = filter.state.get_field<Attitude>().x();
+  tfs.transform.rotation.y = filter.state.get_field<Attitude>().y();
+  tfs.transform.rotation.z = filter.state.get_field<Attitude>().z();
   SendDynamicTransform(tfs);
 
   // Broadcast the pose with covariance
   geometry_msgs::PoseWithCovarianceStamped pwcs;
   pwcs.header.stamp = now;
   pwcs.header.frame_id = frame_world_;
-  pwcs.pose.pose.position.x = filter_.state.get_field<Position>()[0];
-  pwcs.pose.pose.position.y = filter_.state.get_field<Position>()[1];
-  pwcs.pose.pose.position.z = filter_.state.get_field<Position>()[2];
-  pwcs.pose.pose.orientation.w = filter_.state.get_field<Attitude>().w();
-  pwcs.pose.pose.orientation.x = filter_.state.get_field<Attitude>().x();
-  pwcs.pose.pose.orientation.y = filter_.state.get_field<Attitude>().y();
-  pwcs.pose.pose.orientation.z = filter_.state.get_field<Attitude>().z();
+  pwcs.pose.pose.position.x = filter.state.get_field<Position>()[0];
+  pwcs.pose.pose.position.y = filter.state.get_field<Position>()[1];
+  pwcs.pose.pose.position.z = filter.state.get_field<Position>()[2];
+  pwcs.pose.pose.orientation.w = filter.state.get_field<Attitude>().w();
+  pwcs.pose.pose.orientation.x = filter.state.get_field<Attitude>().x();
+  pwcs.pose.pose.orientation.y = filter.state.get_field<Attitude>().y();
+  pwcs.pose.pose.orientation.z = filter.state.get_field<Attitude>().z();
   for (size_t i = 0; i < 6; i++)
     for (size_t j = 0; j < 6; j++)
-      pwcs.pose.covariance[i*6 + j] = filter_.covariance(i, j);
-  pub_pose_.publish(pwcs);
+      pwcs.pose.covariance[i*6 + j] = filter.covariance(i, j);
+  body.pub_pose.publish(pwcs);
 
   // Broadcast the twist with covariance
   geometry_msgs::TwistWithCovarianceStamped twcs;
   twcs.header.stamp = now;
   twcs.header.frame_id = frame_world_;
-  twcs.twist.twist.linear.x = filter_.state.get_field<Velocity>()[0];
-  twcs.twist.twist.linear.y = filter_.state.get_field<Velocity>()[1];
-  twcs.twist.twist.linear.z = filter_.state.get_field<Velocity>()[2];
-  twcs.twist.twist.angular.x = filter_.state.get_field<Omega>()[0];
-  twcs.twist.twist.angular.y = filter_.state.get_field<Omega>()[1];
-  twcs.twist.twist.angular.z = filter_.state.get_field<Omega>()[2];
+  twcs.twist.twist.linear.x = filter.state.get_field<Velocity>()[0];
+  twcs.twist.twist.linear.y = filter.state.get_field<Velocity>()[1];
+  twcs.twist.twist.linear.z = filter.state.get_field<Velocity>()[2];
+  twcs.twist.twist.angular.x = filter.state.get_field<Omega>()[0];
+  twcs.twist.twist.angular.y = filter.state.get_field<Omega>()[1];
+  twcs.twist.twist.angular.z = filter.state.get_field<Omega>()[2];
   for (size_t i = 0; i < 6; i++)
     for (size_t j = 0; j < 6; j++)
-      twcs.twist.covariance[i*6 + j] = filter_.covariance(6+i, 6+j);
-  pub_twist_.publish(twcs);
+      twcs.twist.covariance[i*6 + j] = filter.covariance(6+i, 6+j);
+  body.pub_twist.publish(twcs);
+
+#ifdef DEEPDIVE_METRICS
+  // Stamps are host times, so this includes transport from the bridge
+  body.latency.Feed(1e3 * (ros::Time::now() - now).toSec());
+#endif
+}
+
+#ifdef DEEPDIVE_METRICS
+
+// Pipeline diagnostics for all bodies
+static ros::Publisher pub_diagnostics_;
+static ros::Timer diagnostics_timer_;
+
+// Add a key value pair to a diagnostic status
+void AddValue(diagnostic_msgs::DiagnosticStatus & status,
+  std::string const& key, double value) {
+  diagnostic_msgs::KeyValue kv;
+  kv.key = key;
+  kv.value = std::to_string(value);
+  status.values.push_back(kv);
+}
+
+// Report and reset the statistics of a body, on the worker that owns it
+void Diagnose(Body & body) {
+  diagnostic_msgs::DiagnosticArray msg;
+  msg.header.stamp = ros::Time::now();
+  msg.status.resize(1);
+  diagnostic_msgs::DiagnosticStatus & status = msg.status[0];
+  status.name = "deepdive_track: " + body.frame;
+  status.hardware_id = body.frame;
+  status.level = diagnostic_msgs::DiagnosticStatus::OK;
+  status.message = "OK";
+  if (body.latency.Count() < 1) {
+    status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+    status.message = "No poses published";
+  }
+  AddValue(status, "poses", body.latency.Count());
+  AddValue(status, "measurement_to_pose_ms", body.latency.Mean());
+  AddValue(status, "measurement_to_pose_ms_dev", body.latency.Deviation());
+  AddValue(status, "light_updates", body.light_cost.Count());
+  AddValue(status, "light_us", body.light_cost.Mean());
+  AddValue(status, "imu_updates", body.imu_cost.Count());
+  AddValue(status, "imu_us", body.imu_cost.Mean());
+  AddValue(status, "late_measurements", body.replays.Count());
+  AddValue(status, "replayed_per_late", body.replays.Mean());
+  body.latency.Reset();
+  body.light_cost.Reset();
+  body.imu_cost.Reset();
+  body.replays.Reset();
+  pub_diagnostics_.publish(msg);
+}
+
+// Called back once a second to report diagnostics
+void DiagnosticsCallback(ros::TimerEvent const& info) {
+  if (!initialized_)
+    return;
+  BodyMap::iterator it;
+  for (it = bodies_.begin(); it != bodies_.end(); it++)
+    pool_.Dispatch(it->second.index, std::bind(Diagnose, std::ref(it->second)));
+}
+
+#endif
+
+// This will be called back at the desired tracking rate
+void TimerCallback(ros::TimerEvent const& info) {
+  if (!initialized_)
+    return;
+  BodyMap::iterator it;
+  for (it = bodies_.begin(); it != bodies_.end(); it++)
+    pool_.Dispatch(it->second.index, std::bind(Publish, std::ref(it->second)));
+}
+
+// Compose the constant transforms used by the measurement models
+void BuildTables() {
+  tracker_table_.clear();
+  tracker_index_.clear();
+  TrackerMap::const_iterator it;
+  for (it = trackers_.begin(); it != trackers_.end(); it++) {
+    Eigen::Affine3d bTt = bTh_.at(it->first)               // head -> body
+                        * tTh_.at(it->first).inverse();    // tracker -> head
+    TrackerEntry entry;
+    entry.iTb = tTi_.at(it->first).inverse()               // light -> imu
+              * tTh_.at(it->first)                         // head -> light
+              * bTh_.at(it->first).inverse();              // body -> head
+    for (size_t i = 0; i < NUM_SENSORS; i++)
+      entry.sensors[i] = bTt * Eigen::Vector3d(
+        it->second.sensors[6 * i + 0],
+        it->second.sensors[6 * i + 1],
+        it->second.sensors[6 * i + 2]);
+    tracker_index_[it->first] = tracker_table_.size();
+    tracker_table_.push_back(entry);
+  }
+  lighthouse_table_.clear();
+  lighthouse_index_.clear();
+  LighthouseMap::const_iterator jt;
+  for (jt = lighthouses_.begin(); jt != lighthouses_.end(); jt++) {
+    LighthouseEntry entry;
+    entry.lTw = wTv_.inverse()                             // world -> vive
+              * vTl_.at(jt->first).inverse();              // vive -> lh
+    entry.params = jt->second.params;
+    lighthouse_index_[jt->first] = lighthouse_table_.size();
+    lighthouse_table_.push_back(entry);
+  }
 }
 
+// The tables are rebuilt whenever a tracker or lighthouse appears, and the
+// workers are idle while this happens.
 void CheckIfReadyToTrack() {
+  TrackerMap::const_iterator it;
+  for (it = trackers_.begin(); it != trackers_.end(); it++)
+    if (!it->second.ready) return;
+  LighthouseMap::const_iterator jt;
+  for (jt = lighthouses_.begin(); jt != lighthouses_.end(); jt++)
+    if (!jt->second.ready) return;
+  BuildTables();
+  // Measurements in the history were fused with the old tables
+  BodyMap::iterator bt;
+  for (bt = bodies_.begin(); bt != bodies_.end(); bt++)
+    bt->second.history.Clear();
   if (!initialized_) {
-    TrackerMap::const_iterator it;
-    for (it = trackers_.begin(); it != trackers_.end(); it++)
-      if (!it->second.ready) return;
-    LighthouseMap::const_iterator jt;
-    for (jt = lighthouses_.begin(); jt != lighthouses_.end(); jt++)
-      if (!jt->second.ready) return;
     ROS_INFO_STREAM("All trackers and lighthouses found. Tracking started.");
     initialized_ = true;
   }
@@ -569,6 +1045,18 @@ void NewTrackerCallback(TrackerMap::iterator tracker) {
   CheckIfReadyToTrack();
 }
 
+// The workers read the tracker and lighthouse data, so they must be idle
+// before it is updated.
+void TrackerConfigCallback(deepdive_ros::Trackers::ConstPtr const& msg) {
+  pool_.Flush();
+  TrackerCallback(msg, trackers_, NewTrackerCallback);
+}
+
+void LighthouseConfigCallback(deepdive_ros::Lighthouses::ConstPtr const& msg) {
+  pool_.Flush();
+  LighthouseCallback(msg, lighthouses_, NewLighthouseCallback);
+}
+
 // MAIN ENTRY POINT OF APPLICATION
 
 bool GetPairParam(ros::NodeHandle &nh,
@@ -604,11 +1092,12 @@ bool GetQuaternionParam(ros::NodeHandle &nh,
   return true;
 }
 
-int main(int argc, char **argv) {
-  // Initialize ROS and create node handle
-  ros::init(argc, argv, "deepdive_tracker");
-  ros::NodeHandle nh("~");
+// Subscribers and timer, which must outlive TrackStart
+static std::vector<ros::Subscriber> subs_;
+static ros::Timer timer_;
 
+// Read the configuration, and start listening for data
+void TrackStart(ros::NodeHandle & nh) {
   // Get the parent information
   if (!nh.getParam("calfile", calfile_))
     ROS_FATAL("Failed to get the calfile file.");
@@ -658,11 +1147,13 @@ int main(int argc, char **argv) {
   std::vector<std::string> trackers;
   if (!nh.getParam("trackers", trackers))
     ROS_FATAL("Failed to get the tracker list.");
+  std::map<std::string, std::string> serials;
   std::vector<std::string>::iterator jt;
   for (jt = trackers.begin(); jt != trackers.end(); jt++) {
     std::string serial;
     if (!nh.getParam(*jt + "/serial", serial))
       ROS_FATAL("Failed to get the tracker serial.");
+    serials[*jt] = serial;
     std::vector<double> extrinsics;
     if (!nh.getParam(*jt + "/extrinsics", extrinsics))
       ROS_FATAL("Failed to get the tracker extrinsics.");
@@ -708,6 +1199,16 @@ int main(int argc, char **argv) {
   if (!nh.getParam("rate", rate_))
     ROS_FATAL("Failed to get rate parameter.");
 
+  // Optionally publish at IMU rate, and share the state in memory
+  nh.param<bool>("imu_rate", imu_rate_, false);
+  nh.param<std::string>("snapshot", snapshot_, "");
+  nh.param<std::string>("bag", bag_, "");
+  nh.param<double>("bag_duration", bag_duration_, 0.0);
+
+  // How many measurements to keep, and how late they may be, for replaying
+  nh.param<int>("history/size", history_size_, history_size_);
+  nh.param<double>("history/lag", history_lag_, history_lag_);
+
   // Get the tracker update rate.
   if (!nh.getParam("use/gyroscope", use_gyroscope_))
     ROS_FATAL("Failed to get use/gyroscope  parameter.");
@@ -780,23 +1281,55 @@ int main(int argc, char **argv) {
   if (!GetVectorParam(nh, "process_noise_cov/alpha", noise_alpha))
     ROS_FATAL("Failed to get acceleration parameter.");
 
-  // Setup the filter
-  filter_.state.set_field<Position>(est_position);
-  filter_.state.set_field<Attitude>(est_attitude);
-  filter_.state.set_field<Velocity>(est_velocity);
-  filter_.state.set_field<Omega>(est_omega);
-  filter_.state.set_field<Acceleration>(est_acceleration);
-  filter_.state.set_field<Alpha>(est_alpha);
-  filter_.covariance = State::CovarianceMatrix::Zero();
-  filter_.covariance.diagonal() << 
-    cov_position, cov_attitude,
-    cov_velocity, cov_omega,
-    cov_accel, cov_alpha;
-  filter_.process_noise_covariance = State::CovarianceMatrix::Zero();
-  filter_.process_noise_covariance.diagonal() <<
-    noise_position, noise_attitude,
-    noise_velocity, noise_omega,
-    noise_accel, noise_alpha;
+  // Get the bodies, each listing the trackers rigidly attached to it. If
+  // there is no body list, then all trackers are attached to the truth frame.
+  std::vector<std::string> bodies;
+  if (nh.getParam("bodies", bodies)) {
+    for (it = bodies.begin(); it != bodies.end(); it++) {
+      Body & body = bodies_[*it];
+      if (!nh.getParam(*it + "/frame", body.frame))
+        ROS_FATAL("Failed to get the body frame.");
+      std::vector<std::string> attached;
+      if (!nh.getParam(*it + "/trackers", attached))
+        ROS_FATAL("Failed to get the body tracker list.");
+      for (jt = attached.begin(); jt != attached.end(); jt++) {
+        if (serials.find(*jt) == serials.end()) {
+          ROS_FATAL_STREAM("Body " << *it << " has unknown tracker " << *jt);
+          continue;
+        }
+        tracker_bodies_[serials[*jt]] = &body;
+      }
+    }
+  } else {
+    Body & body = bodies_[frame_truth_];
+    body.frame = frame_truth_;
+    std::map<std::string, std::string>::iterator kt;
+    for (kt = serials.begin(); kt != serials.end(); kt++)
+      tracker_bodies_[kt->second] = &body;
+  }
+
+  // Setup the filters
+  BodyMap::iterator bt;
+  for (bt = bodies_.begin(); bt != bodies_.end(); bt++) {
+    TrackingFilter & filter = bt->second.filter;
+    filter.state.set_field<Position>(est_position);
+    filter.state.set_field<Attitude>(est_attitude);
+    filter.state.set_field<Velocity>(est_velocity);
+    filter.state.set_field<Omega>(est_omega);
+    filter.state.set_field<Acceleration>(est_acceleration);
+    filter.state.set_field<Alpha>(est_alpha);
+    filter.covariance = State::CovarianceMatrix::Zero();
+    filter.covariance.diagonal() << 
+      cov_position, cov_attitude,
+      cov_velocity, cov_omega,
+      cov_accel, cov_alpha;
+    filter.process_noise_covariance = State::CovarianceMatrix::Zero();
+    filter.process_noise_covariance.diagonal() <<
+      noise_position, noise_attitude,
+      noise_velocity, noise_omega,
+      noise_accel, noise_alpha;
+    bt->second.history.Reserve(history_lag_ > 0 ? std::max(history_size_, 0) : 0);
+  }
 
   // IMU error : initial estimate
   if (!GetVectorParam(nh, "measurement_cov/accelerometer", obs_cov_acc_))
@@ -842,29 +1375,116 @@ int main(int argc, char **argv) {
   wTv_ = AngleAxisToTransform(registration_);
 
   // Markers showing sensor positions
-  pub_pose_ = nh.advertise<geometry_msgs::PoseWithCovarianceStamped>
-    (topic_pose, 0);
-  pub_twist_ = nh.advertise<geometry_msgs::TwistWithCovarianceStamped>
-    (topic_twist, 0);
+  size_t index = 0;
+  for (bt = bodies_.begin(); bt != bodies_.end(); bt++, index++) {
+    std::string suffix = (bodies.empty() ? "" : "/" + bt->first);
+    bt->second.index = index;
+    bt->second.pub_pose = nh.advertise<geometry_msgs::PoseWithCovarianceStamped>
+      (topic_pose + suffix, 0);
+    bt->second.pub_twist =
+      nh.advertise<geometry_msgs::TwistWithCovarianceStamped>
+        (topic_twist + suffix, 0);
+    if (!snapshot_.empty() &&
+        !bt->second.snapshot.Open(snapshot_ + "_" + bt->first))
+      ROS_WARN_STREAM("Could not share state of body " << bt->first);
+  }
+
+  // Independent bodies are updated in parallel. By default there is one
+  // worker per core, and a single body is updated inline.
+  int threads = std::thread::hardware_concurrency();
+  nh.param<int>("threads", threads, threads);
+  threads = std::min<int>(threads, bodies_.size());
+  pool_.Start(threads > 1 ? threads : 0);
 
   // Subscribe to the motion and light callbacks
-  std::vector<ros::Subscriber> subs;
-  subs.push_back(nh.subscribe<deepdive_ros::Trackers>("/trackers", 1000,
-    std::bind(TrackerCallback, std::placeholders::_1,
-      std::ref(trackers_), NewTrackerCallback)));
-  subs.push_back(nh.subscribe<deepdive_ros::Lighthouses>("/lighthouses", 1000,
-    std::bind(LighthouseCallback, std::placeholders::_1,
-      std::ref(lighthouses_), NewLighthouseCallback)));
-  subs.push_back(nh.subscribe("/light", 1000, LightCallback));
-  subs.push_back(nh.subscribe("/imu", 1000, ImuCallback));
+  subs_.push_back(nh.subscribe("/trackers", 1000, TrackerConfigCallback));
+  subs_.push_back(nh.subscribe("/lighthouses", 1000, LighthouseConfigCallback));
+  subs_.push_back(nh.subscribe("/light", 1000, LightCallback));
+  subs_.push_back(nh.subscribe<deepdive_ros::Trackers>("/trackers", 1000,
+    std::bind(TrackerHandleCallback, std::placeholders::_1,
+      std::ref(tracker_handles_))));
+  subs_.push_back(nh.subscribe<deepdive_ros::Lighthouses>("/lighthouses", 1000,
+    std::bind(LighthouseHandleCallback, std::placeholders::_1,
+      std::ref(lighthouse_handles_))));
+  subs_.push_back(nh.subscribe<deepdive_ros::LightCompact>("/light_compact",
+    1000, std::bind(LightCompactCallback, std::placeholders::_1,
+      std::cref(tracker_handles_), std::cref(lighthouse_handles_),
+        LightCallback)));
+  subs_.push_back(nh.subscribe("/imu", 1000, ImuCallback));
 
   // Start a timer to callback
-  ros::Timer timer = nh.createTimer(
+  timer_ = nh.createTimer(
     ros::Duration(ros::Rate(rate_)), TimerCallback, false, true);
 
+#ifdef DEEPDIVE_METRICS
+  // Report the pipeline latency and filter cost once a second
+  pub_diagnostics_ =
+    nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 10);
+  diagnostics_timer_ = nh.createTimer(ros::Duration(1.0), DiagnosticsCallback);
+#endif
+}
+
+#ifdef DEEPDIVE_NODELET
+
+namespace deepdive_ros {
+
+// The tracker as a nodelet. When loaded into the same manager as the bridge
+// nodelet, light and IMU messages arrive as shared pointers. All callbacks
+// share global state, so only one tracker can be loaded per manager.
+class TrackNodelet : public nodelet::Nodelet {
+ private:
+  void onInit() {
+    TrackStart(getPrivateNodeHandle());
+  }
+};
+
+}  // namespace deepdive_ros
+
+PLUGINLIB_EXPORT_CLASS(deepdive_ros::TrackNodelet, nodelet::Nodelet)
+
+#else
+
+// Run the filters over a bag at disk speed, and report the cost of their
+// updates with one line per body, in the same format as the benchmarks
+bool TrackBag() {
+  ROS_INFO_STREAM("Reading bag " << bag_);
+  BagCallbacks cb;
+  cb.trackers = TrackerConfigCallback;
+  cb.lighthouses = LighthouseConfigCallback;
+  cb.light = LightCallback;
+  cb.imu = ImuCallback;
+  if (!ReadBag(bag_, cb, bag_duration_))
+    return false;
+  pool_.Flush();
+  BodyMap::iterator bt;
+  for (bt = bodies_.begin(); bt != bodies_.end(); bt++) {
+    Body & body = bt->second;
+    printf("track body=%s light_updates=%.0f light_us=%.3f light_us_dev=%.3f"
+      " imu_updates=%.0f imu_us=%.3f imu_us_dev=%.3f\n", bt->first.c_str(),
+      body.light_cost.Count(), body.light_cost.Mean(),
+      body.light_cost.Deviation(), body.imu_cost.Count(),
+      body.imu_cost.Mean(), body.imu_cost.Deviation());
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  // Initialize ROS and create node handle
+  ros::init(argc, argv, "deepdive_tracker");
+  ros::NodeHandle nh("~");
+
+  // Read the configuration, and start listening for data
+  TrackStart(nh);
+
+  // A bag is filtered directly, without waiting for messages
+  if (!bag_.empty())
+    return TrackBag() ? 0 : 1;
+
   // Block until safe shutdown
   ros::spin();
 
   // Success!
   return 0;
 }
+
+#endif
@@ -35,15 +35,35 @@
 
 // Interface implementations
 #include "deepdive_usb.h"
+#include "deepdive_queue.h"
+#include "deepdive_map.h"
+#include "deepdive_capture.h"
 
-// Initialize the driver
-struct Driver * deepdive_init() {
+#include <stdatomic.h>
+
+// Optional raw packet capture, enabled by setting this to a file path
+#define CAPTURE_ENV           "DEEPDIVE_CAPTURE"
+
+// How long the USB thread blocks in the event loop before checking for exit
+#define THREAD_TIMEOUT_USEC   100000
+
+// USB event thread state
+struct EventThread {
+  pthread_t thread;
+  atomic_int running;             // Should the thread keep running?
+};
+
+// Allocate a driver with the default configuration
+static struct Driver * driver_new(void) {
   // Create a new driver context
   struct Driver *drv = malloc(sizeof(struct Driver));
   if (drv == NULL)
     return NULL;
   // Make sure we are zeroed by default
   memset(drv, 0, sizeof(struct Driver));
+  pthread_mutex_init(&drv->lock, NULL);
+  deepdive_map_clear(&drv->lighthouse_map);
+  deepdive_map_clear(&drv->tracker_map);
   // General constants
   drv->general.timebase_hz            = 48000000UL; // Ticks per second
   drv->general.timecenter_ticks       = 200000UL;   // Midpoint of sweep
@@ -53,10 +73,44 @@ struct Driver * deepdive_init() {
   drv->general.pulse_max_for_sweep    = 1800UL;
   drv->general.pulse_synctime_offset  = 20000UL;
   drv->general.pulse_synctime_slack   = 5000UL;
-  // Initialize tracker
+  return drv;
+}
+
+// Initialize the driver
+struct Driver * deepdive_init() {
+  return deepdive_init_capture(getenv(CAPTURE_ENV));
+}
+
+// Initialize the driver, logging raw packets to a file if path is not NULL
+struct Driver * deepdive_init_capture(const char * path) {
+  struct Driver *drv = driver_new();
+  if (drv == NULL)
+    return NULL;
+  // Start capturing before anything is downloaded from the devices
+  if (path && deepdive_capture_open(drv, path)) {
+    deepdive_close(drv);
+    return NULL;
+  }
+  // Initialize tracker. With hotplug support devices may be plugged in
+  // later, so it is only an error to find none if they cannot be.
   if (deepdive_usb_init(drv) == 0) {
-    printf("No devices found\n");
-    free(drv);
+    if (!drv->has_hotplug) {
+      printf("No devices found\n");
+      deepdive_close(drv);
+      return NULL;
+    }
+    printf("No devices found yet, waiting for them to be plugged in\n");
+  }
+  return drv;
+}
+
+// Initialize the driver from a raw packet log instead of USB devices
+struct Driver * deepdive_init_replay(const char * path, int realtime) {
+  struct Driver *drv = driver_new();
+  if (drv == NULL)
+    return NULL;
+  if (deepdive_replay_open(drv, path, realtime)) {
+    deepdive_close(drv);
     return NULL;
   }
   return drv;
@@ -94,6 +148,55 @@ void deepdive_install_lighthouse_fn(struct Driver * drv, lighthouse_func fbp) {
   if (fbp) drv->lighthouse_fn = fbp;
 }
 
+// Give every tracker a queue, so that data is delivered on the polling thread
+static int queue_trackers(struct Driver * drv) {
+  pthread_mutex_lock(&drv->lock);
+  for (size_t i = 0; i < drv->num_trackers; i++) {
+    if (drv->trackers[i] && deepdive_queue_init(drv->trackers[i])) {
+      printf("Could not allocate queue for tracker %s\n",
+        drv->trackers[i]->serial);
+      pthread_mutex_unlock(&drv->lock);
+      return -1;
+    }
+  }
+  pthread_mutex_unlock(&drv->lock);
+  return 0;
+}
+
+// Register a batched light callback function. The batch is shared by all
+// trackers, so their data is always queued and only batched when drained.
+int deepdive_install_light_batch_fn(struct Driver * drv, lig_batch_func fbp) {
+  if (drv == NULL || fbp == NULL) return -1;
+  if (!drv->lig_batch) {
+    drv->lig_batch = malloc(sizeof(struct LightBatch));
+    if (!drv->lig_batch) return -2;
+    drv->lig_batch->num_sweeps = 0;
+    drv->lig_batch->num_pulses = 0;
+  }
+  if (queue_trackers(drv)) return -3;
+  drv->lig_batch_fn = fbp;
+  return 0;
+}
+
+// Register a batched IMU callback function, which queues data likewise
+int deepdive_install_imu_batch_fn(struct Driver * drv, imu_batch_func fbp) {
+  if (drv == NULL || fbp == NULL) return -1;
+  if (!drv->imu_batch) {
+    drv->imu_batch = malloc(sizeof(struct ImuBatch));
+    if (!drv->imu_batch) return -2;
+    drv->imu_batch->num = 0;
+  }
+  if (queue_trackers(drv)) return -3;
+  drv->imu_batch_fn = fbp;
+  return 0;
+}
+
+// Register a tracker removal callback function
+void deepdive_install_removed_fn(struct Driver * drv, tracker_func fbp) {
+  if (drv == NULL) return;
+  if (fbp) drv->removed_fn = fbp;
+}
+
 // GETTERS
 
 // Get the general configuration data
@@ -104,45 +207,357 @@ struct General * deepdive_general(struct Driver * drv) {
 
 // Get the calibration data for the lighthouse with the given serial number
 struct Lighthouse * deepdive_lighthouse(struct Driver * drv, const char* id) {
+  if (!drv || !id) return NULL;
+  char *end;
+  unsigned long uid = strtoul(id, &end, 10);
+  if (end == id || *end != '\0') return NULL;
+  return deepdive_lighthouse_by_serial(drv, uid);
+}
+
+// Get the calibration data for the lighthouse with the given numeric serial
+struct Lighthouse * deepdive_lighthouse_by_serial(struct Driver * drv,
+  uint32_t uid) {
   if (!drv) return NULL;
-  for (size_t i = 0; i < MAX_NUM_LIGHTHOUSES; i++) {
-    if (strcmp(drv->lighthouses[i].serial, id) == 0)
-      return &drv->lighthouses[i];
-  }
-  return NULL;
+  // Lighthouses are never erased, so the map can be read without the lock
+  int idx = deepdive_map_find(&drv->lighthouse_map, uid);
+  if (idx < 0) return NULL;
+  return &drv->lighthouses[idx / LIGHTHOUSE_BLOCK][idx % LIGHTHOUSE_BLOCK];
+}
+
+// Get the calibration data for a lighthouse by its handle (id)
+struct Lighthouse * deepdive_lighthouse_by_handle(struct Driver * drv,
+  uint8_t handle) {
+  if (!drv) return NULL;
+  if (handle >= __atomic_load_n(&drv->num_lighthouses, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &drv->lighthouses[handle / LIGHTHOUSE_BLOCK][handle % LIGHTHOUSE_BLOCK];
 }
 
 // Get the calibration data for a tracker with the given serial number
 struct Tracker * deepdive_tracker(struct Driver * drv, const char* id) {
-  if (!drv) return NULL;
-  for (size_t i = 0; i < drv->num_trackers; i++) {
-    if (strcmp(drv->trackers[i]->serial, id) == 0)
-      return drv->trackers[i];
+  if (!drv || !id) return NULL;
+  uint32_t pos = 0;
+  uint32_t key = deepdive_map_hash(id);
+  int idx;
+  while ((idx = deepdive_map_next(&drv->tracker_map, key, &pos)) >= 0) {
+    if (drv->trackers[idx] && strcmp(drv->trackers[idx]->serial, id) == 0)
+      return drv->trackers[idx];
   }
   return NULL;
 }
 
+// Get a tracker by its handle
+struct Tracker * deepdive_tracker_by_handle(struct Driver * drv,
+  uint16_t handle) {
+  if (!drv || handle >= MAX_NUM_TRACKERS) return NULL;
+  struct Tracker * tracker = drv->trackers[handle];
+  if (!tracker || !tracker->pushed) return NULL;
+  return tracker;
+}
+
+// Get the tracker in a slot, which may be filled by a hotplug thread
+static inline struct Tracker * slot(struct Driver * drv, size_t i) {
+  return __atomic_load_n(&drv->trackers[i], __ATOMIC_ACQUIRE);
+}
+
+// Get the number of tracker slots in use
+static inline size_t num_slots(struct Driver * drv) {
+  return __atomic_load_n(&drv->num_trackers, __ATOMIC_ACQUIRE);
+}
+
+// Push the config of each tracker to the callee as soon as it is ready
+static void push_trackers(struct Driver * drv) {
+  for (size_t i = 0; i < num_slots(drv); i++) {
+    struct Tracker * tracker = slot(drv, i);
+    if (!tracker || tracker->pushed
+      || !__atomic_load_n(&tracker->ready, __ATOMIC_ACQUIRE))
+      continue;
+    deepdive_map_insert(&drv->tracker_map,
+      deepdive_map_hash(tracker->serial), tracker->handle);
+    tracker->pushed = 1;
+    if (drv->tracker_fn)
+      drv->tracker_fn(tracker);
+  }
+}
+
+// Deliver queued records from all trackers whose config has been pushed
+static int drain_trackers(struct Driver * drv) {
+  int count = 0;
+  for (size_t i = 0; i < num_slots(drv); i++) {
+    struct Tracker * tracker = slot(drv, i);
+    if (tracker && tracker->pushed)
+      count += deepdive_queue_drain(tracker);
+  }
+  return count;
+}
+
+// Release trackers that have been unplugged, once nothing refers to them
+static void reap_trackers(struct Driver * drv) {
+  for (size_t i = 0; i < num_slots(drv); i++) {
+    struct Tracker * tracker = slot(drv, i);
+    if (!tracker
+      || !__atomic_load_n(&tracker->removed, __ATOMIC_ACQUIRE)
+      || !__atomic_load_n(&tracker->done, __ATOMIC_ACQUIRE)
+      || __atomic_load_n(&tracker->inflight, __ATOMIC_ACQUIRE) > 0)
+      continue;
+    // Let the callee know before the memory disappears
+    if (tracker->pushed) {
+      printf("Removed tracker %s\n", tracker->serial);
+      deepdive_queue_drain(tracker);
+      deepdive_queue_flush(drv);
+      if (drv->removed_fn)
+        drv->removed_fn(tracker);
+      deepdive_map_erase(&drv->tracker_map,
+        deepdive_map_hash(tracker->serial), tracker->handle);
+    }
+    pthread_mutex_lock(&drv->lock);
+    __atomic_store_n(&drv->trackers[i], NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&drv->lock);
+    deepdive_usb_release(tracker);
+    deepdive_queue_free(tracker);
+    free(tracker);
+  }
+}
+
+// Service events on the calling thread. While devices are being configured
+// callbacks may fire on configuration threads, so data is queued and then
+// delivered here. After that the queues are no longer needed.
+static int handle_events(struct Driver * drv, struct timeval * tv) {
+  int settled = (__atomic_load_n(&drv->configuring, __ATOMIC_ACQUIRE) == 0);
+  push_trackers(drv);
+  int ret;
+  if (drv->replay)
+    ret = deepdive_replay(drv, tv);
+  else if (tv)
+    ret = libusb_handle_events_timeout_completed(drv->usb, tv, NULL);
+  else
+    ret = libusb_handle_events(drv->usb);
+  drain_trackers(drv);
+  deepdive_queue_flush(drv);
+  reap_trackers(drv);
+  // A device may have arrived while handling events
+  settled &= (__atomic_load_n(&drv->configuring, __ATOMIC_ACQUIRE) == 0);
+  // Without configuration threads there is no producer but us, so the
+  // queues can be released safely, unless data is being batched
+  if (settled && !deepdive_queue_batched(drv)) {
+    pthread_mutex_lock(&drv->lock);
+    for (size_t i = 0; i < drv->num_trackers; i++)
+      if (drv->trackers[i])
+        deepdive_queue_free(drv->trackers[i]);
+    pthread_mutex_unlock(&drv->lock);
+  }
+  return ret;
+}
+
+// Is the USB thread still producing data?
+static int thread_running(struct Driver * drv) {
+  return atomic_load_explicit(&drv->thread->running, memory_order_acquire);
+}
+
+// Block until the USB thread has data for us, or it has stopped
+static void thread_wait(struct Driver * drv, int timeout) {
+  if (thread_running(drv))
+    deepdive_queue_wait(drv, timeout);
+}
+
 // Poll the driver for events
 int deepdive_poll(struct Driver * drv) {
   if (drv == NULL) return -1;
-  // Push general and tracker config
-  if (drv->pushed == 0) {
-    for (size_t i = 0; i < drv->num_trackers; i++)
-      if (drv->tracker_fn)
-        drv->tracker_fn(drv->trackers[i]);
-    drv->pushed = 1;
+  // In threaded mode the USB thread is already handling events
+  if (drv->threaded) {
+    thread_wait(drv, -1);
+    return deepdive_poll_nonblock(drv);
+  }
+  // Handle any USB events
+  return handle_events(drv, NULL);
+}
+
+// USB event loop, which runs in its own thread
+static void * deepdive_thread(void * arg) {
+  struct Driver * drv = (struct Driver *) arg;
+  struct timeval tv = {0, THREAD_TIMEOUT_USEC};
+  while (thread_running(drv)) {
+    if (!drv->replay) {
+      libusb_handle_events_timeout_completed(drv->usb, &tv, NULL);
+    } else if (deepdive_replay(drv, &tv) < 0) {
+      // The end of the log has been reached, which the poller must see
+      atomic_store_explicit(&drv->thread->running, 0, memory_order_release);
+      deepdive_queue_ring(drv);
+    }
+  }
+  return NULL;
+}
+
+// Start a thread to handle USB events
+int deepdive_start(struct Driver * drv) {
+  if (drv == NULL) return -1;
+  if (drv->threaded) return 0;
+  // Every tracker needs a queue before the thread starts producing
+  if (queue_trackers(drv))
+    return -2;
+  // The doorbell outlives the thread, as configuration threads ring it
+  if (deepdive_queue_doorbell_init(drv)) {
+    printf("Could not create USB thread doorbell\n");
+    return -4;
+  }
+  drv->thread = malloc(sizeof(struct EventThread));
+  if (!drv->thread)
+    return -3;
+  atomic_init(&drv->thread->running, 1);
+  // Set before the thread starts, so that a replay thread queues its data
+  drv->threaded = 1;
+  if (pthread_create(&drv->thread->thread, NULL, deepdive_thread, drv)) {
+    printf("Could not start USB thread\n");
+    drv->threaded = 0;
+    free(drv->thread);
+    drv->thread = NULL;
+    return -3;
+  }
+  return 0;
+}
+
+// Stop the USB thread and return to calling back from the event loop
+void deepdive_stop(struct Driver * drv) {
+  if (drv == NULL || !drv->threaded) return;
+  atomic_store_explicit(&drv->thread->running, 0, memory_order_release);
+  pthread_join(drv->thread->thread, NULL);
+  free(drv->thread);
+  drv->thread = NULL;
+  drv->threaded = 0;
+  // Deliver what is left over. The queues are released by the next poll,
+  // once configuration threads are no longer producing into them.
+  push_trackers(drv);
+  drain_trackers(drv);
+  deepdive_queue_flush(drv);
+}
+
+// Deliver any pending data without blocking, returning the record count
+int deepdive_poll_nonblock(struct Driver * drv) {
+  if (drv == NULL) return -1;
+  // Push tracker config
+  push_trackers(drv);
+  // Without a USB thread, handle whatever events are already pending
+  if (!drv->threaded)
+    return deepdive_poll_timeout(drv, 0);
+  // Otherwise, drain the per-tracker queues
+  int running = thread_running(drv);
+  deepdive_queue_answer(drv);
+  int count = drain_trackers(drv);
+  deepdive_queue_flush(drv);
+  reap_trackers(drv);
+  // A replay thread exits once it reaches the end of the log
+  if (count == 0 && !running)
+    return -1;
+  return count;
+}
+
+// EVENT LOOP INTEGRATION
+
+// Copy the USB file descriptors into an array of pollfd structures, and
+// return how many there are, even if they did not all fit
+int deepdive_get_pollfds(struct Driver * drv, struct pollfd * fds, int max) {
+  if (drv == NULL || (fds == NULL && max > 0)) return -1;
+  // In threaded mode the doorbell is all there is to wait on
+  if (drv->threaded) {
+    if (max > 0) {
+      fds[0].fd = deepdive_queue_doorbell_fd(drv);
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+    }
+    return 1;
+  }
+  if (drv->replay) return -4;
+  const struct libusb_pollfd ** pfds = libusb_get_pollfds(drv->usb);
+  if (pfds == NULL) return -3;
+  int num = 0;
+  for (; pfds[num]; num++) {
+    if (num >= max)
+      continue;
+    fds[num].fd = pfds[num]->fd;
+    fds[num].events = pfds[num]->events;
+    fds[num].revents = 0;
+  }
+  libusb_free_pollfds(pfds);
+  return num;
+}
+
+// Forward descriptor changes from libusb to the callee
+static void pollfd_added(int fd, short events, void * user) {
+  struct Driver * drv = (struct Driver *) user;
+  if (drv->pollfd_added_fn)
+    drv->pollfd_added_fn(fd, events, drv->pollfd_user);
+}
+
+static void pollfd_removed(int fd, void * user) {
+  struct Driver * drv = (struct Driver *) user;
+  if (drv->pollfd_removed_fn)
+    drv->pollfd_removed_fn(fd, drv->pollfd_user);
+}
+
+// Register callbacks for changes to the set of USB file descriptors
+int deepdive_install_pollfd_fns(struct Driver * drv,
+  pollfd_added_func added, pollfd_removed_func removed, void * user) {
+  if (drv == NULL) return -1;
+  if (drv->threaded) return -2;
+  if (drv->replay) return -4;
+  drv->pollfd_added_fn = added;
+  drv->pollfd_removed_fn = removed;
+  drv->pollfd_user = user;
+  if (added || removed)
+    libusb_set_pollfd_notifiers(drv->usb, pollfd_added, pollfd_removed, drv);
+  else
+    libusb_set_pollfd_notifiers(drv->usb, NULL, NULL, NULL);
+  return 0;
+}
+
+// Get the time until the driver next needs servicing
+int deepdive_get_timeout(struct Driver * drv, struct timeval * tv) {
+  if (drv == NULL || tv == NULL) return -1;
+  if (drv->threaded) return -2;
+  if (drv->replay) return -4;
+  return libusb_get_next_timeout(drv->usb, tv);
+}
+
+// Service events, blocking for at most usec microseconds
+int deepdive_poll_timeout(struct Driver * drv, uint32_t usec) {
+  if (drv == NULL) return -1;
+  // In threaded mode wait for the USB thread to have data for us
+  if (drv->threaded) {
+    thread_wait(drv, (usec + 999) / 1000);
+    return deepdive_poll_nonblock(drv);
   }
   // Handle any USB events
-  return libusb_handle_events(drv->usb);
+  struct timeval tv = {usec / 1000000, usec % 1000000};
+  return handle_events(drv, &tv);
+}
+
+// Service events after an external event loop signals activity
+int deepdive_events_ready(struct Driver * drv) {
+  return deepdive_poll_timeout(drv, 0);
 }
 
 // Close the driver and clean up memory
 void deepdive_close(struct Driver * drv) {
   if (drv == NULL) return;
+  deepdive_stop(drv);
+  // Nobody is polling the descriptors once the devices start closing
+  if (drv->usb)
+    libusb_set_pollfd_notifiers(drv->usb, NULL, NULL, NULL);
+  deepdive_usb_close(drv);
+  deepdive_capture_close(drv);
+  deepdive_queue_doorbell_free(drv);
   for (size_t i = 0; i < drv->num_trackers; i++) {
-    libusb_close(drv->trackers[i]->udev);
+    if (!drv->trackers[i])
+      continue;
+    deepdive_queue_free(drv->trackers[i]);
     free(drv->trackers[i]);
   }
-  libusb_exit(drv->usb);
+  if (drv->usb)
+    libusb_exit(drv->usb);
+  pthread_mutex_destroy(&drv->lock);
+  for (size_t i = 0; i < MAX_NUM_LIGHTHOUSES / LIGHTHOUSE_BLOCK; i++)
+    free(drv->lighthouses[i]);
+  free(drv->lig_batch);
+  free(drv->imu_batch);
   free(drv);
 }
@@ -36,6 +36,9 @@
 
 #include <libusb-1.0/libusb.h>
 
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -45,11 +48,22 @@
 #define MAX_PACKET_LEN        64
 #define PREAMBLE_LENGTH       17
 
-#define MAX_NUM_LIGHTHOUSES   2
+#define MAX_NUM_CHANNELS      2
+#define MAX_NUM_LIGHTHOUSES   128
+#define LIGHTHOUSE_BLOCK      8
 #define MAX_NUM_TRACKERS      128
 #define MAX_NUM_SENSORS       32
 #define MAX_SERIAL_LENGTH     32
 #define USB_INT_BUFF_LENGTH   64
+#define MAX_TRANSFERS         8
+#define MAP_SIZE              256
+#define MAX_BATCH_SWEEPS      256
+#define MAX_BATCH_PULSES      (MAX_BATCH_SWEEPS * MAX_NUM_SENSORS)
+#define MAX_BATCH_IMU         256
+
+#define HISTOGRAM_SUB_BITS    2
+#define HISTOGRAM_SUB_BUCKETS 4
+#define MAX_HISTOGRAM_BUCKETS (40 * HISTOGRAM_SUB_BUCKETS)
 
 #define USB_VEND_HTC          0x28de
 #define USB_PROD_TRACKER      0x2022
@@ -67,6 +81,9 @@
 // Forward declaration of driver context
 struct Driver;
 struct Tracker;
+struct Queue;
+struct Capture;
+struct Replay;
 
 // Extrinsics axes
 typedef enum {
@@ -86,12 +103,27 @@ typedef enum {
   BUTTON_PAD_TOUCH  = (1<<28)
 } ButtonType;
 
-// Interrupt buffer for an endpoint
+// Transfer states, used to decode completions in submission order
+typedef enum {
+  TRANSFER_PENDING  = 0,
+  TRANSFER_READY    = 1,
+  TRANSFER_LAST     = 2,
+  TRANSFER_DEAD     = 3
+} TransferState;
+
+// Pool of interrupt transfers for an endpoint. Transfers are resubmitted as
+// soon as they complete, and their data is decoded in submission order.
 struct Endpoint {
   struct Tracker *tracker;
   CallbackType type;
-  struct libusb_transfer *tx;
-  uint8_t buffer[USB_INT_BUFF_LENGTH];
+  uint8_t num_transfers;                            // Transfers in the pool
+  uint8_t next;                                     // Next transfer to decode
+  struct libusb_transfer *tx[MAX_TRANSFERS];        // Transfer pool
+  uint8_t buffer[MAX_TRANSFERS][USB_INT_BUFF_LENGTH];   // USB buffers
+  uint8_t data[MAX_TRANSFERS][USB_INT_BUFF_LENGTH];     // Completed data
+  uint8_t length[MAX_TRANSFERS];                    // Completed data length
+  uint8_t state[MAX_TRANSFERS];                     // Transfer state
+  uint64_t received[MAX_TRANSFERS];                 // Completion time (ns)
 };
 
 // Calibration for a given tracker
@@ -111,6 +143,7 @@ struct Calibration {
 };
 
 typedef struct {
+  uint32_t active;                          // Bitmask of sensors with data
   uint32_t sweep_time[MAX_NUM_SENSORS];
   uint16_t sweep_len[MAX_NUM_SENSORS];
 } lightcaps_sweep_data;
@@ -120,9 +153,9 @@ typedef struct {
   int activeSweepStartTime;
   int activeLighthouse;
   int activeAcode;
-  int lh_start_time[MAX_NUM_LIGHTHOUSES];
-  int lh_max_pulse_length[MAX_NUM_LIGHTHOUSES];
-  int8_t lh_acode[MAX_NUM_LIGHTHOUSES];
+  int lh_start_time[MAX_NUM_CHANNELS];
+  int lh_max_pulse_length[MAX_NUM_CHANNELS];
+  int8_t lh_acode[MAX_NUM_CHANNELS];
   int current_lh;
 } per_sweep_data;
 
@@ -151,22 +184,62 @@ typedef struct {
   struct Lighthouse *lighthouse;  // Lighthouse reference...
 } OOTX;
 
+// Health counters kept for each tracker
+typedef enum {
+  METRIC_TRANSFERS        = 0,    // Interrupt transfers completed
+  METRIC_TRANSFER_ERRORS  = 1,    // Interrupt transfers failed or not resubmitted
+  METRIC_DECODE_FAULTS    = 2,    // Watchman light packets that failed to decode
+  METRIC_OOTX_FRAMES      = 3,    // OOTX frames received
+  METRIC_OOTX_CRC_ERRORS  = 4,    // OOTX frames discarded on a bad checksum
+  METRIC_SWEEPS           = 5,    // Light measurement bundles emitted
+  METRIC_DROPPED_SWEEPS   = 6,    // Sweeps discarded with no lighthouse yet
+  METRIC_IMU_SAMPLES      = 7,    // IMU measurements emitted
+  METRIC_OVERFLOWS        = 8,    // Records dropped by the queue
+  MAX_NUM_METRICS         = 9
+} MetricType;
+
+// Latency histogram in nanoseconds, with HISTOGRAM_SUB_BUCKETS log-linear
+// buckets per power of two, so that percentiles are within ~20%
+struct Histogram {
+  uint64_t count;                           // Number of samples
+  uint64_t total;                           // Sum of samples
+  uint64_t max;                             // Largest sample
+  uint32_t buckets[MAX_HISTOGRAM_BUCKETS];  // Sample counts
+};
+
+// Instrumentation for a tracker, only updated when the library is built
+// with DEEPDIVE_METRICS. Take a copy with deepdive_metrics().
+struct Metrics {
+  uint64_t counters[MAX_NUM_METRICS];       // Indexed by MetricType
+  struct Histogram usb_to_callback;         // Transfer completion -> callback
+};
+
 // Information about a tracked device
 struct Tracker {
   uint16_t type;                            // Tracker type
   struct Driver * driver;                   // Parent driver
+  struct libusb_device * dev;               // USB device
   struct libusb_device_handle * udev;       // Udev handle
   char serial[MAX_SERIAL_LENGTH];           // Serial number
   struct Endpoint endpoints[MAX_ENDPOINTS]; // USB endpoints
   struct Calibration cal;                   // Calibration data
   lightcap_data lcd;                        // Lightcap data
-  OOTX ootx[MAX_NUM_LIGHTHOUSES];           // OOTX data
+  OOTX ootx[MAX_NUM_CHANNELS];              // OOTX data for each sync slot
   uint8_t charge;                           // Current charge
   uint8_t ischarging:1;                     // Charging?
   uint8_t ison:1;                           // Turned on?
   uint8_t axis[3];                          // Gravitational axis
   uint8_t buttonmask;                       // Buttom mask
   uint32_t timecode;                        // Timecode of last update
+  struct Queue * queue;                     // Record queue
+  uint8_t done;                             // Configuration thread finished?
+  uint8_t ready;                            // Configuration complete?
+  uint8_t pushed;                           // Pushed to tracker callback?
+  uint8_t removed;                          // Device has been unplugged?
+  int inflight;                             // Transfers still submitted
+  uint16_t handle;                          // Slot in the driver
+  uint64_t received;                        // Completion time of packet (ns)
+  struct Metrics metrics;                   // Instrumentation
 };
 
 // Motor information
@@ -197,9 +270,10 @@ struct Motor {
 // Lighthouse information
 struct Lighthouse {
   uint32_t timestamp;                   // Time of last update (0 = invalud)
-  uint8_t id;                           // ID of this lighthouse
+  uint8_t id;                           // ID (handle) of this lighthouse
   uint16_t fw_version;                  // Firmware version
-  char serial[MAX_SERIAL_LENGTH];       // Unique serial number
+  uint32_t uid;                         // Unique serial number
+  char serial[MAX_SERIAL_LENGTH];       // Unique serial number, as a string
   struct Motor motors[MAX_NUM_MOTORS];  // Motor calibration data
   float accel[3];                       // acceleration vector
   uint8_t sys_unlock_count;             // Lowest 8 bits of desynchronization
@@ -230,25 +304,123 @@ typedef void (*but_func)(struct Tracker * tracker,
   uint32_t mask, uint16_t trigger, int16_t horizontal, int16_t vertical);
 typedef void (*tracker_func)(struct Tracker * tracker);
 typedef void (*lighthouse_func)(struct Lighthouse * lighthouse);
+typedef void (*pollfd_added_func)(int fd, short events, void * user);
+typedef void (*pollfd_removed_func)(int fd, void * user);
+
+// A batch of sweeps, stored as a structure of arrays. Sweep i contains the
+// pulses in the range [offset[i], offset[i] + count[i]). Trackers and
+// lighthouses are identified by their handles.
+struct LightBatch {
+  uint32_t num_sweeps;                      // Number of sweeps
+  uint16_t tracker[MAX_BATCH_SWEEPS];       // Tracker handle
+  uint8_t lighthouse[MAX_BATCH_SWEEPS];     // Lighthouse handle
+  uint8_t axis[MAX_BATCH_SWEEPS];           // Motor axis
+  uint32_t synctime[MAX_BATCH_SWEEPS];      // Sync pulse time
+  uint32_t offset[MAX_BATCH_SWEEPS];        // Index of first pulse
+  uint16_t count[MAX_BATCH_SWEEPS];         // Number of pulses
+  uint32_t num_pulses;                      // Number of pulses
+  uint16_t sensor[MAX_BATCH_PULSES];        // Sensor id
+  uint32_t sweeptime[MAX_BATCH_PULSES];     // Time of pulse
+  uint32_t angle[MAX_BATCH_PULSES];         // Angle in ticks
+  uint16_t length[MAX_BATCH_PULSES];        // Pulse length in ticks
+};
+
+// A batch of IMU measurements, stored as a structure of arrays
+struct ImuBatch {
+  uint32_t num;                             // Number of measurements
+  uint16_t tracker[MAX_BATCH_IMU];          // Tracker handle
+  uint32_t timecode[MAX_BATCH_IMU];         // Timecode (48MHz ticks)
+  int16_t acc[MAX_BATCH_IMU][3];            // Accelerometer
+  int16_t gyr[MAX_BATCH_IMU][3];            // Gyroscope
+  int16_t mag[MAX_BATCH_IMU][3];            // Magnetometer (if has_mag)
+  uint8_t has_mag[MAX_BATCH_IMU];           // Is there magnetometer data?
+};
+
+// Batched callbacks
+typedef void (*lig_batch_func)(struct Driver * drv,
+  const struct LightBatch * batch);
+typedef void (*imu_batch_func)(struct Driver * drv,
+  const struct ImuBatch * batch);
+
+// Open-addressing map from integer keys to small integer values
+struct Map {
+  uint32_t keys[MAP_SIZE];
+  int16_t vals[MAP_SIZE];
+  uint16_t deleted;                         // Number of tombstones
+};
 
 // Driver context
 struct Driver {
   struct libusb_context* usb;
-  uint16_t num_trackers;
-  struct Tracker *trackers[MAX_NUM_TRACKERS];
+  uint16_t num_trackers;                      // Slots used (may be NULL)
+  struct Tracker *trackers[MAX_NUM_TRACKERS]; // Tracker slots
+  pthread_mutex_t lock;                       // Protects the tracker slots
+  libusb_hotplug_callback_handle hotplug;     // Hotplug registration
+  uint8_t has_hotplug;                        // Is hotplug registered?
   lig_func lig_fn;               // Called when new light data arrives
   imu_func imu_fn;               // Called when new IMU data arrives
   but_func but_fn;               // Called when new button data arrives
   tracker_func tracker_fn;       // Called when tracker cal info is ready
+  tracker_func removed_fn;       // Called when a tracker is unplugged
   lighthouse_func lighthouse_fn; // Called when lighthouse cal info is ready
-  struct Lighthouse lighthouses[MAX_NUM_LIGHTHOUSES];
+  lig_batch_func lig_batch_fn;   // Called with all light data from a poll
+  imu_batch_func imu_batch_fn;   // Called with all IMU data from a poll
+  pollfd_added_func pollfd_added_fn;     // Called when a descriptor is added
+  pollfd_removed_func pollfd_removed_fn; // Called when one is removed
+  void * pollfd_user;                    // Passed to the descriptor callbacks
+  struct LightBatch * lig_batch; // Light data accumulated during this poll
+  struct ImuBatch * imu_batch;   // IMU data accumulated during this poll
+  struct Lighthouse * lighthouses[MAX_NUM_LIGHTHOUSES / LIGHTHOUSE_BLOCK];
+  uint8_t num_lighthouses;       // Number of lighthouses seen
+  struct Map lighthouse_map;     // Lighthouse uid -> lighthouse index
+  struct Map tracker_map;        // Hashed tracker serial -> tracker slot
   struct General general;        // General configuration
-  uint8_t pushed;                // Have we pushed thie tracker/general config
+  int configuring;               // Number of trackers being configured
+  uint8_t threaded;              // Is a USB thread handling events?
+  struct EventThread * thread;   // USB event thread, while threaded
+  struct Doorbell * doorbell;    // Rung when queued data is pending
+  struct Capture * capture;      // Raw packet log being written, if any
+  struct Replay * replay;        // Raw packet log being replayed, if any
 };
 
-// Initialize the driver
+// Threading contract:
+// - Decoding state is kept per tracker, so packets from different trackers
+//   may be decoded concurrently. Packets for one tracker must be decoded in
+//   order by one thread at a time, which libusb guarantees per endpoint.
+// - The lighthouse table is shared, and is only grown under drv->lock. It
+//   is allocated LIGHTHOUSE_BLOCK entries at a time, and entries never move.
+// - A tracker decodes up to MAX_NUM_CHANNELS lighthouses at once, one for
+//   each sync slot, but the driver can see up to MAX_NUM_LIGHTHOUSES.
+// - Each tracker's queue pointer is stored with release and loaded with
+//   acquire semantics, as producers on configuration threads may read it.
+//   Queues are only freed on the thread that handles hotplug events, either
+//   while drv->configuring is zero or once the tracker has nothing in flight.
+// - The light and IMU batches are shared by all trackers. While they are
+//   installed every tracker queues its data, and the batches are only
+//   appended to while draining queues on the polling thread.
+// - Callbacks are only ever called from the thread calling deepdive_poll*,
+//   which must be a single thread. They must not call deepdive_close.
+// - Tracker and lighthouse pointers passed to callbacks remain valid until
+//   removed_fn has returned for that tracker, or until deepdive_close.
+// - The lighthouse passed to lighthouse_fn is a copy of the calibration at
+//   the time it was decoded, and is only valid during the callback.
+
+// Initialize the driver. If DEEPDIVE_CAPTURE is set to a file path then
+// raw packets are logged to it, as for deepdive_init_capture. Returns NULL
+// if no devices are found, unless libusb can report devices plugged in
+// later, in which case the driver waits for them.
 struct Driver * deepdive_init();
 
+// Initialize the driver, logging the configuration blob and every raw
+// endpoint buffer of each device to a file if path is not NULL
+struct Driver * deepdive_init_capture(const char * path);
+
+// Initialize the driver from a file written by deepdive_init_capture. The
+// packets are fed through the same decoders, either as fast as the driver
+// is polled or at the rate they were captured, if realtime is non-zero.
+// Polling returns a negative number once the end of the file is reached.
+struct Driver * deepdive_init_replay(const char * path, int realtime);
+
 // Register a light callback function
 void deepdive_install_light_fn(struct Driver * drv, lig_func fbp);
 
@@ -264,18 +436,102 @@ void deepdive_install_tracker_fn(struct Driver * drv, tracker_func fbp);
 // Register a lighthouse callback function
 void deepdive_install_lighthouse_fn(struct Driver * drv, lighthouse_func fbp);
 
+// Register a batched light callback function, which is called at most once
+// per poll with all sweeps since the last poll. It replaces the light fn.
+// From then on data is queued per tracker, even without a USB thread.
+int deepdive_install_light_batch_fn(struct Driver * drv, lig_batch_func fbp);
+
+// Register a batched IMU callback function, which is called at most once
+// per poll with all measurements since the last poll. It replaces the IMU fn.
+int deepdive_install_imu_batch_fn(struct Driver * drv, imu_batch_func fbp);
+
+// Register a callback for trackers that have been unplugged. The tracker
+// memory is released as soon as the callback returns.
+void deepdive_install_removed_fn(struct Driver * drv, tracker_func fbp);
+
 // Get the general configuration data
 struct General * deepdive_general(struct Driver * drv);
 
 // Get the calibration data for the lighthouse with the given serial number
 struct Lighthouse * deepdive_lighthouse(struct Driver * drv, const char* id);
 
+// Get the calibration data for the lighthouse with the given numeric serial
+struct Lighthouse * deepdive_lighthouse_by_serial(struct Driver * drv,
+  uint32_t uid);
+
+// Get the calibration data for a lighthouse by its handle (id)
+struct Lighthouse * deepdive_lighthouse_by_handle(struct Driver * drv,
+  uint8_t handle);
+
 // Get the calibration data for a tracker with the given serial number
 struct Tracker * deepdive_tracker(struct Driver * tracker, const char* id);
 
+// Get a tracker by its handle. Handles of removed trackers may be reused.
+struct Tracker * deepdive_tracker_by_handle(struct Driver * drv,
+  uint16_t handle);
+
 // Poll the driver for events
 int deepdive_poll(struct Driver * drv);
 
+// Start a thread to handle USB events. From this point on decoded data is
+// queued per tracker, and callbacks are only called from deepdive_poll*.
+// deepdive_poll and deepdive_poll_timeout block until data is pending, and
+// deepdive_get_pollfds returns one descriptor that is readable when it is.
+int deepdive_start(struct Driver * drv);
+
+// Stop the USB thread and return to calling back from the event loop
+void deepdive_stop(struct Driver * drv);
+
+// Deliver pending data without blocking. In threaded mode this returns the
+// number of records delivered, or a negative number once a replay is done,
+// otherwise the libusb error code.
+int deepdive_poll_nonblock(struct Driver * drv);
+
+// Copy up to max USB file descriptors into fds for use in an external event
+// loop. Returns the total number of descriptors, which is more than max if
+// they did not all fit: grow fds and call again. Passing a NULL fds with a
+// zero max just counts them. The set changes as devices are plugged in and
+// removed, so it is only a snapshot: install the descriptor callbacks to
+// find out when it changes. In threaded mode the set is a single descriptor
+// that never changes while the thread runs.
+int deepdive_get_pollfds(struct Driver * drv, struct pollfd * fds, int max);
+
+// Register callbacks for descriptors being added to or removed from the set
+// returned by deepdive_get_pollfds, along with a pointer passed to them. They
+// are not called for descriptors that already exist, so fetch the set after
+// installing them. They may be called from any driver thread, including the
+// ones that configure hotplugged devices. Pass NULLs to remove them.
+int deepdive_install_pollfd_fns(struct Driver * drv,
+  pollfd_added_func added, pollfd_removed_func removed, void * user);
+
+// Get the time until the driver next needs servicing, even if no file
+// descriptor becomes ready. Returns 1 if tv was set, 0 if there is no
+// pending timeout, and a negative number on error.
+int deepdive_get_timeout(struct Driver * drv, struct timeval * tv);
+
+// Service events, blocking for at most usec microseconds
+int deepdive_poll_timeout(struct Driver * drv, uint32_t usec);
+
+// Service events after an external event loop signals that a descriptor is
+// ready or the timeout has expired. This never blocks.
+int deepdive_events_ready(struct Driver * drv);
+
+// Get the number of records dropped for a tracker in threaded mode
+uint32_t deepdive_overflows(struct Tracker * tracker);
+
+// Get the number of records delivered for a tracker by the last poll
+uint32_t deepdive_lastcount(struct Tracker * tracker);
+
+// Whether the library was built with DEEPDIVE_METRICS
+int deepdive_metrics_enabled(void);
+
+// Copy the instrumentation for a tracker. Returns 0 on success, or -1 if
+// the library was built without DEEPDIVE_METRICS.
+int deepdive_metrics(struct Tracker * tracker, struct Metrics * metrics);
+
+// Get the latency in nanoseconds below which a fraction p of samples fall
+uint64_t deepdive_histogram_percentile(const struct Histogram * h, double p);
+
 // Close the driver and clean up memory
 void deepdive_close(struct Driver * drv);
 
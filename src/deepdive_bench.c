@@ -0,0 +1,604 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+// Micro-benchmarks for the hot decoding paths. These run without hardware,
+// and print one "name key=value ..." line per benchmark so that the output
+// can be compared between builds. Raw packet captures that are passed on
+// the command line are replayed as fast as possible, and then decoded by
+// both the library and the original decoders to check that the two agree.
+
+#include <time.h>
+#include <zlib.h>
+
+#include <deepdive.h>
+
+#include "deepdive_bench_reference.h"
+#include "deepdive_capture.h"
+#include "deepdive_data_light.h"
+#include "deepdive_dev_tracker.h"
+#include "deepdive_dev_watchman.h"
+#include "deepdive_usb.h"
+
+// Number of synthetic lighthouse cycles to decode
+#define BENCH_CYCLES 200000
+
+// Ticks of the 48MHz clock between sync pulses
+#define BENCH_PERIOD 400000
+
+// Number of repeats when timing a single call
+#define BENCH_REPEATS 1000000
+
+// Serial number of the synthetic lighthouse
+#define BENCH_UID 0x12345678
+
+// Length of the synthetic OOTX payload, which is padded to an even length
+#define BENCH_OOTX_LEN 33
+
+// Output checksum, so the compiler cannot discard the work
+static uint64_t checksum_ = 0;
+static uint64_t bundles_ = 0;
+static uint64_t samples_ = 0;
+static uint64_t frames_ = 0;
+
+// Bits of one OOTX frame, which are carried by successive sync pulses
+static uint8_t ootx_bits_[1024];
+static uint32_t num_ootx_bits_ = 0;
+
+// Get the current time in nanoseconds
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Serialize an OOTX frame : a preamble of seventeen zeros and a one, then
+// the little-endian length, the payload and the little-endian CRC32. These
+// are sent most significant bit first in 16 bit words, each of which is
+// followed by a sync bit.
+static void bench_ootx_init(void) {
+  uint8_t frame[2 + BENCH_OOTX_LEN + 1 + 4];
+  memset(frame, 0, sizeof(frame));
+  frame[0] = BENCH_OOTX_LEN & 0xff;
+  frame[1] = BENCH_OOTX_LEN >> 8;
+  uint8_t * payload = &frame[2];
+  uint32_t uid = BENCH_UID;
+  for (int i = 0; i < BENCH_OOTX_LEN; i++)
+    payload[i] = (uint8_t)(0x11 * i);
+  memcpy(payload + 0x02, &uid, sizeof(uid));
+  uint32_t crc = crc32(crc32(0L, Z_NULL, 0), payload, BENCH_OOTX_LEN);
+  for (int i = 0; i < 4; i++)
+    frame[2 + BENCH_OOTX_LEN + 1 + i] = (crc >> (8 * i)) & 0xff;
+  num_ootx_bits_ = 0;
+  for (int i = 0; i < PREAMBLE_LENGTH; i++)
+    ootx_bits_[num_ootx_bits_++] = 0;
+  ootx_bits_[num_ootx_bits_++] = 1;
+  for (int w = 0; w < (int)sizeof(frame); w += 2) {
+    for (int b = 0; b < 16; b++)
+      ootx_bits_[num_ootx_bits_++] = (frame[w + b / 8] >> (7 - b % 8)) & 1;
+    ootx_bits_[num_ootx_bits_++] = 1;
+  }
+}
+
+// Acode of the sync pulse in some cycle, holding the axis and an OOTX bit
+static uint16_t sync_length(uint32_t c) {
+  int acode = (c & 1) | (ootx_bits_[c % num_ootx_bits_] << 1);
+  return 3000 + 500 * acode;
+}
+
+// Fold the light bundle into the checksum
+static void bench_light_fn(struct Tracker * tracker,
+  struct Lighthouse * lighthouse, uint8_t axis, uint32_t synctime,
+    uint16_t num_sensors, uint16_t *sensors, uint32_t *sweeptimes,
+      uint32_t *angles, uint16_t *lengths) {
+  bundles_++;
+  for (uint16_t i = 0; i < num_sensors; i++)
+    checksum_ = checksum_ * 31 + sensors[i] + angles[i] + lengths[i];
+}
+
+// Count lighthouse calibrations decoded from OOTX frames
+static void bench_lighthouse_fn(struct Lighthouse * lighthouse) {
+  frames_++;
+}
+
+// Fold the IMU measurement into the checksum
+static void bench_imu_fn(struct Tracker * tracker, uint32_t timecode,
+  int16_t acc[3], int16_t gyr[3], int16_t mag[3]) {
+  samples_++;
+  checksum_ = checksum_ * 31 + timecode + acc[0] + acc[1] + acc[2]
+    + gyr[0] + gyr[1] + gyr[2];
+}
+
+// Create a tracker whose decoded data goes straight to the callbacks above,
+// and which has already received the OOTX of the synthetic lighthouse
+static struct Tracker * bench_tracker(void) {
+  struct Driver * drv = calloc(1, sizeof(struct Driver));
+  struct Tracker * tracker = calloc(1, sizeof(struct Tracker));
+  struct Lighthouse * block = calloc(LIGHTHOUSE_BLOCK, sizeof(struct Lighthouse));
+  if (!drv || !tracker || !block) {
+    free(drv);
+    free(tracker);
+    free(block);
+    return NULL;
+  }
+  drv->lig_fn = bench_light_fn;
+  drv->imu_fn = bench_imu_fn;
+  drv->lighthouse_fn = bench_lighthouse_fn;
+  drv->lighthouses[0] = block;
+  drv->lighthouses[0][0].uid = BENCH_UID;
+  drv->num_lighthouses = 1;
+  tracker->driver = drv;
+  tracker->ootx[0].lighthouse = &drv->lighthouses[0][0];
+  checksum_ = 0;
+  bundles_ = 0;
+  samples_ = 0;
+  frames_ = 0;
+  return tracker;
+}
+
+static void bench_free(struct Tracker * tracker) {
+  free(tracker->driver->lighthouses[0]);
+  free(tracker->driver);
+  free(tracker);
+}
+
+// Write one 8-byte lightcap entry into a tracker packet
+static void put_entry(uint8_t * buf, int i,
+  uint16_t sensor, uint16_t length, uint32_t timecode) {
+  memcpy(&buf[i*8+1], &sensor, sizeof(sensor));
+  memcpy(&buf[i*8+3], &length, sizeof(length));
+  memcpy(&buf[i*8+5], &timecode, sizeof(timecode));
+}
+
+// Decode synthetic tracker lightcap packets : one sync pulse followed by
+// a sweep that hits half of the sensors, alternating between axes
+static int bench_light(void) {
+  struct Tracker * tracker = bench_tracker();
+  if (!tracker)
+    return -1;
+
+  // Sensors hit by the sweep, in packets of seven entries
+  const int hits = MAX_NUM_SENSORS / 2;
+  uint8_t buf[64];
+  uint64_t packets = 0;
+  uint64_t t0 = now();
+  uint32_t tc = 1000000;
+  for (uint32_t c = 0; c < BENCH_CYCLES; c++) {
+    memset(buf, 0xff, sizeof(buf));
+    put_entry(buf, 0, 0, sync_length(c), tc);
+    deepdive_dev_tracker_light(tracker, buf, sizeof(buf));
+    packets++;
+    for (int s = 0; s < hits; s += 7) {
+      memset(buf, 0xff, sizeof(buf));
+      for (int i = 0; i < 7 && s + i < hits; i++) {
+        int sensor = (2 * (s + i) + c) % MAX_NUM_SENSORS;
+        put_entry(buf, i, sensor, 100 + sensor,
+          tc + 100000 + 1000 * (s + i) + (c & 0xff));
+      }
+      deepdive_dev_tracker_light(tracker, buf, sizeof(buf));
+      packets++;
+    }
+    tc += BENCH_PERIOD;
+  }
+  uint64_t t1 = now();
+  printf("light packets=%lu bundles=%lu frames=%lu ns_per_packet=%.3f"
+    " checksum=%016lx\n", (unsigned long)packets, (unsigned long)bundles_,
+    (unsigned long)frames_, (double)(t1 - t0) / (double)packets,
+    (unsigned long)checksum_);
+  bench_free(tracker);
+  return 0;
+}
+
+// Decode a stream of sync pulses alone, which feeds the OOTX decoder one
+// bit at a time. Every frame that passes its CRC updates the lighthouse.
+static int bench_ootx(void) {
+  struct Tracker * tracker = bench_tracker();
+  if (!tracker)
+    return -1;
+  uint32_t bits = 10000 * num_ootx_bits_;
+  uint32_t tc = 1000000;
+  uint64_t t0 = now();
+  for (uint32_t c = 0; c < bits; c++) {
+    deepdive_data_light(tracker, tc, 0, sync_length(c));
+    tc += BENCH_PERIOD;
+  }
+  uint64_t t1 = now();
+  printf("ootx bits=%u frames=%lu ns_per_bit=%.3f\n", bits,
+    (unsigned long)frames_, (double)(t1 - t0) / (double)bits);
+  bench_free(tracker);
+  return (frames_ ? 0 : -1);
+}
+
+// Time the processing of the sweep measurements that follows every sync
+// pulse, as a function of the number of sensors that saw the sweep. The
+// sweep data is restored before each call, which is included in the time.
+static int bench_measurements(int num_sensors) {
+  struct Tracker * tracker = bench_tracker();
+  if (!tracker)
+    return -1;
+  lightcaps_sweep_data sweep;
+  memset(&sweep, 0, sizeof(sweep));
+  for (int i = 0; i < num_sensors; i++) {
+    int sensor = (i * 7) % MAX_NUM_SENSORS;
+    sweep.active |= (1u << sensor);
+    sweep.sweep_time[sensor] = 1100000 + 1000 * i;
+    sweep.sweep_len[sensor] = 100 + sensor;
+  }
+  tracker->lcd.per_sweep.activeLighthouse = 0;
+  tracker->lcd.per_sweep.activeSweepStartTime = 1000000;
+  uint64_t t0 = now();
+  for (uint32_t r = 0; r < BENCH_REPEATS; r++) {
+    tracker->lcd.sweep = sweep;
+    tracker->lcd.per_sweep.activeAcode = r & 1;
+    handle_measurements(tracker);
+  }
+  uint64_t t1 = now();
+  printf("measurements sensors=%d bundles=%lu ns=%.3f\n", num_sensors,
+    (unsigned long)bundles_, (double)(t1 - t0) / (double)BENCH_REPEATS);
+  bench_free(tracker);
+  return (bundles_ == BENCH_REPEATS ? 0 : -1);
+}
+
+// Write an "arcane" value into a watchman packet. It is read backwards, so
+// the most significant seven bits come last and the marked byte first.
+static int put_arcane(uint8_t * buf, uint32_t value) {
+  int n = 0;
+  buf[n++] = 0x80 | (value & 0x7f);
+  for (value >>= 7; value; value >>= 7)
+    buf[n++] = value & 0x7f;
+  return n;
+}
+
+// Write a watchman light packet for some pulses, the latest first, that do
+// not overlap. The sensor ids are followed by the deltas back in time from
+// the end of the latest pulse, and then the low bytes of that time.
+static void put_watchman_light(uint8_t * buf, int n,
+  const uint8_t * sensors, const uint32_t * starts, const uint16_t * lengths) {
+  uint32_t times[2 * 10];
+  for (int i = 0; i < n; i++) {
+    times[2 * i + 0] = starts[i] + lengths[i];
+    times[2 * i + 1] = starts[i];
+  }
+  uint8_t * p = &buf[4];
+  for (int i = 0; i < n; i++)
+    *(p++) = sensors[i] << 3;
+  for (int i = 2 * n - 1; i > 0; i--)
+    p += put_arcane(p, times[i - 1] - times[i]);
+  *(p++) = times[0] & 0xff;
+  *(p++) = (times[0] >> 8) & 0xff;
+  *(p++) = (times[0] >> 16) & 0xff;
+  buf[0] = 35;
+  buf[1] = times[0] >> 24;
+  buf[2] = (p - &buf[4]) + 1;
+  buf[3] = 0;
+}
+
+// Write a watchman IMU packet
+static void put_watchman_imu(uint8_t * buf, uint32_t tc, int16_t v) {
+  int16_t data[6] = { v, -v, 2048, v >> 1, -(v >> 1), 0 };
+  buf[0] = 35;
+  buf[1] = tc >> 24;
+  buf[2] = 15;
+  buf[3] = (tc >> 16) & 0xff;
+  buf[4] = 0xe8;
+  buf[5] = tc & 0xff;
+  memcpy(&buf[6], data, sizeof(data));
+}
+
+// Decode synthetic watchman packets : two IMU samples and one sync pulse
+// per cycle, then a sweep that hits half of the sensors in two packets. The
+// first sensor in a packet must not look like a packet type.
+static int bench_watchman(void) {
+  struct Tracker * tracker = bench_tracker();
+  if (!tracker)
+    return -1;
+  const int hits = 14;
+  uint8_t buf[64], sensors[7];
+  uint32_t starts[7];
+  uint16_t lengths[7];
+  uint64_t packets = 0;
+  uint32_t tc = 1000000;
+  uint64_t t0 = now();
+  for (uint32_t c = 0; c < BENCH_CYCLES; c++) {
+    for (int i = 0; i < 2; i++) {
+      memset(buf, 0, sizeof(buf));
+      put_watchman_imu(buf, tc + i * 200000, c + i);
+      deepdive_dev_watchman(tracker, buf, sizeof(buf));
+      packets++;
+    }
+    memset(buf, 0, sizeof(buf));
+    sensors[0] = 0;
+    starts[0] = tc;
+    lengths[0] = sync_length(c);
+    put_watchman_light(buf, 1, sensors, starts, lengths);
+    deepdive_dev_watchman(tracker, buf, sizeof(buf));
+    packets++;
+    for (int s = 0; s < hits; s += 7) {
+      for (int i = 0; i < 7; i++) {
+        int h = s + 6 - i;
+        sensors[i] = 2 * h + (c & 1);
+        starts[i] = tc + 100000 + 1000 * h + (c & 0xff);
+        lengths[i] = 100 + sensors[i];
+      }
+      memset(buf, 0, sizeof(buf));
+      put_watchman_light(buf, 7, sensors, starts, lengths);
+      deepdive_dev_watchman(tracker, buf, sizeof(buf));
+      packets++;
+    }
+    tc += BENCH_PERIOD;
+  }
+  uint64_t t1 = now();
+  printf("watchman packets=%lu bundles=%lu samples=%lu frames=%lu"
+    " ns_per_packet=%.3f checksum=%016lx\n", (unsigned long)packets,
+    (unsigned long)bundles_, (unsigned long)samples_, (unsigned long)frames_,
+    (double)(t1 - t0) / (double)packets, (unsigned long)checksum_);
+  bench_free(tracker);
+  return (bundles_ ? 0 : -1);
+}
+
+// Replay a raw packet capture through the full decode path
+static int bench_replay(const char * path) {
+  uint64_t t0 = now();
+  struct Driver * drv = deepdive_init_replay(path, 0);
+  if (!drv)
+    return -1;
+  deepdive_install_light_fn(drv, bench_light_fn);
+  deepdive_install_imu_fn(drv, bench_imu_fn);
+  checksum_ = 0;
+  bundles_ = 0;
+  uint64_t polls = 0;
+  while (deepdive_poll(drv) == 0)
+    polls++;
+  deepdive_close(drv);
+  uint64_t t1 = now();
+  printf("replay file=%s polls=%lu bundles=%lu ms=%.3f checksum=%016lx\n",
+    path, (unsigned long)polls, (unsigned long)bundles_,
+    (double)(t1 - t0) / 1e6, (unsigned long)checksum_);
+  return 0;
+}
+
+// Fingerprints of the events decoded from a capture, in order
+struct Events {
+  uint32_t * crcs;
+  size_t num;
+  size_t max;
+};
+
+// Where the compare callbacks below append their events
+static struct Events * events_ = NULL;
+
+// Append the fingerprint of an event
+static void events_push(uint32_t crc) {
+  if (events_->num == events_->max) {
+    size_t max = (events_->max ? 2 * events_->max : 4096);
+    uint32_t * crcs = realloc(events_->crcs, max * sizeof(uint32_t));
+    if (!crcs)
+      return;
+    events_->crcs = crcs;
+    events_->max = max;
+  }
+  events_->crcs[events_->num++] = crc;
+}
+
+// Fold some data into a fingerprint
+static uint32_t fold(uint32_t crc, const void * data, size_t len) {
+  return crc32(crc, (const Bytef *) data, len);
+}
+
+// Fingerprint of the start of an event of some kind from some tracker
+static uint32_t fold_start(uint8_t kind, struct Tracker * tracker) {
+  uint32_t crc = fold(crc32(0L, Z_NULL, 0), &kind, sizeof(kind));
+  return fold(crc, tracker->serial, strlen(tracker->serial));
+}
+
+// Record a light bundle
+static void compare_light_fn(struct Tracker * tracker,
+  struct Lighthouse * lighthouse, uint8_t axis, uint32_t synctime,
+    uint16_t num_sensors, uint16_t *sensors, uint32_t *sweeptimes,
+      uint32_t *angles, uint16_t *lengths) {
+  uint32_t crc = fold_start(0, tracker);
+  crc = fold(crc, lighthouse->serial, strlen(lighthouse->serial));
+  crc = fold(crc, &axis, sizeof(axis));
+  crc = fold(crc, &synctime, sizeof(synctime));
+  crc = fold(crc, &num_sensors, sizeof(num_sensors));
+  crc = fold(crc, sensors, num_sensors * sizeof(uint16_t));
+  crc = fold(crc, sweeptimes, num_sensors * sizeof(uint32_t));
+  crc = fold(crc, angles, num_sensors * sizeof(uint32_t));
+  crc = fold(crc, lengths, num_sensors * sizeof(uint16_t));
+  events_push(crc);
+}
+
+// Record an IMU measurement
+static void compare_imu_fn(struct Tracker * tracker, uint32_t timecode,
+  int16_t acc[3], int16_t gyr[3], int16_t mag[3]) {
+  uint32_t crc = fold_start(1, tracker);
+  crc = fold(crc, &timecode, sizeof(timecode));
+  crc = fold(crc, acc, 3 * sizeof(int16_t));
+  crc = fold(crc, gyr, 3 * sizeof(int16_t));
+  events_push(crc);
+}
+
+// Record a button event
+static void compare_button_fn(struct Tracker * tracker,
+  uint32_t mask, uint16_t trigger, int16_t horizontal, int16_t vertical) {
+  uint32_t crc = fold_start(2, tracker);
+  crc = fold(crc, &mask, sizeof(mask));
+  crc = fold(crc, &trigger, sizeof(trigger));
+  crc = fold(crc, &horizontal, sizeof(horizontal));
+  crc = fold(crc, &vertical, sizeof(vertical));
+  events_push(crc);
+}
+
+// Record a lighthouse calibration
+static void compare_lighthouse_fn(struct Lighthouse * lighthouse) {
+  uint8_t kind = 3;
+  uint32_t crc = fold(crc32(0L, Z_NULL, 0), &kind, sizeof(kind));
+  crc = fold(crc, lighthouse->serial, strlen(lighthouse->serial));
+  crc = fold(crc, &lighthouse->timestamp, sizeof(lighthouse->timestamp));
+  crc = fold(crc, &lighthouse->fw_version, sizeof(lighthouse->fw_version));
+  crc = fold(crc, lighthouse->motors, sizeof(lighthouse->motors));
+  crc = fold(crc, lighthouse->accel, sizeof(lighthouse->accel));
+  crc = fold(crc, &lighthouse->sys_unlock_count, sizeof(uint8_t));
+  crc = fold(crc, &lighthouse->hw_version, sizeof(uint8_t));
+  crc = fold(crc, &lighthouse->mode_current, sizeof(uint8_t));
+  crc = fold(crc, &lighthouse->sys_faults, sizeof(uint8_t));
+  events_push(crc);
+}
+
+// Decode a capture with the original decoders. The configuration is still
+// loaded by the library, as only the decoders are being compared.
+static int compare_reference(const char * path) {
+  FILE * file = fopen(path, "rb");
+  if (!file)
+    return -1;
+  struct CaptureHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, file) != 1
+    || hdr.magic != CAPTURE_MAGIC || hdr.version != CAPTURE_VERSION) {
+    fclose(file);
+    return -2;
+  }
+  struct Driver * drv = calloc(1, sizeof(struct Driver));
+  uint8_t * data = malloc(CAPTURE_MAX_LENGTH);
+  if (!drv || !data) {
+    free(drv);
+    free(data);
+    fclose(file);
+    return -3;
+  }
+  drv->lig_fn = compare_light_fn;
+  drv->imu_fn = compare_imu_fn;
+  drv->but_fn = compare_button_fn;
+  drv->lighthouse_fn = compare_lighthouse_fn;
+  deepdive_bench_reference_reset();
+  struct Tracker * trackers[MAX_NUM_TRACKERS] = {NULL};
+  struct CaptureRecord rec;
+  int ret = 0;
+  while (fread(&rec, sizeof(rec), 1, file) == 1) {
+    if (rec.length > CAPTURE_MAX_LENGTH
+      || (rec.length && fread(data, rec.length, 1, file) != 1)) {
+      ret = -4;
+      break;
+    }
+    if (rec.tracker >= MAX_NUM_TRACKERS)
+      continue;
+    struct Tracker ** tracker = &trackers[rec.tracker];
+    switch (rec.kind) {
+     case CAPTURE_CONFIG: {
+      struct CaptureDevice dev;
+      if (rec.length < sizeof(dev))
+        break;
+      memcpy(&dev, data, sizeof(dev));
+      dev.serial[MAX_SERIAL_LENGTH - 1] = '\0';
+      free(*tracker);
+      *tracker = calloc(1, sizeof(struct Tracker));
+      if (!*tracker)
+        break;
+      (*tracker)->driver = drv;
+      (*tracker)->type = dev.type;
+      memcpy((*tracker)->serial, dev.serial, MAX_SERIAL_LENGTH);
+      if (deepdive_usb_config(*tracker, data + sizeof(dev),
+        rec.length - sizeof(dev)) < 0) {
+        free(*tracker);
+        *tracker = NULL;
+      }
+      break;
+     }
+     case CAPTURE_PACKET:
+      if (*tracker && rec.length <= USB_INT_BUFF_LENGTH)
+        deepdive_bench_reference_decode(*tracker, rec.type, data, rec.length);
+      break;
+     case CAPTURE_REMOVED:
+      free(*tracker);
+      *tracker = NULL;
+      break;
+    }
+  }
+  for (size_t i = 0; i < MAX_NUM_TRACKERS; i++)
+    free(trackers[i]);
+  free(data);
+  free(drv);
+  fclose(file);
+  return ret;
+}
+
+// Check that a capture decodes to exactly the same events with the library
+// as it does with the original decoders
+static int bench_compare(const char * path) {
+  struct Events lib = {NULL, 0, 0};
+  struct Events ref = {NULL, 0, 0};
+  struct Driver * drv = deepdive_init_replay(path, 0);
+  if (!drv)
+    return -1;
+  deepdive_install_light_fn(drv, compare_light_fn);
+  deepdive_install_imu_fn(drv, compare_imu_fn);
+  deepdive_install_button_fn(drv, compare_button_fn);
+  deepdive_install_lighthouse_fn(drv, compare_lighthouse_fn);
+  events_ = &lib;
+  while (deepdive_poll(drv) == 0) {}
+  deepdive_close(drv);
+  events_ = &ref;
+  int ret = compare_reference(path);
+  events_ = NULL;
+  size_t mismatches = 0;
+  long first = -1;
+  for (size_t i = 0; i < lib.num || i < ref.num; i++) {
+    if (i < lib.num && i < ref.num && lib.crcs[i] == ref.crcs[i])
+      continue;
+    if (first < 0)
+      first = i;
+    mismatches++;
+  }
+  printf("compare file=%s events=%lu reference=%lu mismatches=%lu first=%ld\n",
+    path, (unsigned long)lib.num, (unsigned long)ref.num,
+    (unsigned long)mismatches, first);
+  free(lib.crcs);
+  free(ref.crcs);
+  return (ret || mismatches ? -1 : 0);
+}
+
+int main(int argc, char *argv[]) {
+  int ret = 0;
+  bench_ootx_init();
+  if (bench_light())
+    ret = 1;
+  if (bench_ootx())
+    ret = 1;
+  if (bench_measurements(4) || bench_measurements(16)
+      || bench_measurements(MAX_NUM_SENSORS))
+    ret = 1;
+  if (bench_watchman())
+    ret = 1;
+  for (int i = 1; i < argc; i++)
+    if (bench_replay(argv[i]) || bench_compare(argv[i]))
+      ret = 1;
+  return ret;
+}
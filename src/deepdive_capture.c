@@ -0,0 +1,331 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "deepdive_capture.h"
+#include "deepdive_usb.h"
+#include "deepdive_queue.h"
+#include "deepdive_metrics.h"
+
+#include <time.h>
+
+// Size of the capture write buffer
+#define CAPTURE_BUFFER_SIZE   (1 << 20)
+
+// Number of records replayed per poll when not replaying in real time
+#define REPLAY_CHUNK          1024
+
+// Capture state
+struct Capture {
+  FILE * file;
+  char * buffer;
+};
+
+// Replay state
+struct Replay {
+  FILE * file;
+  int realtime;                             // Replay at the captured rate?
+  int synced;                               // Is the time offset known?
+  int pending;                              // Has a record been read?
+  uint64_t offset;                          // Capture to local time offset
+  struct CaptureRecord rec;                 // Next record
+  uint8_t data[CAPTURE_MAX_LENGTH];         // Next record payload
+  struct Tracker * trackers[MAX_NUM_TRACKERS];  // Captured handle -> tracker
+};
+
+// Get the monotonic time in microseconds
+static uint64_t now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+// CAPTURE
+
+// Append a record. This may be called from configuration threads as well
+// as the event thread, so the header and payload are written atomically.
+static void capture_write(struct Capture * cap, uint16_t tracker,
+  CaptureKind kind, uint8_t type, const void * a, uint32_t alen,
+  const void * b, uint32_t blen) {
+  struct CaptureRecord rec;
+  rec.usec = now_usec();
+  rec.length = alen + blen;
+  rec.tracker = tracker;
+  rec.kind = kind;
+  rec.type = type;
+  flockfile(cap->file);
+  fwrite(&rec, sizeof(rec), 1, cap->file);
+  if (alen)
+    fwrite(a, alen, 1, cap->file);
+  if (blen)
+    fwrite(b, blen, 1, cap->file);
+  funlockfile(cap->file);
+}
+
+// Start logging raw packets to a file
+int deepdive_capture_open(struct Driver * drv, const char * path) {
+  if (!drv || !path || drv->capture)
+    return -1;
+  struct Capture * cap = malloc(sizeof(struct Capture));
+  if (!cap)
+    return -2;
+  cap->buffer = malloc(CAPTURE_BUFFER_SIZE);
+  cap->file = fopen(path, "wb");
+  if (!cap->buffer || !cap->file) {
+    printf("Could not open capture file %s\n", path);
+    if (cap->file)
+      fclose(cap->file);
+    free(cap->buffer);
+    free(cap);
+    return -3;
+  }
+  setvbuf(cap->file, cap->buffer, _IOFBF, CAPTURE_BUFFER_SIZE);
+  struct CaptureHeader hdr = {CAPTURE_MAGIC, CAPTURE_VERSION};
+  fwrite(&hdr, sizeof(hdr), 1, cap->file);
+  drv->capture = cap;
+  return 0;
+}
+
+// Log the compressed configuration blob downloaded from a tracker
+void deepdive_capture_config(struct Tracker * tracker, const char * serial,
+  const uint8_t * data, uint32_t len) {
+  struct Capture * cap = tracker->driver->capture;
+  if (!cap)
+    return;
+  struct CaptureDevice dev;
+  memset(&dev, 0, sizeof(dev));
+  dev.type = tracker->type;
+  strncpy(dev.serial, serial, MAX_SERIAL_LENGTH - 1);
+  if (len > CAPTURE_MAX_LENGTH - sizeof(dev))
+    return;
+  capture_write(cap, tracker->handle, CAPTURE_CONFIG, 0,
+    &dev, sizeof(dev), data, len);
+}
+
+// Log a raw endpoint buffer
+void deepdive_capture_packet(struct Tracker * tracker, CallbackType type,
+  const uint8_t * data, uint8_t len) {
+  struct Capture * cap = tracker->driver->capture;
+  if (!cap)
+    return;
+  capture_write(cap, tracker->handle, CAPTURE_PACKET, type,
+    data, len, NULL, 0);
+}
+
+// Log the removal of a tracker
+void deepdive_capture_removed(struct Tracker * tracker) {
+  struct Capture * cap = tracker->driver->capture;
+  if (!cap)
+    return;
+  capture_write(cap, tracker->handle, CAPTURE_REMOVED, 0, NULL, 0, NULL, 0);
+}
+
+// REPLAY
+
+// Open a raw packet log for replay, optionally at the captured rate
+int deepdive_replay_open(struct Driver * drv, const char * path,
+  int realtime) {
+  if (!drv || !path || drv->replay)
+    return -1;
+  struct Replay * rep = malloc(sizeof(struct Replay));
+  if (!rep)
+    return -2;
+  memset(rep, 0, sizeof(struct Replay));
+  rep->realtime = realtime;
+  rep->file = fopen(path, "rb");
+  if (!rep->file) {
+    printf("Could not open capture file %s\n", path);
+    free(rep);
+    return -3;
+  }
+  struct CaptureHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, rep->file) != 1
+    || hdr.magic != CAPTURE_MAGIC || hdr.version != CAPTURE_VERSION) {
+    printf("File %s is not a deepdive capture\n", path);
+    fclose(rep->file);
+    free(rep);
+    return -4;
+  }
+  drv->replay = rep;
+  return 0;
+}
+
+// Read the next record, returning non-zero at the end of the log
+static int replay_read(struct Replay * rep) {
+  if (fread(&rep->rec, sizeof(rep->rec), 1, rep->file) != 1)
+    return -1;
+  if (rep->rec.length > CAPTURE_MAX_LENGTH
+    || (rep->rec.length
+      && fread(rep->data, rep->rec.length, 1, rep->file) != 1)) {
+    printf("Capture file is truncated or corrupt\n");
+    return -2;
+  }
+  return 0;
+}
+
+// Create a tracker from a configuration record
+static void replay_config(struct Driver * drv, struct Replay * rep) {
+  if (rep->rec.length < sizeof(struct CaptureDevice)
+    || rep->rec.tracker >= MAX_NUM_TRACKERS)
+    return;
+  struct CaptureDevice dev;
+  memcpy(&dev, rep->data, sizeof(dev));
+  struct Tracker *tracker = malloc(sizeof(struct Tracker));
+  if (!tracker)
+    return;
+  memset(tracker, 0, sizeof(struct Tracker));
+  tracker->driver = drv;
+  tracker->type = dev.type;
+  memcpy(tracker->serial, dev.serial, MAX_SERIAL_LENGTH);
+  tracker->serial[MAX_SERIAL_LENGTH - 1] = '\0';
+  // A replay thread needs to queue its data, just like a USB thread, and
+  // batched data is always queued. The thread flag only changes while the
+  // replay thread is not running.
+  if ((drv->threaded || deepdive_queue_batched(drv))
+    && deepdive_queue_init(tracker)) {
+    free(tracker);
+    return;
+  }
+  // Put the tracker in the first free slot
+  int slot = -1;
+  pthread_mutex_lock(&drv->lock);
+  for (size_t i = 0; i < drv->num_trackers && slot < 0; i++)
+    if (!drv->trackers[i])
+      slot = i;
+  if (slot < 0 && drv->num_trackers < MAX_NUM_TRACKERS)
+    slot = drv->num_trackers;
+  if (slot >= 0) {
+    tracker->handle = slot;
+    __atomic_store_n(&drv->trackers[slot], tracker, __ATOMIC_RELEASE);
+    if (slot == drv->num_trackers)
+      __atomic_store_n(&drv->num_trackers, slot + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&drv->lock);
+  if (slot < 0) {
+    deepdive_queue_free(tracker);
+    free(tracker);
+    return;
+  }
+  // Load the calibration exactly as it was loaded from the device
+  rep->trackers[rep->rec.tracker] = tracker;
+  if (deepdive_usb_config(tracker, rep->data + sizeof(dev),
+    rep->rec.length - sizeof(dev)) < 0) {
+    printf("Calibration cannot be pulled for %s. Ignoring.\n", dev.serial);
+    rep->trackers[rep->rec.tracker] = NULL;
+    __atomic_store_n(&tracker->removed, 1, __ATOMIC_RELEASE);
+  } else {
+    printf("Found tracker %s\n", tracker->serial);
+    __atomic_store_n(&tracker->ready, 1, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&tracker->done, 1, __ATOMIC_RELEASE);
+  deepdive_queue_ring(drv);
+}
+
+// Process the current record
+static void replay_record(struct Driver * drv, struct Replay * rep) {
+  struct Tracker * tracker = NULL;
+  if (rep->rec.tracker < MAX_NUM_TRACKERS)
+    tracker = rep->trackers[rep->rec.tracker];
+  switch (rep->rec.kind) {
+   case CAPTURE_CONFIG:
+    replay_config(drv, rep);
+    break;
+   case CAPTURE_PACKET:
+    if (tracker && rep->rec.length <= USB_INT_BUFF_LENGTH) {
+      METRIC_STAMP(tracker->received);
+      deepdive_usb_decode(tracker, rep->rec.type,
+        rep->data, rep->rec.length);
+    }
+    break;
+   case CAPTURE_REMOVED:
+    if (tracker) {
+      rep->trackers[rep->rec.tracker] = NULL;
+      __atomic_store_n(&tracker->removed, 1, __ATOMIC_RELEASE);
+      deepdive_queue_ring(drv);
+    }
+    break;
+  }
+}
+
+// Replay packets, waiting for at most tv when replaying in real time
+int deepdive_replay(struct Driver * drv, struct timeval * tv) {
+  struct Replay * rep = drv->replay;
+  if (!rep)
+    return -1;
+  uint64_t limit = UINT64_MAX;
+  if (tv)
+    limit = now_usec() + tv->tv_sec * 1000000ull + tv->tv_usec;
+  int count = 0;
+  while (1) {
+    // Fetch the next record
+    if (!rep->pending) {
+      if (replay_read(rep))
+        return (count ? 0 : -1);
+      rep->pending = 1;
+    }
+    // In real time, wait until the record is due
+    if (rep->realtime) {
+      uint64_t t = now_usec();
+      if (!rep->synced) {
+        rep->offset = t - rep->rec.usec;
+        rep->synced = 1;
+      }
+      uint64_t due = rep->rec.usec + rep->offset;
+      if (due > t) {
+        if (count > 0 || t >= limit)
+          return 0;
+        usleep((due < limit ? due : limit) - t);
+        continue;
+      }
+    }
+    // Feed the record through the decoder
+    replay_record(drv, rep);
+    rep->pending = 0;
+    if (++count == REPLAY_CHUNK && !rep->realtime)
+      return 0;
+  }
+}
+
+// Close any capture or replay log
+void deepdive_capture_close(struct Driver * drv) {
+  if (drv->capture) {
+    fclose(drv->capture->file);
+    free(drv->capture->buffer);
+    free(drv->capture);
+    drv->capture = NULL;
+  }
+  if (drv->replay) {
+    fclose(drv->replay->file);
+    free(drv->replay);
+    drv->replay = NULL;
+  }
+}
@@ -0,0 +1,100 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef LIBDEEPDIVE_DEEPDIVE_CAPTURE_H
+#define LIBDEEPDIVE_DEEPDIVE_CAPTURE_H
+
+#include <deepdive.h>
+
+// Capture files start with this header
+#define CAPTURE_MAGIC         0x50434444
+#define CAPTURE_VERSION       1
+
+// Largest record payload, which is bounded by the configuration blob
+#define CAPTURE_MAX_LENGTH    16384
+
+// Record kinds
+typedef enum {
+  CAPTURE_CONFIG    = 0,
+  CAPTURE_PACKET    = 1,
+  CAPTURE_REMOVED   = 2
+} CaptureKind;
+
+// File header
+struct CaptureHeader {
+  uint32_t magic;                   // Always CAPTURE_MAGIC
+  uint32_t version;                 // Always CAPTURE_VERSION
+};
+
+// Every record starts with this, and is followed by length bytes
+struct CaptureRecord {
+  uint64_t usec;                    // Monotonic time of capture
+  uint32_t length;                  // Payload length
+  uint16_t tracker;                 // Tracker handle at the time of capture
+  uint8_t kind;                     // CaptureKind
+  uint8_t type;                     // CallbackType of the endpoint
+};
+
+// Payload of a configuration record, followed by the compressed blob
+struct CaptureDevice {
+  uint16_t type;                    // USB product ID
+  char serial[MAX_SERIAL_LENGTH];   // USB serial number
+};
+
+// Start logging raw packets to a file
+int deepdive_capture_open(struct Driver * drv, const char * path);
+
+// Log the compressed configuration blob downloaded from a tracker, along
+// with the USB serial that keys the calibration cache
+void deepdive_capture_config(struct Tracker * tracker, const char * serial,
+  const uint8_t * data, uint32_t len);
+
+// Log a raw endpoint buffer
+void deepdive_capture_packet(struct Tracker * tracker, CallbackType type,
+  const uint8_t * data, uint8_t len);
+
+// Log the removal of a tracker
+void deepdive_capture_removed(struct Tracker * tracker);
+
+// Open a raw packet log for replay, optionally at the captured rate
+int deepdive_replay_open(struct Driver * drv, const char * path,
+  int realtime);
+
+// Replay packets, waiting for at most tv when replaying in real time. This
+// returns zero, or a negative number once the end of the log is reached.
+int deepdive_replay(struct Driver * drv, struct timeval * tv);
+
+// Close any capture or replay log
+void deepdive_capture_close(struct Driver * drv);
+
+#endif
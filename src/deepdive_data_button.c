@@ -32,11 +32,12 @@
 */
 
 #include "deepdive_data_button.h"
+#include "deepdive_queue.h"
 
 // Called when a new button event occurs
 void deepdive_data_button(struct Tracker * tracker,
   uint32_t mask, uint16_t trigger, int16_t horizontal, int16_t vertical) {
   tracker->buttonmask = mask;
-  if (tracker->driver->but_fn && (mask || trigger))
-    tracker->driver->but_fn(tracker, mask, trigger, horizontal, vertical);
+  if (mask || trigger)
+    deepdive_queue_button(tracker, mask, trigger, horizontal, vertical);
 }
\ No newline at end of file
@@ -32,10 +32,12 @@
 */
 
 #include "deepdive_data_imu.h"
+#include "deepdive_queue.h"
+#include "deepdive_metrics.h"
 
 void deepdive_data_imu(struct Tracker * tracker,
   uint32_t timecode, int16_t acc[3], int16_t gyr[3], int16_t mag[3]) {
   // Simple passthrough
-  if (tracker->driver->imu_fn)
-    tracker->driver->imu_fn(tracker, timecode, acc, gyr, mag);
+  METRIC_INC(tracker, METRIC_IMU_SAMPLES);
+  deepdive_queue_imu(tracker, timecode, acc, gyr, mag);
 }
\ No newline at end of file
@@ -32,6 +32,9 @@
 */
 
 #include "deepdive_data_light.h"
+#include "deepdive_queue.h"
+#include "deepdive_map.h"
+#include "deepdive_metrics.h"
 
 #include <zlib.h>
 
@@ -75,39 +78,64 @@ static float convert_float(uint8_t* data) {
   return fnum.f;
 }
 
+// Add a lighthouse to the table, returning its index or -1 if it is full.
+// This must be called with the driver lock held.
+static int add_lighthouse(struct Driver * drv, uint32_t uid) {
+  // Each tracker only sees two lighthouses at a time, but trackers in
+  // other volumes may see others. This many should never be reached...
+  if (drv->num_lighthouses >= MAX_NUM_LIGHTHOUSES) {
+    printf("We appear to have seen more than MAX_NUM_LIGHTHOUSES\n");
+    printf("We are therefore going to disregard this OOTX data :(\n");
+    return -1;
+  }
+  // Allocate a new block of the table when the last one is full
+  int idx = drv->num_lighthouses;
+  struct Lighthouse ** block = &drv->lighthouses[idx / LIGHTHOUSE_BLOCK];
+  if (!*block)
+    *block = calloc(LIGHTHOUSE_BLOCK, sizeof(struct Lighthouse));
+  if (!*block) {
+    printf("Could not allocate memory for the lighthouse\n");
+    return -1;
+  }
+  // First time we see this lighthouse, so format the serial once
+  struct Lighthouse * lh = &(*block)[idx % LIGHTHOUSE_BLOCK];
+  lh->id = idx;
+  lh->uid = uid;
+  snprintf(lh->serial, MAX_SERIAL_LENGTH, "%u", uid);
+  // Publishing the index in the map also publishes the entry
+  deepdive_map_insert(&drv->lighthouse_map, uid, idx);
+  __atomic_store_n(&drv->num_lighthouses, idx + 1, __ATOMIC_RELEASE);
+  return idx;
+}
+
 // Convert the packet
 static void decode_packet(struct Tracker *tracker, uint8_t id,
   uint8_t *data, uint32_t tc) {
   // Pop the serial number off the packet, so we can perform a lookup
-  static char serial[MAX_SERIAL_LENGTH];
-  sprintf(serial, "%u", *(uint32_t*)(data + 0x02));
+  uint32_t uid = *(uint32_t*)(data + 0x02);
+  struct Driver * drv = tracker->driver;
 
-  // We need to search to see if we already know about this LH
-  uint8_t idx, available = MAX_NUM_LIGHTHOUSES;
-  for (idx = 0; idx < MAX_NUM_LIGHTHOUSES; idx++) {
-    // If there is not timestamp with this lighthouse, then this is a
-    // free record, which we will use in the case the serial is not found.
-    if (!tracker->driver->lighthouses[idx].timestamp &&
-      available == MAX_NUM_LIGHTHOUSES) available = idx;
-    // If we find the tracker
-    if (!strcmp(tracker->driver->lighthouses[idx].serial, serial))
-      break;
-  }
-
-  // We should never really be in the position where we get OOTX packets
-  // from more than two lighthouses. But, if we do, you should see this...
-  if (idx >= MAX_NUM_LIGHTHOUSES) {
-    if (available == MAX_NUM_LIGHTHOUSES) {
-      printf("We appear to have seen more than MAX_NUM_LIGHTHOUSES\n");
-      printf("We are therefore going to disregard this OOTX data :(\n");
-      return;
+  // Most packets come from the lighthouse we already know on this channel,
+  // so the table is only searched when a channel changes lighthouse
+  struct Lighthouse *lh = tracker->ootx[id].lighthouse;
+  if (!lh || lh->uid != uid) {
+    // Known lighthouses are found without the lock, as they are never
+    // erased from the map. The lock is only needed to add one.
+    int idx = deepdive_map_find(&drv->lighthouse_map, uid);
+    if (idx < 0) {
+      pthread_mutex_lock(&drv->lock);
+      // Another tracker may have added it in the meantime
+      idx = deepdive_map_find(&drv->lighthouse_map, uid);
+      if (idx < 0)
+        idx = add_lighthouse(drv, uid);
+      pthread_mutex_unlock(&drv->lock);
+      if (idx < 0)
+        return;
     }
-    idx = available;
+    lh = &drv->lighthouses[idx / LIGHTHOUSE_BLOCK][idx % LIGHTHOUSE_BLOCK];
   }
 
   // Populate this data
-  struct Lighthouse *lh = &tracker->driver->lighthouses[idx]; 
-  strcpy(lh->serial, serial);
   lh->fw_version = *(uint16_t*)(data + 0x00);
   lh->motors[0].phase = convert_float(data + 0x06);
   lh->motors[1].phase = convert_float(data + 0x08);
@@ -135,8 +163,7 @@ static void decode_packet(struct Tracker *tracker, uint8_t id,
   tracker->ootx[id].lighthouse = lh;
 
   // Push the new lighthouse data to the callee
-  if (tracker->driver->lighthouse_fn)
-    tracker->driver->lighthouse_fn(lh);
+  deepdive_queue_lighthouse(tracker, lh);
 }
 
 // Swap endianness of 16 bit unsigned integer
@@ -157,7 +184,7 @@ static uint32_t swapl(uint32_t val) {
 static void ootx_feed(struct Tracker *tracker, 
   uint8_t lh, uint8_t bit, uint32_t tc) {
   // OOTX decoders to gather base station configuration
-  if (lh >= MAX_NUM_LIGHTHOUSES)
+  if (lh >= MAX_NUM_CHANNELS)
     return;
   // Get the correct context for this OOTX
   OOTX *ctx = &tracker->ootx[lh];
@@ -232,8 +259,11 @@ static void ootx_feed(struct Tracker *tracker,
         // printf("[CRC] -> [PRE]\n");
         // printf("[CRC] RX = %08x\n", swapl(ctx->crc));
         // printf("[CRC] CA = %08x\n", crc);
+        METRIC_INC(tracker, METRIC_OOTX_FRAMES);
         if (crc == swapl(ctx->crc))
           decode_packet(tracker, lh, ctx->data, tc);
+        else
+          METRIC_INC(tracker, METRIC_OOTX_CRC_ERRORS);
         // Return to state
         ctx->state = PREAMBLE;
         ctx->pos = ctx->syn = 0;
@@ -266,64 +296,51 @@ int handle_acode(lightcap_data* lcd, int length) {
 void handle_measurements(struct Tracker * tracker) {
   // Get the tracker-specific lightcap data
   lightcap_data* lcd = &tracker->lcd;
-  unsigned int longest_pulse = 0;
-  unsigned int timestamp_of_longest_pulse = 0;
-  for (int i = 0; i < MAX_NUM_SENSORS; i++) {
-    if (lcd->sweep.sweep_len[i] > longest_pulse) {
-      longest_pulse = lcd->sweep.sweep_len[i];
-      timestamp_of_longest_pulse = lcd->sweep.sweep_time[i];
-    }
-  }
-  int allZero = 1;
-  for (int q = 0; q < MAX_NUM_SENSORS; q++)
-    if (lcd->sweep.sweep_len[q] != 0)
-      allZero = 0;
-
-  // Temporary data structures to hold results
-  static uint16_t num_sensors;
-  static uint16_t sensors[MAX_NUM_SENSORS];
-  static uint32_t sweeptimes[MAX_NUM_SENSORS];
-  static uint32_t angles[MAX_NUM_SENSORS];
-  static uint16_t lengths[MAX_NUM_SENSORS];
-  static uint32_t st;
-  static uint8_t lh;
-  static uint8_t ax;
+  uint32_t active = lcd->sweep.active;
 
   // Get the sync pulse rising edge time, lighthouse and axis
-  st = lcd->per_sweep.activeSweepStartTime;
-  lh = lcd->per_sweep.activeLighthouse;
-  ax = lcd->per_sweep.activeAcode & 1;
+  uint32_t st = lcd->per_sweep.activeSweepStartTime;
+  int lh = lcd->per_sweep.activeLighthouse;
+  uint8_t ax = lcd->per_sweep.activeAcode & 1;
 
   // Get the rotation based on the axis and negate Y to 
   uint8_t motor = (ax == 0 ? MOTOR_AXIS0 : MOTOR_AXIS1);
 
-  // Copy over the final data
-  num_sensors = 0;
-  for (int i = 0; i < MAX_NUM_SENSORS; i++) {
-    static int counts[MAX_NUM_SENSORS][2] = {0};
-    if (lcd->per_sweep.activeLighthouse > -1 && !allZero)
-      if (lcd->sweep.sweep_len[i] == 0)
-        counts[i][lcd->per_sweep.activeAcode & 1] = 0;
-    if (lcd->sweep.sweep_len[i] != 0) {
-      sensors[num_sensors] = i;
-      sweeptimes[num_sensors] = lcd->sweep.sweep_time[i];
-      angles[num_sensors] = lcd->sweep.sweep_time[i]
-        - lcd->per_sweep.activeSweepStartTime + lcd->sweep.sweep_len[i] / 2;
-      lengths[num_sensors] = lcd->sweep.sweep_len[i];
-      num_sensors++;
-    }
+  // Nothing to do if no sensor saw the sweep
+  if (!active)
+    return;
+
+  // Temporary data structures to hold results, which live on the stack so
+  // that trackers can be decoded concurrently
+  uint16_t num_sensors = 0;
+  uint16_t sensors[MAX_NUM_SENSORS];
+  uint32_t sweeptimes[MAX_NUM_SENSORS];
+  uint32_t angles[MAX_NUM_SENSORS];
+  uint16_t lengths[MAX_NUM_SENSORS];
+
+  // Compact the active sensors in a single pass, clearing as we go
+  for (uint32_t m = active; m; m &= m - 1) {
+    int i = __builtin_ctz(m);
+    sensors[num_sensors] = i;
+    sweeptimes[num_sensors] = lcd->sweep.sweep_time[i];
+    angles[num_sensors] = lcd->sweep.sweep_time[i]
+      - lcd->per_sweep.activeSweepStartTime + lcd->sweep.sweep_len[i] / 2;
+    lengths[num_sensors] = lcd->sweep.sweep_len[i];
+    lcd->sweep.sweep_time[i] = 0;
+    lcd->sweep.sweep_len[i] = 0;
+    num_sensors++;
   }
+  lcd->sweep.active = 0;
 
   // Push off the measurement bundle ONLY when we have received
   // an OOTX from the current lighthouse and if we have data
-  if (num_sensors > 0 && tracker->ootx[lh].lighthouse) {
-    if (tracker->driver->lig_fn)
-      tracker->driver->lig_fn(tracker, tracker->ootx[lh].lighthouse,
-        motor, st, num_sensors, sensors, sweeptimes, angles, lengths);
+  if (lh >= 0 && lh < MAX_NUM_CHANNELS && tracker->ootx[lh].lighthouse) {
+    METRIC_INC(tracker, METRIC_SWEEPS);
+    deepdive_queue_light(tracker, tracker->ootx[lh].lighthouse,
+      motor, st, num_sensors, sensors, sweeptimes, angles, lengths);
+  } else {
+    METRIC_INC(tracker, METRIC_DROPPED_SWEEPS);
   }
-
-  // Clear memory
-  memset(&lcd->sweep, 0, sizeof(lightcaps_sweep_data));
 }
 
 // Handle sync
@@ -356,7 +373,7 @@ void handle_sync(struct Tracker * tracker,
     // Initialize here
     memset(&lcd->per_sweep, 0, sizeof(lcd->per_sweep));
     lcd->per_sweep.activeLighthouse = -1; 
-    for (uint8_t i = 0; i < MAX_NUM_LIGHTHOUSES; ++i)
+    for (uint8_t i = 0; i < MAX_NUM_CHANNELS; ++i)
       lcd->per_sweep.lh_acode[i] = -1;
     lcd->per_sweep.recent_sync_time = timecode;
     lcd->per_sweep.current_lh = 0;
@@ -365,7 +382,7 @@ void handle_sync(struct Tracker * tracker,
     lcd->per_sweep.lh_acode[lcd->per_sweep.current_lh] = acode;
   }
   // Feed the lighthouse OOTX decoder with the data bit
-  if (lcd->per_sweep.current_lh < MAX_NUM_LIGHTHOUSES) {
+  if (lcd->per_sweep.current_lh < MAX_NUM_CHANNELS) {
     ootx_feed(tracker, lcd->per_sweep.current_lh,
      ((acode & 0x2) ? 1 : 0), timecode);
   }
@@ -380,7 +397,7 @@ void handle_sweep(struct Tracker * tracker,
   lcd->per_sweep.activeLighthouse = -1;
   lcd->per_sweep.activeSweepStartTime = 0;
   lcd->per_sweep.activeAcode = 0;
-  for (uint8_t i = 0; i < MAX_NUM_LIGHTHOUSES; ++i) {
+  for (uint8_t i = 0; i < MAX_NUM_CHANNELS; ++i) {
     int acode = lcd->per_sweep.lh_acode[i];
     if ((acode >= 0) && !(acode >> 2 & 1)) {
       lcd->per_sweep.activeLighthouse = i;
@@ -395,12 +412,13 @@ void handle_sweep(struct Tracker * tracker,
   if (lcd->sweep.sweep_len[sensor] < length) {
     lcd->sweep.sweep_len[sensor] = length;
     lcd->sweep.sweep_time[sensor] = timecode;
+    lcd->sweep.active |= (1u << sensor);
   }
 }
 
 void deepdive_data_light(struct Tracker * tracker,
   uint32_t timecode, uint16_t sensor, uint16_t length) {
-  if (sensor > MAX_NUM_SENSORS) return;
+  if (sensor >= MAX_NUM_SENSORS) return;
   if (length > 6750) return;
   if (length > 2750)
     handle_sync(tracker, timecode, sensor, length);
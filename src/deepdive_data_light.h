@@ -40,4 +40,7 @@
 void deepdive_data_light(struct Tracker * tracker,
   uint32_t timecode, uint16_t sensor, uint16_t length);
 
+// Push off the sweep measurements gathered since the last sync pulse
+void handle_measurements(struct Tracker * tracker);
+
 #endif
\ No newline at end of file
@@ -39,13 +39,10 @@
 // Process light data
 void deepdive_dev_tracker_light(struct Tracker * tracker,
   const uint8_t *buf, int32_t len) {
-  static uint16_t sensor;
-  static uint16_t length;
-  static uint32_t timecode;
   for (size_t i = 0; i < 7; i++ ) {
-    sensor = *((uint16_t*)(&(buf[i*8+1])));
-    length = *((uint16_t*)(&(buf[i*8+3])));
-    timecode = *((uint32_t*)(&(buf[i*8+5])));
+    uint16_t sensor = *((uint16_t*)(&(buf[i*8+1])));
+    uint16_t length = *((uint16_t*)(&(buf[i*8+3])));
+    uint32_t timecode = *((uint32_t*)(&(buf[i*8+5])));
     if (sensor > 0xfd)
       continue;
     deepdive_data_light(tracker, timecode, sensor, length);
@@ -63,7 +60,7 @@ void deepdive_dev_tracker_imu(struct Tracker * tracker,
   gyr[0] = *((int16_t*)(buf+7));
   gyr[1] = *((int16_t*)(buf+9));
   gyr[2] = *((int16_t*)(buf+11));
-  // Timecode is wrapping milliseconds
+  // Timecode is the wrapping 48MHz tick counter used for light
   uint32_t timecode = *((uint32_t*)(buf+13));
   // Process the data
   deepdive_data_imu(tracker, timecode, acc, gyr, NULL);
@@ -35,12 +35,32 @@
 #include "deepdive_data_imu.h"
 #include "deepdive_data_light.h"
 #include "deepdive_data_button.h"
+#include "deepdive_metrics.h"
 
 // Pop a value off the array (shifts the pointer to the next element)
 #define POP1  (*(buf++))
 #define POP2  (*(((uint16_t*)((buf+=2)-2))))
 #define POP4  (*(((uint32_t*)((buf+=4)-4))))
 
+// Pop a variable-length ("arcane") value off the back of the buffer. Each
+// byte holds seven bits, most significant first, and the last byte of the
+// value has its top bit set. Values are at most five bytes long.
+static inline int arcane_pop(uint8_t ** mptr, uint8_t * stop,
+  uint32_t * value) {
+  uint8_t *p = *mptr;
+  uint32_t v = 0;
+  for (int n = 0; n < 5 && p >= stop; n++) {
+    uint8_t ap = *(p--);
+    v = (v << 7) | (ap & 0x7f);
+    if (ap & 0x80) {
+      *mptr = p;
+      *value = v;
+      return 0;
+    }
+  }
+  return -1;
+}
+
 // Stores a single light capture event
 typedef struct {
   uint8_t sensor_id;
@@ -117,7 +137,7 @@ static void watchman_decode(struct Tracker * tracker, uint8_t *buf) {
   // Hmm, this looks kind of yucky... we can get e8's that are accelgyro's but, cleared by first propset.
   if (((type & 0xe8) == 0xe8) || doimu) {
     propset |= 2;
-    // Timecode is wrapping milliseconds
+    // Timecode is the wrapping 48MHz tick counter used for light
     uint32_t timecode = (time1<<24)|(time2<<16)|buf[0];
     // Accelerometer (moved from imu-frame to tracker-frame)
     int16_t acc[3], gyr[3];
@@ -174,14 +194,11 @@ static void watchman_decode(struct Tracker * tracker, uint8_t *buf) {
     {
       while( mptr - buf > (timecount>>1) )
       {
-        uint32_t arcane_value = 0;
-        //ArcanePop (Pop off values from the back, forward, checking if the MSB is set)
-        do {
-          uint8_t ap = *(mptr--);
-          arcane_value |= (ap&0x7f);
-          if( ap & 0x80 )  break;
-          arcane_value <<= 7;
-        } while(1);
+        uint32_t arcane_value;
+        if (timecount >= nrtime || arcane_pop(&mptr, buf, &arcane_value)) {
+          fault = 7;
+          goto end;
+        }
         times[timecount++] = (mytime -= arcane_value);
       }
 
@@ -198,9 +215,7 @@ static void watchman_decode(struct Tracker * tracker, uint8_t *buf) {
 
     //Second, go through all LEDs and extract the lightevent from them. 
     {
-      uint8_t *marked;
-      marked = alloca(nrtime);
-      memset( marked, 0, nrtime );
+      uint32_t marked = 0;
       int i, parpl = 0;
       timecount--;
       int timepl = 0;
@@ -211,8 +226,8 @@ static void watchman_decode(struct Tracker * tracker, uint8_t *buf) {
         int adv = led & 0x07;
         led >>= 3;
 
-        while (marked[timepl])
-          timepl++;
+        // Skip over the times that were used as start times
+        timepl += __builtin_ctz(~(marked >> timepl));
 
         if (timepl > timecount) {
           fault = 3;
@@ -222,9 +237,9 @@ static void watchman_decode(struct Tracker * tracker, uint8_t *buf) {
 
         int end = timepl + adv;
         if( end > timecount ) { fault = 4; goto end; } //end referencing off list
-        if( marked[end] > 0 ) { fault = 5; goto end; } //Already marked trying to be used.
+        if( marked & (1u << end) ) { fault = 5; goto end; } //Already marked trying to be used.
         uint32_t starttime = times[end];
-        marked[end] = 1;
+        marked |= (1u << end);
 
         //Insert all lighting things into a sorted list.  This list will be
         //reverse sorted, but that is to minimize operations.  To read it
@@ -237,19 +252,23 @@ static void watchman_decode(struct Tracker * tracker, uint8_t *buf) {
           goto end;
         }
 
+        if (lese >= sizeof(les) / sizeof(les[0])) {
+          fault = 8;
+          goto end;
+        }
         LightcapElement * le = &les[lese++];
         le->sensor_id = led;
         le->length = endtime - starttime;
         le->timestamp = starttime;
 
+        // Shift smaller elements up and drop the new one into place
+        LightcapElement l = *le;
         int swap = lese-2;
-        while( swap >= 0 && les[swap].timestamp < les[swap+1].timestamp) {
-          LightcapElement l;
-          memcpy( &l, &les[swap], sizeof( l ) );
-          memcpy( &les[swap], &les[swap+1], sizeof( l ) );
-          memcpy( &les[swap+1], &l, sizeof( l ) );
+        while( swap >= 0 && les[swap].timestamp < l.timestamp) {
+          les[swap+1] = les[swap];
           swap--;
         }
+        les[swap+1] = l;
       }
     }
 
@@ -262,6 +281,7 @@ static void watchman_decode(struct Tracker * tracker, uint8_t *buf) {
     return;
 end:
     printf("Light decoding fault: %d", fault);
+    METRIC_INC(tracker, METRIC_DECODE_FAULTS);
   }
 }
 
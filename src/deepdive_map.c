@@ -0,0 +1,147 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "deepdive_map.h"
+
+// Special values
+#define MAP_EMPTY       -1
+#define MAP_DELETED     -2
+#define MAP_MASK        (MAP_SIZE - 1)
+
+// Tombstones lengthen every probe, so the map is rebuilt past this many
+#define MAP_MAX_DELETED (MAP_SIZE / 4)
+
+// Mix the bits of a key, so that sequential keys spread out
+static inline uint32_t mix(uint32_t key) {
+  key ^= key >> 16;
+  key *= 0x85ebca6bu;
+  key ^= key >> 13;
+  key *= 0xc2b2ae35u;
+  key ^= key >> 16;
+  return key;
+}
+
+// Clear all entries in a map
+void deepdive_map_clear(struct Map * map) {
+  for (uint32_t i = 0; i < MAP_SIZE; i++) {
+    map->keys[i] = 0;
+    map->vals[i] = MAP_EMPTY;
+  }
+  map->deleted = 0;
+}
+
+// Get the next value stored against a key, starting at probe position *pos
+int deepdive_map_next(struct Map * map, uint32_t key, uint32_t * pos) {
+  uint32_t h = mix(key);
+  for (; *pos < MAP_SIZE; (*pos)++) {
+    uint32_t i = (h + *pos) & MAP_MASK;
+    int16_t val = __atomic_load_n(&map->vals[i], __ATOMIC_ACQUIRE);
+    if (val == MAP_EMPTY)
+      break;
+    if (val >= 0 && __atomic_load_n(&map->keys[i], __ATOMIC_RELAXED) == key) {
+      (*pos)++;
+      return val;
+    }
+  }
+  *pos = MAP_SIZE;
+  return -1;
+}
+
+// Get the first value stored against a key, or -1 if there is none
+int deepdive_map_find(struct Map * map, uint32_t key) {
+  uint32_t pos = 0;
+  return deepdive_map_next(map, key, &pos);
+}
+
+// Store a value against a key, returning zero on success. The value is
+// published after the key, so that a concurrent find sees both or neither.
+int deepdive_map_insert(struct Map * map, uint32_t key, int16_t val) {
+  if (val < 0)
+    return -1;
+  uint32_t h = mix(key);
+  for (uint32_t p = 0; p < MAP_SIZE; p++) {
+    uint32_t i = (h + p) & MAP_MASK;
+    if (map->vals[i] < 0) {
+      if (map->vals[i] == MAP_DELETED)
+        map->deleted--;
+      __atomic_store_n(&map->keys[i], key, __ATOMIC_RELAXED);
+      __atomic_store_n(&map->vals[i], val, __ATOMIC_RELEASE);
+      return 0;
+    }
+  }
+  return -2;
+}
+
+// Rebuild the map without its tombstones
+static void compact(struct Map * map) {
+  uint32_t keys[MAP_SIZE];
+  int16_t vals[MAP_SIZE];
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < MAP_SIZE; i++) {
+    if (map->vals[i] < 0)
+      continue;
+    keys[n] = map->keys[i];
+    vals[n] = map->vals[i];
+    n++;
+  }
+  deepdive_map_clear(map);
+  for (uint32_t i = 0; i < n; i++)
+    deepdive_map_insert(map, keys[i], vals[i]);
+}
+
+// Remove a specific key/value pair, returning zero on success
+int deepdive_map_erase(struct Map * map, uint32_t key, int16_t val) {
+  uint32_t h = mix(key);
+  for (uint32_t p = 0; p < MAP_SIZE; p++) {
+    uint32_t i = (h + p) & MAP_MASK;
+    if (map->vals[i] == MAP_EMPTY)
+      break;
+    if (map->vals[i] == val && map->keys[i] == key) {
+      __atomic_store_n(&map->vals[i], MAP_DELETED, __ATOMIC_RELEASE);
+      if (++map->deleted > MAP_MAX_DELETED)
+        compact(map);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Hash a string key (FNV-1a)
+uint32_t deepdive_map_hash(const char * str) {
+  uint32_t h = 2166136261u;
+  for (; *str; str++) {
+    h ^= (uint8_t)(*str);
+    h *= 16777619u;
+  }
+  return h;
+}
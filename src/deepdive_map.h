@@ -0,0 +1,62 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef LIBDEEPDIVE_DEEPDIVE_MAP_H
+#define LIBDEEPDIVE_DEEPDIVE_MAP_H
+
+#include <deepdive.h>
+
+// Clear all entries in a map
+void deepdive_map_clear(struct Map * map);
+
+// Get the next value stored against a key, starting at probe position *pos
+// (which should initially be zero). Returns -1 when there are no more.
+int deepdive_map_next(struct Map * map, uint32_t key, uint32_t * pos);
+
+// Get the first value stored against a key, or -1 if there is none
+int deepdive_map_find(struct Map * map, uint32_t key);
+
+// Store a value against a key, returning zero on success. Finds may run
+// concurrently with inserts, but not with anything else that modifies the
+// map, and modifications must be serialized by the caller.
+int deepdive_map_insert(struct Map * map, uint32_t key, int16_t val);
+
+// Remove a specific key/value pair, returning zero on success. The map is
+// rebuilt once too many tombstones build up, so unlike inserts this must
+// never run concurrently with a find.
+int deepdive_map_erase(struct Map * map, uint32_t key, int16_t val);
+
+// Hash a string key (FNV-1a)
+uint32_t deepdive_map_hash(const char * str);
+
+#endif
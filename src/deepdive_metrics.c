@@ -0,0 +1,128 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "deepdive_metrics.h"
+
+#include <time.h>
+
+// The sub-bucket is taken from the bits after the leading one
+_Static_assert(HISTOGRAM_SUB_BUCKETS == (1 << HISTOGRAM_SUB_BITS),
+  "HISTOGRAM_SUB_BUCKETS must be 1 << HISTOGRAM_SUB_BITS");
+
+// Get the host monotonic time in nanoseconds
+uint64_t deepdive_metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Bucket for a sample : small values are exact, and above that the top
+// bits after the leading one select the sub-bucket in each power of two
+static uint32_t bucket(uint64_t ns) {
+  if (ns < HISTOGRAM_SUB_BUCKETS)
+    return (uint32_t) ns;
+  uint32_t e = 63 - __builtin_clzll(ns);
+  uint32_t m = (uint32_t)(ns >> (e - HISTOGRAM_SUB_BITS))
+    & (HISTOGRAM_SUB_BUCKETS - 1);
+  uint32_t b = (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + m;
+  return (b < MAX_HISTOGRAM_BUCKETS ? b : MAX_HISTOGRAM_BUCKETS - 1);
+}
+
+// Smallest sample that falls in the bucket after b
+static uint64_t upper(uint32_t b) {
+  b++;
+  if (b < HISTOGRAM_SUB_BUCKETS)
+    return b;
+  uint32_t e = b / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+  uint32_t m = b % HISTOGRAM_SUB_BUCKETS;
+  return (uint64_t)(HISTOGRAM_SUB_BUCKETS + m) << (e - HISTOGRAM_SUB_BITS);
+}
+
+// Add a latency sample to a histogram. Each histogram has a single writer.
+void deepdive_metrics_record(struct Histogram * h, uint64_t ns) {
+  __atomic_fetch_add(&h->buckets[bucket(ns)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->total, ns, __ATOMIC_RELAXED);
+  if (ns > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+    __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+// Whether the library was built with DEEPDIVE_METRICS
+int deepdive_metrics_enabled(void) {
+#ifdef DEEPDIVE_METRICS
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+// Copy one histogram, field by field so that no sample is torn
+static void copy_histogram(struct Histogram * dst, struct Histogram * src) {
+  dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+  dst->total = __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+  dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+  for (uint32_t b = 0; b < MAX_HISTOGRAM_BUCKETS; b++)
+    dst->buckets[b] = __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+}
+
+// Copy the instrumentation for a tracker. Returns 0 on success, or -1 if
+// the library was built without DEEPDIVE_METRICS.
+int deepdive_metrics(struct Tracker * tracker, struct Metrics * metrics) {
+  if (!tracker || !metrics || !deepdive_metrics_enabled())
+    return -1;
+  for (uint32_t m = 0; m < MAX_NUM_METRICS; m++)
+    metrics->counters[m] =
+      __atomic_load_n(&tracker->metrics.counters[m], __ATOMIC_RELAXED);
+  metrics->counters[METRIC_OVERFLOWS] = deepdive_overflows(tracker);
+  copy_histogram(&metrics->usb_to_callback, &tracker->metrics.usb_to_callback);
+  return 0;
+}
+
+// Get the latency in nanoseconds below which a fraction p of samples fall
+uint64_t deepdive_histogram_percentile(const struct Histogram * h, double p) {
+  uint64_t total = 0;
+  for (uint32_t b = 0; b < MAX_HISTOGRAM_BUCKETS; b++)
+    total += h->buckets[b];
+  if (!total)
+    return 0;
+  uint64_t rank = (uint64_t)(p * (double) total + 0.5);
+  if (rank < 1) rank = 1;
+  if (rank > total) rank = total;
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < MAX_HISTOGRAM_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank)
+      return (upper(b) - 1 < h->max ? upper(b) - 1 : h->max);
+  }
+  return h->max;
+}
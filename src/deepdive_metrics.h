@@ -0,0 +1,63 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef LIBDEEPDIVE_DEEPDIVE_METRICS_H
+#define LIBDEEPDIVE_DEEPDIVE_METRICS_H
+
+#include <deepdive.h>
+
+// Get the host monotonic time in nanoseconds
+uint64_t deepdive_metrics_now(void);
+
+// Add a latency sample to a histogram. Each histogram has a single writer.
+void deepdive_metrics_record(struct Histogram * h, uint64_t ns);
+
+// Instrumentation compiles away unless DEEPDIVE_METRICS is defined
+#ifdef DEEPDIVE_METRICS
+#define METRIC_INC(tracker, m) \
+  __atomic_fetch_add(&(tracker)->metrics.counters[m], 1, __ATOMIC_RELAXED)
+#define METRIC_STAMP(var) \
+  ((var) = deepdive_metrics_now())
+#define METRIC_STAMP_COPY(dst, src) \
+  ((dst) = (src))
+#define METRIC_LATENCY(tracker, h, since) \
+  do { if (since) deepdive_metrics_record(&(tracker)->metrics.h, \
+    deepdive_metrics_now() - (since)); } while (0)
+#else
+#define METRIC_INC(tracker, m) do {} while (0)
+#define METRIC_STAMP(var) do {} while (0)
+#define METRIC_STAMP_COPY(dst, src) do {} while (0)
+#define METRIC_LATENCY(tracker, h, since) do {} while (0)
+#endif
+
+#endif
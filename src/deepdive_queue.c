@@ -0,0 +1,458 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "deepdive_queue.h"
+#include "deepdive_metrics.h"
+
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+// Must be a power of two, so that indexes can be masked
+#define QUEUE_LENGTH  256
+#define QUEUE_MASK    (QUEUE_LENGTH - 1)
+
+// Record types
+typedef enum {
+  RECORD_LIGHT      = 0,
+  RECORD_IMU        = 1,
+  RECORD_BUTTON     = 2,
+  RECORD_LIGHTHOUSE = 3
+} RecordType;
+
+// A single decoded event, as it was passed to the callback
+struct Record {
+  RecordType type;
+#ifdef DEEPDIVE_METRICS
+  uint64_t received;    // Completion time of the source packet (ns)
+#endif
+  union {
+    struct {
+      struct Lighthouse * lighthouse;
+      uint8_t axis;
+      uint32_t synctime;
+      uint16_t num_sensors;
+      uint16_t sensors[MAX_NUM_SENSORS];
+      uint32_t sweeptimes[MAX_NUM_SENSORS];
+      uint32_t angles[MAX_NUM_SENSORS];
+      uint16_t lengths[MAX_NUM_SENSORS];
+    } light;
+    struct {
+      uint32_t timecode;
+      int16_t acc[3];
+      int16_t gyr[3];
+      int16_t mag[3];
+      uint8_t has_mag;
+    } imu;
+    struct {
+      uint32_t mask;
+      uint16_t trigger;
+      int16_t horizontal;
+      int16_t vertical;
+    } button;
+    struct {
+      struct Lighthouse lighthouse;   // Copy, as decoding keeps updating it
+    } lighthouse;
+  };
+};
+
+// Single-producer (USB thread) single-consumer (polling thread) ring buffer.
+// The head and tail live on separate cache lines to prevent false sharing.
+struct Queue {
+  _Alignas(64) atomic_uint head;      // Next slot to write (producer)
+  _Alignas(64) atomic_uint tail;      // Next slot to read (consumer)
+  _Alignas(64) atomic_uint overflows; // Records dropped because we were full
+  uint32_t lastcount;                 // Records delivered by the last drain
+  struct Record records[QUEUE_LENGTH];
+};
+
+// Wakes the polling thread when records are pending. The eventfd is only
+// written when the flag is clear, so producers rarely make a system call.
+struct Doorbell {
+  atomic_int rung;                    // Has the eventfd been written?
+  int fd;                             // Readable once rung
+};
+
+// Get the queue of a tracker. The pointer is published with release
+// semantics by the thread that handles hotplug events, while producers on
+// configuration threads may be reading it, so it is always loaded with
+// acquire semantics. A queue is only freed while no tracker is being
+// configured (drv->configuring is zero) or once its tracker has no
+// transfers in flight, and always on the thread that handles hotplug
+// events, so no producer can still be using it.
+static struct Queue * queue_of(struct Tracker * tracker) {
+  return __atomic_load_n(&tracker->queue, __ATOMIC_ACQUIRE);
+}
+
+// Allocate a record queue for a tracker
+int deepdive_queue_init(struct Tracker * tracker) {
+  if (queue_of(tracker))
+    return 0;
+  struct Queue *queue = aligned_alloc(64, sizeof(struct Queue));
+  if (!queue)
+    return -1;
+  memset(queue, 0, sizeof(struct Queue));
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  atomic_init(&queue->overflows, 0);
+  __atomic_store_n(&tracker->queue, queue, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Release the record queue for a tracker
+void deepdive_queue_free(struct Tracker * tracker) {
+  struct Queue * queue = queue_of(tracker);
+  __atomic_store_n(&tracker->queue, NULL, __ATOMIC_RELEASE);
+  free(queue);
+}
+
+// Get a free slot to write into, or NULL if the consumer has fallen behind
+static struct Record * acquire(struct Queue * queue) {
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  if (head - tail >= QUEUE_LENGTH) {
+    atomic_fetch_add_explicit(&queue->overflows, 1, memory_order_relaxed);
+    return NULL;
+  }
+  return &queue->records[head & QUEUE_MASK];
+}
+
+// Publish the slot previously returned by acquire()
+static void commit(struct Queue * queue) {
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+// Call the batched callbacks with whatever has been accumulated
+void deepdive_queue_flush(struct Driver * drv) {
+  if (drv->lig_batch && drv->lig_batch->num_sweeps) {
+    if (drv->lig_batch_fn)
+      drv->lig_batch_fn(drv, drv->lig_batch);
+    drv->lig_batch->num_sweeps = 0;
+    drv->lig_batch->num_pulses = 0;
+  }
+  if (drv->imu_batch && drv->imu_batch->num) {
+    if (drv->imu_batch_fn)
+      drv->imu_batch_fn(drv, drv->imu_batch);
+    drv->imu_batch->num = 0;
+  }
+}
+
+// Is data batched, in which case trackers always queue it? Batches are only
+// appended to while draining queues, so that decoding never touches them.
+int deepdive_queue_batched(struct Driver * drv) {
+  return (drv->lig_batch || drv->imu_batch);
+}
+
+// Pass a light measurement bundle to the callee, or append it to the batch.
+// This is only called on the polling thread.
+static void emit_light(struct Tracker * tracker,
+  struct Lighthouse * lighthouse, uint8_t axis, uint32_t synctime,
+  uint16_t num_sensors, uint16_t *sensors, uint32_t *sweeptimes,
+  uint32_t *angles, uint16_t *lengths) {
+  struct Driver * drv = tracker->driver;
+  struct LightBatch * b = drv->lig_batch;
+  if (!b) {
+    if (drv->lig_fn)
+      drv->lig_fn(tracker, lighthouse, axis, synctime,
+        num_sensors, sensors, sweeptimes, angles, lengths);
+    return;
+  }
+  if (b->num_sweeps == MAX_BATCH_SWEEPS
+    || b->num_pulses + num_sensors > MAX_BATCH_PULSES)
+    deepdive_queue_flush(drv);
+  uint32_t n = b->num_sweeps++;
+  uint32_t o = b->num_pulses;
+  b->tracker[n] = tracker->handle;
+  b->lighthouse[n] = lighthouse->id;
+  b->axis[n] = axis;
+  b->synctime[n] = synctime;
+  b->offset[n] = o;
+  b->count[n] = num_sensors;
+  memcpy(&b->sensor[o], sensors, num_sensors * sizeof(uint16_t));
+  memcpy(&b->sweeptime[o], sweeptimes, num_sensors * sizeof(uint32_t));
+  memcpy(&b->angle[o], angles, num_sensors * sizeof(uint32_t));
+  memcpy(&b->length[o], lengths, num_sensors * sizeof(uint16_t));
+  b->num_pulses += num_sensors;
+}
+
+// Pass an IMU measurement to the callee, or append it to the batch. This is
+// only called on the polling thread.
+static void emit_imu(struct Tracker * tracker,
+  uint32_t timecode, int16_t acc[3], int16_t gyr[3], int16_t mag[3]) {
+  struct Driver * drv = tracker->driver;
+  struct ImuBatch * b = drv->imu_batch;
+  if (!b) {
+    if (drv->imu_fn)
+      drv->imu_fn(tracker, timecode, acc, gyr, mag);
+    return;
+  }
+  if (b->num == MAX_BATCH_IMU)
+    deepdive_queue_flush(drv);
+  uint32_t n = b->num++;
+  b->tracker[n] = tracker->handle;
+  b->timecode[n] = timecode;
+  memcpy(b->acc[n], acc, sizeof(b->acc[n]));
+  memcpy(b->gyr[n], gyr, sizeof(b->gyr[n]));
+  b->has_mag[n] = (mag != NULL);
+  if (mag)
+    memcpy(b->mag[n], mag, sizeof(b->mag[n]));
+}
+
+// Deliver a single record to the callee
+static void deliver(struct Tracker * tracker, struct Record * r) {
+  struct Driver * drv = tracker->driver;
+  switch (r->type) {
+  case RECORD_LIGHT:
+    METRIC_LATENCY(tracker, usb_to_callback, r->received);
+    emit_light(tracker, r->light.lighthouse, r->light.axis,
+      r->light.synctime, r->light.num_sensors, r->light.sensors,
+      r->light.sweeptimes, r->light.angles, r->light.lengths);
+    break;
+  case RECORD_IMU:
+    METRIC_LATENCY(tracker, usb_to_callback, r->received);
+    emit_imu(tracker, r->imu.timecode, r->imu.acc, r->imu.gyr,
+      r->imu.has_mag ? r->imu.mag : NULL);
+    break;
+  case RECORD_BUTTON:
+    if (drv->but_fn)
+      drv->but_fn(tracker, r->button.mask, r->button.trigger,
+        r->button.horizontal, r->button.vertical);
+    break;
+  case RECORD_LIGHTHOUSE:
+    if (drv->lighthouse_fn)
+      drv->lighthouse_fn(&r->lighthouse.lighthouse);
+    break;
+  }
+}
+
+// Deliver all queued records for a tracker, returning the number delivered
+uint32_t deepdive_queue_drain(struct Tracker * tracker) {
+  struct Queue * queue = queue_of(tracker);
+  if (!queue)
+    return 0;
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  uint32_t count = head - tail;
+  for (; tail != head; tail++) {
+    deliver(tracker, &queue->records[tail & QUEUE_MASK]);
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  }
+  queue->lastcount = count;
+  return count;
+}
+
+// Push or deliver a light measurement bundle
+void deepdive_queue_light(struct Tracker * tracker,
+  struct Lighthouse * lighthouse, uint8_t axis, uint32_t synctime,
+  uint16_t num_sensors, uint16_t *sensors, uint32_t *sweeptimes,
+  uint32_t *angles, uint16_t *lengths) {
+  // Synchronous mode : call straight through to the callee. Data is never
+  // batched here, as decoding may run on a configuration thread.
+  struct Queue * queue = queue_of(tracker);
+  if (!queue) {
+    METRIC_LATENCY(tracker, usb_to_callback, tracker->received);
+    if (tracker->driver->lig_fn)
+      tracker->driver->lig_fn(tracker, lighthouse, axis, synctime,
+        num_sensors, sensors, sweeptimes, angles, lengths);
+    return;
+  }
+  // Threaded mode : copy into the ring buffer
+  struct Record * r = acquire(queue);
+  if (!r)
+    return;
+  if (num_sensors > MAX_NUM_SENSORS)
+    num_sensors = MAX_NUM_SENSORS;
+  r->type = RECORD_LIGHT;
+  METRIC_STAMP_COPY(r->received, tracker->received);
+  r->light.lighthouse = lighthouse;
+  r->light.axis = axis;
+  r->light.synctime = synctime;
+  r->light.num_sensors = num_sensors;
+  memcpy(r->light.sensors, sensors, num_sensors * sizeof(uint16_t));
+  memcpy(r->light.sweeptimes, sweeptimes, num_sensors * sizeof(uint32_t));
+  memcpy(r->light.angles, angles, num_sensors * sizeof(uint32_t));
+  memcpy(r->light.lengths, lengths, num_sensors * sizeof(uint16_t));
+  commit(queue);
+}
+
+// Push or deliver an IMU measurement
+void deepdive_queue_imu(struct Tracker * tracker,
+  uint32_t timecode, int16_t acc[3], int16_t gyr[3], int16_t mag[3]) {
+  // Synchronous mode : call straight through to the callee
+  struct Queue * queue = queue_of(tracker);
+  if (!queue) {
+    METRIC_LATENCY(tracker, usb_to_callback, tracker->received);
+    if (tracker->driver->imu_fn)
+      tracker->driver->imu_fn(tracker, timecode, acc, gyr, mag);
+    return;
+  }
+  // Threaded mode : copy into the ring buffer
+  struct Record * r = acquire(queue);
+  if (!r)
+    return;
+  r->type = RECORD_IMU;
+  METRIC_STAMP_COPY(r->received, tracker->received);
+  r->imu.timecode = timecode;
+  memcpy(r->imu.acc, acc, sizeof(r->imu.acc));
+  memcpy(r->imu.gyr, gyr, sizeof(r->imu.gyr));
+  r->imu.has_mag = (mag != NULL);
+  if (mag)
+    memcpy(r->imu.mag, mag, sizeof(r->imu.mag));
+  commit(queue);
+}
+
+// Push or deliver a button event
+void deepdive_queue_button(struct Tracker * tracker,
+  uint32_t mask, uint16_t trigger, int16_t horizontal, int16_t vertical) {
+  // Synchronous mode : call straight through to the callee
+  struct Queue * queue = queue_of(tracker);
+  if (!queue) {
+    if (tracker->driver->but_fn)
+      tracker->driver->but_fn(tracker, mask, trigger, horizontal, vertical);
+    return;
+  }
+  // Threaded mode : copy into the ring buffer
+  struct Record * r = acquire(queue);
+  if (!r)
+    return;
+  r->type = RECORD_BUTTON;
+  r->button.mask = mask;
+  r->button.trigger = trigger;
+  r->button.horizontal = horizontal;
+  r->button.vertical = vertical;
+  commit(queue);
+}
+
+// Push or deliver a lighthouse calibration update
+void deepdive_queue_lighthouse(struct Tracker * tracker,
+  struct Lighthouse * lighthouse) {
+  // Synchronous mode : call straight through to the callee
+  struct Queue * queue = queue_of(tracker);
+  if (!queue) {
+    if (tracker->driver->lighthouse_fn)
+      tracker->driver->lighthouse_fn(lighthouse);
+    return;
+  }
+  // Threaded mode : copy into the ring buffer
+  struct Record * r = acquire(queue);
+  if (!r)
+    return;
+  r->type = RECORD_LIGHTHOUSE;
+  r->lighthouse.lighthouse = *lighthouse;
+  commit(queue);
+}
+
+// Get the number of records dropped because the consumer fell behind
+uint32_t deepdive_overflows(struct Tracker * tracker) {
+  struct Queue * queue = (tracker ? queue_of(tracker) : NULL);
+  if (!queue) return 0;
+  return atomic_load_explicit(&queue->overflows, memory_order_relaxed);
+}
+
+// Get the number of records delivered by the last call to drain
+uint32_t deepdive_lastcount(struct Tracker * tracker) {
+  struct Queue * queue = (tracker ? queue_of(tracker) : NULL);
+  if (!queue) return 0;
+  return queue->lastcount;
+}
+
+// DOORBELL
+
+// Allocate the doorbell of a driver
+int deepdive_queue_doorbell_init(struct Driver * drv) {
+  if (drv->doorbell)
+    return 0;
+  struct Doorbell * bell = malloc(sizeof(struct Doorbell));
+  if (!bell)
+    return -1;
+  bell->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (bell->fd < 0) {
+    free(bell);
+    return -2;
+  }
+  atomic_init(&bell->rung, 0);
+  __atomic_store_n(&drv->doorbell, bell, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Release the doorbell of a driver, once nothing can ring it
+void deepdive_queue_doorbell_free(struct Driver * drv) {
+  if (!drv->doorbell)
+    return;
+  close(drv->doorbell->fd);
+  free(drv->doorbell);
+  drv->doorbell = NULL;
+}
+
+// Get the descriptor that is readable once the doorbell rings
+int deepdive_queue_doorbell_fd(struct Driver * drv) {
+  return (drv->doorbell ? drv->doorbell->fd : -1);
+}
+
+// Let the polling thread know that there is something to deliver. The
+// fence orders what was published before against the check of the flag,
+// and pairs with the one in deepdive_queue_answer.
+void deepdive_queue_ring(struct Driver * drv) {
+  struct Doorbell * bell = __atomic_load_n(&drv->doorbell, __ATOMIC_ACQUIRE);
+  if (!bell)
+    return;
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&bell->rung, memory_order_relaxed)
+    || atomic_exchange_explicit(&bell->rung, 1, memory_order_relaxed))
+    return;
+  uint64_t one = 1;
+  ssize_t ret = write(bell->fd, &one, sizeof(one));
+  (void) ret;
+}
+
+// Reset the doorbell before looking for something to deliver. The eventfd
+// is read before the flag is cleared, so that a ring is never swallowed.
+void deepdive_queue_answer(struct Driver * drv) {
+  struct Doorbell * bell = drv->doorbell;
+  if (!bell)
+    return;
+  uint64_t count;
+  ssize_t ret = read(bell->fd, &count, sizeof(count));
+  (void) ret;
+  atomic_store_explicit(&bell->rung, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+// Block until the doorbell rings, for at most timeout milliseconds or
+// forever if it is negative. Returns 1 if it rang, 0 on timeout.
+int deepdive_queue_wait(struct Driver * drv, int timeout) {
+  if (!drv->doorbell)
+    return -1;
+  struct pollfd pfd = {drv->doorbell->fd, POLLIN, 0};
+  return poll(&pfd, 1, timeout);
+}
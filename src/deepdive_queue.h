@@ -0,0 +1,92 @@
+/* 
+  Unofficial driver for Vive Trackers and up to two lighthouses, with an
+    emphasis on pulling tracker and lighthouse calibration data from devices.
+  
+  Adapted from: https://github.com/cnlohr/libsurvive
+  Which was based off: https://github.com/collabora/OSVR-Vive-Libre
+    Originally Copyright 2016 Philipp Zabel
+    Originally Copyright 2016 Lubosz Sarnecki <lubosz.sarnecki@collabora.co.uk>
+    Originally Copyright (C) 2013 Fredrik Hultin
+    Originally Copyright (C) 2013 Jakob Bornecrantz
+  Using documentation from: https://github.com/nairol/LighthouseRedox
+  
+  Copyright (c) 2017 Andrew Symington
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#ifndef LIBDEEPDIVE_DEEPDIVE_QUEUE_H
+#define LIBDEEPDIVE_DEEPDIVE_QUEUE_H
+
+#include <deepdive.h>
+
+// Allocate a record queue for a tracker
+int deepdive_queue_init(struct Tracker * tracker);
+
+// Release the record queue for a tracker
+void deepdive_queue_free(struct Tracker * tracker);
+
+// Is data batched, in which case every tracker must queue it?
+int deepdive_queue_batched(struct Driver * drv);
+
+// Deliver all queued records for a tracker, returning the number delivered
+uint32_t deepdive_queue_drain(struct Tracker * tracker);
+
+// Call the batched callbacks with whatever has been accumulated
+void deepdive_queue_flush(struct Driver * drv);
+
+// Push or deliver a light measurement bundle
+void deepdive_queue_light(struct Tracker * tracker,
+  struct Lighthouse * lighthouse, uint8_t axis, uint32_t synctime,
+  uint16_t num_sensors, uint16_t *sensors, uint32_t *sweeptimes,
+  uint32_t *angles, uint16_t *lengths);
+
+// Push or deliver an IMU measurement
+void deepdive_queue_imu(struct Tracker * tracker,
+  uint32_t timecode, int16_t acc[3], int16_t gyr[3], int16_t mag[3]);
+
+// Push or deliver a button event
+void deepdive_queue_button(struct Tracker * tracker,
+  uint32_t mask, uint16_t trigger, int16_t horizontal, int16_t vertical);
+
+// Push or deliver a lighthouse calibration update
+void deepdive_queue_lighthouse(struct Tracker * tracker,
+  struct Lighthouse * lighthouse);
+
+// Allocate the doorbell of a driver, which is rung when data is pending
+int deepdive_queue_doorbell_init(struct Driver * drv);
+
+// Release the doorbell of a driver, once nothing can ring it
+void deepdive_queue_doorbell_free(struct Driver * drv);
+
+// Get the descriptor that is readable once the doorbell rings, or -1
+int deepdive_queue_doorbell_fd(struct Driver * drv);
+
+// Let the polling thread know that there is something to deliver. This may
+// be called from any thread, and does nothing until a doorbell exists.
+void deepdive_queue_ring(struct Driver * drv);
+
+// Reset the doorbell, before looking for something to deliver
+void deepdive_queue_answer(struct Driver * drv);
+
+// Block until the doorbell rings, for at most timeout milliseconds or
+// forever if it is negative
+int deepdive_queue_wait(struct Driver * drv, int timeout);
+
+#endif
@@ -33,12 +33,22 @@
 
 #include <argtable2.h>
 
+#include <signal.h>
+
 #include <deepdive.h>
 
 // Enable X and Y axis
 int en0_ = 0;
 int en1_ = 0;
 
+// Set when ctrl+c is pressed
+volatile sig_atomic_t stop_ = 0;
+
+// Stop cleanly, so that any capture file is flushed
+void my_signal_handler(int sig) {
+  stop_ = 1;
+}
+
 // Callback to display light info
 void my_light_process(struct Tracker * tracker, struct Lighthouse * lighthouse,
   uint8_t axis, uint32_t synctime, uint16_t num_sensors, uint16_t *sensors,
@@ -144,6 +154,12 @@ void my_tracker_process(struct Tracker * t) {
     t->cal.head_transform[6]);
 }
 
+// Called when a tracker is unplugged
+void my_removed_process(struct Tracker * t) {
+  if (!t) return;
+  printf("Tracker with serial %s was removed\n", t->serial);
+}
+
 // Called when OOTX data is decoded from this lighthouse
 void my_lighthouse_process(struct Lighthouse *l) {
   if (!l) return;
@@ -170,9 +186,14 @@ int main(int argc, char **argv) {
   struct arg_lit  *button  = arg_lit0("b", "button", "print buttons");
   struct arg_lit  *lh      = arg_lit0("l", "lh", "print lighthouse info");
   struct arg_lit  *tracker = arg_lit0("t", "tracker", "print tracker info");
+  struct arg_lit  *thread  = arg_lit0("T", "threaded", "handle USB in a thread");
+  struct arg_file *capture = arg_file0("c", "capture", "<file>", "log raw packets to a file");
+  struct arg_file *replay  = arg_file0("r", "replay", "<file>", "replay raw packets from a file");
+  struct arg_lit  *rt      = arg_lit0("R", "realtime", "replay at the captured rate");
   struct arg_lit  *help    = arg_lit0(NULL, "help", "print this help and exit");
   struct arg_end  *end     = arg_end(20);
-  void* argtable[] = {imu, l0, l1, button, tracker, lh, help, end};
+  void* argtable[] = {imu, l0, l1, button, tracker, lh, thread,
+    capture, replay, rt, help, end};
   // Verify we allocated correcty
   const char* progname = "deepdive_tool";
   int nerrors, exitcode = 0;
@@ -201,7 +222,13 @@ int main(int argc, char **argv) {
     goto exit;
   }
   // Initialize the driver
-  struct Driver * drv = deepdive_init(0);
+  struct Driver * drv;
+  if (replay->count > 0)
+    drv = deepdive_init_replay(replay->filename[0], rt->count);
+  else if (capture->count > 0)
+    drv = deepdive_init_capture(capture->filename[0]);
+  else
+    drv = deepdive_init();
   if (!drv) {
     printf("%s: could not initialize driver\n", progname);
     exitcode = 3;
@@ -219,11 +246,25 @@ int main(int argc, char **argv) {
     deepdive_install_button_fn(drv, my_button_process);
   if (lh->count > 0)
     deepdive_install_lighthouse_fn(drv, my_lighthouse_process);
-  if (tracker->count > 0)
+  if (tracker->count > 0) {
     deepdive_install_tracker_fn(drv, my_tracker_process);
-  // Keep going until ctrl+c
-  while(deepdive_poll(drv) == 0) {}
-    return 0;
+    deepdive_install_removed_fn(drv, my_removed_process);
+  }
+  // Optionally move USB handling to its own thread
+  if (thread->count > 0 && deepdive_start(drv)) {
+    printf("%s: could not start USB thread\n", progname);
+    exitcode = 4;
+    goto exit;
+  }
+  // Keep going until ctrl+c, or until a replay is done
+  signal(SIGINT, my_signal_handler);
+  if (thread->count > 0) {
+    // The signal may land on the USB thread, so wake up to check for it
+    while(!stop_ && deepdive_poll_timeout(drv, 100000) >= 0) {}
+  } else {
+    while(!stop_ && deepdive_poll(drv) == 0) {}
+  }
+  deepdive_close(drv);
   // Exit cleanly
   exitcode = 0;
 exit:
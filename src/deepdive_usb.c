@@ -38,6 +38,13 @@
 #include "deepdive_dev_tracker.h"
 #include "deepdive_dev_watchman.h"
 
+// Record queues
+#include "deepdive_queue.h"
+
+// Raw packet capture
+#include "deepdive_capture.h"
+#include "deepdive_metrics.h"
+
 #include <json/json.h>
 
 #include <stdio.h>
@@ -47,29 +54,138 @@
 // Special codes
 static uint8_t magic_code_power_en_[5] = {0x04};
 
-// Interrupt handler
-static void interrupt_handler(struct libusb_transfer* t) {
-  struct Endpoint *ep = t->user_data;
-  if (t->status != LIBUSB_TRANSFER_COMPLETED ) {
-    printf("Transfer problem\n");
+// Optional calibration cache, enabled by setting this to a directory
+#define CACHE_ENV             "DEEPDIVE_CACHE"
+#define CACHE_MAGIC           0x43434444
+#define CACHE_VERSION         1
+
+// Number of times the configuration is requested before a device is dropped
+#define CONFIG_ATTEMPTS       3
+
+// Calibration cache file contents
+struct CacheEntry {
+  uint32_t magic;                   // Always CACHE_MAGIC
+  uint32_t version;                 // Always CACHE_VERSION
+  uint32_t size;                    // Size of the calibration structure
+  uint32_t crc;                     // CRC32 of the compressed configuration
+  char serial[MAX_SERIAL_LENGTH];   // Serial number from the configuration
+  struct Calibration cal;           // Parsed calibration
+};
+
+// Number of interrupt transfers kept in flight for each endpoint
+#ifndef USB_NUM_TRANSFERS
+#define USB_NUM_TRANSFERS 4
+#endif
+
+// Decode a completed interrupt buffer
+void deepdive_usb_decode(struct Tracker * tracker, CallbackType type,
+  uint8_t *data, uint8_t len) {
+  // Nothing is emitted until the tracker calibration is known, or after
+  // the device has been removed
+  if (!__atomic_load_n(&tracker->ready, __ATOMIC_ACQUIRE)
+    || __atomic_load_n(&tracker->removed, __ATOMIC_ACQUIRE))
     return;
-  }
-  switch (ep->type) {
+  switch (type) {
    case TRACKER_IMU:
-    deepdive_dev_tracker_imu(ep->tracker, ep->buffer, t->actual_length);
+    deepdive_dev_tracker_imu(tracker, data, len);
     break;
    case TRACKER_LIGHT:
-    deepdive_dev_tracker_light(ep->tracker, ep->buffer, t->actual_length);
+    deepdive_dev_tracker_light(tracker, data, len);
     break;
    case TRACKER_BUTTONS:
-    deepdive_dev_tracker_button(ep->tracker, ep->buffer, t->actual_length);
+    deepdive_dev_tracker_button(tracker, data, len);
     break;
    case WATCHMAN:
-    deepdive_dev_watchman(ep->tracker, ep->buffer, t->actual_length);
+    deepdive_dev_watchman(tracker, data, len);
     break;
+   default:
+    break;
+  }
+  // Wake the polling thread, once per packet rather than per record
+  if (__atomic_load_n(&tracker->queue, __ATOMIC_ACQUIRE))
+    deepdive_queue_ring(tracker->driver);
+}
+
+// Interrupt handler
+static void interrupt_handler(struct libusb_transfer* t) {
+  struct Endpoint *ep = t->user_data;
+  struct Tracker *tracker = ep->tracker;
+  // Whether this transfer will not be submitted again
+  int finished = 0;
+  // Find the pool slot for this transfer
+  uint8_t i;
+  for (i = 0; i < ep->num_transfers; i++)
+    if (ep->tx[i] == t)
+      break;
+  if (i == ep->num_transfers)
+    return;
+  if (t->status != LIBUSB_TRANSFER_COMPLETED ) {
+    if (t->status != LIBUSB_TRANSFER_CANCELLED
+      && t->status != LIBUSB_TRANSFER_NO_DEVICE) {
+      printf("Transfer problem\n");
+      METRIC_INC(ep->tracker, METRIC_TRANSFER_ERRORS);
+    }
+    ep->state[i] = TRANSFER_DEAD;
+    finished = 1;
+  } else {
+    // Copy out the data and resubmit before decoding, so that the host
+    // controller always has a transfer pending on this endpoint
+    METRIC_STAMP(ep->received[i]);
+    METRIC_INC(ep->tracker, METRIC_TRANSFERS);
+    memcpy(ep->data[i], t->buffer, t->actual_length);
+    ep->length[i] = t->actual_length;
+    ep->state[i] = TRANSFER_READY;
+    if (libusb_submit_transfer(t)) {
+      printf( "Error resubmitting transfer\n");
+      METRIC_INC(ep->tracker, METRIC_TRANSFER_ERRORS);
+      ep->state[i] = TRANSFER_LAST;
+      finished = 1;
+    }
+  }
+  // Decode everything that is ready, in the order it was submitted
+  for (uint8_t k = 0; k < ep->num_transfers; k++) {
+    uint8_t n = ep->next;
+    if (ep->state[n] == TRANSFER_PENDING)
+      break;
+    if (ep->state[n] == TRANSFER_READY || ep->state[n] == TRANSFER_LAST) {
+      ep->state[n] = (ep->state[n] == TRANSFER_READY)
+        ? TRANSFER_PENDING : TRANSFER_DEAD;
+      deepdive_capture_packet(ep->tracker, ep->type,
+        ep->data[n], ep->length[n]);
+      ep->tracker->received = ep->received[n];
+      deepdive_usb_decode(ep->tracker, ep->type, ep->data[n], ep->length[n]);
+    }
+    ep->next = (n + 1) % ep->num_transfers;
   }
-  if (libusb_submit_transfer(t))
-    printf( "Error resubmitting transfer\n");
+  // The tracker may be freed as soon as nothing is in flight, so this must
+  // be the last time that it or the endpoint is touched
+  if (finished)
+    __atomic_fetch_sub(&tracker->inflight, 1, __ATOMIC_RELEASE);
+}
+
+// Allocate and submit a pool of interrupt transfers for an endpoint
+static int setup_endpoint(struct Tracker * tracker, uint8_t idx,
+  CallbackType type, uint8_t address) {
+  struct Endpoint *ep = &tracker->endpoints[idx];
+  ep->tracker = tracker;
+  ep->type = type;
+  ep->next = 0;
+  ep->num_transfers = 0;
+  for (uint8_t i = 0; i < USB_NUM_TRANSFERS && i < MAX_TRANSFERS; i++) {
+    ep->tx[i] = libusb_alloc_transfer(0);
+    if (!ep->tx[i])
+      return -1;
+    libusb_fill_interrupt_transfer(ep->tx[i], tracker->udev, address,
+      ep->buffer[i], USB_INT_BUFF_LENGTH, interrupt_handler, ep, 0);
+    ep->state[i] = TRANSFER_PENDING;
+    ep->num_transfers++;
+    if (libusb_submit_transfer(ep->tx[i])) {
+      ep->state[i] = TRANSFER_DEAD;
+      return -2;
+    }
+    __atomic_fetch_add(&tracker->inflight, 1, __ATOMIC_RELEASE);
+  }
+  return 0;
 }
 
 static inline int update_feature_report(libusb_device_handle* dev,
@@ -156,9 +272,13 @@ static int json_read_arr_int(json_object * jobj, uint8_t *data, size_t len) {
   return numread;
 }
 
-// Parse the jscond evice configuation
+// Parse the jscond evice configuation, returning zero on success
 static int json_parse(struct Tracker * tracker, const char* data) {
   json_object *jobj = json_tokener_parse(data);
+  if (!jobj) {
+    printf("Could not parse the JSON configuration\n");
+    return -1;
+  }
   json_object *jtmp;
   // IMU calibration parameters
   if (json_object_object_get_ex(jobj, "device_serial_number", &jtmp))
@@ -213,6 +333,64 @@ static int json_parse(struct Tracker * tracker, const char* data) {
   // Mark as valid!
   tracker->cal.timestamp = 1;
   printf("Read calibration data for tracker %s\n", tracker->serial);
+  json_object_put(jobj);
+  return 0;
+}
+
+// Get the cache file path for a device, returning zero if caching is enabled
+static int cache_path(const char * key, char * path, size_t len) {
+  const char * dir = getenv(CACHE_ENV);
+  if (!dir || dir[0] == '\0')
+    return -1;
+  snprintf(path, len, "%s/%s.cal", dir, key);
+  return 0;
+}
+
+// Load a cached calibration, if one exists for this configuration
+static int cache_load(struct Tracker * tracker, const char * key, uint32_t crc) {
+  char path[1024];
+  if (cache_path(key, path, sizeof(path)))
+    return -1;
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return -2;
+  struct CacheEntry entry;
+  size_t n = fread(&entry, sizeof(entry), 1, f);
+  fclose(f);
+  if (n != 1 || entry.magic != CACHE_MAGIC || entry.version != CACHE_VERSION
+    || entry.size != sizeof(struct Calibration) || entry.crc != crc)
+    return -3;
+  entry.serial[MAX_SERIAL_LENGTH - 1] = '\0';
+  strcpy(tracker->serial, entry.serial);
+  tracker->cal = entry.cal;
+  printf("Read cached calibration data for tracker %s\n", tracker->serial);
+  return 0;
+}
+
+// Save a calibration to the cache, writing atomically through a rename
+static void cache_save(struct Tracker * tracker, const char * key, uint32_t crc) {
+  char path[1024], temp[1040];
+  if (cache_path(key, path, sizeof(path)))
+    return;
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  struct CacheEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.magic = CACHE_MAGIC;
+  entry.version = CACHE_VERSION;
+  entry.size = sizeof(struct Calibration);
+  entry.crc = crc;
+  strncpy(entry.serial, tracker->serial, MAX_SERIAL_LENGTH - 1);
+  entry.cal = tracker->cal;
+  FILE *f = fopen(temp, "wb");
+  if (!f) {
+    printf("Could not write calibration cache %s\n", temp);
+    return;
+  }
+  size_t n = fwrite(&entry, sizeof(entry), 1, f);
+  if (fclose(f) || n != 1 || rename(temp, path)) {
+    printf("Could not write calibration cache %s\n", path);
+    remove(temp);
+  }
 }
 
 // Read the tracker configuration (sensor extrinsics and imu bias/scale)
@@ -220,7 +398,6 @@ static int get_config(struct Tracker * tracker, int send_extra_magic) {
   int ret, count = 0, size = 0;
   uint8_t cfgbuff[64];
   uint8_t compressed_data[8192];
-  uint8_t uncompressed_data[65536];
   // Send a magic code to iniitalize the config download process
   if (send_extra_magic) {
     uint8_t cfgbuffwide[65];
@@ -274,8 +451,30 @@ static int get_config(struct Tracker * tracker, int send_extra_magic) {
     printf( "Empty configuration");
     return -5;
   }
+  // Keep a copy of the raw configuration when capturing, once it has loaded
+  // so that a replay sees the same configuration exactly once. Loading it
+  // replaces the USB serial, which the replay needs to find the cache.
+  char serial[MAX_SERIAL_LENGTH];
+  strcpy(serial, tracker->serial);
+  ret = deepdive_usb_config(tracker, compressed_data, count);
+  if (ret == 0)
+    deepdive_capture_config(tracker, serial, compressed_data, count);
+  return ret;
+}
+
+// Load a compressed configuration blob into a tracker
+int deepdive_usb_config(struct Tracker * tracker,
+  const uint8_t * data, uint32_t count) {
+  uint8_t uncompressed_data[65536];
+  // The USB serial is the cache key, as the JSON serial replaces it
+  char key[MAX_SERIAL_LENGTH];
+  strcpy(key, tracker->serial);
+  // Skip decompression and parsing if this exact config was seen before
+  uint32_t crc = crc32(0L, data, count);
+  if (cache_load(tracker, key, crc) == 0)
+    return 0;
   // Decompress the data
-  int len = decompress(compressed_data, count,
+  int len = decompress(data, count,
     uncompressed_data, sizeof(uncompressed_data));
   if (len <= 0) {
     printf( "Error: data for config descriptor is bad. (%d)", len);
@@ -288,8 +487,273 @@ static int get_config(struct Tracker * tracker, int send_extra_magic) {
   fwrite(uncompressed_data, len, 1, f);
   fclose(f);
   */
-  // Parse the JSON data structure
-  json_parse(tracker, uncompressed_data);
+  // Parse the JSON data structure, and only cache what could be parsed
+  if (json_parse(tracker, uncompressed_data))
+    return -6;
+  cache_save(tracker, key, crc);
+  return 0;
+}
+
+// Cancel all submitted transfers for a tracker
+static void cancel_transfers(struct Tracker * tracker) {
+  for (size_t e = 0; e < MAX_ENDPOINTS; e++)
+    for (size_t i = 0; i < tracker->endpoints[e].num_transfers; i++)
+      if (tracker->endpoints[e].state[i] == TRANSFER_PENDING)
+        libusb_cancel_transfer(tracker->endpoints[e].tx[i]);
+}
+
+// Flag a tracker for removal. It is released by the polling thread once
+// it has no transfers in flight.
+static void remove_tracker(struct Tracker * tracker) {
+  __atomic_store_n(&tracker->removed, 1, __ATOMIC_RELEASE);
+  cancel_transfers(tracker);
+  deepdive_queue_ring(tracker->driver);
+}
+
+// Download the configuration, retrying a few times as reads sometimes fail
+static int fetch_config(struct Tracker * tracker, int send_extra_magic) {
+  int ret = -1;
+  for (int i = 0; i < CONFIG_ATTEMPTS && ret < 0; i++) {
+    if (i > 0) {
+      printf("Retrying configuration for %s\n", tracker->serial);
+      usleep(100000);
+    }
+    ret = get_config(tracker, send_extra_magic);
+  }
+  return ret;
+}
+
+// Power on and download the configuration for a device. A device whose
+// configuration cannot be read is dropped, so it does not linger unready.
+static void configure_device(struct Tracker * tracker) {
+  char serial[MAX_SERIAL_LENGTH];
+  strcpy(serial, tracker->serial);
+  // What we do depends on the product
+  switch (tracker->type) {
+   case USB_PROD_CONTROLLER:
+   case USB_PROD_TRACKER:
+    // Send a magic code to power on the tracker
+    if (update_feature_report(tracker->udev, 0, magic_code_power_en_,
+      sizeof(magic_code_power_en_)) != sizeof(magic_code_power_en_))
+        printf("Power on failed for %s\n", serial);
+    else
+      printf("Power on success for %s\n", serial);
+    // Get the configuration for this device
+    if (fetch_config(tracker, 0) < 0) {
+      printf("Calibration cannot be pulled for %s. Dropping.\n", serial);
+      remove_tracker(tracker);
+      break;
+    }
+    printf("Found tracker %s\n", tracker->serial);
+    __atomic_store_n(&tracker->ready, 1, __ATOMIC_RELEASE);
+    deepdive_queue_ring(tracker->driver);
+    break;
+   case USB_PROD_WATCHMAN:
+    // Get the configuration for this device
+    if (fetch_config(tracker, 1) < 0) {
+      printf("Calibration cannot be pulled for %s. Dropping.\n", serial);
+      remove_tracker(tracker);
+      break;
+    }
+    printf("Found watchman %s\n", tracker->serial);
+    __atomic_store_n(&tracker->ready, 1, __ATOMIC_RELEASE);
+    deepdive_queue_ring(tracker->driver);
+    break;
+  }
+}
+
+// Open a device, claim its interfaces and start its interrupt transfers
+static int open_device(struct Tracker * tracker) {
+  struct libusb_device_descriptor desc;
+  int ret = libusb_get_device_descriptor(tracker->dev, &desc);
+  if (ret < 0 || desc.idVendor != USB_VEND_HTC)
+    return -1;
+
+  // Only trackers, controllers and watchmen are supported
+  switch (desc.idProduct) {
+   case USB_PROD_CONTROLLER:
+   case USB_PROD_TRACKER:
+   case USB_PROD_WATCHMAN:
+    break;
+   default:
+    return -2;
+  }
+
+  // Get a config descriptor
+  struct libusb_config_descriptor *conf;
+  ret = libusb_get_config_descriptor(tracker->dev, 0, &conf);
+  if (ret)
+    return -3;
+  uint8_t num_interfaces = conf->bNumInterfaces;
+  libusb_free_config_descriptor(conf);
+
+  // Try and open the device
+  ret = libusb_open(tracker->dev, &tracker->udev);
+  if (ret || !tracker->udev)
+    return -4;
+
+  // Set to auto-detatch
+  libusb_set_auto_detach_kernel_driver(tracker->udev, 1);
+  for (int j = 0; j < num_interfaces; j++)
+    if (libusb_claim_interface(tracker->udev, j))
+      return -5;
+
+  // Get the serial number from the opened device handle
+  ret = libusb_get_string_descriptor_ascii(tracker->udev,
+    desc.iSerialNumber, tracker->serial, MAX_SERIAL_LENGTH);
+  if (ret < 0)
+    return -6;
+
+  // The tracker type is simply the USB product ID
+  tracker->type = desc.idProduct;
+
+  // What we do depends on the product
+  switch (tracker->type) {
+   ///////////////////////////////
+   // USB TRACKER OR CONTROLLER //
+   ///////////////////////////////
+   case USB_PROD_CONTROLLER:
+   case USB_PROD_TRACKER:
+    // Endpoint for IMU
+    if (setup_endpoint(tracker, 0, TRACKER_IMU, USB_ENDPOINT_GENERAL))
+      return -7;
+    // Endpoint for light
+    if (setup_endpoint(tracker, 1, TRACKER_LIGHT, USB_ENDPOINT_LIGHT))
+      return -7;
+    // Endpoint for buttons
+    if (setup_endpoint(tracker, 2, TRACKER_BUTTONS, USB_ENDPOINT_BUTTONS))
+      return -7;
+    break;
+   ///////////////////////
+   // WIRELESS WATCHMAN //
+   ///////////////////////
+   case USB_PROD_WATCHMAN:
+    // Set up the interrupts
+    if (setup_endpoint(tracker, 0, WATCHMAN, USB_ENDPOINT_GENERAL))
+      return -7;
+    break;
+  }
+  return 0;
+}
+
+// Allocate a tracker for a device, with a queue for its data
+static struct Tracker * new_tracker(struct Driver * drv,
+  struct libusb_device * dev) {
+  struct Tracker *tracker = malloc(sizeof(struct Tracker));
+  if (!tracker)
+    return NULL;
+  // Make sure the memory is zeroed
+  memset(tracker, 0, sizeof(struct Tracker));
+  tracker->driver = drv;
+  tracker->dev = libusb_ref_device(dev);
+  // Null the lighthouse pointer
+  for (size_t i = 0; i < MAX_NUM_CHANNELS; i++)
+    tracker->ootx[i].lighthouse = NULL;
+  // Until all devices are configured data must be queued, as callbacks
+  // may fire on any of the configuration threads
+  if (deepdive_queue_init(tracker)) {
+    libusb_unref_device(tracker->dev);
+    free(tracker);
+    return NULL;
+  }
+  return tracker;
+}
+
+// Put a tracker in the first free slot, unless its device is already known
+static int insert_tracker(struct Driver * drv, struct Tracker * tracker) {
+  int slot = -1;
+  pthread_mutex_lock(&drv->lock);
+  for (size_t i = 0; i < drv->num_trackers; i++) {
+    if (drv->trackers[i] && drv->trackers[i]->dev == tracker->dev) {
+      pthread_mutex_unlock(&drv->lock);
+      return -1;
+    }
+    if (!drv->trackers[i] && slot < 0)
+      slot = i;
+  }
+  if (slot < 0 && drv->num_trackers < MAX_NUM_TRACKERS)
+    slot = drv->num_trackers;
+  if (slot >= 0) {
+    tracker->handle = slot;
+    __atomic_store_n(&drv->trackers[slot], tracker, __ATOMIC_RELEASE);
+    if (slot == drv->num_trackers)
+      __atomic_store_n(&drv->num_trackers, slot + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&drv->lock);
+  return slot;
+}
+
+// Configure an enumerated device in the background
+static void * configure(void * arg) {
+  struct Tracker * tracker = (struct Tracker *) arg;
+  struct Driver * drv = tracker->driver;
+  configure_device(tracker);
+  __atomic_store_n(&tracker->done, 1, __ATOMIC_RELEASE);
+  __atomic_fetch_sub(&drv->configuring, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Open and configure a hotplugged device in the background
+static void * attach(void * arg) {
+  struct Tracker * tracker = (struct Tracker *) arg;
+  struct Driver * drv = tracker->driver;
+  if (insert_tracker(drv, tracker) < 0) {
+    deepdive_queue_free(tracker);
+    libusb_unref_device(tracker->dev);
+    free(tracker);
+    tracker = NULL;
+  } else if (open_device(tracker)) {
+    remove_tracker(tracker);
+  } else {
+    configure_device(tracker);
+  }
+  // The tracker may be released as soon as this is set
+  if (tracker)
+    __atomic_store_n(&tracker->done, 1, __ATOMIC_RELEASE);
+  __atomic_fetch_sub(&drv->configuring, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Called by libusb when a device arrives or leaves
+static int hotplug_handler(libusb_context *ctx, libusb_device *dev,
+  libusb_hotplug_event event, void *user_data) {
+  struct Driver * drv = (struct Driver *) user_data;
+  switch (event) {
+   case LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED: {
+    // Callbacks may now fire on the configuration thread, so queue data
+    // for every tracker. This is safe as we are the only producer.
+    pthread_mutex_lock(&drv->lock);
+    for (size_t i = 0; i < drv->num_trackers; i++)
+      if (drv->trackers[i])
+        deepdive_queue_init(drv->trackers[i]);
+    pthread_mutex_unlock(&drv->lock);
+    // Open and configure the device without blocking the event loop
+    struct Tracker *tracker = new_tracker(drv, dev);
+    if (!tracker)
+      break;
+    pthread_t thread;
+    __atomic_fetch_add(&drv->configuring, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&thread, NULL, attach, tracker)) {
+      printf("Could not start configuration thread for new device\n");
+      __atomic_fetch_sub(&drv->configuring, 1, __ATOMIC_RELEASE);
+      deepdive_queue_free(tracker);
+      libusb_unref_device(tracker->dev);
+      free(tracker);
+      break;
+    }
+    pthread_detach(thread);
+    break;
+   }
+   case LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT:
+    pthread_mutex_lock(&drv->lock);
+    for (size_t i = 0; i < drv->num_trackers; i++)
+      if (drv->trackers[i] && drv->trackers[i]->dev == dev) {
+        deepdive_capture_removed(drv->trackers[i]);
+        remove_tracker(drv->trackers[i]);
+      }
+    pthread_mutex_unlock(&drv->lock);
+    break;
+  }
   return 0;
 }
 
@@ -300,6 +764,19 @@ int deepdive_usb_init(struct Driver * drv) {
   if (ret)
     return 0;
 
+  // Listen for devices arriving and leaving. This is registered before
+  // enumeration so that nothing is missed; duplicates are ignored.
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    ret = libusb_hotplug_register_callback(drv->usb,
+      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+      LIBUSB_HOTPLUG_NO_FLAGS, USB_VEND_HTC, LIBUSB_HOTPLUG_MATCH_ANY,
+      LIBUSB_HOTPLUG_MATCH_ANY, hotplug_handler, drv, &drv->hotplug);
+    if (ret == 0)
+      drv->has_hotplug = 1;
+    else
+      printf("Could not register for hotplug events\n");
+  }
+
   // Get a list of devices
   libusb_device** devs;
   ret = libusb_get_device_list(drv->usb, &devs);
@@ -307,6 +784,7 @@ int deepdive_usb_init(struct Driver * drv) {
     return 0;
 
   // Iterate over the devices looking for vive products
+  int num_devices = 0;
   struct libusb_device_descriptor desc;
   struct libusb_device * dev;
   for (int did = 0; dev = devs[did]; did++) {
@@ -315,140 +793,93 @@ int deepdive_usb_init(struct Driver * drv) {
     if (ret < 0 || dev == 0 || desc.idVendor != USB_VEND_HTC)
       continue;
 
-    // Get a config descriptor
-    struct libusb_config_descriptor *conf;
-    ret = libusb_get_config_descriptor(dev, 0, &conf);
-    if (ret)
-      continue;
-
     // Allocate the tracker memory
-    struct Tracker *tracker = malloc(sizeof(struct Tracker));
+    struct Tracker *tracker = new_tracker(drv, dev);
     if (!tracker)
       continue;
-    // Make sure the memory is zeroed
-    memset(tracker, 0, sizeof(struct Tracker));
-    tracker->driver = drv;
-
-    // Null the lighthouse pointer
-    for (size_t i = 0; i < MAX_NUM_LIGHTHOUSES; i++)
-      tracker->ootx[i].lighthouse = NULL;
-
-    // Try and open the device
-    ret = libusb_open(dev, &tracker->udev);
-    if (ret || !tracker->udev)
-      goto fail;
-
-    // Set to auto-detatch
-    libusb_set_auto_detach_kernel_driver(tracker->udev, 1);
-    for (int j = 0; j < conf->bNumInterfaces; j++)
-      if (libusb_claim_interface(tracker->udev, j))
-        goto fail;
-
-    // Get the serial number from the opened device handle
-    ret = libusb_get_string_descriptor_ascii(tracker->udev,
-      desc.iSerialNumber, tracker->serial, MAX_SERIAL_LENGTH);
-    if (ret < 0)
-      goto fail;
-
-    // The tracker type is simply the USB product ID
-    tracker->type = desc.idProduct;
-
-    // What we do depends on the product
-    switch (tracker->type) {
-     ///////////////////////////////
-     // USB TRACKER OR CONTROLLER //
-     ///////////////////////////////
-     default:
+
+    // Add the tracker to the dynamic list of trackers
+    if (insert_tracker(drv, tracker) < 0) {
+      deepdive_queue_free(tracker);
+      libusb_unref_device(tracker->dev);
+      free(tracker);
       continue;
-     case USB_PROD_CONTROLLER:
-     case USB_PROD_TRACKER:
-      // Endpoint for IMU
-      tracker->endpoints[0].tracker = tracker;
-      tracker->endpoints[0].type = TRACKER_IMU;
-      tracker->endpoints[0].tx = libusb_alloc_transfer(0);
-      if (!tracker->endpoints[0].tx)
-        goto fail;
-      libusb_fill_interrupt_transfer(tracker->endpoints[0].tx, tracker->udev,
-        USB_ENDPOINT_GENERAL, tracker->endpoints[0].buffer,
-        USB_INT_BUFF_LENGTH, interrupt_handler, &tracker->endpoints[0], 0);
-      ret = libusb_submit_transfer(tracker->endpoints[0].tx);
-      if(ret)
-        goto fail;
-      // Endpoint for light
-      tracker->endpoints[1].tracker = tracker;
-      tracker->endpoints[1].type = TRACKER_LIGHT;
-      tracker->endpoints[1].tx = libusb_alloc_transfer(0);
-      if (!tracker->endpoints[1].tx)
-        goto fail;
-      libusb_fill_interrupt_transfer(tracker->endpoints[1].tx, tracker->udev,
-        USB_ENDPOINT_LIGHT, tracker->endpoints[1].buffer,
-        USB_INT_BUFF_LENGTH, interrupt_handler, &tracker->endpoints[1], 0);
-      ret = libusb_submit_transfer(tracker->endpoints[1].tx);
-      if(ret)
-        goto fail;
-      // Endpoint for buttons
-      tracker->endpoints[2].tracker = tracker;
-      tracker->endpoints[2].type = TRACKER_BUTTONS;
-      tracker->endpoints[2].tx = libusb_alloc_transfer(0);
-      if (!tracker->endpoints[2].tx)
-        goto fail;
-      libusb_fill_interrupt_transfer(tracker->endpoints[2].tx, tracker->udev,
-        USB_ENDPOINT_BUTTONS, tracker->endpoints[2].buffer,
-        USB_INT_BUFF_LENGTH, interrupt_handler, &tracker->endpoints[2], 0);
-      ret = libusb_submit_transfer(tracker->endpoints[2].tx);
-      if(ret)
-        goto fail;
-      // Send a magic code to power on the tracker
-      if (update_feature_report(tracker->udev, 0, magic_code_power_en_,
-        sizeof(magic_code_power_en_)) != sizeof(magic_code_power_en_))
-          printf("Power on failed\n");
-      else
-        printf("Power on success\n");
-      // Get the configuration for this device
-      ret = get_config(tracker, 0);
-      if (ret < 0) {
-        printf("Calibration cannot be pulled. Ignoring.\n");
-        goto fail;
-      }
-      printf("Found tracker %s\n", tracker->serial);
-      break;
-     ///////////////////////
-     // WIRELESS WATCHMAN //
-     ///////////////////////
-     case USB_PROD_WATCHMAN:
-      // Set up the interrupts
-      tracker->endpoints[0].tracker = tracker;
-      tracker->endpoints[0].type = WATCHMAN;
-      tracker->endpoints[0].tx = libusb_alloc_transfer(0);
-      if (!tracker->endpoints[0].tx)
-        goto fail;
-      libusb_fill_interrupt_transfer(tracker->endpoints[0].tx, tracker->udev,
-        USB_ENDPOINT_GENERAL, tracker->endpoints[0].buffer,
-        USB_INT_BUFF_LENGTH, interrupt_handler, &tracker->endpoints[0], 0);
-      ret = libusb_submit_transfer(tracker->endpoints[0].tx);
-      if (ret)
-        goto fail;
-      // Get the configuration for this device
-      ret = get_config(tracker, 1);
-      if (ret < 0) {
-        printf("Calibration cannot be pulled. Ignoring.\n");
-        goto fail;
-      }
-      printf("Found watchman %s\n", tracker->serial);
-      break;
     }
-    // Add the tracker to the dynamic list of trackers
-    drv->trackers[drv->num_trackers++] = tracker;
-    continue;
 
-    // Catch-all to prevent memory leaks
-fail:
-     free(tracker);
+    // Try and open the device, and start its transfers. On failure the
+    // tracker is released by the polling thread once nothing is in flight.
+    if (open_device(tracker)) {
+      tracker->done = 1;
+      remove_tracker(tracker);
+      continue;
+    }
+    num_devices++;
   }
 
   // Free the device list
   libusb_free_device_list(devs, 1);
 
+  // Configure all devices concurrently. Each tracker is pushed to the
+  // callee as soon as its own configuration is complete.
+  for (size_t i = 0; i < drv->num_trackers; i++) {
+    struct Tracker * tracker = drv->trackers[i];
+    if (!tracker || tracker->removed)
+      continue;
+    pthread_t thread;
+    __atomic_fetch_add(&drv->configuring, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&thread, NULL, configure, tracker)) {
+      printf("Could not start configuration thread for %s\n", tracker->serial);
+      __atomic_fetch_sub(&drv->configuring, 1, __ATOMIC_RELEASE);
+      tracker->done = 1;
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
   // Success
-  return drv->num_trackers;
-}
\ No newline at end of file
+  return num_devices;
+}
+
+// Release the USB resources held by a tracker with no transfers in flight
+void deepdive_usb_release(struct Tracker * tracker) {
+  for (size_t e = 0; e < MAX_ENDPOINTS; e++) {
+    for (size_t i = 0; i < tracker->endpoints[e].num_transfers; i++)
+      libusb_free_transfer(tracker->endpoints[e].tx[i]);
+    tracker->endpoints[e].num_transfers = 0;
+  }
+  if (tracker->udev)
+    libusb_close(tracker->udev);
+  tracker->udev = NULL;
+  if (tracker->dev)
+    libusb_unref_device(tracker->dev);
+  tracker->dev = NULL;
+}
+
+// Stop listening for devices, and cancel all transfers
+void deepdive_usb_close(struct Driver * drv) {
+  if (drv->has_hotplug)
+    libusb_hotplug_deregister_callback(drv->usb, drv->hotplug);
+  drv->has_hotplug = 0;
+  // Wait for background configuration to finish
+  while (__atomic_load_n(&drv->configuring, __ATOMIC_ACQUIRE) > 0)
+    usleep(1000);
+  // Cancel every transfer, and wait for the cancellations to complete
+  for (size_t i = 0; i < drv->num_trackers; i++)
+    if (drv->trackers[i])
+      remove_tracker(drv->trackers[i]);
+  for (int tries = 0; tries < 1000; tries++) {
+    int inflight = 0;
+    for (size_t i = 0; i < drv->num_trackers; i++)
+      if (drv->trackers[i])
+        inflight += __atomic_load_n(&drv->trackers[i]->inflight,
+          __ATOMIC_ACQUIRE);
+    if (inflight == 0)
+      break;
+    struct timeval tv = {0, 1000};
+    libusb_handle_events_timeout_completed(drv->usb, &tv, NULL);
+  }
+  // Release the devices
+  for (size_t i = 0; i < drv->num_trackers; i++)
+    if (drv->trackers[i])
+      deepdive_usb_release(drv->trackers[i]);
+}
@@ -39,4 +39,18 @@
 // Initialize and return the number of devices
 int deepdive_usb_init(struct Driver * drv);
 
+// Decode a raw endpoint buffer for a tracker
+void deepdive_usb_decode(struct Tracker * tracker, CallbackType type,
+  uint8_t *data, uint8_t len);
+
+// Load a compressed configuration blob into a tracker
+int deepdive_usb_config(struct Tracker * tracker,
+  const uint8_t * data, uint32_t count);
+
+// Release the USB resources held by a tracker with no transfers in flight
+void deepdive_usb_release(struct Tracker * tracker);
+
+// Stop listening for devices, and cancel all transfers
+void deepdive_usb_close(struct Driver * drv);
+
 #endif
\ No newline at end of file